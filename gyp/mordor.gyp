@@ -109,6 +109,7 @@
         ['OS == "linux"', {
           'sources':[
             '../mordor/iomanager_epoll.cpp',
+            '../mordor/iomanager_uring.cpp',
           ]
         }],
         ['OS == "mac"', {
@@ -175,12 +176,15 @@
 #        '../mordor/http/client.cpp',
 #        '../mordor/http/oauth2.cpp',
 #        '../mordor/http/http.cpp',
+#        '../mordor/http/hpack.cpp',
+#        '../mordor/http/http2.cpp',
 #        '../mordor/http/oauth.cpp',
 #        '../mordor/http/servlet.cpp',
 #        '../mordor/http/auth.cpp',
 #        '../mordor/http/server.cpp',
 #        '../mordor/http/broker.cpp',
 #        '../mordor/http/digest.cpp',
+#        '../mordor/http/header_table.cpp',
 #        '../mordor/http/connection.cpp',
 #        '../mordor/http/servlets/config.cpp',
 #        '../mordor/http/multipart.cpp',
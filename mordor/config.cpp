@@ -42,9 +42,90 @@ isValidConfigVarName(const std::string &name, bool allowDot)
 
 bool Config::s_locked = false;
 
+namespace {
+struct PendingChanges
+{
+    PendingChanges() : depth(0) {}
+
+    int depth;
+    std::vector<ConfigVarBase *> vars;
+    std::vector<std::shared_ptr<boost::function<void ()> > > monitors;
+};
+}
+
+static thread_local PendingChanges t_pending;
+
+void
+ConfigVarBase::changed()
+{
+    if (!Config::defer(this))
+        notify();
+}
+
+bool
+Config::defer(ConfigVarBase *var)
+{
+    if (t_pending.depth == 0)
+        return false;
+    if (std::find(t_pending.vars.begin(), t_pending.vars.end(), var) ==
+        t_pending.vars.end())
+        t_pending.vars.push_back(var);
+    return true;
+}
+
+Config::Batch::Batch()
+{
+    ++t_pending.depth;
+}
+
+Config::Batch::~Batch()
+{
+    MORDOR_ASSERT(t_pending.depth > 0);
+    if (t_pending.depth == 1) {
+        // Still batching while notifying, so that whatever the notifications
+        // change in turn is collected too
+        while (!t_pending.vars.empty() || !t_pending.monitors.empty()) {
+            std::vector<ConfigVarBase *> vars;
+            vars.swap(t_pending.vars);
+            for (size_t i = 0; i < vars.size(); ++i)
+                vars[i]->notify();
+            if (!t_pending.vars.empty())
+                continue;
+            std::vector<std::shared_ptr<boost::function<void ()> > > monitors;
+            monitors.swap(t_pending.monitors);
+            for (size_t i = 0; i < monitors.size(); ++i)
+                (*monitors[i])();
+        }
+    }
+    --t_pending.depth;
+}
+
+static void
+coalesce(std::shared_ptr<boost::function<void ()> > dg)
+{
+    if (t_pending.depth == 0) {
+        (*dg)();
+        return;
+    }
+    if (std::find(t_pending.monitors.begin(), t_pending.monitors.end(), dg) ==
+        t_pending.monitors.end())
+        t_pending.monitors.push_back(dg);
+}
+
+void
+Config::monitor(const std::vector<ConfigVarBase::ptr> &vars,
+    boost::function<void ()> dg)
+{
+    std::shared_ptr<boost::function<void ()> > shared(
+        new boost::function<void ()>(dg));
+    for (size_t i = 0; i < vars.size(); ++i)
+        vars[i]->onChange.connect(boost::bind(&coalesce, shared));
+}
+
 void
 Config::loadFromCommandLine(int &argc, char *argv[])
 {
+    Batch batch;
     char **end = argv + argc;
     char **arg = argv;
     // Skip argv[0] (presumably program name)
@@ -95,6 +176,7 @@ Config::loadFromCommandLine(int &argc, char *argv[])
 void
 Config::loadFromEnvironment()
 {
+    Batch batch;
 #ifdef WINDOWS
     wchar_t *enviro = GetEnvironmentStringsW();
     if (!enviro)
@@ -208,6 +290,7 @@ public:
 void
 Config::loadFromJSON(const JSON::Value &json)
 {
+    Batch batch;
     JSONVisitor visitor;
     visitor.m_toCheck.push_back(std::make_pair(std::string(), &json));
     while (!visitor.m_toCheck.empty()) {
@@ -241,6 +324,7 @@ Config::visit(boost::function<void (ConfigVarBase::ptr)> dg)
 #ifdef WINDOWS
 static void loadFromRegistry(HKEY hKey)
 {
+    Config::Batch batch;
     std::string buffer;
     std::wstring valueName;
     DWORD type;
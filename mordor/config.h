@@ -4,9 +4,13 @@
 
 #include "predef.h"
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <boost/function.hpp>
@@ -113,6 +117,7 @@ bool isValidConfigVarName(const std::string &name, bool allowDot = true);
 
 class ConfigVarBase : public Mordor::noncopyable
 {
+    friend class Config;
 public:
     typedef std::shared_ptr<ConfigVarBase> ptr;
 
@@ -138,11 +143,62 @@ public:
     /// @return If the new value was accepted
     virtual bool fromString(const std::string &str) = 0;
 
+protected:
+    /// Fires the onChange signals now, or when the current Config::Batch ends
+    void changed();
+
+private:
+    virtual void notify() = 0;
+
 private:
     std::string m_name, m_description;
     bool m_lockable;
 };
 
+namespace Detail {
+// How a ConfigVar holds its value: scalars (numbers, bools, enums) in a
+// std::atomic; anything else as an immutable snapshot that an update
+// replaces (rather than assigns to) with std::atomic_store, so a reader never
+// sees a half-assigned std::string
+template <class T, bool Scalar = std::is_scalar<T>::value>
+class ConfigValue
+{
+public:
+    ConfigValue(const T &value)
+        : m_snapshot(std::make_shared<T>(value))
+    {}
+
+    T get() const { return *snapshot(); }
+    std::shared_ptr<const T> snapshot() const
+    { return std::atomic_load(&m_snapshot); }
+    void set(const T &value)
+    {
+        std::shared_ptr<const T> snapshot(std::make_shared<T>(value));
+        std::atomic_store(&m_snapshot, snapshot);
+    }
+
+private:
+    std::shared_ptr<const T> m_snapshot;
+};
+
+template <class T>
+class ConfigValue<T, true>
+{
+public:
+    ConfigValue(T value)
+        : m_value(value)
+    {}
+
+    T get() const { return m_value.load(std::memory_order_acquire); }
+    std::shared_ptr<const T> snapshot() const
+    { return std::make_shared<T>(get()); }
+    void set(T value) { m_value.store(value, std::memory_order_release); }
+
+private:
+    std::atomic<T> m_value;
+};
+}
+
 template <class T>
 bool isConfigNotLocked(const T &);
 
@@ -170,11 +226,47 @@ public:
     typedef boost::signals2::signal<bool (const T&), BreakOnFailureCombiner> before_change_signal_type;
     typedef boost::signals2::signal<void (const T&)> on_change_signal_type;
 
+    /// A cached reference to the value, for hot paths reading a ConfigVar
+    /// that's expensive to copy
+    ///
+    /// Dereferencing costs one atomic load, plus taking a new snapshot() if
+    /// the ConfigVar changed since the last time.  The reference stays valid
+    /// until the Handle is next dereferenced.  A Handle must not be shared
+    /// between threads; make it thread_local, or a member of something that
+    /// isn't shared.
+    class Handle
+    {
+    public:
+        Handle(ptr var = ptr())
+            : m_var(var),
+              m_version(0)
+        {}
+
+        const T &operator*() const
+        {
+            MORDOR_ASSERT(m_var);
+            unsigned long version =
+                m_var->m_version.load(std::memory_order_acquire);
+            if (version != m_version) {
+                m_snapshot = m_var->snapshot();
+                m_version = version;
+            }
+            return *m_snapshot;
+        }
+        const T *operator->() const { return &**this; }
+
+    private:
+        ptr m_var;
+        mutable unsigned long m_version;
+        mutable std::shared_ptr<const T> m_snapshot;
+    };
+
 public:
     ConfigVar(const std::string &name, const T &defaultValue,
         const std::string &description = "", bool lockable = false)
         : ConfigVarBase(name, description, lockable),
-          m_val(defaultValue)
+          m_val(defaultValue),
+          m_version(1)
     {
         // if Config is locked, should reject changes to lockable ConfigVars
         if (isLockable())
@@ -183,7 +275,7 @@ public:
 
     std::string toString() const
     {
-        return boost::lexical_cast<std::string>(m_val);
+        return boost::lexical_cast<std::string>(*snapshot());
     }
 
     bool fromString(const std::string &str)
@@ -201,23 +293,38 @@ public:
     /// onChange should not throw any exceptions
     on_change_signal_type onChange;
 
-    // TODO: atomicCompareExchange and/or mutex
-    T val() const { return m_val; }
+    /// Safe to call from any thread, even while the value is being changed;
+    /// for anything bigger than a number, snapshot() and Handle avoid copying
+    T val() const { return m_val.get(); }
+    /// The current value, which stays as it is for as long as it's held
+    std::shared_ptr<const T> snapshot() const { return m_val.snapshot(); }
     bool val(const T &v)
     {
-        T oldVal = m_val;
-        if (oldVal != v) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_val.get() == v)
+                return true;
             if (!beforeChange(v))
                 return false;
-            m_val = v;
-            onChange(v);
-            ConfigVarBase::onChange();
+            m_val.set(v);
+            m_version.fetch_add(1, std::memory_order_release);
         }
+        changed();
         return true;
     }
 
 private:
-    T m_val;
+    void notify()
+    {
+        onChange(val());
+        ConfigVarBase::onChange();
+    }
+
+private:
+    // Serializes changes; reads don't take it
+    std::mutex m_mutex;
+    Detail::ConfigValue<T> m_val;
+    std::atomic<unsigned long> m_version;
 };
 
 class Config
@@ -311,6 +418,24 @@ public:
     // If a config var not declared previously,
     // we will create a new var to save it.
     static void loadFromJSON(const JSON::Value &json);
+
+    /// Holds back the onChange notifications of ConfigVars changed on this
+    /// thread while it exists
+    ///
+    /// When the outermost Batch ends, each ConfigVar that changed notifies
+    /// once (with its final value), after all of them have been set.  The
+    /// load* functions apply everything they find in a Batch.
+    class Batch : Mordor::noncopyable
+    {
+    public:
+        Batch();
+        ~Batch();
+    };
+
+    /// Calls dg whenever any of vars changes, but only once for all of them
+    /// that change in the same Batch
+    static void monitor(const std::vector<ConfigVarBase::ptr> &vars,
+        boost::function<void ()> dg);
 #ifdef WINDOWS
     static void loadFromRegistry(HKEY key, const std::string &subKey);
     static void loadFromRegistry(HKEY key, const std::wstring &subKey);
@@ -329,6 +454,11 @@ public:
     static bool isLocked() { return s_locked; }
 
 private:
+    friend class ConfigVarBase;
+    /// @return false if var should notify now, rather than at the end of the
+    /// current Batch
+    static bool defer(ConfigVarBase *var);
+
     static ConfigVarSet &vars()
     {
         static ConfigVarSet vars;
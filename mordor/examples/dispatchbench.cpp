@@ -0,0 +1,171 @@
+// Copyright (c) 2009 - Mozy, Inc.
+//
+// ServletDispatcher benchmark.
+//
+// Registers a population of servlets (a mix of plain and wildcard paths,
+// spread over a few vhosts), then measures getServlet() lookups/sec from one
+// thread, from several threads at once, and from several threads while
+// another keeps registering and unregistering servlets.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <sstream>
+
+#include <boost/bind.hpp>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/http/servlet.h"
+#include "mordor/main.h"
+#include "mordor/thread.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+using namespace Mordor::HTTP;
+
+static ConfigVar<unsigned long long>::ptr g_servlets =
+    Config::lookup<unsigned long long>("dispatchbench.servlets", 5000ull,
+    "Number of servlets registered");
+static ConfigVar<unsigned long long>::ptr g_lookups =
+    Config::lookup<unsigned long long>("dispatchbench.lookups", 1000000ull,
+    "Number of lookups per thread");
+static ConfigVar<unsigned long long>::ptr g_threads =
+    Config::lookup<unsigned long long>("dispatchbench.threads", 4ull,
+    "Number of threads doing lookups concurrently");
+
+namespace {
+class DummyServlet : public Servlet
+{
+public:
+    void request(std::shared_ptr<ServerRequest> request) {}
+};
+}
+
+static std::string
+servletPath(unsigned long long i)
+{
+    std::ostringstream os;
+    if (i % 4 == 3)
+        os << "/api/v" << i % 3 << "/*/tenant" << i << "/";
+    else
+        os << "/api/v" << i % 3 << "/service" << i << "/items";
+    return os.str();
+}
+
+// What a request for servlet i might ask for; every eighth misses
+static std::string
+requestURI(unsigned long long i)
+{
+    std::ostringstream os;
+    if (i % 5 == 0)
+        os << "//host" << i % 4;
+    if (i % 8 == 7)
+        os << "/static/images/" << i << ".png";
+    else if (i % 4 == 3)
+        os << "/api/v" << i % 3 << "/users/tenant" << i << "/documents/"
+            << i * 31;
+    else
+        os << "/api/v" << i % 3 << "/service" << i << "/items/" << i * 17;
+    return os.str();
+}
+
+static void
+report(const char *name, unsigned long long count, unsigned long long elapsed)
+{
+    std::cout << name << ": " << count << " lookups in " << elapsed << " us";
+    if (elapsed)
+        std::cout << ", " << count * 1000000ull / elapsed << " lookups/sec";
+    std::cout << std::endl;
+}
+
+static void
+lookups(ServletDispatcher &dispatcher, const std::vector<URI> &uris,
+    unsigned long long offset, unsigned long long &found)
+{
+    unsigned long long count = g_lookups->val();
+    for (unsigned long long i = 0; i < count; ++i)
+        if (dispatcher.getServlet(uris[(offset + i) % uris.size()]))
+            ++found;
+}
+
+static void
+churn(ServletDispatcher &dispatcher, Servlet::ptr servlet, volatile bool &done,
+    unsigned long long &registrations)
+{
+    while (!done) {
+        std::ostringstream os;
+        os << "/churn/" << registrations % 64;
+        dispatcher.registerServlet(os.str(), servlet);
+        dispatcher.unregisterServlet(os.str());
+        ++registrations;
+    }
+}
+
+static void
+benchThreads(const char *name, ServletDispatcher &dispatcher,
+    const std::vector<URI> &uris, bool withChurn)
+{
+    unsigned long long threads = g_threads->val();
+    std::vector<unsigned long long> found(threads);
+    volatile bool done = false;
+    unsigned long long registrations = 0;
+    std::shared_ptr<Thread> churner;
+    if (withChurn)
+        churner.reset(new Thread(boost::bind(&churn, boost::ref(dispatcher),
+            Servlet::ptr(new DummyServlet()), boost::ref(done),
+            boost::ref(registrations))));
+    unsigned long long start = TimerManager::now();
+    std::vector<std::shared_ptr<Thread> > workers;
+    for (unsigned long long i = 0; i < threads; ++i)
+        workers.push_back(std::shared_ptr<Thread>(new Thread(boost::bind(
+            &lookups, boost::ref(dispatcher), boost::cref(uris), i * 7919,
+            boost::ref(found[i])))));
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i]->join();
+    unsigned long long elapsed = TimerManager::now() - start;
+    if (churner) {
+        done = true;
+        churner->join();
+        std::cout << name << ": " << registrations
+            << " register/unregisters meanwhile" << std::endl;
+    }
+    report(name, threads * g_lookups->val(), elapsed);
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+
+        ServletDispatcher dispatcher(true);
+        Servlet::ptr servlet(new DummyServlet());
+        unsigned long long count = g_servlets->val();
+        for (unsigned long long i = 0; i < count; ++i) {
+            dispatcher.registerServlet(servletPath(i), servlet);
+            if (i % 5 == 0) {
+                std::ostringstream os;
+                os << "//host" << i % 4 << servletPath(i);
+                dispatcher.registerServlet(os.str(), servlet);
+            }
+        }
+
+        std::vector<URI> uris;
+        for (unsigned long long i = 0; i < count; ++i)
+            uris.push_back(requestURI(i));
+        unsigned long long found = 0;
+        unsigned long long start = TimerManager::now();
+        lookups(dispatcher, uris, 0, found);
+        report("1 thread", g_lookups->val(), TimerManager::now() - start);
+        MORDOR_ASSERT(found > 0);
+
+        benchThreads("threads", dispatcher, uris, false);
+        benchThreads("threads+churn", dispatcher, uris, true);
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        throw;
+    }
+}
@@ -0,0 +1,152 @@
+// Copyright (c) 2009 - Mozy, Inc.
+//
+// Fiber context switch benchmark.
+//
+// Measures switches/sec through Mordor::Fiber (using whichever backend
+// libmordor was built with; configure --enable-asm-fibers to get the
+// assembly one), and through bare swapcontext and _setjmp/_longjmp
+// ping-pong loops for comparison.
+//
+
+// glibc's fortified longjmp refuses to jump to another stack
+#undef _FORTIFY_SOURCE
+
+#include "mordor/predef.h"
+
+#include <iostream>
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/fiber.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_iterations =
+    Config::lookup<unsigned long long>("fiberbench.iterations", 1000000ull,
+    "Number of round trips (two switches each) per backend");
+
+static const size_t g_stackSize = 64 * 1024;
+
+static void
+report(const char *name, unsigned long long roundTrips,
+    unsigned long long elapsed)
+{
+    std::cout << name << ": " << roundTrips * 2 << " switches in "
+        << elapsed << " us";
+    if (elapsed)
+        std::cout << ", " << roundTrips * 2 * 1000000ull / elapsed
+            << " switches/sec";
+    std::cout << std::endl;
+}
+
+static bool g_done;
+
+static void
+yieldUntilDone()
+{
+    while (!g_done)
+        Fiber::yield();
+}
+
+static void
+benchFiber(unsigned long long iterations)
+{
+#if defined(ASM_FIBERS)
+    const char *name = "Fiber (asm)";
+#elif defined(UCONTEXT_FIBERS)
+    const char *name = "Fiber (ucontext)";
+#elif defined(SETJMP_FIBERS)
+    const char *name = "Fiber (setjmp)";
+#else
+    const char *name = "Fiber (native)";
+#endif
+    Fiber::ptr fiber(new Fiber(&yieldUntilDone, g_stackSize));
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i)
+        fiber->call();
+    report(name, iterations, TimerManager::now() - start);
+    g_done = true;
+    fiber->call();
+    MORDOR_ASSERT(fiber->state() == Fiber::TERM);
+}
+
+static ucontext_t g_mainCtx, g_coCtx;
+
+static void
+swapcontextLoop()
+{
+    while (true)
+        swapcontext(&g_coCtx, &g_mainCtx);
+}
+
+static void
+benchUcontext(unsigned long long iterations)
+{
+    void *stack = malloc(g_stackSize);
+    getcontext(&g_coCtx);
+    g_coCtx.uc_link = NULL;
+    g_coCtx.uc_stack.ss_sp = stack;
+    g_coCtx.uc_stack.ss_size = g_stackSize;
+    makecontext(&g_coCtx, &swapcontextLoop, 0);
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i)
+        swapcontext(&g_mainCtx, &g_coCtx);
+    report("swapcontext", iterations, TimerManager::now() - start);
+    free(stack);
+}
+
+static jmp_buf g_mainEnv, g_coEnv;
+
+static void
+setjmpLoop()
+{
+    while (true) {
+        if (!_setjmp(g_coEnv))
+            _longjmp(g_mainEnv, 1);
+    }
+}
+
+static void
+benchSetjmp(unsigned long long iterations)
+{
+    // Use ucontext once to get onto the second stack; after that it's pure
+    // _setjmp/_longjmp, which (unlike setjmp) don't save the signal mask
+    void *stack = malloc(g_stackSize);
+    getcontext(&g_coCtx);
+    g_coCtx.uc_link = NULL;
+    g_coCtx.uc_stack.ss_sp = stack;
+    g_coCtx.uc_stack.ss_size = g_stackSize;
+    makecontext(&g_coCtx, &setjmpLoop, 0);
+    if (!_setjmp(g_mainEnv))
+        swapcontext(&g_mainCtx, &g_coCtx);
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i) {
+        if (!_setjmp(g_mainEnv))
+            _longjmp(g_coEnv, 1);
+    }
+    report("_setjmp/_longjmp", iterations, TimerManager::now() - start);
+    free(stack);
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        unsigned long long iterations = g_iterations->val();
+
+        benchFiber(iterations);
+        benchUcontext(iterations);
+        benchSetjmp(iterations);
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        throw;
+    }
+}
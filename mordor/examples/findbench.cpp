@@ -0,0 +1,117 @@
+// Copyright (c) 2009 - Mozy, Inc.
+//
+// Buffer delimiter search benchmark.
+//
+// Fills Buffers with a few kinds of data (split over segments the size a
+// socket read produces), each followed by the delimiters searched for, and
+// measures how fast Buffer::find() gets through them with the vectorized
+// multi-byte search (the default) and with buffer.simd turned off:
+//  - "\r\n" through text with bare LF line endings (a chunked body)
+//  - "\r\n\r\n" through CRLF terminated lines (a long HTTP head)
+//  - a MIME boundary through CRLF lines, and through binary data
+// Single byte searches always use memchr; one is timed for comparison.
+//
+
+#include "mordor/predef.h"
+
+#include <string.h>
+#include <iostream>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_size =
+    Config::lookup<unsigned long long>("findbench.size", 1048576ull,
+    "Number of bytes in each Buffer");
+static ConfigVar<unsigned long long>::ptr g_segment =
+    Config::lookup<unsigned long long>("findbench.segment", 16384ull,
+    "Size of each segment of the Buffers");
+static ConfigVar<unsigned long long>::ptr g_iterations =
+    Config::lookup<unsigned long long>("findbench.iterations", 200ull,
+    "Number of finds per test");
+
+static const char *g_boundary = "\r\n--mordor-boundary-4f3c2a1b0e9d8c7b";
+
+static void
+report(const char *name, unsigned long long bytes, unsigned long long elapsed)
+{
+    std::cout << name << ": " << bytes << " bytes in " << elapsed << " us";
+    if (elapsed)
+        std::cout << ", " << bytes / elapsed << " MB/s";
+    std::cout << std::endl;
+}
+
+// pattern repeated to fill g_size bytes, less the delimiters at the end
+static Buffer
+fill(const std::string &pattern, const std::string &tail)
+{
+    std::string segment;
+    while (segment.size() < g_segment->val())
+        segment.append(pattern);
+    segment.resize(g_segment->val());
+    Buffer buffer;
+    size_t size = g_size->val() - tail.size();
+    // Copying in separate Buffers keeps the segments separate
+    while (buffer.readAvailable() + segment.size() < size)
+        buffer.copyIn(Buffer(segment));
+    buffer.copyIn(Buffer(segment.substr(0, size - buffer.readAvailable())));
+    buffer.copyIn(Buffer(tail));
+    return buffer;
+}
+
+template <class T>
+static void
+bench(const char *name, const Buffer &buffer, const T &delimiter)
+{
+    unsigned long long iterations = g_iterations->val();
+    ptrdiff_t expected = g_size->val() - strlen(g_boundary) - 5;
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i)
+        MORDOR_VERIFY(buffer.find(delimiter) >= expected);
+    report(name, iterations * expected, TimerManager::now() - start);
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+
+        std::string tail = std::string(g_boundary) + "\r\n\r\n";
+        tail.append(1, '\0');
+        Buffer text = fill("Lorem ipsum dolor sit amet, consectetur\n"
+            "adipiscing elit, sed do eiusmod tempor incididunt\n", tail);
+        Buffer lines = fill("X-Forwarded-For: 192.0.2.1, 198.51.100.7\r\n"
+            "Cookie: session=0123456789abcdef; theme=dark\r\n", tail);
+        std::string random;
+        unsigned int seed = 12345;
+        for (int i = 0; i < 65536; ++i) {
+            seed = seed * 1103515245 + 12345;
+            random.append(1, (char)(seed >> 16));
+        }
+        Buffer binary = fill(random, tail);
+        std::cout << text.segments() << " segments" << std::endl;
+
+        ConfigVarBase::ptr simd = Config::lookup("buffer.simd");
+        for (int i = 0; i < 2; ++i) {
+            simd->fromString(i == 0 ? "1" : "0");
+            std::cout << (i == 0 ? "vectorized" : "scalar") << std::endl;
+            bench("  \"\\r\\n\", text", text, std::string("\r\n"));
+            bench("  \"\\r\\n\\r\\n\", lines", lines,
+                std::string("\r\n\r\n"));
+            bench("  boundary, lines", lines, std::string(g_boundary));
+            bench("  boundary, binary", binary, std::string(g_boundary));
+        }
+        simd->fromString("1");
+        bench("'\\0', text", text, '\0');
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        throw;
+    }
+}
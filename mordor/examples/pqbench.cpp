@@ -0,0 +1,160 @@
+// Copyright (c) 2010 - Mozy, Inc.
+//
+// PostgreSQL insert benchmark.
+//
+// Inserts pqbench.statements rows into a temporary table one statement at a
+// time (a round trip each), then through a Pipeline in batches of 1, 10,
+// 100 and 1000 statements (a round trip each batch), and reports
+// statements/sec for each.  Run it against a local server to see the
+// per-statement overhead; against a remote one the round trips dominate.
+//
+// Then loads the same number of typed rows through COPY, once formatted as
+// CSV and once with BinaryCopyWriter.  Without a connection string only the
+// encoding half of that runs, into a NullStream.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "mordor/config.h"
+#include "mordor/iomanager.h"
+#include "mordor/main.h"
+#include "mordor/pq/binarycopy.h"
+#include "mordor/pq/connection.h"
+#include "mordor/streams/null.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+using namespace Mordor::PQ;
+
+static ConfigVar<unsigned long long>::ptr g_statements =
+    Config::lookup<unsigned long long>("pqbench.statements", 10000ull,
+    "Number of rows to insert for each test");
+
+static void
+report(const char *name, unsigned long long batch, unsigned long long count,
+    unsigned long long elapsed, const char *what = "statements")
+{
+    std::cout << name;
+    if (batch)
+        std::cout << ", batches of " << batch;
+    std::cout << ": " << count << " " << what << " in " << elapsed << " us";
+    if (elapsed)
+        std::cout << ", " << count * 1000000ull / elapsed << " " << what
+            << "/sec";
+    std::cout << std::endl;
+}
+
+static const boost::posix_time::ptime g_epoch(
+    boost::gregorian::date(2010, 1, 1));
+
+// The way our loaders have always done it: a string per field
+static void
+copyCsv(Stream::ptr stream, const char *name)
+{
+    unsigned long long count = g_statements->val();
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < count; ++i) {
+        std::string line = boost::lexical_cast<std::string>(i);
+        line.append(",mordor,");
+        line.append(boost::lexical_cast<std::string>(i / 3.0));
+        line.append(1, ',');
+        line.append(boost::posix_time::to_iso_extended_string(
+            g_epoch + boost::posix_time::seconds((long)i)));
+        line.append(1, '\n');
+        stream->write(line.c_str(), line.size());
+    }
+    stream->close();
+    report(name, 0, count, TimerManager::now() - start, "rows");
+}
+
+static void
+copyBinary(Stream::ptr stream, const char *name)
+{
+    unsigned long long count = g_statements->val();
+    unsigned long long start = TimerManager::now();
+    BinaryCopyWriter writer(stream);
+    for (unsigned long long i = 0; i < count; ++i) {
+        writer.row(4);
+        writer.append((long long)i);
+        writer.append("mordor", 6);
+        writer.append(i / 3.0);
+        writer.append(g_epoch + boost::posix_time::seconds((long)i));
+    }
+    writer.finish();
+    report(name, 0, count, TimerManager::now() - start, "rows");
+}
+
+static void
+serial(Connection &conn, PreparedStatement &insert)
+{
+    unsigned long long count = g_statements->val();
+    conn.execute("TRUNCATE pqbench");
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < count; ++i)
+        insert.execute((long long)i, "mordor");
+    report("execute", 0, count, TimerManager::now() - start);
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+static void
+pipelined(Connection &conn, PreparedStatement &insert,
+    unsigned long long batch)
+{
+    unsigned long long count = g_statements->val();
+    conn.execute("TRUNCATE pqbench");
+    unsigned long long start = TimerManager::now();
+    {
+        Pipeline::ptr pipeline = conn.pipeline();
+        for (unsigned long long i = 0; i < count;) {
+            for (unsigned long long j = 0; j < batch && i < count; ++j, ++i)
+                pipeline->queue(insert, (long long)i, "mordor");
+            pipeline->sync();
+            while (pipeline->pending())
+                pipeline->next();
+        }
+    }
+    report("pipeline", batch, count, TimerManager::now() - start);
+}
+#endif
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        copyCsv(NullStream::get_ptr(), "csv encode");
+        copyBinary(NullStream::get_ptr(), "binary encode");
+        if (argc < 2) {
+            std::cerr << "Usage: " << argv[0] << " [<connection string>]"
+                << std::endl;
+            return 0;
+        }
+
+        IOManager ioManager;
+        Connection conn(argv[1], &ioManager);
+        conn.execute("CREATE TEMP TABLE pqbench (id BIGINT, name TEXT)");
+        PreparedStatement insert = conn.prepare(
+            "INSERT INTO pqbench VALUES($1, $2)", "pqbench_insert");
+
+        serial(conn, insert);
+#ifdef LIBPQ_HAS_PIPELINING
+        for (unsigned long long batch = 1; batch <= 1000; batch *= 10)
+            pipelined(conn, insert, batch);
+#endif
+
+        conn.execute("CREATE TEMP TABLE pqbench_copy (id BIGINT, name TEXT, "
+            "efficiency DOUBLE PRECISION, sometime TIMESTAMP)");
+        copyCsv(conn.copyIn("pqbench_copy").csv()(), "csv copy");
+        conn.execute("TRUNCATE pqbench_copy");
+        copyBinary(conn.copyIn("pqbench_copy").binary()(), "binary copy");
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2009 - Mozy, Inc.
+//
+// Statistics contention benchmark.
+//
+// Has 1, 2, 4 ... statbench.threads threads update the same statistic as
+// fast as they can, and reports updates/sec for a plain statistic (one
+// shared word per value, updated atomically) and for a ShardedStatistic of
+// it (a shard per thread, merged when read).  Counts, the
+// AverageMinMaxStatistic the fiber stack pool statistics use, and the
+// HistogramStatistic the HTTP server's latency statistic uses.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/statistics.h"
+#include "mordor/thread.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_updates =
+    Config::lookup<unsigned long long>("statbench.updates", 10000000ull,
+    "Number of updates per thread");
+static ConfigVar<unsigned long long>::ptr g_threads =
+    Config::lookup<unsigned long long>("statbench.threads", 8ull,
+    "Maximum number of threads updating at once");
+
+static void
+report(const char *name, unsigned long long threads, unsigned long long count,
+    unsigned long long elapsed)
+{
+    std::cout << name << ", " << threads << " thread(s): " << count
+        << " updates in " << elapsed << " us";
+    if (elapsed)
+        std::cout << ", " << count * 1000000ull / elapsed << " updates/sec";
+    std::cout << std::endl;
+}
+
+template <class S>
+static void
+increment(S &stat)
+{
+    unsigned long long count = g_updates->val();
+    for (unsigned long long i = 0; i < count; ++i)
+        stat.increment();
+}
+
+template <class S>
+static void
+update(S &stat)
+{
+    unsigned long long count = g_updates->val();
+    for (unsigned long long i = 0; i < count; ++i)
+        stat.update((unsigned int)(i & 1023));
+}
+
+template <class S>
+static void
+bench(const char *name, S &stat, void (*dg)(S &))
+{
+    for (unsigned long long threads = 1; threads <= g_threads->val();
+        threads *= 2) {
+        stat.reset();
+        unsigned long long start = TimerManager::now();
+        std::vector<std::shared_ptr<Thread> > workers;
+        for (unsigned long long i = 0; i < threads; ++i)
+            workers.push_back(std::shared_ptr<Thread>(new Thread(
+                boost::bind(dg, boost::ref(stat)))));
+        for (size_t i = 0; i < workers.size(); ++i)
+            workers[i]->join();
+        report(name, threads, threads * g_updates->val(),
+            TimerManager::now() - start);
+    }
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        std::cout << Detail::statisticShards() << " shards" << std::endl;
+
+        CountStatistic<unsigned long long> count;
+        bench("count", count, &increment<CountStatistic<unsigned long long> >);
+        ShardedStatistic<CountStatistic<unsigned long long> > shardedCount;
+        bench("sharded count", shardedCount,
+            &increment<ShardedStatistic<CountStatistic<unsigned long long> > >);
+
+        AverageMinMaxStatistic<unsigned int> average;
+        bench("averageminmax", average,
+            &update<AverageMinMaxStatistic<unsigned int> >);
+        ShardedStatistic<AverageMinMaxStatistic<unsigned int> >
+            shardedAverage;
+        bench("sharded averageminmax", shardedAverage,
+            &update<ShardedStatistic<AverageMinMaxStatistic<unsigned int> > >);
+
+        HistogramStatistic<unsigned int> histogram;
+        bench("histogram", histogram,
+            &update<HistogramStatistic<unsigned int> >);
+        ShardedStatistic<HistogramStatistic<unsigned int> > shardedHistogram;
+        bench("sharded histogram", shardedHistogram,
+            &update<ShardedStatistic<HistogramStatistic<unsigned int> > >);
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        throw;
+    }
+}
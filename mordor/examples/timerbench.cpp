@@ -0,0 +1,144 @@
+// Copyright (c) 2009 - Mozy, Inc.
+//
+// Timer benchmark.
+//
+// Measures the register/cancel churn Socket generates for I/O timeouts, and
+// registering and firing a population of timers, both against the ordered
+// set TimerManager uses by default and against its timing wheel.
+//
+
+#include "mordor/predef.h"
+
+#include <chrono>
+#include <iostream>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_iterations =
+    Config::lookup<unsigned long long>("timerbench.iterations", 1000000ull,
+    "Number of timers registered per test");
+static ConfigVar<unsigned long long>::ptr g_outstanding =
+    Config::lookup<unsigned long long>("timerbench.outstanding", 100000ull,
+    "Number of long timers kept registered while churning (think idle "
+    "connections)");
+static ConfigVar<unsigned long long>::ptr g_granularity =
+    Config::lookup<unsigned long long>("timerbench.granularity", 1000ull,
+    "Tick length (us) of the timing wheel");
+
+namespace {
+
+// A clock we can move ourselves, so that firing doesn't depend on how long
+// the machine takes
+class FakeClock
+{
+public:
+    FakeClock() : m_now(1000000ull)
+    {
+        TimerManager::setClock(std::bind(&FakeClock::now, this));
+    }
+    ~FakeClock() { TimerManager::setClock(); }
+
+    unsigned long long now() { return m_now; }
+    void advance(unsigned long long us) { m_now += us; }
+
+private:
+    unsigned long long m_now;
+};
+
+class BenchTimerManager : public TimerManager
+{
+public:
+    BenchTimerManager(unsigned long long granularity)
+        : TimerManager(granularity)
+    {}
+
+    using TimerManager::processTimers;
+};
+
+}
+
+static void
+doNothing()
+{}
+
+// TimerManager::now() may be the fake clock
+static unsigned long long
+realNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void
+report(const char *name, const char *what, unsigned long long count,
+    unsigned long long elapsed)
+{
+    std::cout << name << ": " << count << " " << what << " in " << elapsed
+        << " us";
+    if (elapsed)
+        std::cout << ", " << count * 1000000ull / elapsed << " " << what
+            << "/sec";
+    std::cout << std::endl;
+}
+
+// Register a timeout and cancel it again, like a Socket doing I/O that
+// completes before its timeout would
+static void
+benchChurn(const char *name, unsigned long long granularity)
+{
+    unsigned long long iterations = g_iterations->val();
+    BenchTimerManager manager(granularity);
+    std::vector<Timer::ptr> outstanding;
+    for (unsigned long long i = 0; i < g_outstanding->val(); ++i)
+        outstanding.push_back(manager.registerTimer(
+            30000000ull + i * 100, &doNothing));
+    unsigned long long start = realNow();
+    for (unsigned long long i = 0; i < iterations; ++i)
+        manager.registerTimer(30000000ull, &doNothing)->cancel();
+    report(name, "register/cancels", iterations, realNow() - start);
+    for (size_t i = 0; i < outstanding.size(); ++i)
+        outstanding[i]->cancel();
+}
+
+// Register timers spread over a minute, and fire all of them
+static void
+benchExpire(const char *name, unsigned long long granularity)
+{
+    unsigned long long iterations = g_iterations->val();
+    FakeClock clock;
+    BenchTimerManager manager(granularity);
+    unsigned long long start = realNow();
+    for (unsigned long long i = 0; i < iterations; ++i)
+        manager.registerTimer((i * 7919) % 60000000ull, &doNothing);
+    unsigned long long fired = 0;
+    for (unsigned long long elapsed = 0; elapsed <= 60000000ull;
+        elapsed += 10000) {
+        fired += manager.processTimers().size();
+        clock.advance(10000);
+    }
+    fired += manager.processTimers().size();
+    MORDOR_ASSERT(fired == iterations);
+    report(name, "register/fires", fired, realNow() - start);
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+
+        benchChurn("set", 0);
+        benchChurn("wheel", g_granularity->val());
+        benchExpire("set", 0);
+        benchExpire("wheel", g_granularity->val());
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        throw;
+    }
+}
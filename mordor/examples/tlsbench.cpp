@@ -0,0 +1,113 @@
+// Copyright (c) 2009 - Mozy, Inc.
+//
+// Thread local lookup benchmark.
+//
+// Measures lookups/sec through a ThreadLocalStorage that is a pthread key,
+// one that is tagged (a native thread_local, unless libmordor was built
+// with MORDOR_PTHREAD_TLS or for something other than Linux), and through
+// Scheduler::getThis() and Fiber::getThis(), which are backed by tagged
+// ones.  Build with -DMORDOR_PTHREAD_TLS to get the "before" numbers for
+// the last two.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+
+#include "mordor/config.h"
+#include "mordor/fiber.h"
+#include "mordor/main.h"
+#include "mordor/thread_local_storage.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_iterations =
+    Config::lookup<unsigned long long>("tlsbench.iterations", 100000000ull,
+    "Number of lookups per test");
+
+static void
+report(const char *name, unsigned long long count, unsigned long long elapsed)
+{
+    std::cout << name << ": " << count << " lookups in " << elapsed << " us";
+    if (elapsed)
+        std::cout << ", " << count * 1000000ull / elapsed << " lookups/sec, "
+            << elapsed * 1000.0 / count << " ns each";
+    std::cout << std::endl;
+}
+
+// Keeps the compiler from hoisting a native thread local load out of the
+// loop, as it would otherwise be free to
+#define BARRIER() asm volatile("" ::: "memory")
+
+struct BenchTag;
+static ThreadLocalStorage<unsigned long long *> g_key;
+static ThreadLocalStorage<unsigned long long *, BenchTag> g_tagged;
+
+template <class T>
+static void
+benchStorage(const char *name, T &storage)
+{
+    unsigned long long count = g_iterations->val();
+    storage = &count;
+    uintptr_t sum = 0;
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < count; ++i) {
+        BARRIER();
+        sum += (uintptr_t)storage.get();
+    }
+    report(name, count, TimerManager::now() - start);
+    if (sum == 0)
+        std::cout << "(unexpected sum)" << std::endl;
+}
+
+static void
+benchSchedulerGetThis()
+{
+    unsigned long long count = g_iterations->val();
+    uintptr_t sum = 0;
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < count; ++i)
+        sum += (uintptr_t)Scheduler::getThis();
+    report("Scheduler::getThis()", count, TimerManager::now() - start);
+    if (sum == 0)
+        std::cout << "(unexpected sum)" << std::endl;
+}
+
+static void
+benchFiberGetThis()
+{
+    unsigned long long count = g_iterations->val();
+    uintptr_t sum = 0;
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < count; ++i)
+        sum += (uintptr_t)Fiber::getThis().get();
+    report("Fiber::getThis()", count, TimerManager::now() - start);
+    if (sum == 0)
+        std::cout << "(unexpected sum)" << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        // Makes this thread a Scheduler thread, with a Fiber, so getThis()
+        // has something to find
+        WorkerPool pool;
+
+        benchStorage("ThreadLocalStorage (key)", g_key);
+#ifdef MORDOR_NATIVE_TLS
+        benchStorage("ThreadLocalStorage (tagged, native)", g_tagged);
+#else
+        benchStorage("ThreadLocalStorage (tagged, key)", g_tagged);
+#endif
+        benchSchedulerGetThis();
+        benchFiberGetThis();
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
@@ -1,10 +1,12 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include "fiber.h"
+#include <map>
 #include <mutex>
 #include "assert.h"
 #include "mordor/config.h"
 #include "exception.h"
+#include "per_thread.h"
 #include "statistics.h"
 #include "version.h"
 
@@ -17,14 +19,109 @@
 #include <pthread.h>
 #endif
 
+#ifdef ASM_FIBERS
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in *from, then loads to as the new stack pointer and restores the
+// registers saved there; returning "into" whichever fiber last switched away
+// from that stack (or into Fiber::entryPoint for a fresh one, see initStack)
+extern "C" void mordor_fiber_switch(void **from, void *to);
+
+#ifdef X86_64
+asm(
+    ".pushsection .text\n"
+    ".globl mordor_fiber_switch\n"
+    ".hidden mordor_fiber_switch\n"
+    ".type mordor_fiber_switch,@function\n"
+    ".align 16\n"
+"mordor_fiber_switch:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    // The SSE and x87 control words are callee-saved as well
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size mordor_fiber_switch,.-mordor_fiber_switch\n"
+    ".popsection\n"
+);
+#elif defined(AARCH64)
+asm(
+    ".pushsection .text\n"
+    ".globl mordor_fiber_switch\n"
+    ".hidden mordor_fiber_switch\n"
+    ".type mordor_fiber_switch,%function\n"
+    ".align 4\n"
+"mordor_fiber_switch:\n"
+    "sub sp, sp, #160\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mov x9, sp\n"
+    "str x9, [x0]\n"
+    "mov sp, x1\n"
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "add sp, sp, #160\n"
+    "ret\n"
+    ".size mordor_fiber_switch,.-mordor_fiber_switch\n"
+    ".popsection\n"
+);
+#else
+#error Architecture not supported
+#endif
+#endif
+
 namespace Mordor {
 
-static AverageMinMaxStatistic<unsigned int> &g_statAlloc =
-    Statistics::registerStatistic("fiber.allocstack",
-    AverageMinMaxStatistic<unsigned int>("us"));
-static AverageMinMaxStatistic<unsigned int> &g_statFree=
-    Statistics::registerStatistic("fiber.freestack",
-    AverageMinMaxStatistic<unsigned int>("us"));
+// Updated on every fiber creation and destruction, from every thread
+typedef ShardedStatistic<AverageMinMaxStatistic<unsigned int> > StackStatistic;
+
+static StackStatistic &g_statAllocHit =
+    Statistics::registerStatistic("fiber.allocstack.hit",
+    StackStatistic(AverageMinMaxStatistic<unsigned int>("us")),
+    "Stacks taken from the per-thread stack pool");
+static StackStatistic &g_statAllocMiss =
+    Statistics::registerStatistic("fiber.allocstack.miss",
+    StackStatistic(AverageMinMaxStatistic<unsigned int>("us")),
+    "Stacks allocated from the OS");
+static StackStatistic &g_statFreeHit =
+    Statistics::registerStatistic("fiber.freestack.hit",
+    StackStatistic(AverageMinMaxStatistic<unsigned int>("us")),
+    "Stacks returned to the per-thread stack pool");
+static StackStatistic &g_statFreeMiss =
+    Statistics::registerStatistic("fiber.freestack.miss",
+    StackStatistic(AverageMinMaxStatistic<unsigned int>("us")),
+    "Stacks released to the OS");
 static volatile unsigned int g_cntFibers = 0; // Active fibers
 static MaxStatistic<unsigned int> &g_statMaxFibers=Statistics::registerStatistic("fiber.max",
     MaxStatistic<unsigned int>());
@@ -65,13 +162,81 @@ static ConfigVar<size_t>::ptr g_defaultStackSize = Config::lookup<size_t>(
     "Default stack size for new fibers.  This is the virtual size; physical "
     "memory isn't consumed until it is actually referenced.");
 
+#ifdef POSIX
+static ConfigVar<size_t>::ptr g_stackPoolSize = Config::lookup<size_t>(
+    "fiber.stackpoolsize",
+    64u,
+    "Maximum number of freed fiber stacks each thread keeps for reuse.  "
+    "Pooled stacks keep their address space, but their physical memory is "
+    "given back to the OS.");
+
+namespace {
+
+/// Freed fiber stacks, kept per thread and keyed by stack size
+struct StackPool : Mordor::noncopyable
+{
+    StackPool() : count(0) {}
+    ~StackPool();
+
+    std::map<size_t, std::vector<void *> > stacks;
+    size_t count;
+};
+
+}
+
+// Fibers destroyed late during thread exit find the pool already gone, and
+// just unmap their stacks
+static StackPool *
+stackPool()
+{
+    return PerThread<StackPool>::get();
+}
+
+static void *
+mapStack(size_t stacksize)
+{
+    // Reserve an extra page below the stack, so that overflowing it faults
+    // instead of silently corrupting whatever is mapped next to it
+    char *base = (char *)mmap(NULL, stacksize + g_pagesize,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    if (mprotect(base, g_pagesize, PROT_NONE)) {
+        error_t error = lastError();
+        munmap(base, stacksize + g_pagesize);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mprotect");
+    }
+    return base + g_pagesize;
+}
+
+static void
+unmapStack(void *stack, size_t stacksize)
+{
+    munmap((char *)stack - g_pagesize, stacksize + g_pagesize);
+}
+
+StackPool::~StackPool()
+{
+    for (std::map<size_t, std::vector<void *> >::const_iterator it =
+        stacks.begin();
+        it != stacks.end();
+        ++it) {
+        for (std::vector<void *>::const_iterator it2 = it->second.begin();
+            it2 != it->second.end();
+            ++it2)
+            unmapStack(*it2, it->first);
+    }
+}
+#endif
+
 // t_fiber is the Fiber currently executing on this thread
 // t_threadFiber is the Fiber that represents the thread's original stack
 // t_threadFiber is a boost::tss, because it supports automatic cleanup when
 // the thread exits (and datatypes larger than pointer size), while
 // ThreadLocalStorage does not
-// t_fiber is a ThreadLocalStorage, because it's faster than boost::tss
-ThreadLocalStorage<Fiber *> Fiber::t_fiber;
+// t_fiber is a ThreadLocalStorage, because it's faster than boost::tss (and
+// tagged, so it's a native thread local where there are any)
+ThreadLocalStorage<Fiber *, Fiber> Fiber::t_fiber;
 //static boost::thread_specific_ptr<Fiber::ptr> t_threadFiber; // Z
 static thread_local std::unique_ptr<Fiber::ptr> t_threadFiber; // Z
 
@@ -381,12 +546,10 @@ Fiber::allocStack()
 {
     if (m_stacksize == 0)
         m_stacksize = g_defaultStackSize->val();
-#ifndef NATIVE_WINDOWS_FIBERS
-    TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statAlloc);
-#endif
 #ifdef NATIVE_WINDOWS_FIBERS
     // Fibers are allocated in initStack
 #elif defined(WINDOWS)
+    TimeStatistic<StackStatistic> time(g_statAllocMiss);
     m_stack = VirtualAlloc(NULL, m_stacksize + g_pagesize, MEM_RESERVE, PAGE_NOACCESS);
     if (!m_stack)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("VirtualAlloc");
@@ -395,9 +558,18 @@ Fiber::allocStack()
     VirtualAlloc((char*)m_stack + g_pagesize, m_stacksize, MEM_COMMIT, PAGE_READWRITE);
     m_sp = (char*)m_stack + m_stacksize + g_pagesize;
 #elif defined(POSIX)
-    m_stack = mmap(NULL, m_stacksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (m_stack == MAP_FAILED)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    StackPool *pool = stackPool();
+    std::map<size_t, std::vector<void *> >::iterator it;
+    if (pool && (it = pool->stacks.find(m_stacksize)) != pool->stacks.end()
+        && !it->second.empty()) {
+        TimeStatistic<StackStatistic> time(g_statAllocHit);
+        m_stack = it->second.back();
+        it->second.pop_back();
+        --pool->count;
+    } else {
+        TimeStatistic<StackStatistic> time(g_statAllocMiss);
+        m_stack = mapStack(m_stacksize);
+    }
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     m_valgrindStackId = VALGRIND_STACK_REGISTER(m_stack, (char *)m_stack + m_stacksize);
 #endif
@@ -408,17 +580,32 @@ Fiber::allocStack()
 void
 Fiber::freeStack()
 {
-    TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statFree);
 #ifdef NATIVE_WINDOWS_FIBERS
+    TimeStatistic<StackStatistic> time(g_statFreeMiss);
     MORDOR_ASSERT(m_stack == &m_sp);
     DeleteFiber(m_sp);
 #elif defined(WINDOWS)
+    TimeStatistic<StackStatistic> time(g_statFreeMiss);
     VirtualFree(m_stack, 0, MEM_RELEASE);
 #elif defined(POSIX)
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     VALGRIND_STACK_DEREGISTER(m_valgrindStackId);
 #endif
-    munmap(m_stack, m_stacksize);
+    StackPool *pool = stackPool();
+    if (pool && pool->count < g_stackPoolSize->val()) {
+        TimeStatistic<StackStatistic> time(g_statFreeHit);
+        // Keep the mapping (and its guard page), but let the kernel reclaim
+        // the memory lazily; the next owner doesn't care what's in it
+#ifdef MADV_FREE
+        if (madvise(m_stack, m_stacksize, MADV_FREE))
+#endif
+            madvise(m_stack, m_stacksize, MADV_DONTNEED);
+        pool->stacks[m_stacksize].push_back(m_stack);
+        ++pool->count;
+    } else {
+        TimeStatistic<StackStatistic> time(g_statFreeMiss);
+        unmapStack(m_stack, m_stacksize);
+    }
 #endif
 }
 
@@ -442,6 +629,12 @@ Fiber::switchContext(Fiber *to)
 #  endif
         longjmp(*(jmp_buf*)to->m_sp, 1);
     }
+
+#elif defined(ASM_FIBERS)
+#  if defined(CXXABIV1_EXCEPTION)
+    this->m_eh.swap(to->m_eh);
+#  endif
+    mordor_fiber_switch(&this->m_sp, to->m_sp);
 #endif
 }
 
@@ -451,7 +644,7 @@ Fiber::initStack()
 #ifdef NATIVE_WINDOWS_FIBERS
     if (m_stack)
         return;
-    TimeStatistic<AverageMinMaxStatistic<unsigned int> > stat(g_statAlloc);
+    TimeStatistic<StackStatistic> stat(g_statAllocMiss);
     m_sp = m_stack = pCreateFiberEx(0, m_stacksize, 0, &native_fiber_entryPoint, &Fiber::entryPoint);
     stat.finish();
     if (!m_stack)
@@ -516,6 +709,25 @@ Fiber::initStack()
 #else
 #error Platform not supported
 #endif
+#elif defined(ASM_FIBERS)
+    // Lay out the frame mordor_fiber_switch expects to find, so that the
+    // first switch to this fiber "returns" into entryPoint
+    unsigned long long *top = (unsigned long long *)
+        (((uintptr_t)m_stack + m_stacksize) & ~(uintptr_t)15);
+#ifdef X86_64
+    // fpu control words, r15, r14, r13, r12, rbx, rbp, return address, and a
+    // null slot so entryPoint sees the stack alignment of a normal call
+    unsigned long long *sp = top - 9;
+    memset(sp, 0, 9 * sizeof(unsigned long long));
+    sp[0] = 0x1F80ull | (0x037Full << 32); // default MXCSR and x87 CW
+    sp[7] = (unsigned long long)&Fiber::entryPoint;
+#elif defined(AARCH64)
+    // x19-x28, x29 (null frame pointer), x30 (return address), d8-d15
+    unsigned long long *sp = top - 20;
+    memset(sp, 0, 20 * sizeof(unsigned long long));
+    sp[11] = (unsigned long long)&Fiber::entryPoint;
+#endif
+    m_sp = sp;
 #endif
 }
 
@@ -11,11 +11,18 @@
 
 // Fiber impl selection
 
+// Define MORDOR_ASM_FIBERS (configure --enable-asm-fibers) to switch fibers
+// with a hand-written assembly routine that only saves the callee-saved
+// registers, instead of swapcontext (which also makes a sigprocmask syscall
+// on every switch).  Only available for x86-64 and AArch64 Linux.
+
 #ifdef X86_64
 #   ifdef WINDOWS
 #       define NATIVE_WINDOWS_FIBERS
 #   elif defined(OSX)
 #       define SETJMP_FIBERS
+#   elif defined(LINUX) && defined(MORDOR_ASM_FIBERS)
+#       define ASM_FIBERS
 #   elif defined(POSIX)
 #       define UCONTEXT_FIBERS
 #   endif
@@ -29,6 +36,12 @@
 #   endif
 #elif defined(PPC)
 #   define UCONTEXT_FIBERS
+#elif defined(AARCH64)
+#   if defined(LINUX) && defined(MORDOR_ASM_FIBERS)
+#       define ASM_FIBERS
+#   else
+#       define UCONTEXT_FIBERS
+#   endif
 #elif defined(ARM)
 #   define UCONTEXT_FIBERS
 #else
@@ -187,7 +200,7 @@ private:
     weak_ptr m_terminateOuter;
     boost::exception_ptr m_exception;
 
-    static ThreadLocalStorage<Fiber *> t_fiber;
+    static ThreadLocalStorage<Fiber *, Fiber> t_fiber;
 
     // FLS Support
     static size_t flsAlloc();
@@ -4,12 +4,14 @@
 
 #include "auth.h"
 #include "client.h"
+#include "http2.h"
 #include "mordor/atomic.h"
 #include "mordor/fiber.h"
 #include "mordor/future.h"
 #include "mordor/iomanager.h"
 #include "mordor/log.h"
 #include "mordor/socks.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/buffered.h"
 #include "mordor/streams/pipe.h"
 #include "mordor/streams/socket.h"
@@ -41,7 +43,10 @@ createRequestBroker(const RequestBrokerOptions &options)
 
     ConnectionBroker::ptr connectionBroker;
     ConnectionCache::ptr connectionCache;
-    if (!options.enableConnectionCache) {
+    if (options.http2) {
+        connectionBroker.reset(new HTTP2::SessionCache(streamBroker,
+            timerManager));
+    } else if (!options.enableConnectionCache) {
         ConnectionNoCache::ptr connectionNoCache(new ConnectionNoCache(streamBroker,
             timerManager));
         connectionBroker = std::static_pointer_cast<ConnectionBroker>(connectionNoCache);
@@ -51,6 +56,7 @@ createRequestBroker(const RequestBrokerOptions &options)
         connectionCache->proxyForURI(options.proxyForURIDg);
         connectionCache->proxyRequestBroker(options.proxyRequestBroker);
         connectionCache->connectionsPerHost(options.connectionsPerHost);
+        connectionCache->pipelineDepth(options.pipelineDepth);
         connectionBroker = std::static_pointer_cast<ConnectionBroker>(connectionCache);
     }
     connectionBroker->httpReadTimeout(options.httpReadTimeout);
@@ -58,10 +64,19 @@ createRequestBroker(const RequestBrokerOptions &options)
     connectionBroker->sslReadTimeout(options.sslConnectReadTimeout);
     connectionBroker->sslWriteTimeout(options.sslConnectWriteTimeout);
     connectionBroker->sslCtx(options.sslCtx);
+    if (options.sslSessionCacheSize == 0)
+        connectionBroker->sslSessionCache(SSLSessionCache::ptr());
+    else
+        connectionBroker->sslSessionCache(SSLSessionCache::ptr(
+            new SSLSessionCache(options.sslSessionCacheSize,
+            options.sslSessionTimeout)));
     connectionBroker->verifySslCertificate(options.verifySslCertificate);
     connectionBroker->verifySslCertificateHost(options.verifySslCertificateHost);
 
-    RequestBroker::ptr requestBroker(new BaseRequestBroker(connectionBroker));
+    BaseRequestBroker::ptr baseRequestBroker(
+        new BaseRequestBroker(connectionBroker));
+    baseRequestBroker->idempotentRetries(options.idempotentRetries);
+    RequestBroker::ptr requestBroker = baseRequestBroker;
 
     if (options.getCredentialsDg || options.getProxyCredentialsDg)
         requestBroker.reset(new AuthRequestBroker(requestBroker,
@@ -193,6 +208,41 @@ static bool least(const ClientConnection::ptr &lhs,
 
 static Logger::ptr g_cacheLog = Log::lookup("mordor:http:connectioncache");
 
+static AverageMinMaxStatistic<unsigned int> &g_statPipelineOccupancy =
+    Statistics::registerStatistic("http.connectioncache.pipeline.occupancy",
+    AverageMinMaxStatistic<unsigned int>("requests"),
+    "Outstanding requests on a cached connection, including the one it is "
+    "being handed out for");
+static CountStatistic<unsigned long long> &g_statPipelineWaits =
+    Statistics::registerStatistic("http.connectioncache.pipeline.waits",
+    CountStatistic<unsigned long long>(),
+    "Times a request waited for room in a full pipeline");
+static CountStatistic<unsigned long long> &g_statIdempotentRetries =
+    Statistics::registerStatistic("http.broker.idempotentretries",
+    CountStatistic<unsigned long long>(),
+    "Idempotent requests resent after losing their connection");
+
+ConnectionCache::ConnectionCache(StreamBroker::ptr streamBroker,
+    TimerManager *timerManager)
+    : m_streamBroker(streamBroker),
+      m_connectionsPerHost(1u),
+      m_pipelineDepth(0u),
+      m_closed(false)
+{
+    m_timerManager = timerManager;
+    m_sslSessionCache.reset(new SSLSessionCache());
+}
+
+void
+ConnectionBroker::sslCtx(SSL_CTX *ctx)
+{
+    m_sslCtx = ctx;
+    // Once, here, rather than from each connection (possibly on different
+    // threads) that resumes a session
+    if (ctx)
+        SSLStream::enableClientSessionCache(ctx);
+}
+
 std::pair<ClientConnection::ptr, bool>
 ConnectionCache::getConnection(const URI &uri, bool forceNewConnection)
 {
@@ -334,8 +384,23 @@ ConnectionCache::getConnectionViaProxyFromCache(const URI &uri, const URI &proxy
                 // disappeared
                 it = m_conns.find(endpoint);
             } else {
+                size_t outstanding = (*it2)->outstandingRequests();
+                if (m_pipelineDepth != 0 && outstanding >= m_pipelineDepth) {
+                    MORDOR_LOG_TRACE(g_cacheLog) << this << " waiting for room"
+                        << " in the pipeline to " << endpoint;
+                    g_statPipelineWaits.increment();
+                    info->condition.wait();
+                    if (m_closed)
+                        MORDOR_THROW_EXCEPTION(OperationAbortedException());
+                    // A connection may have failed while we were waiting,
+                    // leaving room to open another one
+                    cleanOutDeadConns(m_conns);
+                    it = m_conns.find(endpoint);
+                    continue;
+                }
                 MORDOR_LOG_TRACE(g_cacheLog) << this << " returning cached connection "
                     << *it2 << " to " << endpoint;
+                g_statPipelineOccupancy.update((unsigned int)outstanding + 1);
                 // Return the existing, completed connection
                 return std::make_pair(*it2, proxied);
             }
@@ -419,6 +484,10 @@ ConnectionCache::getConnectionViaProxy(const URI &uri, const URI &proxy,
             result.first->idleTimeout(m_idleTimeout,
             boost::bind(&ConnectionCache::dropConnection,
                 this, weak_ptr(shared_from_this()), endpoint, result.first.get()));
+        if (m_pipelineDepth != 0)
+            result.first->onRequestComplete(boost::bind(
+                &ConnectionCache::requestComplete, this,
+                weak_ptr(shared_from_this()), endpoint));
         // Assign this connection to the first blank connection for this
         // schemeAndAuthority
         for (it2 = info->connections.begin();
@@ -550,7 +619,8 @@ ConnectionCache::cleanOutDeadConns(CachedConnectionMap &conns)
 }
 
 void
-ConnectionBroker::addSSL(const URI &uri, Stream::ptr &stream)
+ConnectionBroker::addSSL(const URI &uri, Stream::ptr &stream,
+    std::string *alpnProtocol)
 {
     if (uri.schemeDefined() && uri.scheme() == "https") {
         TimeoutStream::ptr timeoutStream;
@@ -564,11 +634,30 @@ ConnectionBroker::addSSL(const URI &uri, Stream::ptr &stream)
         bufferedStream->allowPartialReads(true);
         SSLStream::ptr sslStream(new SSLStream(bufferedStream, true, true, m_sslCtx));
         sslStream->serverNameIndication(uri.authority.host());
+        std::string sessionKey;
+        if (m_sslSessionCache) {
+            std::ostringstream os;
+            os << uri.authority.host() << ':'
+                << (uri.authority.portDefined() ? uri.authority.port() : 443);
+            sessionKey = os.str();
+            sslStream->sessionCache(m_sslSessionCache, sessionKey);
+        }
+        if (!m_alpnProtocols.empty())
+            sslStream->alpnProtocols(m_alpnProtocols);
         sslStream->connect();
-        if (m_verifySslCertificate)
-            sslStream->verifyPeerCertificate();
-        if (m_verifySslCertificateHost)
-            sslStream->verifyPeerCertificate(uri.authority.host());
+        try {
+            if (m_verifySslCertificate)
+                sslStream->verifyPeerCertificate();
+            if (m_verifySslCertificateHost)
+                sslStream->verifyPeerCertificate(uri.authority.host());
+        } catch (...) {
+            // Don't let the next connection skip straight past verification
+            if (m_sslSessionCache)
+                m_sslSessionCache->remove(sessionKey);
+            throw;
+        }
+        if (alpnProtocol)
+            *alpnProtocol = sslStream->alpnProtocol();
         if (timeoutStream) {
             bufferedStream->parent(timeoutStream->parent());
             timeoutStream.reset();
@@ -620,11 +709,26 @@ ConnectionCache::dropConnection(weak_ptr self,
         if (m_idleTimeout != ~0ull)
             (*it2)->idleTimeout(~0ull, NULL);
         it->second->connections.erase(it2);
+        // Let anyone waiting for room in a pipeline open a new connection
+        it->second->condition.broadcast();
         if (it->second->connections.empty())
             m_conns.erase(it);
     }
 }
 
+void
+ConnectionCache::requestComplete(weak_ptr self, const URI &uri)
+{
+    ptr strongSelf = self.lock();
+    if (!strongSelf)
+        return;
+
+    FiberMutex::ScopedLock lock(m_mutex);
+    CachedConnectionMap::iterator it = m_conns.find(uri);
+    if (it != m_conns.end())
+        it->second->condition.broadcast();
+}
+
 // Get the number of active connections
 // Can be used to determine throttling with multiple connections.
 size_t
@@ -719,9 +823,58 @@ static void doBody(ClientRequest::ptr request,
     future.signal();
 }
 
+static bool
+isIdempotent(const std::string &method)
+{
+    return method == GET || method == HEAD || method == PUT ||
+        method == DELETE || method == OPTIONS || method == TRACE;
+}
+
+// Failures establishing a connection are RetryRequestBroker's business; only
+// resend when an established one went away
+static bool
+shouldResend(const boost::exception &ex, const Request &requestHeaders,
+    bool hasBody, size_t retries, size_t maxRetries)
+{
+    if (hasBody || retries >= maxRetries ||
+        !isIdempotent(requestHeaders.requestLine.method))
+        return false;
+    const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
+    return !source || *source != CONNECTION;
+}
+
 ClientRequest::ptr
 BaseRequestBroker::request(Request &requestHeaders, bool forceNewConnection,
                            boost::function<void (ClientRequest::ptr)> bodyDg)
+{
+    size_t retries = 0;
+    while (true) {
+        try {
+            return requestOnce(requestHeaders, forceNewConnection, bodyDg);
+        } catch (PriorRequestFailedException &ex) {
+            if (!shouldResend(ex, requestHeaders, !bodyDg.empty(), retries,
+                m_idempotentRetries))
+                throw;
+        } catch (UnexpectedEofException &ex) {
+            if (!shouldResend(ex, requestHeaders, !bodyDg.empty(), retries,
+                m_idempotentRetries))
+                throw;
+        } catch (SocketException &ex) {
+            if (!shouldResend(ex, requestHeaders, !bodyDg.empty(), retries,
+                m_idempotentRetries))
+                throw;
+        }
+        ++retries;
+        g_statIdempotentRetries.increment();
+        MORDOR_LOG_DEBUG(g_cacheLog) << this << " resending "
+            << requestHeaders.requestLine.method << " "
+            << requestHeaders.requestLine.uri << " after losing its connection";
+    }
+}
+
+ClientRequest::ptr
+BaseRequestBroker::requestOnce(Request &requestHeaders,
+    bool forceNewConnection, boost::function<void (ClientRequest::ptr)> bodyDg)
 {
     URI &currentUri = requestHeaders.requestLine.uri;
     URI originalUri = currentUri;
@@ -815,6 +968,21 @@ BaseRequestBroker::request(Request &requestHeaders, bool forceNewConnection,
     }
 }
 
+// Only failures from the HTTP layer (and, if connectionFailures, from
+// establishing the connection) are retried; only those that count consume
+// the shared retry counter
+static bool
+shouldRetry(const boost::exception &ex, bool connectionFailures, bool count,
+    const boost::function<bool (size_t)> &delayDg, size_t *retries)
+{
+    const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
+    if (!source || (*source != HTTP &&
+        (!connectionFailures || *source != CONNECTION)))
+        return false;
+    return !delayDg ||
+        delayDg(count ? atomicIncrement(*retries) : *retries + 1);
+}
+
 ClientRequest::ptr
 RetryRequestBroker::request(Request &requestHeaders, bool forceNewConnection,
                            boost::function<void (ClientRequest::ptr)> bodyDg)
@@ -829,31 +997,19 @@ RetryRequestBroker::request(Request &requestHeaders, bool forceNewConnection,
             *retries = 0;
             return request;
         } catch (SocketException &ex) {
-            const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
-            if (!source || (*source != HTTP && *source != CONNECTION))
-                throw;
-            if (m_delayDg && !m_delayDg(atomicIncrement(*retries)))
+            if (!shouldRetry(ex, true, true, m_delayDg, retries))
                 throw;
             continue;
         } catch (PriorRequestFailedException &ex) {
-            const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
-            if (!source || *source != HTTP)
-                throw;
-            if (m_delayDg && !m_delayDg(*retries + 1))
+            if (!shouldRetry(ex, false, false, m_delayDg, retries))
                 throw;
             continue;
         } catch (PriorConnectionFailedException &ex) {
-            const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
-            if (!source || (*source != HTTP && *source != CONNECTION))
-                throw;
-            if (m_delayDg && !m_delayDg(*retries + 1))
+            if (!shouldRetry(ex, true, false, m_delayDg, retries))
                 throw;
             continue;
         } catch (UnexpectedEofException &ex) {
-            const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
-            if (!source || *source != HTTP)
-                throw;
-            if (m_delayDg && !m_delayDg(atomicIncrement(*retries)))
+            if (!shouldRetry(ex, false, true, m_delayDg, retries))
                 throw;
             continue;
         }
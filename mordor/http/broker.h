@@ -13,6 +13,7 @@ namespace Mordor {
 class IOManager;
 class Scheduler;
 class Socket;
+class SSLSessionCache;
 class Stream;
 class TimerManager;
 
@@ -123,18 +124,31 @@ public:
     void idleTimeout(unsigned long long timeout) { m_idleTimeout = timeout; }
     void sslReadTimeout(unsigned long long timeout) { m_sslReadTimeout = timeout; }
     void sslWriteTimeout(unsigned long long timeout) { m_sslWriteTimeout = timeout; }
-    void sslCtx(SSL_CTX *ctx) { m_sslCtx = ctx; }
+    /// Shared by every https connection; readies it for sslSessionCache()
+    void sslCtx(SSL_CTX *ctx);
+    // Sessions to resume when making new https connections; NULL to always
+    // do a full handshake
+    void sslSessionCache(std::shared_ptr<SSLSessionCache> cache)
+    { m_sslSessionCache = cache; }
+    std::shared_ptr<SSLSessionCache> sslSessionCache() const
+    { return m_sslSessionCache; }
     void verifySslCertificate(bool verify) { m_verifySslCertificate = verify; }
     void verifySslCertificateHost(bool verify) { m_verifySslCertificateHost = verify; }
 
 protected:
-    void addSSL(const URI &uri, std::shared_ptr<Stream> &stream);
+    /// @param alpnProtocol If not NULL, gets the protocol the server chose
+    /// from m_alpnProtocols
+    void addSSL(const URI &uri, std::shared_ptr<Stream> &stream,
+        std::string *alpnProtocol = NULL);
 
 protected:
     bool m_verifySslCertificate, m_verifySslCertificateHost;
     unsigned long long m_httpReadTimeout, m_httpWriteTimeout, m_idleTimeout,
         m_sslReadTimeout, m_sslWriteTimeout;
     SSL_CTX * m_sslCtx;
+    std::shared_ptr<SSLSessionCache> m_sslSessionCache;
+    // Offered in the TLS handshake, if not empty
+    std::vector<std::string> m_alpnProtocols;
     TimerManager *m_timerManager;
 };
 
@@ -161,13 +175,8 @@ public:
     typedef std::weak_ptr<ConnectionCache> weak_ptr;
 
 protected:
-    ConnectionCache(StreamBroker::ptr streamBroker, TimerManager *timerManager = NULL)
-        : m_streamBroker(streamBroker),
-          m_connectionsPerHost(1u),
-          m_closed(false)
-    {
-        m_timerManager = timerManager;
-    }
+    // Starts out with its own SSLSessionCache
+    ConnectionCache(StreamBroker::ptr streamBroker, TimerManager *timerManager = NULL);
 
 public:
     static ConnectionCache::ptr create(StreamBroker::ptr streamBroker, TimerManager *timerManager = NULL)
@@ -177,6 +186,14 @@ public:
     // at a time
     void connectionsPerHost(size_t connections) { m_connectionsPerHost = connections; }
 
+    // Pipelining: once there are connectionsPerHost connections to a host,
+    // requests are sent down the one with the fewest outstanding, without
+    // waiting for earlier responses.  With a depth, no connection is given
+    // more than that many outstanding requests; callers wait for room
+    // instead.  0 (the default) is no limit.
+    void pipelineDepth(size_t depth) { m_pipelineDepth = depth; }
+    size_t pipelineDepth() const { return m_pipelineDepth; }
+
     // Get number of active connections
     size_t getActiveConnections();
 
@@ -232,11 +249,12 @@ private:
         FiberMutex::ScopedLock &lock);
     void cleanOutDeadConns(CachedConnectionMap &conns);
     void dropConnection(weak_ptr self, const URI &uri, const ClientConnection *connection);
+    void requestComplete(weak_ptr self, const URI &uri);
 
 private:
     FiberMutex m_mutex;
     StreamBroker::ptr m_streamBroker;
-    size_t m_connectionsPerHost;
+    size_t m_connectionsPerHost, m_pipelineDepth;
 
     CachedConnectionMap m_conns;
     bool m_closed;
@@ -366,19 +384,32 @@ public:
 
 public:
     BaseRequestBroker(ConnectionBroker::ptr connectionBroker)
-        : m_connectionBroker(connectionBroker)
+        : m_connectionBroker(connectionBroker),
+          m_idempotentRetries(0)
     {}
     BaseRequestBroker(ConnectionBroker::weak_ptr connectionBroker)
-        : m_weakConnectionBroker(connectionBroker)
+        : m_weakConnectionBroker(connectionBroker),
+          m_idempotentRetries(0)
     {}
 
+    // When a connection is lost before the response arrives (which, with
+    // pipelining, takes every request queued behind it along too), resend
+    // requests with an idempotent method and no body up to this many times
+    void idempotentRetries(size_t retries) { m_idempotentRetries = retries; }
+
     std::shared_ptr<ClientRequest> request(Request &requestHeaders,
         bool forceNewConnection = false,
         boost::function<void (std::shared_ptr<ClientRequest>)> bodyDg = NULL);
 
+private:
+    std::shared_ptr<ClientRequest> requestOnce(Request &requestHeaders,
+        bool forceNewConnection,
+        boost::function<void (std::shared_ptr<ClientRequest>)> bodyDg);
+
 private:
     ConnectionBroker::ptr m_connectionBroker;
     ConnectionBroker::weak_ptr m_weakConnectionBroker;
+    size_t m_idempotentRetries;
 };
 
 /// Retries connection error and PriorRequestFailed errors
@@ -485,10 +516,15 @@ struct RequestBrokerOptions
         httpWriteTimeout(~0ull),
         idleTimeout(~0ull),
         connectionsPerHost(1u),
+        pipelineDepth(0u),
+        idempotentRetries(0u),
         sslCtx(NULL),
+        sslSessionCacheSize(1024u),
+        sslSessionTimeout(3600000000ull),
         verifySslCertificate(false),
         verifySslCertificateHost(true),
-        enableConnectionCache(true)
+        enableConnectionCache(true),
+        http2(false)
     {}
 
     IOManager *ioManager;
@@ -514,6 +550,10 @@ struct RequestBrokerOptions
     unsigned long long httpWriteTimeout;
     unsigned long long idleTimeout;
     size_t connectionsPerHost;
+    // See ConnectionCache::pipelineDepth and
+    // BaseRequestBroker::idempotentRetries
+    size_t pipelineDepth;
+    size_t idempotentRetries;
 
     // Callback to find proxy for an URI, see ConnectionCache::proxyForURI
     boost::function<std::vector<URI> (const URI &)> proxyForURIDg;
@@ -536,9 +576,17 @@ struct RequestBrokerOptions
     StreamBrokerFilter::ptr customStreamBrokerFilter;
 
     SSL_CTX *sslCtx;
+    // How many servers to remember TLS sessions for (0 to disable resumption),
+    // and for how long (us)
+    size_t sslSessionCacheSize;
+    unsigned long long sslSessionTimeout;
     bool verifySslCertificate;
     bool verifySslCertificateHost;
     bool enableConnectionCache;
+    // Multiplex requests to https servers that negotiate h2 over one
+    // connection per server (see HTTP2::SessionCache); connectionsPerHost,
+    // pipelineDepth, and proxies don't apply
+    bool http2;
 
     // When specified a UserAgentRequestBroker will take care of adding
     // the User-Agent header to each request
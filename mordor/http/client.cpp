@@ -130,6 +130,14 @@ ClientConnection::idleTimeout(unsigned long long us, boost::function<void ()> dg
         m_idleTimer = m_timerManager->registerTimer(m_idleTimeout, dg);
 }
 
+void
+ClientConnection::requestComplete()
+{
+    // Scheduled instead of called, since m_mutex is usually held
+    if (m_requestCompleteDg && Scheduler::getThis())
+        Scheduler::getThis()->schedule(m_requestCompleteDg);
+}
+
 void
 ClientConnection::scheduleNextRequest(ClientRequest *request)
 {
@@ -153,6 +161,7 @@ ClientConnection::scheduleNextRequest(ClientRequest *request)
         if (request->m_responseState >= ClientRequest::COMPLETE) {
             MORDOR_ASSERT(request == m_pendingRequests.front());
             m_pendingRequests.pop_front();
+            requestComplete();
         }
         m_currentRequest = it;
         request = *it;
@@ -202,6 +211,7 @@ ClientConnection::scheduleNextRequest(ClientRequest *request)
         if (request->m_responseState >= ClientRequest::COMPLETE) {
             MORDOR_ASSERT(request == m_pendingRequests.front());
             m_pendingRequests.pop_front();
+            requestComplete();
             if (m_priorResponseClosed <= request->m_requestNumber ||
                 m_priorResponseFailed <= request->m_requestNumber) {
                 MORDOR_ASSERT(m_pendingRequests.empty());
@@ -252,6 +262,7 @@ ClientConnection::scheduleNextResponse(ClientRequest *request)
         ++it;
         if (request->m_requestState >= ClientRequest::COMPLETE) {
             m_pendingRequests.pop_front();
+            requestComplete();
             if (m_priorResponseClosed <= request->m_requestNumber ||
                 m_priorResponseFailed <= request->m_requestNumber)
                 close = true;
@@ -310,6 +321,9 @@ ClientConnection::scheduleAllWaitingRequests()
         m_priorResponseClosed != ~0ull);
     // MORDOR_ASSERT(m_mutex.locked());
     MORDOR_LOG_TRACE(g_log) << m_connectionNumber << " scheduling all requests";
+    // The connection is done for; anyone waiting for room in it should look
+    // elsewhere
+    requestComplete();
 
     for (std::list<ClientRequest *>::iterator it(m_currentRequest);
         it != m_pendingRequests.end();
@@ -701,6 +715,7 @@ ClientRequest::cancel(bool abort, bool error)
             m_conn->m_pendingRequests.end(), this);
         MORDOR_ASSERT(it != m_conn->m_pendingRequests.end());
         m_conn->m_pendingRequests.erase(it);
+        m_conn->requestComplete();
         if (m_responseState == WAITING) {
             std::set<ClientRequest *>::iterator waitIt =
                 m_conn->m_waitingResponses.find(this);
@@ -761,6 +776,7 @@ ClientRequest::cancel(bool abort, bool error)
                 m_conn->m_currentRequest = m_conn->m_pendingRequests.erase(it);
             else
                 m_conn->m_pendingRequests.erase(it);
+            m_conn->requestComplete();
         } else if (it == m_conn->m_currentRequest) {
             ++m_conn->m_currentRequest;
         }
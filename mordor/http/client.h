@@ -166,12 +166,17 @@ public:
     void readTimeout(unsigned long long us);
     void writeTimeout(unsigned long long us);
     void idleTimeout(unsigned long long us, boost::function<void ()> dg);
+    /// Scheduled on the current Scheduler whenever a request leaves this
+    /// connection's pipeline, whether it completed or failed
+    void onRequestComplete(boost::function<void ()> dg)
+    { m_requestCompleteDg = dg; }
 
 private:
     void scheduleNextRequest(ClientRequest *currentRequest);
     void scheduleNextResponse(ClientRequest *currentRequest);
     void scheduleAllWaitingRequests();
     void scheduleAllWaitingResponses();
+    void requestComplete();
 
 private:
     std::mutex m_mutex;
@@ -180,6 +185,7 @@ private:
     std::shared_ptr<Timer> m_idleTimer;
     TimerManager *m_timerManager;
     std::function<void ()> m_idleDg;
+    std::function<void ()> m_requestCompleteDg;
     std::list<ClientRequest *> m_pendingRequests;
     std::list<ClientRequest *>::iterator m_currentRequest;
     std::set<ClientRequest *> m_waitingResponses;
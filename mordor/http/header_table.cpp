@@ -0,0 +1,464 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "header_table.h"
+
+#include <ostream>
+
+#include "mordor/assert.h"
+#include "mordor/streams/stream.h"
+#include "parser.h"
+
+namespace Mordor {
+namespace HTTP {
+
+bool
+Slice::operator==(const char *string) const
+{
+    return strncmp(data, string, length) == 0 && string[length] == '\0';
+}
+
+bool
+Slice::iequals(const char *string) const
+{
+    return strnicmp(data, string, length) == 0 && string[length] == '\0';
+}
+
+std::ostream &
+operator <<(std::ostream &os, const Slice &slice)
+{
+    return os.write(slice.data, slice.length);
+}
+
+namespace {
+// Where we are in looking for the empty line that ends a head; it can be fed
+// the bytes in pieces
+struct Scanner
+{
+    Scanner() : offset(0), skip(0), lineLength(0), started(false) {}
+
+    /// @return Offset just past the end of the head, or 0
+    size_t scan(const char *p, size_t length)
+    {
+        for (const char *end = p + length; p < end; ++p, ++offset) {
+            switch (*p) {
+                case '\n':
+                    if (lineLength == 0) {
+                        // Empty lines before the start line are ignored
+                        if (started)
+                            return offset + 1;
+                        skip = offset + 1;
+                    }
+                    lineLength = 0;
+                    break;
+                case '\r':
+                    break;
+                default:
+                    ++lineLength;
+                    started = true;
+                    break;
+            }
+        }
+        return 0;
+    }
+
+    size_t offset, skip, lineLength;
+    bool started;
+};
+}
+
+static bool
+isTokenChar(char c)
+{
+    if (c <= 32 || c >= 127)
+        return false;
+    switch (c) {
+        case '(': case ')': case '<': case '>': case '@': case ',': case ';':
+        case ':': case '\\': case '"': case '/': case '[': case ']': case '?':
+        case '=': case '{': case '}':
+            return false;
+        default:
+            return true;
+    }
+}
+
+static bool
+isWhitespace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static void
+trim(const char *&start, const char *&end)
+{
+    while (start < end && isWhitespace(*start))
+        ++start;
+    while (end > start && isWhitespace(end[-1]))
+        --end;
+}
+
+// "HTTP/" DIGIT+ "." DIGIT+, with each number fitting in a byte
+static bool
+parseVersion(const char *start, const char *end, Version &version)
+{
+    if (end - start < 8 || strncmp(start, "HTTP/", 5) != 0)
+        return false;
+    start += 5;
+    unsigned int numbers[2] = { 0, 0 };
+    for (int i = 0; i < 2; ++i) {
+        const char *digits = start;
+        while (start < end && *start >= '0' && *start <= '9') {
+            numbers[i] = numbers[i] * 10 + (*start++ - '0');
+            if (numbers[i] > 255)
+                return false;
+        }
+        if (start == digits)
+            return false;
+        if (i == 0) {
+            if (start == end || *start != '.')
+                return false;
+            ++start;
+        }
+    }
+    if (start != end)
+        return false;
+    version = Version((unsigned char)numbers[0], (unsigned char)numbers[1]);
+    return true;
+}
+
+HeaderTable::HeaderTable(bool request)
+    : m_request(request)
+{
+    clear();
+}
+
+void
+HeaderTable::clear()
+{
+    m_buffer.clear();
+    m_head = NULL;
+    m_length = 0;
+    m_method = m_target = m_reason = Slice();
+    m_status = INVALID;
+    m_version = Version();
+    m_overflow.clear();
+    m_size = 0;
+    m_unfolded.clear();
+    m_contentLengthState = UNKNOWN;
+}
+
+size_t
+HeaderTable::parse(const Buffer &buffer)
+{
+    clear();
+    Scanner scanner;
+    size_t end;
+    // Almost always the head is in the first segment
+    iovec first = buffer.readBuffer(~0, false);
+    end = scanner.scan((const char *)first.iov_base, first.iov_len);
+    if (end == 0 && first.iov_len < buffer.readAvailable()) {
+        std::vector<iovec> iovs = buffer.readBuffers();
+        for (size_t i = 1; i < iovs.size() && end == 0; ++i)
+            end = scanner.scan((const char *)iovs[i].iov_base,
+                iovs[i].iov_len);
+    }
+    if (end == 0)
+        return 0;
+    m_length = end - scanner.skip;
+    m_buffer.copyIn(buffer, m_length, scanner.skip);
+    m_head = (const char *)m_buffer.readBuffer(m_length, true).iov_base;
+    parseHead();
+    return end;
+}
+
+bool
+HeaderTable::read(Stream &stream, size_t maxSize)
+{
+    // Otherwise whatever we read past the head would be lost
+    MORDOR_ASSERT(stream.supportsUnread());
+    clear();
+    Buffer buffer;
+    Scanner scanner;
+    size_t end = 0;
+    while (end == 0) {
+        if (buffer.readAvailable() >= maxSize)
+            MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+        size_t read = stream.read(buffer, 65536);
+        if (read == 0) {
+            if (buffer.readAvailable() == 0)
+                return false;
+            MORDOR_THROW_EXCEPTION(IncompleteMessageHeaderException());
+        }
+        // Only look at what's new
+        std::vector<iovec> iovs = buffer.readBuffers();
+        size_t skip = buffer.readAvailable() - read;
+        for (size_t i = 0; i < iovs.size() && end == 0; ++i) {
+            if (skip >= iovs[i].iov_len) {
+                skip -= iovs[i].iov_len;
+                continue;
+            }
+            end = scanner.scan((const char *)iovs[i].iov_base + skip,
+                iovs[i].iov_len - skip);
+            skip = 0;
+        }
+    }
+    if (end > maxSize)
+        MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+    m_length = end - scanner.skip;
+    m_buffer.copyIn(buffer, m_length, scanner.skip);
+    buffer.consume(end);
+    if (buffer.readAvailable() > 0)
+        stream.unread(buffer, buffer.readAvailable());
+    m_head = (const char *)m_buffer.readBuffer(m_length, true).iov_base;
+    parseHead();
+    return true;
+}
+
+void
+HeaderTable::parseHead()
+{
+    const char *p = m_head;
+    const char *end = m_head + m_length;
+    bool startLine = true;
+    while (p < end) {
+        const char *lineEnd = (const char *)memchr(p, '\n', end - p);
+        MORDOR_ASSERT(lineEnd);
+        const char *next = lineEnd + 1;
+        if (lineEnd > p && lineEnd[-1] == '\r')
+            --lineEnd;
+        if (startLine) {
+            parseStartLine(p, lineEnd);
+            startLine = false;
+        } else if (p == lineEnd) {
+            // The empty line
+            MORDOR_ASSERT(next == end);
+        } else if (isWhitespace(*p)) {
+            // obs-fold continues the previous field
+            if (m_size == 0)
+                MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+            addField(NULL, NULL, p, lineEnd, true);
+        } else {
+            const char *colon = p;
+            while (colon < lineEnd && isTokenChar(*colon))
+                ++colon;
+            if (colon == p || colon == lineEnd || *colon != ':')
+                MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+            addField(p, colon, colon + 1, lineEnd, false);
+        }
+        p = next;
+    }
+}
+
+void
+HeaderTable::parseStartLine(const char *start, const char *end)
+{
+    const char *space = (const char *)memchr(start, ' ', end - start);
+    if (!space)
+        MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+    if (m_request) {
+        // method SP request-target SP HTTP-version
+        for (const char *p = start; p < space; ++p)
+            if (!isTokenChar(*p))
+                MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+        const char *target = space + 1;
+        const char *targetEnd = target;
+        while (targetEnd < end && *targetEnd > ' ' && *targetEnd != 127)
+            ++targetEnd;
+        if (space == start || targetEnd == target || targetEnd == end ||
+            *targetEnd != ' ' ||
+            !parseVersion(targetEnd + 1, end, m_version))
+            MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+        m_method = Slice(start, space - start);
+        m_target = Slice(target, targetEnd - target);
+    } else {
+        // HTTP-version SP status-code [SP reason-phrase]
+        const char *code = space + 1;
+        if (!parseVersion(start, space, m_version) || end - code < 3 ||
+            (end - code > 3 && code[3] != ' '))
+            MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+        int status = 0;
+        for (int i = 0; i < 3; ++i) {
+            if (code[i] < '0' || code[i] > '9')
+                MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+            status = status * 10 + (code[i] - '0');
+        }
+        m_status = (Status)status;
+        if (end - code > 3)
+            m_reason = Slice(code + 4, end - code - 4);
+    }
+}
+
+void
+HeaderTable::addField(const char *name, const char *nameEnd,
+    const char *value, const char *valueEnd, bool folded)
+{
+    trim(value, valueEnd);
+    for (const char *p = value; p < valueEnd; ++p)
+        if ((*p < ' ' && *p != '\t') || *p == 127)
+            MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+    if (folded) {
+        Field &field = m_size <= INLINE_FIELDS ? m_inline[m_size - 1] :
+            m_overflow.back();
+        if (field.value.data < m_head ||
+            field.value.data >= m_head + m_length) {
+            // Already unfolded
+            MORDOR_ASSERT(!m_unfolded.empty());
+        } else {
+            m_unfolded.push_back(field.value.str());
+        }
+        std::string &unfolded = m_unfolded.back();
+        if (valueEnd > value) {
+            if (!unfolded.empty())
+                unfolded.append(1, ' ');
+            unfolded.append(value, valueEnd - value);
+        }
+        field.value = Slice(unfolded.c_str(), unfolded.size());
+        return;
+    }
+    Field field;
+    field.name = Slice(name, nameEnd - name);
+    field.value = Slice(value, valueEnd - value);
+    if (m_size < INLINE_FIELDS)
+        m_inline[m_size] = field;
+    else
+        m_overflow.push_back(field);
+    ++m_size;
+}
+
+const Slice *
+HeaderTable::find(const char *name) const
+{
+    for (size_t i = 0; i < m_size; ++i) {
+        const Field &field = (*this)[i];
+        if (field.name.iequals(name))
+            return &field.value;
+    }
+    return NULL;
+}
+
+std::string
+HeaderTable::get(const char *name) const
+{
+    std::string result;
+    bool found = false;
+    for (size_t i = 0; i < m_size; ++i) {
+        const Field &field = (*this)[i];
+        if (!field.name.iequals(name))
+            continue;
+        if (found)
+            result.append(1, ',');
+        result.append(field.value.data, field.value.length);
+        found = true;
+    }
+    return result;
+}
+
+bool
+HeaderTable::hasToken(const char *name, const char *token) const
+{
+    for (size_t i = 0; i < m_size; ++i) {
+        const Field &field = (*this)[i];
+        if (!field.name.iequals(name))
+            continue;
+        const char *p = field.value.data;
+        const char *end = p + field.value.length;
+        while (p < end) {
+            const char *comma = (const char *)memchr(p, ',', end - p);
+            if (!comma)
+                comma = end;
+            const char *elementEnd = comma;
+            trim(p, elementEnd);
+            if (Slice(p, elementEnd - p).iequals(token))
+                return true;
+            p = comma + 1;
+        }
+    }
+    return false;
+}
+
+bool
+HeaderTable::contentLength(unsigned long long &length) const
+{
+    if (m_contentLengthState == UNKNOWN) {
+        m_contentLengthState = ABSENT;
+        for (size_t i = 0; i < m_size; ++i) {
+            const Field &field = (*this)[i];
+            if (!field.name.iequals("Content-Length"))
+                continue;
+            if (field.value.empty())
+                MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+            unsigned long long value = 0;
+            for (size_t j = 0; j < field.value.length; ++j) {
+                char c = field.value.data[j];
+                if (c < '0' || c > '9' || value > (~0ull - 9) / 10)
+                    MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+                value = value * 10 + (c - '0');
+            }
+            if (m_contentLengthState == PRESENT && value != m_contentLength)
+                MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+            m_contentLength = value;
+            m_contentLengthState = PRESENT;
+        }
+    }
+    if (m_contentLengthState == ABSENT)
+        return false;
+    length = m_contentLength;
+    return true;
+}
+
+bool
+HeaderTable::chunked() const
+{
+    // Only the last coding of the last Transfer-Encoding field matters
+    const Slice *last = NULL;
+    for (size_t i = 0; i < m_size; ++i) {
+        const Field &field = (*this)[i];
+        if (field.name.iequals("Transfer-Encoding") && !field.value.empty())
+            last = &field.value;
+    }
+    if (!last)
+        return false;
+    const char *start = last->data;
+    const char *end = start + last->length;
+    for (const char *p = end; p > start; --p) {
+        if (p[-1] == ',') {
+            start = p;
+            break;
+        }
+    }
+    const char *semicolon = (const char *)memchr(start, ';', end - start);
+    if (semicolon)
+        end = semicolon;
+    trim(start, end);
+    return Slice(start, end - start).iequals("chunked");
+}
+
+Slice
+HeaderTable::host() const
+{
+    const Slice *result = find("Host");
+    return result ? *result : Slice();
+}
+
+void
+HeaderTable::request(Request &request, bool strict) const
+{
+    MORDOR_ASSERT(m_request);
+    MORDOR_ASSERT(m_head);
+    RequestParser parser(request, strict);
+    parser.run(m_head, m_length);
+    if (parser.error() || !parser.complete())
+        MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+}
+
+void
+HeaderTable::response(Response &response, bool strict) const
+{
+    MORDOR_ASSERT(!m_request);
+    MORDOR_ASSERT(m_head);
+    ResponseParser parser(response, strict);
+    parser.run(m_head, m_length);
+    if (parser.error() || !parser.complete())
+        MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+}
+
+}}
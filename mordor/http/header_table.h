@@ -0,0 +1,167 @@
+#ifndef __MORDOR_HTTP_HEADER_TABLE_H__
+#define __MORDOR_HTTP_HEADER_TABLE_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <deque>
+#include <iosfwd>
+
+#include "http.h"
+#include "mordor/streams/buffer.h"
+
+namespace Mordor {
+
+class Stream;
+
+namespace HTTP {
+
+/// A run of characters inside a HeaderTable; only valid as long as the
+/// HeaderTable is, and until it parses something else
+struct Slice
+{
+    Slice() : data(NULL), length(0) {}
+    Slice(const char *data_, size_t length_)
+        : data(data_), length(length_)
+    {}
+
+    bool empty() const { return length == 0; }
+    std::string str() const { return std::string(data, length); }
+
+    bool operator==(const char *string) const;
+    bool operator!=(const char *string) const { return !(*this == string); }
+    bool iequals(const char *string) const;
+
+    const char *data;
+    size_t length;
+};
+
+std::ostream &operator <<(std::ostream &os, const Slice &slice);
+
+/// A request or response head, parsed in place
+///
+/// Unlike RequestParser and ResponseParser, which copy every header into the
+/// typed (and heavily allocating) structures of Request and Response, a
+/// HeaderTable only records where the start line and each field are in the
+/// bytes that were read, keeping a reference to the Buffer's memory rather
+/// than copying it (unless the head straddles segments, in which case it's
+/// copied once to be contiguous).  Fields live in a flat table with room for
+/// the first INLINE_FIELDS of them inside the HeaderTable itself.  The few
+/// headers a connection needs to frame a message (Content-Length,
+/// Transfer-Encoding, Connection, Host) are decoded from the slices when asked
+/// for; request() and response() materialize the full typed headers for
+/// callers that need them.
+///
+/// Header values have surrounding whitespace trimmed; obsolete line folding
+/// is accepted (and is the only time a value gets copied).
+///
+/// ServerConnection and ClientConnection don't use it (they still parse
+/// straight into Request and Response); it's for callers that only need a
+/// few headers from each message.  Its grammar is stricter than
+/// RequestParser's, and read() refuses heads longer than maxSize.
+class HeaderTable : Mordor::noncopyable
+{
+public:
+    struct Field
+    {
+        Slice name;
+        Slice value;
+    };
+
+public:
+    /// @param request Whether to expect a request line or a status line
+    HeaderTable(bool request = true);
+
+    void clear();
+
+    /// Parses a head from the front of buffer
+    /// @return How many bytes of buffer made up the head (including any empty
+    /// lines preceding it), or 0 if the head isn't complete yet
+    /// @throws BadMessageHeaderException If it's malformed
+    size_t parse(const Buffer &buffer);
+    /// Reads a head from stream; anything read past it (i.e. the start of
+    /// the body) is unread, so it has to be possible to
+    /// @pre stream.supportsUnread(), as with a BufferedStream (which
+    /// Connection already puts around its stream)
+    /// @return false if stream ended before any of a head arrived
+    /// @throws IncompleteMessageHeaderException If stream ends part way
+    /// @throws BadMessageHeaderException If it's malformed, or longer than
+    /// maxSize
+    bool read(Stream &stream, size_t maxSize = 65536);
+    bool read(std::shared_ptr<Stream> stream, size_t maxSize = 65536)
+    { return read(*stream, maxSize); }
+
+    bool isRequest() const { return m_request; }
+    /// The whole head, through the empty line
+    Slice head() const { return Slice(m_head, m_length); }
+
+    Slice method() const { MORDOR_ASSERT(m_request); return m_method; }
+    Slice target() const { MORDOR_ASSERT(m_request); return m_target; }
+    Status status() const { MORDOR_ASSERT(!m_request); return m_status; }
+    Slice reason() const { MORDOR_ASSERT(!m_request); return m_reason; }
+    Version version() const { return m_version; }
+
+    size_t size() const { return m_size; }
+    const Field &operator[](size_t index) const
+    {
+        MORDOR_ASSERT(index < m_size);
+        return index < INLINE_FIELDS ? m_inline[index] :
+            m_overflow[index - INLINE_FIELDS];
+    }
+    /// @return The value of the first field called name (case insensitive),
+    /// or NULL
+    const Slice *find(const char *name) const;
+    /// All the values of name joined with commas, the way RFC 2616 allows a
+    /// header to be split
+    std::string get(const char *name) const;
+    /// Whether name's comma separated list includes token (both case
+    /// insensitive), i.e. hasToken("Connection", "close")
+    bool hasToken(const char *name, const char *token) const;
+
+    /// @return false if there isn't a Content-Length
+    /// @throws BadMessageHeaderException If it isn't a number, or there are
+    /// conflicting ones
+    bool contentLength(unsigned long long &length) const;
+    /// Whether the final transfer-coding is chunked
+    bool chunked() const;
+    Slice host() const;
+
+    /// Full typed headers, parsed with RequestParser/ResponseParser
+    /// @throws BadMessageHeaderException
+    void request(Request &request, bool strict = false) const;
+    void response(Response &response, bool strict = false) const;
+
+private:
+    void parseHead();
+    void parseStartLine(const char *start, const char *end);
+    void addField(const char *name, const char *nameEnd, const char *value,
+        const char *valueEnd, bool folded);
+
+private:
+    enum { INLINE_FIELDS = 24 };
+
+    bool m_request;
+    // Shares the memory the head was parsed from
+    Buffer m_buffer;
+    const char *m_head;
+    size_t m_length;
+
+    Slice m_method, m_target, m_reason;
+    Status m_status;
+    Version m_version;
+
+    Field m_inline[INLINE_FIELDS];
+    std::vector<Field> m_overflow;
+    size_t m_size;
+    // Values that had to be unfolded
+    std::deque<std::string> m_unfolded;
+
+    mutable enum {
+        UNKNOWN,
+        ABSENT,
+        PRESENT
+    } m_contentLengthState;
+    mutable unsigned long long m_contentLength;
+};
+
+}}
+
+#endif
@@ -0,0 +1,552 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "hpack.h"
+
+#include "mordor/assert.h"
+
+namespace Mordor {
+namespace HTTP {
+
+namespace {
+struct StaticEntry
+{
+    const char *name;
+    const char *value;
+};
+}
+
+// RFC 7541 Appendix A
+static const StaticEntry g_staticTable[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+static const size_t g_staticTableSize =
+    sizeof(g_staticTable) / sizeof(g_staticTable[0]);
+
+namespace {
+struct HuffmanCode
+{
+    unsigned int code;
+    int bits;
+};
+}
+
+// RFC 7541 Appendix B; codes are right aligned, and the last one is EOS
+static const HuffmanCode g_huffmanCodes[257] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+    { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+    { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+    { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+    { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+    { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+    { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+    { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+    { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+    { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+    { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+    { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+    { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+    { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+    { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+    { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+    { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+    { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+    { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+    { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+    { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+    { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+    { 0x3fffffff, 30 }
+};
+
+namespace {
+// Binary tree for decoding, one bit at a time; children are either the
+// index of another node, or -(symbol + 1)
+struct HuffmanTree
+{
+    HuffmanTree()
+    {
+        nodes.resize(1);
+        for (int symbol = 0; symbol < 257; ++symbol) {
+            const HuffmanCode &code = g_huffmanCodes[symbol];
+            int node = 0;
+            for (int bit = code.bits - 1; bit >= 0; --bit) {
+                int b = (code.code >> bit) & 1;
+                if (bit == 0) {
+                    nodes[node].children[b] = -(symbol + 1);
+                } else {
+                    if (nodes[node].children[b] == 0) {
+                        nodes[node].children[b] = (int)nodes.size();
+                        nodes.resize(nodes.size() + 1);
+                    }
+                    node = nodes[node].children[b];
+                }
+            }
+        }
+    }
+
+    struct Node
+    {
+        Node() { children[0] = children[1] = 0; }
+        int children[2];
+    };
+    std::vector<Node> nodes;
+};
+}
+
+static const HuffmanTree &huffmanTree()
+{
+    static const HuffmanTree tree;
+    return tree;
+}
+
+namespace HPACK {
+
+void
+encodeInteger(unsigned long long value, int prefixBits, unsigned char prefix,
+    std::string &out)
+{
+    unsigned long long max = (1u << prefixBits) - 1;
+    if (value < max) {
+        out.append(1, (char)(prefix | value));
+        return;
+    }
+    out.append(1, (char)(prefix | max));
+    value -= max;
+    while (value >= 128) {
+        out.append(1, (char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.append(1, (char)value);
+}
+
+bool
+decodeInteger(const unsigned char *&data, const unsigned char *end,
+    int prefixBits, unsigned long long &value)
+{
+    const unsigned char *p = data;
+    if (p == end)
+        return false;
+    unsigned long long max = (1u << prefixBits) - 1;
+    value = *p++ & max;
+    if (value == max) {
+        int shift = 0;
+        while (true) {
+            if (p == end)
+                return false;
+            unsigned char b = *p++;
+            value += (unsigned long long)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                break;
+            shift += 7;
+            if (shift > 56)
+                MORDOR_THROW_EXCEPTION(HPACKException());
+        }
+    }
+    data = p;
+    return true;
+}
+
+size_t
+huffmanLength(const std::string &string)
+{
+    size_t bits = 0;
+    for (size_t i = 0; i < string.size(); ++i)
+        bits += g_huffmanCodes[(unsigned char)string[i]].bits;
+    return (bits + 7) / 8;
+}
+
+void
+huffmanEncode(const std::string &string, std::string &out)
+{
+    unsigned long long pending = 0;
+    int bits = 0;
+    for (size_t i = 0; i < string.size(); ++i) {
+        const HuffmanCode &code = g_huffmanCodes[(unsigned char)string[i]];
+        pending = (pending << code.bits) | code.code;
+        bits += code.bits;
+        while (bits >= 8) {
+            bits -= 8;
+            out.append(1, (char)(pending >> bits));
+        }
+    }
+    // Pad with the most significant bits of EOS
+    if (bits > 0)
+        out.append(1, (char)((pending << (8 - bits)) | (0xff >> bits)));
+}
+
+void
+huffmanDecode(const unsigned char *data, size_t length, std::string &out)
+{
+    const std::vector<HuffmanTree::Node> &nodes = huffmanTree().nodes;
+    int node = 0, depth = 0;
+    bool padding = true;
+    for (size_t i = 0; i < length; ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            int b = (data[i] >> bit) & 1;
+            int next = nodes[node].children[b];
+            if (next < 0) {
+                int symbol = -next - 1;
+                if (symbol == 256)
+                    MORDOR_THROW_EXCEPTION(HPACKException());
+                out.append(1, (char)symbol);
+                node = 0;
+                depth = 0;
+                padding = true;
+            } else {
+                node = next;
+                ++depth;
+                padding = padding && b;
+            }
+        }
+    }
+    // Anything left over has to be a (short) prefix of EOS
+    if (depth > 7 || !padding)
+        MORDOR_THROW_EXCEPTION(HPACKException());
+}
+
+}
+
+static std::vector<std::pair<std::string, std::string> >
+buildStaticTable()
+{
+    std::vector<std::pair<std::string, std::string> > result;
+    for (size_t i = 0; i < g_staticTableSize; ++i)
+        result.push_back(std::make_pair(std::string(g_staticTable[i].name),
+            std::string(g_staticTable[i].value)));
+    return result;
+}
+
+static size_t entrySize(const std::string &name, const std::string &value)
+{
+    return 32 + name.size() + value.size();
+}
+
+HPACKTable::HPACKTable(size_t maxSize)
+    : m_size(0),
+      m_maxSize(maxSize)
+{}
+
+void
+HPACKTable::maxSize(size_t size)
+{
+    m_maxSize = size;
+    evict(0);
+}
+
+void
+HPACKTable::evict(size_t size)
+{
+    while (!m_entries.empty() && m_size + size > m_maxSize) {
+        m_size -= entrySize(m_entries.back().first, m_entries.back().second);
+        m_entries.pop_back();
+    }
+}
+
+const std::pair<std::string, std::string> *
+HPACKTable::get(size_t index) const
+{
+    if (index == 0)
+        return NULL;
+    if (index <= g_staticTableSize) {
+        static const std::vector<std::pair<std::string, std::string> >
+            staticTable = buildStaticTable();
+        return &staticTable[index - 1];
+    }
+    index -= g_staticTableSize + 1;
+    if (index >= m_entries.size())
+        return NULL;
+    return &m_entries[index];
+}
+
+size_t
+HPACKTable::find(const std::string &name, const std::string &value,
+    size_t &nameIndex) const
+{
+    nameIndex = 0;
+    for (size_t i = 0; i < g_staticTableSize; ++i) {
+        if (name != g_staticTable[i].name)
+            continue;
+        if (value == g_staticTable[i].value)
+            return i + 1;
+        if (nameIndex == 0)
+            nameIndex = i + 1;
+    }
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        if (name != m_entries[i].first)
+            continue;
+        if (value == m_entries[i].second)
+            return g_staticTableSize + i + 1;
+        if (nameIndex == 0)
+            nameIndex = g_staticTableSize + i + 1;
+    }
+    return 0;
+}
+
+void
+HPACKTable::add(const std::string &name, const std::string &value)
+{
+    size_t size = entrySize(name, value);
+    if (size > m_maxSize) {
+        // Not an error; the table just ends up empty
+        evict(m_maxSize + 1);
+        return;
+    }
+    evict(size);
+    m_entries.push_front(std::make_pair(name, value));
+    m_size += size;
+}
+
+HPACKEncoder::HPACKEncoder(size_t tableSize)
+    : m_table(tableSize),
+      m_minTableSize(tableSize),
+      m_tableSizeChanged(false),
+      m_huffman(true)
+{}
+
+void
+HPACKEncoder::tableSize(size_t size)
+{
+    // Never bother with a bigger table than the default
+    if (size > 4096)
+        size = 4096;
+    if (size == m_table.maxSize() && !m_tableSizeChanged)
+        return;
+    if (!m_tableSizeChanged || size < m_minTableSize)
+        m_minTableSize = size;
+    m_table.maxSize(size);
+    m_tableSizeChanged = true;
+}
+
+void
+HPACKEncoder::encodeString(const std::string &string, std::string &out)
+{
+    if (m_huffman) {
+        size_t length = HPACK::huffmanLength(string);
+        if (length < string.size()) {
+            HPACK::encodeInteger(length, 7, 0x80, out);
+            HPACK::huffmanEncode(string, out);
+            return;
+        }
+    }
+    HPACK::encodeInteger(string.size(), 7, 0, out);
+    out.append(string);
+}
+
+void
+HPACKEncoder::encode(const HeaderList &headers, std::string &out)
+{
+    if (m_tableSizeChanged) {
+        // If it went down and back up, the peer needs to hear about both
+        if (m_minTableSize < m_table.maxSize())
+            HPACK::encodeInteger(m_minTableSize, 5, 0x20, out);
+        HPACK::encodeInteger(m_table.maxSize(), 5, 0x20, out);
+        m_tableSizeChanged = false;
+    }
+    for (HeaderList::const_iterator it = headers.begin();
+        it != headers.end();
+        ++it) {
+        const std::string &name = it->first, &value = it->second;
+        size_t nameIndex;
+        size_t index = m_table.find(name, value, nameIndex);
+        if (index != 0) {
+            HPACK::encodeInteger(index, 7, 0x80, out);
+            continue;
+        }
+        // Credentials never go in a table (where an intermediary could
+        // recompress them), and neither does anything that would flush most
+        // of the table
+        if (name == "authorization" || name == "proxy-authorization" ||
+            (name == "cookie" && value.size() < 20)) {
+            HPACK::encodeInteger(nameIndex, 4, 0x10, out);
+        } else if (entrySize(name, value) > m_table.maxSize() * 3 / 4) {
+            HPACK::encodeInteger(nameIndex, 4, 0x00, out);
+        } else {
+            HPACK::encodeInteger(nameIndex, 6, 0x40, out);
+            m_table.add(name, value);
+        }
+        if (nameIndex == 0)
+            encodeString(name, out);
+        encodeString(value, out);
+    }
+}
+
+HPACKDecoder::HPACKDecoder(size_t maxTableSize, size_t maxHeaderListSize)
+    : m_table(maxTableSize),
+      m_maxTableSize(maxTableSize),
+      m_maxHeaderListSize(maxHeaderListSize)
+{}
+
+static void
+decodeString(const unsigned char *&data, const unsigned char *end,
+    std::string &out)
+{
+    if (data == end)
+        MORDOR_THROW_EXCEPTION(HPACKException());
+    bool huffman = !!(*data & 0x80);
+    unsigned long long length;
+    if (!HPACK::decodeInteger(data, end, 7, length) ||
+        length > (unsigned long long)(end - data))
+        MORDOR_THROW_EXCEPTION(HPACKException());
+    if (huffman)
+        HPACK::huffmanDecode(data, (size_t)length, out);
+    else
+        out.assign((const char *)data, (size_t)length);
+    data += length;
+}
+
+void
+HPACKDecoder::decode(const void *data, size_t length, HeaderList &headers)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + length;
+    size_t listSize = 0;
+    bool sawHeader = false;
+    while (p < end) {
+        unsigned char b = *p;
+        unsigned long long index;
+        std::pair<std::string, std::string> header;
+        if (b & 0x80) {
+            // Indexed
+            if (!HPACK::decodeInteger(p, end, 7, index))
+                MORDOR_THROW_EXCEPTION(HPACKException());
+            const std::pair<std::string, std::string> *entry =
+                m_table.get((size_t)index);
+            if (!entry)
+                MORDOR_THROW_EXCEPTION(HPACKException());
+            header = *entry;
+        } else if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update; only allowed before any headers
+            if (!HPACK::decodeInteger(p, end, 5, index) ||
+                index > m_maxTableSize || sawHeader)
+                MORDOR_THROW_EXCEPTION(HPACKException());
+            m_table.maxSize((size_t)index);
+            continue;
+        } else {
+            // Literal, with incremental indexing, without indexing, or never
+            // indexed
+            bool indexing = (b & 0xc0) == 0x40;
+            if (!HPACK::decodeInteger(p, end, indexing ? 6 : 4, index))
+                MORDOR_THROW_EXCEPTION(HPACKException());
+            if (index != 0) {
+                const std::pair<std::string, std::string> *entry =
+                    m_table.get((size_t)index);
+                if (!entry)
+                    MORDOR_THROW_EXCEPTION(HPACKException());
+                header.first = entry->first;
+            } else {
+                decodeString(p, end, header.first);
+            }
+            decodeString(p, end, header.second);
+            if (indexing)
+                m_table.add(header.first, header.second);
+        }
+        sawHeader = true;
+        listSize += entrySize(header.first, header.second);
+        if (listSize > m_maxHeaderListSize)
+            MORDOR_THROW_EXCEPTION(HPACKException());
+        headers.push_back(header);
+    }
+}
+
+}}
@@ -0,0 +1,118 @@
+#ifndef __MORDOR_HTTP_HPACK_H__
+#define __MORDOR_HTTP_HPACK_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "http.h"
+
+namespace Mordor {
+namespace HTTP {
+
+/// A header block as HTTP/2 sees it: lower case names (including the
+/// :pseudo-headers) in order, each with its value
+typedef std::vector<std::pair<std::string, std::string> > HeaderList;
+
+/// A header block that can't be decoded; the connection it came from can't
+/// be used any more (RFC 7540 COMPRESSION_ERROR)
+struct HPACKException : virtual Exception {};
+
+/// The table of recently sent headers each end of an HTTP/2 connection keeps
+/// (RFC 7541 section 2.3.2), combined with the static table
+class HPACKTable
+{
+public:
+    HPACKTable(size_t maxSize = 4096);
+
+    /// Bytes in use, counted as the RFC does (32 bytes of overhead per entry)
+    size_t size() const { return m_size; }
+    size_t maxSize() const { return m_maxSize; }
+    /// Shrinks the table as necessary
+    void maxSize(size_t size);
+    /// Number of entries in the dynamic part
+    size_t entries() const { return m_entries.size(); }
+
+    /// @param index 1-based, static table first
+    /// @return NULL if there is no such entry
+    const std::pair<std::string, std::string> *get(size_t index) const;
+    /// @return index of an exact match, or 0; if there isn't one nameIndex
+    /// is set to an entry with the same name (or 0)
+    size_t find(const std::string &name, const std::string &value,
+        size_t &nameIndex) const;
+    void add(const std::string &name, const std::string &value);
+
+private:
+    void evict(size_t size);
+
+private:
+    std::deque<std::pair<std::string, std::string> > m_entries;
+    size_t m_size, m_maxSize;
+};
+
+class HPACKEncoder
+{
+public:
+    HPACKEncoder(size_t tableSize = 4096);
+
+    /// The peer's SETTINGS_HEADER_TABLE_SIZE; the next block will tell it the
+    /// table shrank, if it did
+    void tableSize(size_t size);
+    /// Whether to Huffman code strings, when it's shorter
+    void huffman(bool huffman) { m_huffman = huffman; }
+
+    /// Appends a complete header block to out
+    void encode(const HeaderList &headers, std::string &out);
+
+    const HPACKTable &table() const { return m_table; }
+
+private:
+    void encodeString(const std::string &string, std::string &out);
+
+private:
+    HPACKTable m_table;
+    size_t m_minTableSize;
+    bool m_tableSizeChanged, m_huffman;
+};
+
+class HPACKDecoder
+{
+public:
+    /// @param maxTableSize What we advertise as SETTINGS_HEADER_TABLE_SIZE
+    /// @param maxHeaderListSize Limit on the decoded size of one block (what
+    /// we advertise as SETTINGS_MAX_HEADER_LIST_SIZE)
+    HPACKDecoder(size_t maxTableSize = 4096,
+        size_t maxHeaderListSize = 65536);
+
+    /// Decodes a complete header block, appending to headers
+    void decode(const void *data, size_t length, HeaderList &headers);
+    void decode(const std::string &block, HeaderList &headers)
+    { decode(block.c_str(), block.size(), headers); }
+
+    const HPACKTable &table() const { return m_table; }
+
+private:
+    HPACKTable m_table;
+    size_t m_maxTableSize, m_maxHeaderListSize;
+};
+
+namespace HPACK {
+/// Integer representation (RFC 7541 section 5.1); prefix is the bits
+/// already set in the first byte
+void encodeInteger(unsigned long long value, int prefixBits,
+    unsigned char prefix, std::string &out);
+/// @return false if there aren't enough bytes; throws if it overflows
+bool decodeInteger(const unsigned char *&data, const unsigned char *end,
+    int prefixBits, unsigned long long &value);
+
+size_t huffmanLength(const std::string &string);
+void huffmanEncode(const std::string &string, std::string &out);
+void huffmanDecode(const unsigned char *data, size_t length,
+    std::string &out);
+}
+
+}}
+
+#endif
@@ -0,0 +1,1527 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "http2.h"
+
+#include <sstream>
+
+#include <boost/lexical_cast.hpp>
+
+#include "client.h"
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/log.h"
+#include "mordor/parallel.h"
+#include "mordor/scheduler.h"
+#include "mordor/streams/pipe.h"
+#include "mordor/streams/stream.h"
+#include "mordor/streams/transfer.h"
+#include "parser.h"
+#include "server.h"
+
+namespace Mordor {
+namespace HTTP {
+namespace HTTP2 {
+
+static ConfigVar<unsigned int>::ptr g_maxConcurrentStreams =
+    Config::lookup("http2.maxconcurrentstreams", 100u,
+    "Most streams a client may have open at once on an HTTP/2 session");
+static ConfigVar<unsigned int>::ptr g_windowSize =
+    Config::lookup("http2.windowsize", 1048576u,
+    "Bytes an HTTP/2 peer may send on a stream (and on the whole session) "
+    "before they've been read");
+
+static Logger::ptr g_log = Log::lookup("mordor:http:http2");
+
+const char g_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// Frames and windows everybody starts with, until SETTINGS say otherwise
+static const size_t g_defaultMaxFrameSize = 16384;
+static const long long g_defaultWindowSize = 65535;
+static const long long g_maxWindowSize = 0x7fffffff;
+static const size_t g_maxHeaderListSize = 65536;
+
+static unsigned int
+readUInt32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+        ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void
+writeUInt32(unsigned char *p, unsigned int value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static void
+connectionError(ErrorCode code)
+{
+    MORDOR_THROW_EXCEPTION(ConnectionErrorException())
+        << errinfo_http2_error(code);
+}
+
+void
+serializeFrameHeader(const FrameHeader &header,
+    unsigned char out[g_frameHeaderLength])
+{
+    MORDOR_ASSERT(header.length < 0x1000000);
+    out[0] = (unsigned char)(header.length >> 16);
+    out[1] = (unsigned char)(header.length >> 8);
+    out[2] = (unsigned char)header.length;
+    out[3] = header.type;
+    out[4] = header.flags;
+    writeUInt32(out + 5, header.streamId & 0x7fffffff);
+}
+
+FrameHeader
+parseFrameHeader(const unsigned char in[g_frameHeaderLength])
+{
+    return FrameHeader(((size_t)in[0] << 16) | ((size_t)in[1] << 8) | in[2],
+        in[3], in[4], readUInt32(in + 5) & 0x7fffffff);
+}
+
+static bool
+connectionSpecific(const std::string &name)
+{
+    return name == "connection" || name == "keep-alive" ||
+        name == "proxy-connection" || name == "transfer-encoding" ||
+        name == "upgrade";
+}
+
+// Picks apart serialized HTTP/1.1 header fields
+static void
+headerFields(const std::string &fields, HeaderList &headers)
+{
+    size_t start = 0;
+    while (start < fields.size()) {
+        size_t end = fields.find("\r\n", start);
+        if (end == std::string::npos)
+            end = fields.size();
+        size_t colon = fields.find(':', start);
+        if (colon < end) {
+            std::string name = fields.substr(start, colon - start);
+            for (std::string::iterator it = name.begin(); it != name.end();
+                ++it)
+                *it = (char)tolower(*it);
+            size_t value = fields.find_first_not_of(" \t", colon + 1);
+            if (value > end)
+                value = end;
+            // Expect: 100-continue is between us and the HTTP/1.1 end
+            if (!connectionSpecific(name) && name != "host" &&
+                name != "expect" &&
+                (name != "te" || fields.compare(value, end - value,
+                "trailers") == 0))
+                headers.push_back(std::make_pair(name,
+                    fields.substr(value, end - value)));
+        }
+        start = end + 2;
+    }
+}
+
+void
+toHeaderList(const Request &request, const std::string &scheme,
+    HeaderList &headers)
+{
+    const URI &uri = request.requestLine.uri;
+    headers.push_back(std::make_pair(std::string(":method"),
+        request.requestLine.method));
+    headers.push_back(std::make_pair(std::string(":scheme"),
+        uri.schemeDefined() ? uri.scheme() : scheme));
+    std::string authority = request.request.host;
+    if (uri.authority.hostDefined()) {
+        authority = uri.authority.host();
+        if (uri.authority.portDefined())
+            authority += ":" +
+                boost::lexical_cast<std::string>(uri.authority.port());
+    }
+    if (!authority.empty())
+        headers.push_back(std::make_pair(std::string(":authority"),
+            authority));
+    std::string path = "*";
+    if (uri.isDefined()) {
+        URI relative = uri;
+        relative.schemeDefined(false);
+        relative.authority.hostDefined(false);
+        relative.fragmentDefined(false);
+        path = relative.toString();
+        if (path.empty() || path[0] == '?')
+            path = "/" + path;
+    }
+    headers.push_back(std::make_pair(std::string(":path"), path));
+
+    std::ostringstream os;
+    os << request.general << request.request << request.entity;
+    headerFields(os.str(), headers);
+}
+
+void
+toHeaderList(const Response &response, HeaderList &headers)
+{
+    headers.push_back(std::make_pair(std::string(":status"),
+        boost::lexical_cast<std::string>((int)response.status.status)));
+    std::ostringstream os;
+    os << response.general << response.response << response.entity;
+    headerFields(os.str(), headers);
+}
+
+static bool
+validField(const std::string &name, const std::string &value)
+{
+    if (name.empty())
+        return false;
+    for (size_t i = (name[0] == ':' ? 1 : 0); i < name.size(); ++i) {
+        char c = name[i];
+        if (c <= ' ' || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z'))
+            return false;
+    }
+    // Anything that would let the peer inject HTTP/1.1 header lines
+    return value.find_first_of(std::string("\r\n\0", 3)) ==
+        std::string::npos;
+}
+
+namespace {
+struct PseudoHeader
+{
+    const char *name;
+    std::string *value;
+};
+}
+
+// Sorts out pseudo-headers, validates everything, and serializes the
+// regular header fields as HTTP/1.1
+static bool
+splitHeaderList(const HeaderList &headers, PseudoHeader *pseudoHeaders,
+    size_t pseudoHeaderCount, std::string &fields)
+{
+    std::ostringstream os;
+    std::string cookie;
+    bool regular = false;
+    for (HeaderList::const_iterator it = headers.begin();
+        it != headers.end();
+        ++it) {
+        const std::string &name = it->first, &value = it->second;
+        if (!validField(name, value))
+            return false;
+        if (name[0] == ':') {
+            if (regular)
+                return false;
+            size_t i;
+            for (i = 0; i < pseudoHeaderCount; ++i)
+                if (name == pseudoHeaders[i].name)
+                    break;
+            if (i == pseudoHeaderCount || !pseudoHeaders[i].value->empty())
+                return false;
+            *pseudoHeaders[i].value = value;
+            continue;
+        }
+        regular = true;
+        if (connectionSpecific(name) || (name == "te" && value != "trailers"))
+            return false;
+        // HTTP/2 may split cookies into several fields (RFC 7540 8.1.2.5)
+        if (name == "cookie") {
+            if (!cookie.empty())
+                cookie += "; ";
+            cookie += value;
+            continue;
+        }
+        os << name << ": " << value << "\r\n";
+    }
+    if (!cookie.empty())
+        os << "cookie: " << cookie << "\r\n";
+    fields = os.str();
+    return true;
+}
+
+bool
+fromHeaderList(const HeaderList &headers, Request &request)
+{
+    std::string method, scheme, authority, path, fields;
+    PseudoHeader pseudoHeaders[] = {
+        { ":method", &method },
+        { ":scheme", &scheme },
+        { ":authority", &authority },
+        { ":path", &path }
+    };
+    if (!splitHeaderList(headers, pseudoHeaders, 4, fields))
+        return false;
+    if (method.empty() || scheme.empty() || path.empty())
+        return false;
+    std::ostringstream os;
+    os << method << ' ' << path << " HTTP/1.1\r\n";
+    if (!authority.empty())
+        os << "Host: " << authority << "\r\n";
+    os << fields << "\r\n";
+    RequestParser parser(request);
+    parser.run(os.str());
+    if (parser.error() || !parser.complete())
+        return false;
+    // :authority wins over Host
+    if (!authority.empty())
+        request.request.host = authority;
+    return true;
+}
+
+bool
+fromHeaderList(const HeaderList &headers, Response &response)
+{
+    std::string status, fields;
+    PseudoHeader pseudoHeaders[] = {
+        { ":status", &status }
+    };
+    if (!splitHeaderList(headers, pseudoHeaders, 1, fields))
+        return false;
+    if (status.size() != 3 ||
+        status.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    std::ostringstream os;
+    os << "HTTP/1.1 " << status << ' '
+        << reason((Status)atoi(status.c_str())) << "\r\n" << fields << "\r\n";
+    ResponseParser parser(response);
+    parser.run(os.str());
+    return !parser.error() && parser.complete();
+}
+
+struct StreamState
+{
+    typedef std::shared_ptr<StreamState> ptr;
+
+    StreamState(FiberMutex &mutex, unsigned int id_, long long sendWindow_,
+        long long receiveWindow_)
+        : id(id_),
+          condition(mutex),
+          headersReceived(false),
+          remoteClosed(false),
+          localClosed(false),
+          reset(false),
+          error(NO_HTTP2_ERROR),
+          sendWindow(sendWindow_),
+          receiveWindow(receiveWindow_),
+          consumed(0)
+    {}
+
+    unsigned int id;
+    FiberCondition condition;
+    HeaderList headers;
+    bool headersReceived, remoteClosed, localClosed, reset;
+    ErrorCode error;
+    // DATA that hasn't been read yet
+    Buffer data;
+    long long sendWindow, receiveWindow;
+    // Read, but not yet given back to the peer with WINDOW_UPDATE
+    size_t consumed;
+};
+
+SessionStream::SessionStream(Session::ptr session, StreamState::ptr state)
+    : m_session(session),
+      m_state(state)
+{}
+
+unsigned int
+SessionStream::id() const
+{
+    return m_state->id;
+}
+
+bool
+SessionStream::receiveHeaders(HeaderList &headers)
+{
+    return m_session->receiveHeaders(m_state, headers);
+}
+
+void
+SessionStream::sendHeaders(const HeaderList &headers, bool endStream)
+{
+    m_session->sendHeaders(m_state, headers, endStream);
+}
+
+void
+SessionStream::reset(ErrorCode code)
+{
+    m_session->resetStream(m_state, code);
+}
+
+void
+SessionStream::close(CloseType type)
+{
+    if (type & WRITE)
+        m_session->endStream(m_state);
+}
+
+size_t
+SessionStream::read(Buffer &buffer, size_t length)
+{
+    return m_session->receiveData(m_state, buffer, length);
+}
+
+size_t
+SessionStream::write(const Buffer &buffer, size_t length)
+{
+    m_session->sendData(m_state, buffer, length, false);
+    return length;
+}
+
+Session::Session(Stream::ptr stream, const std::string &scheme)
+    : m_stream(stream),
+      m_client(true),
+      m_scheme(scheme),
+      m_streamsCondition(m_mutex),
+      m_decoder(4096, g_maxHeaderListSize)
+{
+    init();
+}
+
+Session::Session(Stream::ptr stream,
+    boost::function<void (std::shared_ptr<ServerRequest>)> dg)
+    : m_stream(stream),
+      m_client(false),
+      m_dg(dg),
+      m_streamsCondition(m_mutex),
+      m_decoder(4096, g_maxHeaderListSize)
+{
+    init();
+}
+
+void
+Session::init()
+{
+    MORDOR_ASSERT(m_stream->supportsRead());
+    MORDOR_ASSERT(m_stream->supportsWrite());
+    m_scheduler = Scheduler::getThis();
+    m_nextStreamId = 1;
+    m_lastPeerStreamId = 0;
+    m_goAwayStreamId = 0x7fffffff;
+    m_pendingStreams = 0;
+    m_goAwaySent = m_goAwayReceived = m_failed = false;
+    m_headerStreamId = 0;
+    m_headerEndStream = false;
+    m_windowSize = std::max<long long>(g_windowSize->val(), 1);
+    m_connectionWindowSize = std::max(m_windowSize, g_defaultWindowSize);
+    m_sendWindow = g_defaultWindowSize;
+    m_receiveWindow = m_connectionWindowSize;
+    m_consumed = 0;
+    m_peerInitialWindowSize = g_defaultWindowSize;
+    m_peerMaxFrameSize = g_defaultMaxFrameSize;
+    m_peerMaxConcurrentStreams = ~0u;
+}
+
+void
+Session::start()
+{
+    MORDOR_ASSERT(m_scheduler);
+    if (m_client) {
+        Buffer preface;
+        preface.copyIn(g_preface, g_prefaceLength);
+        FiberMutex::ScopedLock lock(m_writeMutex);
+        writeBuffer(preface);
+    } else {
+        fill(g_prefaceLength);
+        std::string preface(g_prefaceLength, '\0');
+        m_readBuffer.copyOut(&preface[0], g_prefaceLength);
+        if (preface != std::string(g_preface, g_prefaceLength)) {
+            MORDOR_LOG_DEBUG(g_log) << this << " not an HTTP/2 client";
+            m_stream->close();
+            connectionError(PROTOCOL_ERROR);
+        }
+        m_readBuffer.consume(g_prefaceLength);
+    }
+    unsigned char settings[18];
+    size_t length = 0;
+    if (m_client) {
+        writeUInt32(settings, ENABLE_PUSH << 16);
+        writeUInt32(settings + 2, 0);
+    } else {
+        writeUInt32(settings, MAX_CONCURRENT_STREAMS << 16);
+        writeUInt32(settings + 2, g_maxConcurrentStreams->val());
+    }
+    length += 6;
+    writeUInt32(settings + length, INITIAL_WINDOW_SIZE << 16);
+    writeUInt32(settings + length + 2, (unsigned int)m_windowSize);
+    length += 6;
+    writeUInt32(settings + length, MAX_HEADER_LIST_SIZE << 16);
+    writeUInt32(settings + length + 2, (unsigned int)g_maxHeaderListSize);
+    length += 6;
+    writeFrame(FrameHeader(length, SETTINGS, 0, 0), settings);
+    if (m_connectionWindowSize > g_defaultWindowSize)
+        writeWindowUpdate(0,
+            (unsigned int)(m_connectionWindowSize - g_defaultWindowSize));
+    m_scheduler->schedule(boost::bind(&Session::readLoop,
+        shared_from_this()));
+}
+
+void
+Session::close(ErrorCode code)
+{
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        if (m_goAwaySent || m_failed)
+            return;
+        m_goAwaySent = true;
+    }
+    writeGoAway(code);
+    m_scheduler->schedule(boost::bind(&Session::drain, shared_from_this()));
+}
+
+void
+Session::drain()
+{
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        while (!m_streams.empty() && !m_failed)
+            m_streamsCondition.wait();
+    }
+    try {
+        m_stream->close();
+    } catch (...) {
+        // The peer probably already hung up
+    }
+}
+
+bool
+Session::newStreamsAllowed()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    return !m_failed && !m_goAwaySent && !m_goAwayReceived &&
+        m_nextStreamId < 0x7fffffff;
+}
+
+bool
+Session::closed()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    return m_failed || m_goAwaySent || m_goAwayReceived;
+}
+
+size_t
+Session::activeStreams()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    return m_streams.size();
+}
+
+StreamState::ptr
+Session::lookup(unsigned int streamId)
+{
+    std::map<unsigned int, StreamState::ptr>::iterator it =
+        m_streams.find(streamId);
+    if (it == m_streams.end())
+        return StreamState::ptr();
+    return it->second;
+}
+
+bool
+Session::idle(unsigned int streamId)
+{
+    if (m_client)
+        return (streamId & 1) == 0 || streamId >= m_nextStreamId;
+    return streamId > m_lastPeerStreamId;
+}
+
+void
+Session::checkStream(StreamState &state)
+{
+    if (state.reset) {
+        if (state.error == REFUSED_STREAM)
+            MORDOR_THROW_EXCEPTION(StreamRefusedException())
+                << errinfo_http2_error(state.error);
+        MORDOR_THROW_EXCEPTION(StreamResetException())
+            << errinfo_http2_error(state.error);
+    }
+    if (m_failed)
+        MORDOR_THROW_EXCEPTION(ConnectionErrorException());
+}
+
+void
+Session::closeStream(StreamState &state)
+{
+    if (!state.reset && !(state.localClosed && state.remoteClosed))
+        return;
+    std::map<unsigned int, StreamState::ptr>::iterator it =
+        m_streams.find(state.id);
+    if (it != m_streams.end() && it->second.get() == &state) {
+        m_streams.erase(it);
+        m_streamsCondition.broadcast();
+    }
+}
+
+void
+Session::fill(size_t length)
+{
+    while (m_readBuffer.readAvailable() < length) {
+        if (m_stream->read(m_readBuffer, 65536) == 0)
+            MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    }
+}
+
+bool
+Session::readFrame(FrameHeader &header, std::string &payload)
+{
+    // A clean EOF between frames is fine
+    if (m_readBuffer.readAvailable() == 0 &&
+        m_stream->read(m_readBuffer, 65536) == 0)
+        return false;
+    fill(g_frameHeaderLength);
+    unsigned char raw[g_frameHeaderLength];
+    m_readBuffer.copyOut(raw, g_frameHeaderLength);
+    m_readBuffer.consume(g_frameHeaderLength);
+    header = parseFrameHeader(raw);
+    // We never raise SETTINGS_MAX_FRAME_SIZE
+    if (header.length > g_defaultMaxFrameSize)
+        connectionError(FRAME_SIZE_ERROR);
+    fill(header.length);
+    payload.resize(header.length);
+    if (header.length > 0)
+        m_readBuffer.copyOut(&payload[0], header.length);
+    m_readBuffer.consume(header.length);
+    return true;
+}
+
+void
+Session::readLoop()
+{
+    ErrorCode code = NO_HTTP2_ERROR;
+    try {
+        FrameHeader header;
+        std::string payload;
+        bool first = true;
+        while (readFrame(header, payload)) {
+            MORDOR_LOG_TRACE(g_log) << this << " frame type "
+                << (int)header.type << " flags " << (int)header.flags
+                << " stream " << header.streamId << " length "
+                << header.length;
+            // Either way, the first frame has to be SETTINGS
+            if (first && (header.type != SETTINGS || (header.flags & ACK)))
+                connectionError(PROTOCOL_ERROR);
+            first = false;
+            handleFrame(header, payload);
+        }
+        MORDOR_LOG_DEBUG(g_log) << this << " connection closed";
+    } catch (ConnectionErrorException &ex) {
+        const ErrorCode *error = boost::get_error_info<errinfo_http2_error>(ex);
+        code = error ? *error : INTERNAL_ERROR;
+        MORDOR_LOG_ERROR(g_log) << this << " connection error " << code;
+    } catch (HPACKException &) {
+        code = COMPRESSION_ERROR;
+        MORDOR_LOG_ERROR(g_log) << this << " compression error";
+    } catch (...) {
+        MORDOR_LOG_DEBUG(g_log) << this << " "
+            << boost::current_exception_diagnostic_information();
+    }
+    if (code != NO_HTTP2_ERROR) {
+        try {
+            writeGoAway(code);
+        } catch (...) {
+            // We're giving up anyway
+        }
+    }
+    fail();
+}
+
+void
+Session::fail()
+{
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        m_failed = true;
+        for (std::map<unsigned int, StreamState::ptr>::iterator it =
+            m_streams.begin();
+            it != m_streams.end();
+            ++it)
+            it->second->condition.broadcast();
+        m_streams.clear();
+        m_streamsCondition.broadcast();
+    }
+    try {
+        m_stream->close();
+    } catch (...) {
+        // Already broken
+    }
+}
+
+void
+Session::handleFrame(const FrameHeader &header, std::string &payload)
+{
+    // Nothing may come between HEADERS and its CONTINUATIONs
+    if (m_headerStreamId != 0 && header.type != CONTINUATION)
+        connectionError(PROTOCOL_ERROR);
+    const unsigned char *p = (const unsigned char *)payload.c_str();
+    switch (header.type) {
+        case DATA:
+            handleData(header, payload);
+            break;
+        case HEADERS:
+            handleHeaders(header, payload);
+            break;
+        case CONTINUATION:
+            if (m_headerStreamId == 0 || header.streamId != m_headerStreamId)
+                connectionError(PROTOCOL_ERROR);
+            m_headerBlock.append(payload);
+            if (m_headerBlock.size() > 2 * g_maxHeaderListSize)
+                connectionError(ENHANCE_YOUR_CALM);
+            if (header.flags & END_HEADERS) {
+                m_headerStreamId = 0;
+                headersComplete(header.streamId, m_headerEndStream);
+            }
+            break;
+        case PRIORITY:
+            // Not supported, but has to be well formed
+            if (header.streamId == 0)
+                connectionError(PROTOCOL_ERROR);
+            if (header.length != 5)
+                connectionError(FRAME_SIZE_ERROR);
+            break;
+        case RST_STREAM:
+        {
+            if (header.streamId == 0)
+                connectionError(PROTOCOL_ERROR);
+            if (header.length != 4)
+                connectionError(FRAME_SIZE_ERROR);
+            FiberMutex::ScopedLock lock(m_mutex);
+            if (idle(header.streamId))
+                connectionError(PROTOCOL_ERROR);
+            StreamState::ptr state = lookup(header.streamId);
+            if (state) {
+                state->reset = true;
+                state->error = (ErrorCode)readUInt32(p);
+                state->condition.broadcast();
+                closeStream(*state);
+            }
+            break;
+        }
+        case SETTINGS:
+            handleSettings(header, payload);
+            break;
+        case PUSH_PROMISE:
+            // We told servers not to, and clients can't
+            connectionError(PROTOCOL_ERROR);
+            break;
+        case PING:
+            if (header.streamId != 0)
+                connectionError(PROTOCOL_ERROR);
+            if (header.length != 8)
+                connectionError(FRAME_SIZE_ERROR);
+            if (!(header.flags & ACK))
+                writeFrame(FrameHeader(8, PING, ACK, 0), p);
+            break;
+        case GOAWAY:
+            if (header.streamId != 0)
+                connectionError(PROTOCOL_ERROR);
+            handleGoAway(payload);
+            break;
+        case WINDOW_UPDATE:
+            handleWindowUpdate(header, payload);
+            break;
+        default:
+            // Unknown frame types are ignored
+            break;
+    }
+}
+
+void
+Session::handleData(const FrameHeader &header, std::string &payload)
+{
+    if (header.streamId == 0)
+        connectionError(PROTOCOL_ERROR);
+    size_t overhead = 0;
+    if (header.flags & PADDED) {
+        if (header.length < 1 ||
+            (size_t)(unsigned char)payload[0] + 1 > header.length)
+            connectionError(PROTOCOL_ERROR);
+        overhead = (unsigned char)payload[0] + 1;
+    }
+    ErrorCode rst = NO_HTTP2_ERROR;
+    unsigned int increment = 0;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        if ((long long)header.length > m_receiveWindow)
+            connectionError(FLOW_CONTROL_ERROR);
+        m_receiveWindow -= header.length;
+        StreamState::ptr state = lookup(header.streamId);
+        // Padding, and anything we throw away, is given straight back
+        size_t discarded = overhead;
+        if (!state) {
+            if (idle(header.streamId))
+                connectionError(PROTOCOL_ERROR);
+            discarded = header.length;
+            rst = STREAM_CLOSED;
+        } else if (state->remoteClosed) {
+            discarded = header.length;
+            rst = STREAM_CLOSED;
+        } else if ((long long)header.length > state->receiveWindow) {
+            discarded = header.length;
+            rst = FLOW_CONTROL_ERROR;
+        } else {
+            state->receiveWindow -= header.length;
+            state->consumed += overhead;
+            state->data.copyIn(payload.c_str() + (overhead ? 1 : 0),
+                header.length - overhead);
+            if (header.flags & END_STREAM) {
+                state->remoteClosed = true;
+                closeStream(*state);
+            }
+            state->condition.broadcast();
+        }
+        if (rst != NO_HTTP2_ERROR && state) {
+            state->reset = true;
+            state->error = rst;
+            state->condition.broadcast();
+            closeStream(*state);
+        }
+        m_consumed += discarded;
+        if (m_consumed >= (size_t)m_connectionWindowSize / 2) {
+            increment = (unsigned int)m_consumed;
+            m_receiveWindow += m_consumed;
+            m_consumed = 0;
+        }
+    }
+    if (rst != NO_HTTP2_ERROR)
+        writeRstStream(header.streamId, rst);
+    if (increment)
+        writeWindowUpdate(0, increment);
+}
+
+void
+Session::handleHeaders(const FrameHeader &header, std::string &payload)
+{
+    if (header.streamId == 0)
+        connectionError(PROTOCOL_ERROR);
+    size_t offset = 0, length = header.length;
+    if (header.flags & PADDED) {
+        if (length < 1)
+            connectionError(PROTOCOL_ERROR);
+        size_t padding = (unsigned char)payload[0];
+        ++offset;
+        --length;
+        if (padding > length)
+            connectionError(PROTOCOL_ERROR);
+        length -= padding;
+    }
+    // Priorities aren't supported; skip the dependency and weight
+    if (header.flags & PRIORITY_FLAG) {
+        if (length < 5)
+            connectionError(PROTOCOL_ERROR);
+        offset += 5;
+        length -= 5;
+    }
+    m_headerBlock.assign(payload, offset, length);
+    if (header.flags & END_HEADERS) {
+        headersComplete(header.streamId, !!(header.flags & END_STREAM));
+    } else {
+        m_headerStreamId = header.streamId;
+        m_headerEndStream = !!(header.flags & END_STREAM);
+    }
+}
+
+static bool
+informational(const HeaderList &headers)
+{
+    for (HeaderList::const_iterator it = headers.begin();
+        it != headers.end();
+        ++it)
+        if (it->first == ":status")
+            return !it->second.empty() && it->second[0] == '1';
+    return false;
+}
+
+void
+Session::headersComplete(unsigned int streamId, bool endStream)
+{
+    // Even if we're going to ignore it, it has to be decoded to keep the
+    // compression context in sync
+    HeaderList headers;
+    m_decoder.decode(m_headerBlock, headers);
+    m_headerBlock.clear();
+    ErrorCode rst = NO_HTTP2_ERROR;
+    StreamState::ptr newStream;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        StreamState::ptr state = lookup(streamId);
+        if (state) {
+            if (state->remoteClosed) {
+                rst = STREAM_CLOSED;
+            } else if (!state->headersReceived) {
+                if (m_client && informational(headers)) {
+                    // 100 Continue and friends; the HTTP/1.1 end sorts out
+                    // its own
+                    if (endStream)
+                        rst = PROTOCOL_ERROR;
+                } else {
+                    state->headers.swap(headers);
+                    state->headersReceived = true;
+                }
+            } else if (!endStream) {
+                // Trailers have to end the stream
+                rst = PROTOCOL_ERROR;
+            }
+            if (rst != NO_HTTP2_ERROR) {
+                state->reset = true;
+                state->error = rst;
+            } else if (endStream) {
+                state->remoteClosed = true;
+            }
+            state->condition.broadcast();
+            closeStream(*state);
+        } else if (m_client || idle(streamId) == false) {
+            // A stream we've already forgotten about
+            if (idle(streamId))
+                connectionError(PROTOCOL_ERROR);
+        } else {
+            if ((streamId & 1) == 0)
+                connectionError(PROTOCOL_ERROR);
+            m_lastPeerStreamId = streamId;
+            if (m_goAwaySent || m_failed ||
+                m_streams.size() >= g_maxConcurrentStreams->val()) {
+                rst = REFUSED_STREAM;
+            } else {
+                newStream.reset(new StreamState(m_mutex, streamId,
+                    m_peerInitialWindowSize, m_windowSize));
+                newStream->headers.swap(headers);
+                newStream->headersReceived = true;
+                newStream->remoteClosed = endStream;
+                m_streams[streamId] = newStream;
+            }
+        }
+    }
+    if (rst != NO_HTTP2_ERROR)
+        writeRstStream(streamId, rst);
+    if (newStream)
+        m_scheduler->schedule(boost::bind(&Session::serveStream,
+            shared_from_this(), newStream));
+}
+
+void
+Session::handleSettings(const FrameHeader &header,
+    const std::string &payload)
+{
+    if (header.streamId != 0)
+        connectionError(PROTOCOL_ERROR);
+    if (header.flags & ACK) {
+        if (header.length != 0)
+            connectionError(FRAME_SIZE_ERROR);
+        return;
+    }
+    if (header.length % 6 != 0)
+        connectionError(FRAME_SIZE_ERROR);
+    const unsigned char *p = (const unsigned char *)payload.c_str();
+    bool tableSizeChanged = false;
+    size_t tableSize = 0;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        for (size_t i = 0; i < header.length; i += 6) {
+            unsigned int value = readUInt32(p + i + 2);
+            switch ((p[i] << 8) | p[i + 1]) {
+                case HEADER_TABLE_SIZE:
+                    tableSizeChanged = true;
+                    tableSize = value;
+                    break;
+                case ENABLE_PUSH:
+                    if (value > 1)
+                        connectionError(PROTOCOL_ERROR);
+                    break;
+                case MAX_CONCURRENT_STREAMS:
+                    m_peerMaxConcurrentStreams = value;
+                    m_streamsCondition.broadcast();
+                    break;
+                case INITIAL_WINDOW_SIZE:
+                {
+                    if (value > g_maxWindowSize)
+                        connectionError(FLOW_CONTROL_ERROR);
+                    // Applies to streams that are already open, too
+                    long long delta = (long long)value -
+                        m_peerInitialWindowSize;
+                    m_peerInitialWindowSize = value;
+                    for (std::map<unsigned int, StreamState::ptr>::iterator
+                        it = m_streams.begin();
+                        it != m_streams.end();
+                        ++it) {
+                        it->second->sendWindow += delta;
+                        if (it->second->sendWindow > g_maxWindowSize)
+                            connectionError(FLOW_CONTROL_ERROR);
+                        it->second->condition.broadcast();
+                    }
+                    break;
+                }
+                case MAX_FRAME_SIZE:
+                    if (value < g_defaultMaxFrameSize || value > 0xffffff)
+                        connectionError(PROTOCOL_ERROR);
+                    m_peerMaxFrameSize = value;
+                    break;
+                default:
+                    // Including MAX_HEADER_LIST_SIZE, which is advisory
+                    break;
+            }
+        }
+    }
+    if (tableSizeChanged) {
+        FiberMutex::ScopedLock lock(m_writeMutex);
+        m_encoder.tableSize(tableSize);
+    }
+    writeFrame(FrameHeader(0, SETTINGS, ACK, 0));
+}
+
+void
+Session::handleWindowUpdate(const FrameHeader &header,
+    const std::string &payload)
+{
+    if (header.length != 4)
+        connectionError(FRAME_SIZE_ERROR);
+    unsigned int increment =
+        readUInt32((const unsigned char *)payload.c_str()) & 0x7fffffff;
+    ErrorCode rst = NO_HTTP2_ERROR;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        if (header.streamId == 0) {
+            if (increment == 0)
+                connectionError(PROTOCOL_ERROR);
+            m_sendWindow += increment;
+            if (m_sendWindow > g_maxWindowSize)
+                connectionError(FLOW_CONTROL_ERROR);
+            for (std::map<unsigned int, StreamState::ptr>::iterator it =
+                m_streams.begin();
+                it != m_streams.end();
+                ++it)
+                it->second->condition.broadcast();
+        } else {
+            StreamState::ptr state = lookup(header.streamId);
+            if (!state) {
+                if (idle(header.streamId))
+                    connectionError(PROTOCOL_ERROR);
+                return;
+            }
+            if (increment == 0)
+                rst = PROTOCOL_ERROR;
+            state->sendWindow += increment;
+            if (state->sendWindow > g_maxWindowSize)
+                rst = FLOW_CONTROL_ERROR;
+            if (rst != NO_HTTP2_ERROR) {
+                state->reset = true;
+                state->error = rst;
+                closeStream(*state);
+            }
+            state->condition.broadcast();
+        }
+    }
+    if (rst != NO_HTTP2_ERROR)
+        writeRstStream(header.streamId, rst);
+}
+
+void
+Session::handleGoAway(const std::string &payload)
+{
+    if (payload.size() < 8)
+        connectionError(FRAME_SIZE_ERROR);
+    const unsigned char *p = (const unsigned char *)payload.c_str();
+    unsigned int lastStreamId = readUInt32(p) & 0x7fffffff;
+    MORDOR_LOG_DEBUG(g_log) << this << " GOAWAY " << readUInt32(p + 4)
+        << " after stream " << lastStreamId;
+    FiberMutex::ScopedLock lock(m_mutex);
+    m_goAwayReceived = true;
+    if (lastStreamId < m_goAwayStreamId)
+        m_goAwayStreamId = lastStreamId;
+    // Streams we started that the peer never got to are safe to retry
+    std::map<unsigned int, StreamState::ptr>::iterator it =
+        m_streams.upper_bound(m_goAwayStreamId);
+    while (it != m_streams.end()) {
+        if (((it->first & 1) == 1) == m_client) {
+            it->second->reset = true;
+            it->second->error = REFUSED_STREAM;
+            it->second->condition.broadcast();
+            m_streams.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    m_streamsCondition.broadcast();
+}
+
+void
+Session::writeBuffer(Buffer &buffer)
+{
+    while (buffer.readAvailable() > 0)
+        buffer.consume(m_stream->write(buffer, buffer.readAvailable()));
+    m_stream->flush();
+}
+
+void
+Session::writeFrame(const FrameHeader &header, const void *payload)
+{
+    unsigned char raw[g_frameHeaderLength];
+    serializeFrameHeader(header, raw);
+    Buffer buffer;
+    buffer.copyIn(raw, g_frameHeaderLength);
+    if (header.length > 0)
+        buffer.copyIn(payload, header.length);
+    FiberMutex::ScopedLock lock(m_writeMutex);
+    writeBuffer(buffer);
+}
+
+void
+Session::writeFrame(const FrameHeader &header, const Buffer &payload)
+{
+    unsigned char raw[g_frameHeaderLength];
+    serializeFrameHeader(header, raw);
+    Buffer buffer;
+    buffer.copyIn(raw, g_frameHeaderLength);
+    buffer.copyIn(payload, header.length);
+    FiberMutex::ScopedLock lock(m_writeMutex);
+    writeBuffer(buffer);
+}
+
+void
+Session::writeHeaders(unsigned int streamId, const HeaderList &headers,
+    bool endStream)
+{
+    size_t maxFrameSize;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        maxFrameSize = m_peerMaxFrameSize;
+    }
+    std::string block;
+    m_encoder.encode(headers, block);
+    Buffer buffer;
+    size_t offset = 0;
+    do {
+        size_t length = std::min(block.size() - offset, maxFrameSize);
+        FrameHeader header(length, offset == 0 ? HEADERS : CONTINUATION, 0,
+            streamId);
+        if (offset + length == block.size())
+            header.flags |= END_HEADERS;
+        if (offset == 0 && endStream)
+            header.flags |= END_STREAM;
+        unsigned char raw[g_frameHeaderLength];
+        serializeFrameHeader(header, raw);
+        buffer.copyIn(raw, g_frameHeaderLength);
+        buffer.copyIn(block.c_str() + offset, length);
+        offset += length;
+    } while (offset < block.size());
+    writeBuffer(buffer);
+}
+
+void
+Session::writeWindowUpdate(unsigned int streamId, unsigned int increment)
+{
+    unsigned char payload[4];
+    writeUInt32(payload, increment);
+    writeFrame(FrameHeader(4, WINDOW_UPDATE, 0, streamId), payload);
+}
+
+void
+Session::writeRstStream(unsigned int streamId, ErrorCode code)
+{
+    unsigned char payload[4];
+    writeUInt32(payload, code);
+    writeFrame(FrameHeader(4, RST_STREAM, 0, streamId), payload);
+}
+
+void
+Session::writeGoAway(ErrorCode code)
+{
+    unsigned char payload[8];
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        writeUInt32(payload, m_lastPeerStreamId);
+    }
+    writeUInt32(payload + 4, code);
+    writeFrame(FrameHeader(8, GOAWAY, 0, 0), payload);
+}
+
+SessionStream::ptr
+Session::openStream(const HeaderList &headers, bool endStream)
+{
+    return SessionStream::ptr(new SessionStream(shared_from_this(),
+        open(headers, endStream)));
+}
+
+StreamState::ptr
+Session::open(const HeaderList &headers, bool endStream)
+{
+    MORDOR_ASSERT(m_client);
+    {
+        // Wait for room without holding up everybody else's writes
+        FiberMutex::ScopedLock lock(m_mutex);
+        while (true) {
+            if (m_failed)
+                MORDOR_THROW_EXCEPTION(ConnectionErrorException());
+            if (m_goAwaySent || m_goAwayReceived ||
+                m_nextStreamId + 2 * m_pendingStreams >= 0x7fffffff)
+                MORDOR_THROW_EXCEPTION(StreamRefusedException())
+                    << errinfo_http2_error(REFUSED_STREAM);
+            if (m_streams.size() + m_pendingStreams <
+                m_peerMaxConcurrentStreams)
+                break;
+            m_streamsCondition.wait();
+        }
+        ++m_pendingStreams;
+    }
+    // Stream IDs have to go out in order, so they're assigned as the
+    // HEADERS are written
+    FiberMutex::ScopedLock writeLock(m_writeMutex);
+    StreamState::ptr state;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        --m_pendingStreams;
+        state.reset(new StreamState(m_mutex, m_nextStreamId,
+            m_peerInitialWindowSize, m_windowSize));
+        m_nextStreamId += 2;
+        state->localClosed = endStream;
+        m_streams[state->id] = state;
+    }
+    MORDOR_LOG_DEBUG(g_log) << this << " opening stream " << state->id;
+    writeHeaders(state->id, headers, endStream);
+    return state;
+}
+
+void
+Session::sendHeaders(StreamState::ptr state, const HeaderList &headers,
+    bool endStream)
+{
+    FiberMutex::ScopedLock writeLock(m_writeMutex);
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        checkStream(*state);
+        MORDOR_ASSERT(!state->localClosed);
+        if (endStream) {
+            state->localClosed = true;
+            closeStream(*state);
+        }
+    }
+    writeHeaders(state->id, headers, endStream);
+}
+
+bool
+Session::receiveHeaders(StreamState::ptr state, HeaderList &headers)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    while (!state->headersReceived) {
+        checkStream(*state);
+        state->condition.wait();
+    }
+    headers = state->headers;
+    return !state->remoteClosed || state->data.readAvailable() > 0;
+}
+
+void
+Session::resetStream(StreamState::ptr state, ErrorCode code)
+{
+    unsigned int increment = 0;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        if (m_failed || state->reset ||
+            (state->localClosed && state->remoteClosed))
+            return;
+        state->reset = true;
+        state->error = code;
+        // Whatever we didn't read still counts against the session's window
+        m_consumed += state->data.readAvailable();
+        state->data.clear();
+        if (m_consumed >= (size_t)m_connectionWindowSize / 2) {
+            increment = (unsigned int)m_consumed;
+            m_receiveWindow += m_consumed;
+            m_consumed = 0;
+        }
+        state->condition.broadcast();
+        closeStream(*state);
+    }
+    writeRstStream(state->id, code);
+    if (increment)
+        writeWindowUpdate(0, increment);
+}
+
+void
+Session::sendData(StreamState::ptr state, const Buffer &buffer,
+    size_t length, bool endStream)
+{
+    Buffer remaining;
+    remaining.copyIn(buffer, length);
+    do {
+        size_t chunk;
+        bool last;
+        {
+            FiberMutex::ScopedLock lock(m_mutex);
+            while (true) {
+                checkStream(*state);
+                MORDOR_ASSERT(!state->localClosed);
+                if (remaining.readAvailable() == 0 ||
+                    (state->sendWindow > 0 && m_sendWindow > 0))
+                    break;
+                state->condition.wait();
+            }
+            chunk = std::min(remaining.readAvailable(), m_peerMaxFrameSize);
+            chunk = (size_t)std::min<long long>(chunk, state->sendWindow);
+            chunk = (size_t)std::min<long long>(chunk, m_sendWindow);
+            state->sendWindow -= chunk;
+            m_sendWindow -= chunk;
+            last = endStream && chunk == remaining.readAvailable();
+            if (last) {
+                state->localClosed = true;
+                closeStream(*state);
+            }
+        }
+        writeFrame(FrameHeader(chunk, DATA, last ? END_STREAM : 0, state->id),
+            remaining);
+        remaining.consume(chunk);
+    } while (remaining.readAvailable() > 0);
+}
+
+void
+Session::endStream(StreamState::ptr state)
+{
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        if (state->localClosed)
+            return;
+    }
+    sendData(state, Buffer(), 0, true);
+}
+
+size_t
+Session::receiveData(StreamState::ptr state, Buffer &buffer, size_t length)
+{
+    size_t result;
+    unsigned int streamIncrement = 0, increment = 0;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        while (state->data.readAvailable() == 0) {
+            checkStream(*state);
+            if (state->remoteClosed)
+                return 0;
+            state->condition.wait();
+        }
+        result = std::min(length, state->data.readAvailable());
+        buffer.copyIn(state->data, result);
+        state->data.consume(result);
+
+        // Let the peer send more once half the window has been read
+        state->consumed += result;
+        if (!state->remoteClosed &&
+            state->consumed >= (size_t)m_windowSize / 2) {
+            streamIncrement = (unsigned int)state->consumed;
+            state->receiveWindow += state->consumed;
+            state->consumed = 0;
+        }
+        m_consumed += result;
+        if (m_consumed >= (size_t)m_connectionWindowSize / 2) {
+            increment = (unsigned int)m_consumed;
+            m_receiveWindow += m_consumed;
+            m_consumed = 0;
+        }
+    }
+    if (streamIncrement)
+        writeWindowUpdate(state->id, streamIncrement);
+    if (increment)
+        writeWindowUpdate(0, increment);
+    return result;
+}
+
+ClientConnection::ptr
+Session::connection()
+{
+    MORDOR_ASSERT(m_client);
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    ServerConnection::ptr server(new ServerConnection(pipes.second,
+        boost::bind(&Session::forwardRequest, shared_from_this(), _1)));
+    server->processRequests();
+    return ClientConnection::ptr(new ClientConnection(pipes.first));
+}
+
+void
+Session::serveStream(StreamState::ptr state)
+{
+    Request request;
+    if (!fromHeaderList(state->headers, request)) {
+        MORDOR_LOG_DEBUG(g_log) << this << " malformed request on stream "
+            << state->id;
+        resetStream(state, PROTOCOL_ERROR);
+        return;
+    }
+    bool requestBody;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        requestBody = !state->remoteClosed ||
+            state->data.readAvailable() > 0;
+    }
+    if (requestBody && request.entity.contentLength == ~0ull)
+        request.general.transferEncoding.push_back("chunked");
+    MORDOR_LOG_DEBUG(g_log) << this << " stream " << state->id << " "
+        << request.requestLine;
+    try {
+        // The Servlet gets a ServerRequest as usual, from a ServerConnection
+        // on the other end of a pipe
+        std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+        ServerConnection::ptr server(new ServerConnection(pipes.second,
+            m_dg));
+        server->processRequests();
+        ClientConnection::ptr client(new ClientConnection(pipes.first));
+        ClientRequest::ptr clientRequest = client->request(request);
+        std::vector<boost::function<void ()> > dgs;
+        if (requestBody)
+            dgs.push_back(boost::bind(&Session::sendRequestBody, this, state,
+                clientRequest));
+        dgs.push_back(boost::bind(&Session::relayResponse, this, state,
+            clientRequest));
+        parallel_do(dgs);
+    } catch (...) {
+        MORDOR_LOG_DEBUG(g_log) << this << " stream " << state->id << ": "
+            << boost::current_exception_diagnostic_information();
+        resetStream(state, INTERNAL_ERROR);
+    }
+}
+
+void
+Session::sendRequestBody(StreamState::ptr state, ClientRequest::ptr request)
+{
+    SessionStream body(shared_from_this(), state);
+    Stream::ptr requestStream = request->requestStream();
+    transferStream(body, requestStream);
+    requestStream->close();
+}
+
+void
+Session::relayResponse(StreamState::ptr state, ClientRequest::ptr request)
+{
+    const Response &response = request->response();
+    HeaderList headers;
+    toHeaderList(response, headers);
+    bool responseBody = request->hasResponseBody();
+    sendHeaders(state, headers, !responseBody);
+    if (responseBody) {
+        SessionStream body(shared_from_this(), state);
+        transferStream(request->responseStream(), body);
+        body.close();
+    }
+}
+
+void
+Session::forwardRequest(ServerRequest::ptr request)
+{
+    HeaderList headers;
+    toHeaderList(request->request(), m_scheme, headers);
+    bool requestBody = request->hasRequestBody();
+    StreamState::ptr state;
+    try {
+        state = open(headers, !requestBody);
+        std::vector<boost::function<void ()> > dgs;
+        if (requestBody)
+            dgs.push_back(boost::bind(&Session::forwardRequestBody, this,
+                request, state));
+        dgs.push_back(boost::bind(&Session::forwardResponse, this, request,
+            state));
+        parallel_do(dgs);
+    } catch (...) {
+        // Make the ClientRequest fail, rather than get a 500 for something
+        // the server never said
+        MORDOR_LOG_DEBUG(g_log) << this << " "
+            << boost::current_exception_diagnostic_information();
+        if (state)
+            resetStream(state, CANCEL);
+        request->connection()->cancel();
+    }
+}
+
+void
+Session::forwardRequestBody(ServerRequest::ptr request,
+    StreamState::ptr state)
+{
+    SessionStream body(shared_from_this(), state);
+    transferStream(request->requestStream(), body);
+    body.close();
+}
+
+void
+Session::forwardResponse(ServerRequest::ptr request, StreamState::ptr state)
+{
+    HeaderList headers;
+    bool responseBody = receiveHeaders(state, headers);
+    Response response;
+    if (!fromHeaderList(headers, response)) {
+        resetStream(state, PROTOCOL_ERROR);
+        MORDOR_THROW_EXCEPTION(StreamResetException())
+            << errinfo_http2_error(PROTOCOL_ERROR);
+    }
+    Status status = response.status.status;
+    bool bodyAllowed = status >= 200 && status != NO_CONTENT &&
+        status != NOT_MODIFIED && request->request().requestLine.method != HEAD;
+    if (bodyAllowed && !responseBody &&
+        response.entity.contentLength == ~0ull)
+        response.entity.contentLength = 0;
+    request->response() = response;
+    if (!bodyAllowed && responseBody)
+        resetStream(state, CANCEL);
+    if (bodyAllowed && responseBody) {
+        SessionStream body(shared_from_this(), state);
+        Stream::ptr responseStream = request->responseStream();
+        transferStream(body, responseStream);
+        responseStream->close();
+    } else {
+        request->finish();
+    }
+}
+
+SessionCache::SessionCache(StreamBroker::ptr streamBroker,
+    TimerManager *timerManager)
+    : m_streamBroker(streamBroker),
+      m_priorKnowledge(false)
+{
+    m_timerManager = timerManager;
+    m_alpnProtocols.push_back("h2");
+    m_alpnProtocols.push_back("http/1.1");
+}
+
+std::pair<ClientConnection::ptr, bool>
+SessionCache::getConnection(const URI &uri, bool forceNewConnection)
+{
+    URI endpoint;
+    endpoint.scheme(uri.scheme());
+    endpoint.authority = uri.authority;
+
+    // Holding the lock while connecting means there's only ever one session
+    // per server
+    FiberMutex::ScopedLock lock(m_mutex);
+    std::map<URI, Session::ptr>::iterator it = m_sessions.find(endpoint);
+    if (it != m_sessions.end()) {
+        if (!forceNewConnection && it->second->newStreamsAllowed())
+            return std::make_pair(it->second->connection(), false);
+        m_sessions.erase(it);
+    }
+
+    Stream::ptr stream = m_streamBroker->getStream(endpoint);
+    std::string protocol;
+    addSSL(endpoint, stream, &protocol);
+    bool http2 = endpoint.scheme() == "https" ? protocol == "h2" :
+        m_priorKnowledge;
+    if (!http2) {
+        MORDOR_LOG_DEBUG(g_log) << this << " " << endpoint
+            << " doesn't do HTTP/2";
+        ClientConnection::ptr connection(new ClientConnection(stream,
+            m_timerManager));
+        if (m_httpReadTimeout != ~0ull)
+            connection->readTimeout(m_httpReadTimeout);
+        if (m_httpWriteTimeout != ~0ull)
+            connection->writeTimeout(m_httpWriteTimeout);
+        return std::make_pair(connection, false);
+    }
+    Session::ptr session(new Session(stream, endpoint.scheme()));
+    session->start();
+    m_sessions[endpoint] = session;
+    MORDOR_LOG_DEBUG(g_log) << this << " new session " << session << " to "
+        << endpoint;
+    return std::make_pair(session->connection(), false);
+}
+
+void
+SessionCache::closeSessions()
+{
+    std::map<URI, Session::ptr> sessions;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        sessions.swap(m_sessions);
+    }
+    for (std::map<URI, Session::ptr>::iterator it = sessions.begin();
+        it != sessions.end();
+        ++it)
+        it->second->close();
+}
+
+}}}
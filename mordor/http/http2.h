@@ -0,0 +1,342 @@
+#ifndef __MORDOR_HTTP_HTTP2_H__
+#define __MORDOR_HTTP_HTTP2_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <map>
+
+#include <boost/exception/error_info.hpp>
+
+#include "broker.h"
+#include "hpack.h"
+#include "mordor/fibersynchronization.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/streams/stream.h"
+
+namespace Mordor {
+
+class Scheduler;
+
+namespace HTTP {
+
+class ClientConnection;
+class ServerRequest;
+
+/// HTTP/2 (RFC 7540)
+///
+/// A Session speaks HTTP/2 over a Stream (TLS negotiated with ALPN "h2", or
+/// "h2c" with prior knowledge).  Rather than having a second set of request
+/// objects, each HTTP/2 stream is bridged to an HTTP/1.1 exchange over a
+/// pipe, so Servlets and ServerRequest/ClientRequest work unchanged:
+///  * A server Session hands each request to the same dg a ServerConnection
+///    would get.
+///  * A client Session gives out ClientConnections (connection()); any number
+///    of them, each with any number of requests, are multiplexed over the one
+///    TCP connection.
+/// Server push and stream priorities aren't supported.
+namespace HTTP2 {
+
+enum FrameType
+{
+    DATA = 0x0,
+    HEADERS = 0x1,
+    PRIORITY = 0x2,
+    RST_STREAM = 0x3,
+    SETTINGS = 0x4,
+    PUSH_PROMISE = 0x5,
+    PING = 0x6,
+    GOAWAY = 0x7,
+    WINDOW_UPDATE = 0x8,
+    CONTINUATION = 0x9
+};
+
+enum FrameFlags
+{
+    END_STREAM = 0x1,
+    ACK = 0x1,
+    END_HEADERS = 0x4,
+    PADDED = 0x8,
+    PRIORITY_FLAG = 0x20
+};
+
+enum Setting
+{
+    HEADER_TABLE_SIZE = 0x1,
+    ENABLE_PUSH = 0x2,
+    MAX_CONCURRENT_STREAMS = 0x3,
+    INITIAL_WINDOW_SIZE = 0x4,
+    MAX_FRAME_SIZE = 0x5,
+    MAX_HEADER_LIST_SIZE = 0x6
+};
+
+enum ErrorCode
+{
+    // NO_ERROR in the RFC, but windows.h #defines that
+    NO_HTTP2_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    SETTINGS_TIMEOUT = 0x4,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    CANCEL = 0x8,
+    COMPRESSION_ERROR = 0x9,
+    CONNECT_ERROR = 0xa,
+    ENHANCE_YOUR_CALM = 0xb,
+    INADEQUATE_SECURITY = 0xc,
+    HTTP_1_1_REQUIRED = 0xd
+};
+
+typedef boost::error_info<struct tag_http2Error, ErrorCode> errinfo_http2_error;
+
+/// The session is gone (GOAWAY, a protocol error, or the transport failed)
+struct ConnectionErrorException : virtual Exception {};
+/// The peer reset the stream
+struct StreamResetException : virtual Exception {};
+/// The peer didn't process the stream at all, so it's safe to retry
+struct StreamRefusedException : virtual StreamResetException,
+    virtual PriorRequestFailedException {};
+
+/// The first thing a client sends
+extern const char g_preface[];
+static const size_t g_prefaceLength = 24;
+
+struct FrameHeader
+{
+    FrameHeader(size_t length_ = 0, unsigned char type_ = DATA,
+        unsigned char flags_ = 0, unsigned int streamId_ = 0)
+        : length(length_),
+          type(type_),
+          flags(flags_),
+          streamId(streamId_)
+    {}
+
+    size_t length;
+    unsigned char type;
+    unsigned char flags;
+    unsigned int streamId;
+};
+static const size_t g_frameHeaderLength = 9;
+
+void serializeFrameHeader(const FrameHeader &header,
+    unsigned char out[g_frameHeaderLength]);
+FrameHeader parseFrameHeader(const unsigned char in[g_frameHeaderLength]);
+
+/// Translate between HTTP/1.1 messages and HTTP/2 header blocks; header names
+/// are lower cased, Host becomes :authority, and connection-specific headers
+/// are dropped
+void toHeaderList(const Request &request, const std::string &scheme,
+    HeaderList &headers);
+void toHeaderList(const Response &response, HeaderList &headers);
+/// @return false if headers is malformed (RFC 7540 section 8.1.2)
+bool fromHeaderList(const HeaderList &headers, Request &request);
+bool fromHeaderList(const HeaderList &headers, Response &response);
+
+class Session;
+struct StreamState;
+
+/// One stream of a Session
+///
+/// Reads return the peer's DATA (0 after END_STREAM), writes send DATA
+/// (waiting for flow control to allow it), and close() ends our half of the
+/// stream.
+class SessionStream : public Stream
+{
+public:
+    typedef std::shared_ptr<SessionStream> ptr;
+
+public:
+    unsigned int id() const;
+
+    /// Waits for the peer's headers (skipping any 1xx response)
+    /// @return whether a body follows
+    bool receiveHeaders(HeaderList &headers);
+    void sendHeaders(const HeaderList &headers, bool endStream = false);
+    /// Sends RST_STREAM, unless the stream is already closed
+    void reset(ErrorCode code = CANCEL);
+
+    bool supportsHalfClose() { return true; }
+    bool supportsRead() { return true; }
+    bool supportsWrite() { return true; }
+
+    void close(CloseType type = BOTH);
+    using Stream::read;
+    size_t read(Buffer &buffer, size_t length);
+    using Stream::write;
+    size_t write(const Buffer &buffer, size_t length);
+
+private:
+    friend class Session;
+    SessionStream(std::shared_ptr<Session> session,
+        std::shared_ptr<StreamState> state);
+
+private:
+    std::shared_ptr<Session> m_session;
+    std::shared_ptr<StreamState> m_state;
+};
+
+class Session : public std::enable_shared_from_this<Session>,
+    Mordor::noncopyable
+{
+public:
+    typedef std::shared_ptr<Session> ptr;
+
+public:
+    /// Client
+    /// @param scheme What goes in :scheme
+    Session(std::shared_ptr<Stream> stream,
+        const std::string &scheme = "http");
+    /// Server; each request is processed by dg in its own Fiber
+    Session(std::shared_ptr<Stream> stream,
+        boost::function<void (std::shared_ptr<ServerRequest>)> dg);
+
+    /// Exchanges the preface and SETTINGS, then reads frames in a new Fiber
+    /// (on Scheduler::getThis()) until the session ends
+    void start();
+    /// Sends GOAWAY; streams that are already open carry on
+    void close(ErrorCode code = NO_HTTP2_ERROR);
+
+    /// Whether a client can still open streams (it may have to wait for one
+    /// to finish first, if the server limits them)
+    bool newStreamsAllowed();
+    /// Whether the session has ended, or is on its way out (GOAWAY)
+    bool closed();
+    size_t activeStreams();
+
+    /// A connection whose requests each become a stream of this session
+    std::shared_ptr<ClientConnection> connection();
+
+    /// Start a stream directly, rather than with connection(); client only,
+    /// and waits if the server's MAX_CONCURRENT_STREAMS is reached
+    SessionStream::ptr openStream(const HeaderList &headers, bool endStream);
+
+private:
+    void init();
+    std::shared_ptr<StreamState> lookup(unsigned int streamId);
+    bool idle(unsigned int streamId);
+    void checkStream(StreamState &state);
+    void closeStream(StreamState &state);
+    void drain();
+
+    void fill(size_t length);
+    bool readFrame(FrameHeader &header, std::string &payload);
+    void readLoop();
+    void fail();
+    void handleFrame(const FrameHeader &header, std::string &payload);
+    void handleData(const FrameHeader &header, std::string &payload);
+    void handleHeaders(const FrameHeader &header, std::string &payload);
+    void headersComplete(unsigned int streamId, bool endStream);
+    void handleSettings(const FrameHeader &header, const std::string &payload);
+    void handleWindowUpdate(const FrameHeader &header,
+        const std::string &payload);
+    void handleGoAway(const std::string &payload);
+
+    void writeBuffer(Buffer &buffer);
+    void writeFrame(const FrameHeader &header, const void *payload = NULL);
+    void writeFrame(const FrameHeader &header, const Buffer &payload);
+    void writeHeaders(unsigned int streamId, const HeaderList &headers,
+        bool endStream);
+    void writeWindowUpdate(unsigned int streamId, unsigned int increment);
+    void writeRstStream(unsigned int streamId, ErrorCode code);
+    void writeGoAway(ErrorCode code);
+
+    std::shared_ptr<StreamState> open(const HeaderList &headers,
+        bool endStream);
+    void sendHeaders(std::shared_ptr<StreamState> state,
+        const HeaderList &headers, bool endStream);
+    bool receiveHeaders(std::shared_ptr<StreamState> state,
+        HeaderList &headers);
+    void resetStream(std::shared_ptr<StreamState> state, ErrorCode code);
+    void sendData(std::shared_ptr<StreamState> state, const Buffer &buffer,
+        size_t length, bool endStream);
+    void endStream(std::shared_ptr<StreamState> state);
+    size_t receiveData(std::shared_ptr<StreamState> state, Buffer &buffer,
+        size_t length);
+
+    // Server side: from an HTTP/2 stream to m_dg
+    void serveStream(std::shared_ptr<StreamState> state);
+    void sendRequestBody(std::shared_ptr<StreamState> state,
+        std::shared_ptr<ClientRequest> request);
+    void relayResponse(std::shared_ptr<StreamState> state,
+        std::shared_ptr<ClientRequest> request);
+    // Client side: from connection() to an HTTP/2 stream
+    void forwardRequest(std::shared_ptr<ServerRequest> request);
+    void forwardRequestBody(std::shared_ptr<ServerRequest> request,
+        std::shared_ptr<StreamState> state);
+    void forwardResponse(std::shared_ptr<ServerRequest> request,
+        std::shared_ptr<StreamState> state);
+
+    friend class SessionStream;
+
+private:
+    std::shared_ptr<Stream> m_stream;
+    bool m_client;
+    std::string m_scheme;
+    boost::function<void (std::shared_ptr<ServerRequest>)> m_dg;
+    Scheduler *m_scheduler;
+
+    // Protects everything below but m_encoder and the read side
+    FiberMutex m_mutex;
+    // Serializes writes, and protects m_encoder (header blocks have to go
+    // out in the order they were compressed); never taken while holding
+    // m_mutex
+    FiberMutex m_writeMutex;
+    // Signalled whenever a stream closes, or the limit on them changes
+    FiberCondition m_streamsCondition;
+    std::map<unsigned int, std::shared_ptr<StreamState> > m_streams;
+    unsigned int m_nextStreamId, m_lastPeerStreamId, m_goAwayStreamId;
+    // Clients waiting to write their HEADERS
+    size_t m_pendingStreams;
+    bool m_goAwaySent, m_goAwayReceived, m_failed;
+
+    HPACKEncoder m_encoder;
+    // Only used by the Fiber reading frames
+    HPACKDecoder m_decoder;
+    Buffer m_readBuffer;
+    // A header block still waiting for its CONTINUATION frames
+    std::string m_headerBlock;
+    unsigned int m_headerStreamId;
+    bool m_headerEndStream;
+
+    // Flow control; windows are what we (or the peer) may still send
+    long long m_windowSize, m_connectionWindowSize;
+    long long m_sendWindow, m_receiveWindow;
+    size_t m_consumed;
+    long long m_peerInitialWindowSize;
+    size_t m_peerMaxFrameSize, m_peerMaxConcurrentStreams;
+};
+
+/// A ConnectionBroker that multiplexes every request to a server over one
+/// HTTP/2 Session; for https, only if the server picks h2 with ALPN (otherwise
+/// each getConnection() gets a new HTTP/1.1 connection, like
+/// ConnectionNoCache).  Plain http is HTTP/1.1 unless priorKnowledge (h2c).
+/// Proxies aren't supported.
+class SessionCache : public ConnectionBroker,
+    public std::enable_shared_from_this<SessionCache>
+{
+public:
+    typedef std::shared_ptr<SessionCache> ptr;
+
+public:
+    SessionCache(StreamBroker::ptr streamBroker,
+        TimerManager *timerManager = NULL);
+
+    void priorKnowledge(bool priorKnowledge)
+    { m_priorKnowledge = priorKnowledge; }
+
+    std::pair<std::shared_ptr<ClientConnection>, bool>
+        getConnection(const URI &uri, bool forceNewConnection = false);
+
+    /// Send GOAWAY on every session; outstanding requests still finish
+    void closeSessions();
+
+private:
+    FiberMutex m_mutex;
+    StreamBroker::ptr m_streamBroker;
+    bool m_priorKnowledge;
+    std::map<URI, Session::ptr> m_sessions;
+};
+
+}}}
+
+#endif
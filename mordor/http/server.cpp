@@ -7,6 +7,7 @@
 #include "mordor/fiber.h"
 #include "mordor/scheduler.h"
 #include "mordor/socket.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/null.h"
 #include "mordor/streams/transfer.h"
 #include "mordor/timer.h"
@@ -18,6 +19,15 @@ namespace HTTP {
 
 static Logger::ptr g_log = Log::lookup("mordor:http:server");
 
+typedef ShardedStatistic<HistogramStatistic<unsigned long long> >
+    LatencyStatistic;
+// Up to an hour; anything longer is counted as an hour
+static LatencyStatistic &g_statLatency =
+    Statistics::registerStatistic("http.server.latency",
+    LatencyStatistic(HistogramStatistic<unsigned long long>("us", "requests",
+    6, 3600000000ull)),
+    "Time from a request's headers being read to its response completing");
+
 ServerConnection::ServerConnection(Stream::ptr stream, boost::function<void (ServerRequest::ptr)> dg)
 : Connection(stream),
   m_dg(dg),
@@ -861,6 +871,8 @@ ServerRequest::responseDone()
     }
     MORDOR_LOG_INFO(g_log) << m_context << " "
         << m_request.requestLine << " " << m_response.status.status;
+    if (m_startTime)
+        g_statLatency.update(TimerManager::now() - m_startTime);
     m_conn->responseComplete(this);
 }
 
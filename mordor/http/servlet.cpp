@@ -2,18 +2,40 @@
 
 #include "servlet.h"
 
+#include <algorithm>
+
 #include "mordor/assert.h"
 #include "server.h"
 
 namespace Mordor {
 namespace HTTP {
 
+namespace {
+struct SegmentLess
+{
+    template <class T>
+    bool operator()(const T &lhs, const std::string &rhs) const
+    { return lhs.first < rhs; }
+};
+}
+
+const ServletDispatcher::Node *
+ServletDispatcher::Node::child(const std::string &segment) const
+{
+    std::vector<std::pair<std::string, NodePtr> >::const_iterator it =
+        std::lower_bound(children.begin(), children.end(), segment,
+            SegmentLess());
+    if (it != children.end() && it->first == segment)
+        return it->second.get();
+    return NULL;
+}
+
 Servlet::ptr
-ServletDispatcher::getServletPtr(ServletDispatcher::ServletOrCreator &creator)
+ServletDispatcher::getServletPtr(const ServletDispatcher::ServletOrCreator &creator)
 {
-    Servlet::ptr servletPtr = boost::get<Servlet::ptr>(creator);
+    const Servlet::ptr *servletPtr = boost::get<Servlet::ptr>(&creator);
     if (servletPtr)
-        return servletPtr;
+        return *servletPtr;
     else
         return Servlet::ptr(boost::get<boost::function<Servlet *()> >(creator)());
 }
@@ -23,21 +45,23 @@ ServletDispatcher::getServlet(const URI &uri)
 {
     MORDOR_ASSERT(!uri.authority.userinfoDefined());
     Servlet::ptr result;
-    if (m_servlets.empty())
+    std::shared_ptr<const ServletHostMap> servlets =
+        std::atomic_load(&m_servlets);
+    if (servlets->empty())
         return result;
     URI copy(uri);
     copy.normalize();
-    ServletHostMap::iterator it = m_servlets.find(copy.authority);
-    if (it != m_servlets.end()) {
-        result = getServlet(it->second, copy.path);
+    ServletHostMap::const_iterator it = servlets->find(copy.authority);
+    if (it != servlets->end()) {
+        result = getServlet(it->second.get(), copy.path);
         if (result)
             return result;
     }
     if (copy.authority.hostDefined()) {
         // fall back to no authority defined scenario
-        it = m_servlets.find(URI::Authority());
-        if (it != m_servlets.end())
-            result = getServlet(it->second, copy.path);
+        it = servlets->find(URI::Authority());
+        if (it != servlets->end())
+            result = getServlet(it->second.get(), copy.path);
     }
     return result;
 }
@@ -55,40 +79,83 @@ ServletDispatcher::request(ServerRequest::ptr request)
         respondError(request, NOT_FOUND);
 }
 
+// Matches the first end segments of path (plus an empty one, if
+// trailingSlash), preferring literal segments over '*' as far left as
+// possible
+const ServletDispatcher::Node *
+ServletDispatcher::match(const Node *node, const URI::Path &path,
+    size_t segment, size_t end, bool trailingSlash)
+{
+    static const std::string empty;
+    if (segment == end + (trailingSlash ? 1 : 0))
+        return node->registered ? node : NULL;
+    const std::string &name = segment < end ? path.segments[segment] : empty;
+    const Node *child = node->child(name);
+    if (child) {
+        const Node *result = match(child, path, segment + 1, end,
+            trailingSlash);
+        if (result)
+            return result;
+    }
+    if (node->wildcard)
+        return match(node->wildcard.get(), path, segment + 1, end,
+            trailingSlash);
+    return NULL;
+}
+
 Servlet::ptr
-ServletDispatcher::getServletWildcard(ServletWildcardPathMap &vhost, const URI::Path &path)
+ServletDispatcher::getServlet(const Node *root, const URI::Path &path)
 {
-    // reverse order because '*' < [a-zA-Z]
-    for (ServletWildcardPathMap::reverse_iterator it = vhost.rbegin();
-        it != vhost.rend(); ++it) {
-        if (wildcardPathMatch(it->first, path))
-            return getServletPtr(it->second);
+    // Try ever shorter prefixes of the path; "/a/b" is tried as "/a/b",
+    // "/a/", "/a", "/", and ""
+    for (size_t end = path.segments.size(); end > 0; --end) {
+        const Node *node = match(root, path, 0, end, false);
+        if (node)
+            return getServletPtr(node->servlet);
+        if (!path.segments[end - 1].empty()) {
+            node = match(root, path, 0, end - 1, true);
+            if (node)
+                return getServletPtr(node->servlet);
+        }
     }
     return Servlet::ptr();
 }
 
-Servlet::ptr
-ServletDispatcher::getServlet(ServletPathMapPair &vhosts, const URI::Path &path)
+ServletDispatcher::NodePtr
+ServletDispatcher::update(const Node *node, const URI::Path &path,
+    size_t segment, const ServletOrCreator *servlet)
 {
-    URI::Path copy(path);
-    while (!copy.segments.empty()) {
-        // search from non-wildcard path
-        ServletPathMap::iterator it = vhosts.first.find(copy);
-        if (it != vhosts.first.end())
-            return getServletPtr(it->second);
-        if (m_enableWildcard) {
-            Servlet::ptr result = getServletWildcard(vhosts.second, copy);
-            if (result)
-                return result;
+    std::shared_ptr<Node> copy(node ? new Node(*node) : new Node());
+    if (segment == path.segments.size()) {
+        if (servlet) {
+            MORDOR_ASSERT(!copy->registered);
+            copy->servlet = *servlet;
+            copy->registered = true;
+        } else {
+            copy->servlet = ServletOrCreator();
+            copy->registered = false;
         }
-        // can't find any match, shorten the path
-        if (!copy.segments.back().empty()) {
-            copy.segments.back().clear();
+    } else {
+        const std::string &name = path.segments[segment];
+        if (m_enableWildcard && name == "*") {
+            copy->wildcard = update(copy->wildcard.get(), path, segment + 1,
+                servlet);
         } else {
-            copy.segments.pop_back();
+            std::vector<std::pair<std::string, NodePtr> >::iterator it =
+                std::lower_bound(copy->children.begin(), copy->children.end(),
+                    name, SegmentLess());
+            if (it == copy->children.end() || it->first != name)
+                it = copy->children.insert(it,
+                    std::make_pair(name, NodePtr()));
+            it->second = update(it->second.get(), path, segment + 1, servlet);
+            if (!it->second)
+                copy->children.erase(it);
         }
     }
-    return Servlet::ptr();
+    // Prune whatever an unregistration left empty
+    if (!copy->registered && copy->children.empty() && !copy->wildcard)
+        return NodePtr();
+    return copy;
 }
 
 void
@@ -100,13 +167,42 @@ ServletDispatcher::registerServlet(const URI &uri,
     MORDOR_ASSERT(!uri.fragmentDefined());
     URI copy(uri);
     copy.normalize();
-    ServletPathMap * vhost = NULL;
-    if (m_enableWildcard && isWildcardPath(copy.path))
-        vhost = &(m_servlets[copy.authority].second);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::shared_ptr<ServletHostMap> servlets(new ServletHostMap(*m_servlets));
+    NodePtr &root = (*servlets)[copy.authority];
+    root = update(root.get(), copy.path, 0, &servlet);
+    std::atomic_store(&m_servlets,
+        std::shared_ptr<const ServletHostMap>(servlets));
+}
+
+bool
+ServletDispatcher::unregisterServlet(const URI &uri)
+{
+    URI copy(uri);
+    copy.normalize();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ServletHostMap::const_iterator it = m_servlets->find(copy.authority);
+    if (it == m_servlets->end())
+        return false;
+    const Node *node = it->second.get();
+    for (size_t i = 0; node && i < copy.path.segments.size(); ++i) {
+        const std::string &name = copy.path.segments[i];
+        if (m_enableWildcard && name == "*")
+            node = node->wildcard.get();
+        else
+            node = node->child(name);
+    }
+    if (!node || !node->registered)
+        return false;
+    std::shared_ptr<ServletHostMap> servlets(new ServletHostMap(*m_servlets));
+    NodePtr root = update(it->second.get(), copy.path, 0, NULL);
+    if (root)
+        (*servlets)[copy.authority] = root;
     else
-        vhost = &(m_servlets[copy.authority].first);
-    MORDOR_ASSERT(vhost->find(copy.path) == vhost->end());
-    (*vhost)[copy.path] = servlet;
+        servlets->erase(copy.authority);
+    std::atomic_store(&m_servlets,
+        std::shared_ptr<const ServletHostMap>(servlets));
+    return true;
 }
 
 bool
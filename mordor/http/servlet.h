@@ -2,6 +2,8 @@
 #define __MORDOR_HTTP_SERVLET_H__
 // Copyright (c) 2010 - Mozy, Inc.
 
+#include <mutex>
+
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/variant.hpp>
@@ -62,21 +64,40 @@ private:
 ///   * if there is more than one path matches, following precedence will be considered
 ///     - non-wildcard path,
 ///     - wildcard path with right-most postion of the left-most '*'
+///
+/// Registered paths are kept in a trie with one level per path segment (each
+/// node has its literal children and a '*' child), so a lookup costs a few
+/// binary searches per segment no matter how many servlets are registered.
+/// The trie is never modified once built; registering copies the nodes along
+/// the new path and publishes a new root, so lookups don't take a lock and
+/// servlets can be (un)registered while requests are being dispatched.
 class ServletDispatcher : public Servlet
 {
 private:
     typedef boost::variant<std::shared_ptr<Servlet>,
             boost::function<Servlet *()> > ServletOrCreator;
-    typedef std::map<URI::Path, ServletOrCreator> ServletPathMap;
-    typedef ServletPathMap ServletWildcardPathMap;
-    typedef std::pair<ServletPathMap, ServletWildcardPathMap> ServletPathMapPair;
-    typedef std::map<URI::Authority, ServletPathMapPair> ServletHostMap;
+    struct Node;
+    typedef std::shared_ptr<const Node> NodePtr;
+    struct Node
+    {
+        Node() : registered(false) {}
+
+        /// Sorted by segment
+        std::vector<std::pair<std::string, NodePtr> > children;
+        NodePtr wildcard;
+        ServletOrCreator servlet;
+        bool registered;
+
+        const Node *child(const std::string &segment) const;
+    };
+    typedef std::map<URI::Authority, NodePtr> ServletHostMap;
 public:
     typedef std::shared_ptr<ServletDispatcher> ptr;
 
 public:
     ServletDispatcher(bool enableWildcard = false)
-        : m_enableWildcard(enableWildcard)
+        : m_servlets(new ServletHostMap()),
+          m_enableWildcard(enableWildcard)
     {}
 
 public:
@@ -90,7 +111,7 @@ public:
     {
         typedef Creator<Servlet, T> CreatorType;
         std::shared_ptr<CreatorType> creator(new CreatorType());
-        registerServlet(boost::bind(&CreatorType::create0, creator));
+        registerServlet(uri, boost::bind(&CreatorType::create0, creator));
     }
     template <class T, class A1>
     void registerServlet(const URI &uri, A1 a1)
@@ -108,6 +129,9 @@ public:
             a2));
     }
 
+    /// @return false if nothing was registered for uri
+    bool unregisterServlet(const URI &uri);
+
     Servlet::ptr getServlet(const URI &uri);
 
     void request(std::shared_ptr<ServerRequest> request);
@@ -116,15 +140,22 @@ public:
     static bool wildcardPathMatch(const URI::Path &wildPath, const URI::Path &path);
 
 private:
-    Servlet::ptr getServlet(ServletPathMapPair &vhost, const URI::Path &path);
-    Servlet::ptr getServletWildcard(ServletWildcardPathMap &vhost, const URI::Path &path);
+    static const Node *match(const Node *node, const URI::Path &path,
+        size_t segment, size_t end, bool trailingSlash);
+    static Servlet::ptr getServlet(const Node *root, const URI::Path &path);
 
     void registerServlet(const URI &uri, const ServletOrCreator &servlet);
+    /// @param servlet NULL to remove
+    NodePtr update(const Node *node, const URI::Path &path, size_t segment,
+        const ServletOrCreator *servlet);
 
-    static Servlet::ptr getServletPtr(ServletOrCreator &);
+    static Servlet::ptr getServletPtr(const ServletOrCreator &);
 
 private:
-    ServletHostMap m_servlets;
+    // Serializes registrations
+    std::mutex m_mutex;
+    // Read with std::atomic_load, replaced with std::atomic_store
+    std::shared_ptr<const ServletHostMap> m_servlets;
     bool m_enableWildcard;
 };
 
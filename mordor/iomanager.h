@@ -6,6 +6,8 @@
 
 #ifdef WINDOWS
 #include "iomanager_iocp.h"
+#elif defined(LINUX) && defined(MORDOR_IO_URING)
+#include "iomanager_uring.h"
 #elif defined(LINUX)
 #include "iomanager_epoll.h"
 #elif defined(BSD)
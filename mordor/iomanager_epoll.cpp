@@ -2,17 +2,21 @@
 
 #include "pch.h"
 
-#ifdef LINUX
+#if defined(LINUX) && !defined(MORDOR_IO_URING)
 
 #include "iomanager_epoll.h"
 
+#include <algorithm>
+
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <boost/exception_ptr.hpp>
 
 #include "assert.h"
 #include "atomic.h"
 #include "fiber.h"
+#include "statistics.h"
 
 // EPOLLRDHUP is missing in the header on etch
 #ifndef EPOLLRDHUP
@@ -23,6 +27,11 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
+static CountStatistic<unsigned long long> &g_statSpuriousWakeups =
+    Statistics::registerStatistic("iomanager.spuriouswakeups",
+    CountStatistic<unsigned long long>(),
+    "Idle threads tickled awake that found nothing to run");
+
 enum epoll_ctl_op_t
 {
     epoll_ctl_op_t_dummy = 0x7ffffff
@@ -97,7 +106,9 @@ static std::ostream &operator <<(std::ostream &os, EPOLL_EVENTS events)
 
 IOManager::AsyncState::AsyncState()
     : m_fd(0),
-      m_events(NONE)
+      m_events(NONE),
+      m_ready(NONE),
+      m_registered(false)
 {}
 
 IOManager::AsyncState::~AsyncState()
@@ -168,42 +179,36 @@ IOManager::AsyncState::resetContext(EventContext &context)
     context.dg = NULL;
 }
 
-IOManager::IOManager(size_t threads, bool useCaller, bool autoStart)
-    : Scheduler(threads, useCaller),
-      m_pendingEventCount(0)
+IOManager::IOManager(size_t threads, bool useCaller, bool autoStart,
+    bool workStealing, bool edgeTriggered)
+    : Scheduler(threads, useCaller, 1, workStealing),
+      TimerManager(ioManagerGranularity()),
+      m_edgeTriggered(edgeTriggered),
+      m_pendingEventCount(0),
+      m_poller(NULL)
 {
     m_epfd = epoll_create(5000);
     MORDOR_LOG_LEVEL(g_log, m_epfd <= 0 ? Log::ERROR : Log::TRACE) << this
         << " epoll_create(5000): " << m_epfd;
     if (m_epfd <= 0)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_create");
-    int rc = pipe(m_tickleFds);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this << " pipe(): "
-        << rc << " (" << lastError() << ")";
-    if (rc) {
+    m_tickleFd = eventfd(0, EFD_NONBLOCK);
+    MORDOR_LOG_LEVEL(g_log, m_tickleFd < 0 ? Log::ERROR : Log::VERBOSE) << this
+        << " eventfd(): " << m_tickleFd << " (" << lastError() << ")";
+    if (m_tickleFd < 0) {
         close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("eventfd");
     }
-    MORDOR_ASSERT(m_tickleFds[0] > 0);
-    MORDOR_ASSERT(m_tickleFds[1] > 0);
     epoll_event event;
     memset(&event, 0, sizeof(epoll_event));
     event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
-    rc = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    if (rc == -1) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
-    }
-    rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+    event.data.fd = m_tickleFd;
+    int rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFds[0]
+        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFd
         << ", EPOLLIN | EPOLLET): " << rc << " (" << lastError() << ")";
     if (rc) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
+        close(m_tickleFd);
         close(m_epfd);
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
     }
@@ -211,8 +216,7 @@ IOManager::IOManager(size_t threads, bool useCaller, bool autoStart)
         try {
             start();
         } catch (...) {
-            close(m_tickleFds[0]);
-            close(m_tickleFds[1]);
+            close(m_tickleFd);
             close(m_epfd);
             throw;
         }
@@ -224,9 +228,8 @@ IOManager::~IOManager()
     stop();
     close(m_epfd);
     MORDOR_LOG_TRACE(g_log) << this << " close(" << m_epfd << ")";
-    close(m_tickleFds[0]);
-    MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFds[0] << ")";
-    close(m_tickleFds[1]);
+    close(m_tickleFd);
+    MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFd << ")";
     // Yes, it would be more C++-esque to store a std::shared_ptr in the
     // vector, but that requires an extra allocation per fd for the counter
     for (size_t i = 0; i < m_pendingEvents.size(); ++i) {
@@ -251,31 +254,61 @@ IOManager::registerEvent(int fd, Event event, std::function<void ()> dg)
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
     // Look up our state in the global map, expanding it if necessary
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
-        m_pendingEvents.resize(fd * 3 / 2);
-    if (!m_pendingEvents[fd - 1]) {
-        m_pendingEvents[fd - 1] = new AsyncState();
-        m_pendingEvents[fd - 1]->m_fd = fd;
+    AsyncState *statePtr;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_pendingEvents.size() < (size_t)fd)
+            m_pendingEvents.resize(fd * 3 / 2);
+        if (!m_pendingEvents[fd - 1]) {
+            m_pendingEvents[fd - 1] = new AsyncState();
+            m_pendingEvents[fd - 1]->m_fd = fd;
+        }
+        statePtr = m_pendingEvents[fd - 1];
     }
-    AsyncState &state = *m_pendingEvents[fd - 1];
+    AsyncState &state = *statePtr;
     MORDOR_ASSERT(fd == state.m_fd);
-    m_mutex.unlock();
 
     std::lock_guard<std::mutex> lock2(state.m_mutex);
 
     MORDOR_ASSERT(!(state.m_events & event));
-    int op = state.m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    epevent.events = EPOLLET | state.m_events | event;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    if (m_edgeTriggered) {
+        if (state.m_ready & event) {
+            // The edge has already gone by; no need to wait for it
+            state.m_ready = (Event)(state.m_ready & ~event);
+            MORDOR_LOG_TRACE(g_log) << this << " " << fd
+                << " already ready for " << (EPOLL_EVENTS)event;
+            if (dg)
+                Scheduler::getThis()->schedule(&dg);
+            else
+                Scheduler::getThis()->schedule(Fiber::getThis());
+            return;
+        }
+        if (!state.m_registered) {
+            epoll_event epevent;
+            epevent.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+            epevent.data.ptr = &state;
+            int rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &epevent);
+            MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+                << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << fd << ", "
+                << (EPOLL_EVENTS)epevent.events << "): " << rc << " ("
+                << lastError() << ")";
+            if (rc)
+                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+            state.m_registered = true;
+        }
+    } else {
+        int op = state.m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        epevent.events = EPOLLET | state.m_events | event;
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
     atomicIncrement(m_pendingEventCount);
     state.m_events = (Event)(state.m_events | event);
     AsyncState::EventContext &context = state.contextForEvent(event);
@@ -296,14 +329,10 @@ IOManager::unregisterEvent(int fd, Event event)
     MORDOR_ASSERT(fd > 0);
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
-        return false;
-    if (!m_pendingEvents[fd - 1])
+    AsyncState *statePtr = existingStateFor(fd);
+    if (!statePtr)
         return false;
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
-    m_mutex.unlock();
+    AsyncState &state = *statePtr;
 
     std::lock_guard<std::mutex> lock2(state.m_mutex);
     if (!(state.m_events & event))
@@ -311,17 +340,20 @@ IOManager::unregisterEvent(int fd, Event event)
 
     MORDOR_ASSERT(fd == state.m_fd);
     Event newEvents = (Event)(state.m_events &~event);
-    int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | newEvents;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    // In edge-triggered mode the fd stays in the epoll set regardless
+    if (!m_edgeTriggered) {
+        int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | newEvents;
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
     atomicDecrement(m_pendingEventCount);
     state.m_events = newEvents;
     AsyncState::EventContext &context = state.contextForEvent(event);
@@ -336,14 +368,10 @@ IOManager::cancelEvent(int fd, Event event)
     MORDOR_ASSERT(fd > 0);
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
+    AsyncState *statePtr = existingStateFor(fd);
+    if (!statePtr)
         return false;
-    if (!m_pendingEvents[fd - 1])
-        return false;
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
-    m_mutex.unlock();
+    AsyncState &state = *statePtr;
 
     std::lock_guard<std::mutex> lock2(state.m_mutex);
     if (!(state.m_events & event))
@@ -351,21 +379,60 @@ IOManager::cancelEvent(int fd, Event event)
 
     MORDOR_ASSERT(fd == state.m_fd);
     Event newEvents = (Event)(state.m_events &~event);
-    int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | newEvents;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    // In edge-triggered mode the fd stays in the epoll set regardless
+    if (!m_edgeTriggered) {
+        int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | newEvents;
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
     state.triggerEvent(event, m_pendingEventCount);
     return true;
 }
 
+void
+IOManager::unregisterFd(int fd)
+{
+    MORDOR_ASSERT(fd > 0);
+    if (!m_edgeTriggered)
+        return;
+    AsyncState *state = existingStateFor(fd);
+    if (!state)
+        return;
+    std::lock_guard<std::mutex> lock(state->m_mutex);
+    MORDOR_ASSERT(!state->m_events);
+    state->m_ready = NONE;
+    if (!state->m_registered)
+        return;
+    state->m_registered = false;
+    // close() only takes the fd out of the epoll set if it is the last
+    // reference to the file.  Called from destructors, so don't throw
+    epoll_event epevent;
+    memset(&epevent, 0, sizeof(epoll_event));
+    int rc = epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, &epevent);
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_DEL, " << fd << "): "
+        << rc << " (" << lastError() << ")";
+}
+
+IOManager::AsyncState *
+IOManager::existingStateFor(int fd)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_pendingEvents.size() < (size_t)fd)
+        return NULL;
+    AsyncState *state = m_pendingEvents[fd - 1];
+    MORDOR_ASSERT(!state || fd == state->m_fd);
+    return state;
+}
+
 bool
 IOManager::stopping(unsigned long long &nextTimeout)
 {
@@ -377,99 +444,203 @@ IOManager::stopping(unsigned long long &nextTimeout)
 void
 IOManager::idle()
 {
+    IdleThread *me;
+    {
+        std::lock_guard<std::mutex> lock(m_idleMutex);
+        me = &idleThreadFor(gettid());
+        me->fd = eventfd(0, 0);
+        MORDOR_LOG_LEVEL(g_log, me->fd < 0 ? Log::ERROR : Log::VERBOSE)
+            << this << " eventfd(): " << me->fd << " (" << lastError() << ")";
+        if (me->fd < 0) {
+            m_idleThreads.erase(gettid());
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("eventfd");
+        }
+        // Work may have been pinned to this thread before it was here to be
+        // tickled (see tickleThread()); look once more before sleeping
+        me->tickled = true;
+    }
+    // Nobody may try to wake this thread once idle() is done with it
+    struct Forget
+    {
+        Forget(IOManager *ioManager, IdleThread *idleThread)
+            : m_ioManager(ioManager), m_idleThread(idleThread)
+        {}
+        ~Forget()
+        {
+            std::lock_guard<std::mutex> lock(m_ioManager->m_idleMutex);
+            MORDOR_ASSERT(m_idleThread->state == IdleThread::RUNNING);
+            close(m_idleThread->fd);
+            m_ioManager->m_idleThreads.erase(gettid());
+        }
+        IOManager *m_ioManager;
+        IdleThread *m_idleThread;
+    } forget(this, me);
+
     epoll_event events[64];
     while (true) {
         unsigned long long nextTimeout;
         if (stopping(nextTimeout))
             return;
-        int rc;
-        int timeout;
-        do {
-            if (nextTimeout != ~0ull)
-                timeout = (int)(nextTimeout / 1000) + 1;
-            else
-                timeout = -1;
-            rc = epoll_wait(m_epfd, events, 64, timeout);
-            if (rc < 0 && errno == EINTR)
-                nextTimeout = nextTimer();
-            else
-                break;
-        } while (true);
-        MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
-            << " epoll_wait(" << m_epfd << ", 64, " << timeout << "): " << rc
-            << " (" << lastError() << ")";
-        if (rc < 0)
-            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_wait");
-        std::vector<std::function<void ()> > expired = processTimers();
-        if (!expired.empty()) {
-            schedule(expired.begin(), expired.end());
-            expired.clear();
+        IdleThread::State role;
+        {
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            if (me->tickled) {
+                me->tickled = false;
+                role = IdleThread::RUNNING;
+            } else if (!m_poller) {
+                m_poller = me;
+                role = me->state = IdleThread::POLLING;
+            } else {
+                m_sleepers.push_back(me);
+                role = me->state = IdleThread::SLEEPING;
+            }
         }
 
-        boost::exception_ptr exception;
-        for(int i = 0; i < rc; ++i) {
-            epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {
-                unsigned char dummy;
-                int rc2;
-                while((rc2 = read(m_tickleFds[0], &dummy, 1)) == 1) {
-                    MORDOR_LOG_VERBOSE(g_log) << this << " received tickle";
-                }
-                MORDOR_VERIFY(rc2 < 0 && errno == EAGAIN);
-                continue;
+        if (role == IdleThread::SLEEPING) {
+            // Whoever wakes us takes us off m_sleepers
+            unsigned long long count;
+            int rc;
+            do {
+                rc = read(me->fd, &count, sizeof(count));
+            } while (rc < 0 && errno == EINTR);
+            MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
+                << " read(" << me->fd << ", 8): " << rc << " ("
+                << lastError() << ")";
+            MORDOR_VERIFY(rc == sizeof(count));
+            bool promoted;
+            {
+                std::lock_guard<std::mutex> lock(m_idleMutex);
+                promoted = me->promoted;
+                me->promoted = false;
             }
-
-            AsyncState &state = *(AsyncState *)event.data.ptr;
-
-            std::lock_guard<std::mutex> lock2(state.m_mutex);
-            MORDOR_LOG_TRACE(g_log) << " epoll_event {"
-                << (EPOLL_EVENTS)event.events << ", " << state.m_fd
-                << "}, registered for " << (EPOLL_EVENTS)state.m_events;
-
-            if (event.events & (EPOLLERR | EPOLLHUP))
-                event.events |= EPOLLIN | EPOLLOUT;
-
-            int incomingEvents = NONE;
-            if (event.events & EPOLLIN)
-                incomingEvents = READ;
-            if (event.events & EPOLLOUT)
-                incomingEvents |= WRITE;
-            if (event.events & EPOLLRDHUP)
-                incomingEvents |= CLOSE;
-
-            // Nothing will be triggered, probably because a prior cancelEvent call
-            // (probably on a different thread) already triggered it, so no
-            // need to tell epoll anything
-            if ((state.m_events & incomingEvents) == NONE)
+            // Go take over polling
+            if (promoted)
+                continue;
+            if (!hasWorkToDo()) {
+                if (!stopping())
+                    g_statSpuriousWakeups.increment();
                 continue;
+            }
+        } else if (role == IdleThread::POLLING) {
+            int rc;
+            int timeout;
+            do {
+                if (nextTimeout != ~0ull)
+                    timeout = (int)(nextTimeout / 1000) + 1;
+                else
+                    timeout = -1;
+                rc = epoll_wait(m_epfd, events, 64, timeout);
+                if (rc < 0 && errno == EINTR)
+                    nextTimeout = nextTimer();
+                else
+                    break;
+            } while (true);
+            error_t error = lastError();
+            {
+                std::lock_guard<std::mutex> lock(m_idleMutex);
+                m_poller = NULL;
+                me->state = IdleThread::RUNNING;
+            }
+            MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
+                << " epoll_wait(" << m_epfd << ", 64, " << timeout << "): " << rc
+                << " (" << error << ")";
+            if (rc < 0)
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "epoll_wait");
+            std::vector<std::function<void ()> > expired = processTimers();
+            bool triggered = !expired.empty();
+            if (!expired.empty()) {
+                schedule(expired.begin(), expired.end());
+                expired.clear();
+            }
 
-            int remainingEvents = (state.m_events & ~incomingEvents);
-            int op = remainingEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | remainingEvents;
-            int rc2 = epoll_ctl(m_epfd, op, state.m_fd, &event);
-            MORDOR_LOG_LEVEL(g_log, rc2 ? Log::ERROR : Log::VERBOSE) << this
-                << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-                << state.m_fd << ", " << (EPOLL_EVENTS)event.events << "): " << rc2
-                << " (" << lastError() << ")";
-            if (rc2) {
-                try {
-                    MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
-                } catch (boost::exception &) {
-                    exception = boost::current_exception();
+            boost::exception_ptr exception;
+            bool tickled = false;
+            for(int i = 0; i < rc; ++i) {
+                epoll_event &event = events[i];
+                if (event.data.fd == m_tickleFd) {
+                    unsigned long long count;
+                    int rc2 = read(m_tickleFd, &count, sizeof(count));
+                    MORDOR_VERIFY(rc2 == sizeof(count) ||
+                        (rc2 < 0 && errno == EAGAIN));
+                    MORDOR_LOG_VERBOSE(g_log) << this << " received tickle";
+                    tickled = true;
                     continue;
                 }
+
+                AsyncState &state = *(AsyncState *)event.data.ptr;
+
+                std::lock_guard<std::mutex> lock2(state.m_mutex);
+                MORDOR_LOG_TRACE(g_log) << " epoll_event {"
+                    << (EPOLL_EVENTS)event.events << ", " << state.m_fd
+                    << "}, registered for " << (EPOLL_EVENTS)state.m_events;
+
+                if (event.events & (EPOLLERR | EPOLLHUP))
+                    event.events |= EPOLLIN | EPOLLOUT;
+
+                int incomingEvents = NONE;
+                if (event.events & EPOLLIN)
+                    incomingEvents = READ;
+                if (event.events & EPOLLOUT)
+                    incomingEvents |= WRITE;
+                if (event.events & EPOLLRDHUP)
+                    incomingEvents |= CLOSE;
+
+                if (m_edgeTriggered) {
+                    // Nobody is waiting for these yet, and there won't be another
+                    // edge, so keep them for the next registerEvent
+                    state.m_ready = (Event)(state.m_ready |
+                        (incomingEvents & ~state.m_events));
+                    if ((state.m_events & incomingEvents) == NONE)
+                        continue;
+                } else {
+                    // Nothing will be triggered, probably because a prior cancelEvent call
+                    // (probably on a different thread) already triggered it, so no
+                    // need to tell epoll anything
+                    if ((state.m_events & incomingEvents) == NONE)
+                        continue;
+
+                    int remainingEvents = (state.m_events & ~incomingEvents);
+                    int op = remainingEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+                    event.events = EPOLLET | remainingEvents;
+                    int rc2 = epoll_ctl(m_epfd, op, state.m_fd, &event);
+                    MORDOR_LOG_LEVEL(g_log, rc2 ? Log::ERROR : Log::VERBOSE) << this
+                        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+                        << state.m_fd << ", " << (EPOLL_EVENTS)event.events << "): " << rc2
+                        << " (" << lastError() << ")";
+                    if (rc2) {
+                        try {
+                            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+                        } catch (boost::exception &) {
+                            exception = boost::current_exception();
+                            continue;
+                        }
+                    }
+                }
+                bool triggered2 = false;
+                if (incomingEvents & READ)
+                    triggered2 = state.triggerEvent(READ, m_pendingEventCount);
+                if (incomingEvents & WRITE)
+                    triggered2 = state.triggerEvent(WRITE, m_pendingEventCount) || triggered2;
+                if (incomingEvents & CLOSE)
+                    triggered2 = state.triggerEvent(CLOSE, m_pendingEventCount) || triggered2;
+                MORDOR_ASSERT(triggered2);
+                triggered = true;
             }
-            bool triggered = false;
-            if (incomingEvents & READ)
-                triggered = state.triggerEvent(READ, m_pendingEventCount);
-            if (incomingEvents & WRITE)
-                triggered = state.triggerEvent(WRITE, m_pendingEventCount) || triggered;
-            if (incomingEvents & CLOSE)
-                triggered = state.triggerEvent(CLOSE, m_pendingEventCount) || triggered;
-            MORDOR_ASSERT(triggered);
+            if (exception)
+                boost::rethrow_exception(exception);
+            // Just a timeout, or a tickle for something that another thread
+            // has already picked up; keep polling
+            if (!triggered && !hasWorkToDo()) {
+                if (tickled && !stopping())
+                    g_statSpuriousWakeups.increment();
+                continue;
+            }
+            // Somebody else needs to be watching for events while we're off
+            // running fibers
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            if (!m_poller && !m_sleepers.empty())
+                wake(*m_sleepers.back(), true);
         }
-        if (exception)
-            boost::rethrow_exception(exception);
         try {
             Fiber::yield();
         } catch (OperationAbortedException &) {
@@ -485,10 +656,87 @@ IOManager::tickle()
         MORDOR_LOG_VERBOSE(g_log) << this << " 0 idle thread, no tickle.";
         return;
     }
-    int rc = write(m_tickleFds[1], "T", 1);
-    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << m_tickleFds[1] << ", 1): "
+    {
+        std::lock_guard<std::mutex> lock(m_idleMutex);
+        // A sleeper can run the work without anyone having to take over
+        // polling for it
+        if (!m_sleepers.empty()) {
+            wake(*m_sleepers.back(), false);
+            return;
+        }
+    }
+    ticklePoller();
+}
+
+void
+IOManager::tickleThread(tid_t thread)
+{
+    if (!hasIdleThreads()) {
+        MORDOR_LOG_VERBOSE(g_log) << this << " 0 idle thread, no tickle.";
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_idleMutex);
+        if (IdleThread *idleThread = existingIdleThreadFor(thread)) {
+            switch (idleThread->state) {
+                case IdleThread::SLEEPING:
+                    wake(*idleThread, false);
+                    return;
+                case IdleThread::RUNNING:
+                    // It'll look for work before it goes idle again
+                    idleThread->tickled = true;
+                    return;
+                case IdleThread::POLLING:
+                    ticklePoller();
+                    return;
+            }
+        }
+    }
+    // Not in idle(), so it will look for work before it sleeps there (or
+    // it's not one of ours at all, or has exited); wake whoever is idle
+    tickle();
+}
+
+IOManager::IdleThread &
+IOManager::idleThreadFor(tid_t thread)
+{
+    // Only idle() creates these, for its own thread
+    MORDOR_ASSERT(m_idleThreads.find(thread) == m_idleThreads.end());
+    return m_idleThreads[thread];
+}
+
+IOManager::IdleThread *
+IOManager::existingIdleThreadFor(tid_t thread)
+{
+    std::map<tid_t, IdleThread>::iterator it = m_idleThreads.find(thread);
+    return it == m_idleThreads.end() ? NULL : &it->second;
+}
+
+void
+IOManager::wake(IdleThread &idleThread, bool promote)
+{
+    MORDOR_ASSERT(idleThread.state == IdleThread::SLEEPING);
+    std::vector<IdleThread *>::iterator it =
+        std::find(m_sleepers.begin(), m_sleepers.end(), &idleThread);
+    MORDOR_ASSERT(it != m_sleepers.end());
+    m_sleepers.erase(it);
+    idleThread.state = IdleThread::RUNNING;
+    idleThread.promoted = promote;
+    unsigned long long count = 1;
+    int rc = write(idleThread.fd, &count, sizeof(count));
+    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << idleThread.fd
+        << ", 8): " << rc << " (" << lastError() << ")";
+    MORDOR_VERIFY(rc == sizeof(count));
+}
+
+void
+IOManager::ticklePoller()
+{
+    unsigned long long count = 1;
+    int rc = write(m_tickleFd, &count, sizeof(count));
+    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << m_tickleFd << ", 8): "
         << rc << " (" << lastError() << ")";
-    MORDOR_VERIFY(rc == 1);
+    MORDOR_VERIFY(rc == sizeof(count));
 }
 
 }
@@ -2,6 +2,7 @@
 #define __MORDOR_IOMANAGER_EPOLL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <map>
 #include <mutex>
 
 #include "util.h"
@@ -49,17 +50,52 @@ private:
         int m_fd;
         EventContext m_in, m_out, m_close;
         Event m_events;
+        // Edge-triggered mode only: readiness reported while nobody was
+        // waiting for it, and whether m_fd has been added to the epoll set
+        Event m_ready;
+        bool m_registered;
         std::mutex m_mutex;
 
     private:
         void asyncResetContext(EventContext&);
     };
 
+    /// Wakeup state for one of our threads
+
+    /// Only one idle thread at a time (the poller) waits in epoll_wait; the
+    /// rest block reading their own eventfd, so that tickles can wake exactly
+    /// one of them, or the specific thread that new work is pinned to
+    struct IdleThread
+    {
+        enum State {
+            RUNNING,
+            POLLING,
+            SLEEPING
+        };
+
+        IdleThread() : fd(-1), state(RUNNING), tickled(false),
+            promoted(false) {}
+        int fd;
+        State state;
+        /// Tickled while RUNNING; don't go to sleep
+        bool tickled;
+        /// Woken to take over polling, rather than to run anything
+        bool promoted;
+    };
+
 public:
     /// @param autoStart  whether call the start() automatically in constructor
     /// @note @p autoStart provides a more friendly behavior for derived class
     ///      that inherits from IOManager
-    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true);
+    /// @param workStealing  see Scheduler::Scheduler
+    /// @param edgeTriggered  add each fd to epoll once, for all events, and
+    ///      remember readiness that arrives while nobody is waiting for it;
+    ///      registering for an event that is already latched then costs no
+    ///      epoll_ctl at all
+    /// @note In edge-triggered mode, unregisterFd must be called before
+    ///      closing any fd that has been passed to registerEvent
+    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true,
+        bool workStealing = false, bool edgeTriggered = false);
     ~IOManager();
 
     bool stopping();
@@ -71,20 +107,39 @@ public:
     bool unregisterEvent(int fd, Event events);
     /// Will cause the event to fire
     bool cancelEvent(int fd, Event events);
+    /// Forget everything known about fd, which is about to be closed
+    /// @pre No events are registered for fd
+    void unregisterFd(int fd);
 
 protected:
     bool stopping(unsigned long long &nextTimeout);
     void idle();
     void tickle();
+    void tickleThread(tid_t thread);
+
+    void onTimerInsertedAtFront() { ticklePoller(); }
 
-    void onTimerInsertedAtFront() { tickle(); }
+private:
+    AsyncState *existingStateFor(int fd);
+    IdleThread &idleThreadFor(tid_t thread);
+    /// NULL if thread isn't in idle()
+    IdleThread *existingIdleThreadFor(tid_t thread);
+    /// @pre m_idleMutex is locked
+    void wake(IdleThread &idleThread, bool promote);
+    void ticklePoller();
 
 private:
+    bool m_edgeTriggered;
     int m_epfd;
-    int m_tickleFds[2];
+    int m_tickleFd;
     size_t m_pendingEventCount;
     std::mutex m_mutex;
     std::vector<AsyncState *> m_pendingEvents;
+
+    std::mutex m_idleMutex;
+    std::map<tid_t, IdleThread> m_idleThreads;
+    std::vector<IdleThread *> m_sleepers;
+    IdleThread *m_poller;
 };
 
 }
@@ -218,8 +218,10 @@ IOManager::WaitBlock::removeEntry(int index)
     memmove(&m_recurring[index], &m_recurring[index + 1], (m_inUseCount - index) * sizeof(bool));
 }
 
-IOManager::IOManager(size_t threads, bool useCaller, bool autoStart)
-    : Scheduler(threads, useCaller)
+IOManager::IOManager(size_t threads, bool useCaller, bool autoStart,
+    bool workStealing)
+    : Scheduler(threads, useCaller, 1, workStealing),
+      TimerManager(ioManagerGranularity())
 {
     m_pendingEventCount = 0;
     m_hCompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
@@ -61,7 +61,8 @@ private:
     };
 
 public:
-    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true);
+    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true,
+        bool workStealing = false);
     ~IOManager();
 
     bool stopping();
@@ -15,8 +15,10 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
-IOManager::IOManager(size_t threads, bool useCaller, bool autoStart)
-    : Scheduler(threads, useCaller)
+IOManager::IOManager(size_t threads, bool useCaller, bool autoStart,
+    bool workStealing)
+    : Scheduler(threads, useCaller, 1, workStealing),
+      TimerManager(ioManagerGranularity())
 {
     m_kqfd = kqueue();
     MORDOR_LOG_LEVEL(g_log, m_kqfd <= 0 ? Log::ERROR : Log::TRACE) << this
@@ -37,7 +37,8 @@ private:
     };
 
 public:
-    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true);
+    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true,
+        bool workStealing = false);
     ~IOManager();
 
     bool stopping();
@@ -45,6 +46,8 @@ public:
     void registerEvent(int fd, Event events, std::function<void ()> dg = NULL);
     void cancelEvent(int fd, Event events);
     void unregisterEvent(int fd, Event events);
+    /// Nothing is kept registered between events; see iomanager_epoll.h
+    void unregisterFd(int fd) {}
 
 protected:
     bool stopping(unsigned long long &nextTimeout);
@@ -0,0 +1,684 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "pch.h"
+
+#if defined(LINUX) && defined(MORDOR_IO_URING)
+
+#include "iomanager_uring.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <boost/exception_ptr.hpp>
+
+#include "assert.h"
+#include "atomic.h"
+#include "config.h"
+#include "fiber.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:iomanager");
+
+static ConfigVar<unsigned int>::ptr g_entries = Config::lookup<unsigned int>(
+    "iomanager.uring.entries", 256u,
+    "Number of submission queue entries in each IOManager's io_uring");
+
+// user_data of completions that aren't tagged AsyncState pointers; nobody
+// cares about the result of a POLL_REMOVE or ASYNC_CANCEL
+static const unsigned long long IGNORE_USER_DATA = 0;
+static const unsigned long long TICKLE_USER_DATA = 1;
+// AsyncState pointers are tagged with which event the completion is for, and
+// whether it's for an AsyncEvent (as opposed to a readiness poll)
+static const unsigned long long EVENT_MASK = 0x3;
+static const unsigned long long ASYNC_FLAG = 0x4;
+
+static unsigned long long
+tagFor(const void *state, IOManager::Event event, bool async = false)
+{
+    unsigned long long result = (uintptr_t)state;
+    MORDOR_ASSERT(!(result & (EVENT_MASK | ASYNC_FLAG)));
+    switch (event) {
+        case IOManager::READ:
+            result |= 1;
+            break;
+        case IOManager::WRITE:
+            result |= 2;
+            break;
+        case IOManager::CLOSE:
+            result |= 3;
+            break;
+        default:
+            MORDOR_NOTREACHED();
+    }
+    if (async)
+        result |= ASYNC_FLAG;
+    return result;
+}
+
+static IOManager::Event
+eventFor(unsigned long long tag)
+{
+    switch (tag & EVENT_MASK) {
+        case 1:
+            return IOManager::READ;
+        case 2:
+            return IOManager::WRITE;
+        case 3:
+            return IOManager::CLOSE;
+        default:
+            MORDOR_NOTREACHED();
+    }
+}
+
+static int
+io_uring_setup(unsigned int entries, io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(int fd, unsigned int toSubmit, unsigned int minComplete,
+    unsigned int flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+        arg, argsz);
+}
+
+AsyncEvent::AsyncEvent()
+    : result(0)
+{
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+}
+
+void
+AsyncEvent::prepare(int opcode, const void *addr, unsigned int len,
+    unsigned long long offset)
+{
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = (__u8)opcode;
+    sqe.addr = (uintptr_t)addr;
+    sqe.len = len;
+    sqe.off = offset;
+    result = 0;
+}
+
+IOManager::AsyncState::AsyncState()
+    : m_fd(0),
+      m_events(NONE)
+{}
+
+IOManager::AsyncState::~AsyncState()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    MORDOR_ASSERT(!m_events);
+}
+
+IOManager::AsyncState::EventContext &
+IOManager::AsyncState::contextForEvent(Event event)
+{
+    switch (event) {
+        case READ:
+            return m_in;
+        case WRITE:
+            return m_out;
+        case CLOSE:
+            return m_close;
+        default:
+            MORDOR_NOTREACHED();
+    }
+}
+
+bool
+IOManager::AsyncState::triggerEvent(Event event, size_t &pendingEventCount)
+{
+    if (!(m_events & event))
+        return false;
+    m_events = (Event)(m_events & ~event);
+    atomicDecrement(pendingEventCount);
+    EventContext &context = contextForEvent(event);
+    if (context.dg) {
+        context.scheduler->schedule(&context.dg);
+    } else {
+        context.scheduler->schedule(&context.fiber);
+    }
+    context.scheduler = NULL;
+    return true;
+}
+
+void
+IOManager::AsyncState::asyncResetContext(AsyncState::EventContext& context)
+{
+    // Taking m_mutex makes sure this runs after whoever called
+    // resetContext is done with the state
+    std::lock_guard<std::mutex> lock(m_mutex);
+    context.fiber.reset();
+    context.dg = NULL;
+}
+
+void
+IOManager::AsyncState::resetContext(EventContext &context)
+{
+    // asynchronously reset fiber/dg to avoid destroying in IOManager::idle;
+    // the caller holds m_mutex, so the reset can't run until it's released
+    context.scheduler->schedule(boost::bind(
+        &IOManager::AsyncState::asyncResetContext, this, context));
+    context.scheduler = NULL;
+    context.fiber.reset();
+    context.dg = NULL;
+}
+
+IOManager::IOManager(size_t threads, bool useCaller, bool autoStart,
+    bool workStealing)
+    : Scheduler(threads, useCaller, 1, workStealing),
+      TimerManager(ioManagerGranularity()),
+      m_ringfd(-1),
+      m_tickleFd(-1),
+      m_tickleValue(0),
+      m_sqes((io_uring_sqe *)MAP_FAILED),
+      m_sqRing(MAP_FAILED),
+      m_cqRing(MAP_FAILED),
+      m_pendingEventCount(0)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
+    m_ringfd = io_uring_setup(g_entries->val(), &params);
+    MORDOR_LOG_LEVEL(g_log, m_ringfd < 0 ? Log::ERROR : Log::TRACE) << this
+        << " io_uring_setup(" << g_entries->val() << "): " << m_ringfd
+        << " (" << lastError() << ")";
+    if (m_ringfd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_setup");
+    try {
+        // idle() relies on io_uring_enter accepting a timeout (Linux 5.11)
+        if (!(params.features & IORING_FEAT_EXT_ARG))
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(ENOSYS, "io_uring_enter");
+
+        m_sqRingSize = params.sq_off.array +
+            params.sq_entries * sizeof(unsigned int);
+        m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+        m_cqRingSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(io_uring_cqe);
+        m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+        m_sqEntries = params.sq_entries;
+        m_sqes = (io_uring_sqe *)mmap(NULL,
+            m_sqEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES);
+        if (m_sqes == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+
+        char *sqRing = (char *)m_sqRing;
+        m_sqHead = (unsigned int *)(sqRing + params.sq_off.head);
+        m_sqTail = (unsigned int *)(sqRing + params.sq_off.tail);
+        m_sqMask = *(unsigned int *)(sqRing + params.sq_off.ring_mask);
+        m_sqArray = (unsigned int *)(sqRing + params.sq_off.array);
+        char *cqRing = (char *)m_cqRing;
+        m_cqHead = (unsigned int *)(cqRing + params.cq_off.head);
+        m_cqTail = (unsigned int *)(cqRing + params.cq_off.tail);
+        m_cqMask = *(unsigned int *)(cqRing + params.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe *)(cqRing + params.cq_off.cqes);
+
+        m_tickleFd = eventfd(0, EFD_CLOEXEC);
+        MORDOR_LOG_LEVEL(g_log, m_tickleFd < 0 ? Log::ERROR : Log::VERBOSE)
+            << this << " eventfd(): " << m_tickleFd << " (" << lastError()
+            << ")";
+        if (m_tickleFd < 0)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("eventfd");
+        armTickle();
+        if (autoStart)
+            start();
+    } catch (...) {
+        closeRing();
+        throw;
+    }
+}
+
+IOManager::~IOManager()
+{
+    stop();
+    closeRing();
+    // Yes, it would be more C++-esque to store a std::shared_ptr in the
+    // vector, but that requires an extra allocation per fd for the counter
+    for (size_t i = 0; i < m_pendingEvents.size(); ++i) {
+        if (m_pendingEvents[i])
+            delete m_pendingEvents[i];
+    }
+}
+
+void
+IOManager::closeRing()
+{
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqEntries * sizeof(io_uring_sqe));
+    if (m_cqRing != MAP_FAILED)
+        munmap(m_cqRing, m_cqRingSize);
+    if (m_sqRing != MAP_FAILED)
+        munmap(m_sqRing, m_sqRingSize);
+    // Closing the ring cancels anything still in flight
+    if (m_ringfd >= 0) {
+        close(m_ringfd);
+        MORDOR_LOG_TRACE(g_log) << this << " close(" << m_ringfd << ")";
+    }
+    if (m_tickleFd >= 0) {
+        close(m_tickleFd);
+        MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFd << ")";
+    }
+}
+
+bool
+IOManager::stopping()
+{
+    unsigned long long timeout;
+    return stopping(timeout);
+}
+
+IOManager::AsyncState &
+IOManager::stateFor(int fd)
+{
+    // Look up our state in the global map, expanding it if necessary
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_pendingEvents.size() < (size_t)fd)
+        m_pendingEvents.resize(fd * 3 / 2);
+    if (!m_pendingEvents[fd - 1]) {
+        m_pendingEvents[fd - 1] = new AsyncState();
+        m_pendingEvents[fd - 1]->m_fd = fd;
+    }
+    MORDOR_ASSERT(fd == m_pendingEvents[fd - 1]->m_fd);
+    return *m_pendingEvents[fd - 1];
+}
+
+IOManager::AsyncState *
+IOManager::existingStateFor(int fd)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_pendingEvents.size() < (size_t)fd)
+        return NULL;
+    return m_pendingEvents[fd - 1];
+}
+
+void
+IOManager::registerEvent(int fd, Event event, std::function<void ()> dg)
+{
+    MORDOR_ASSERT(fd > 0);
+    MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(dg || Fiber::getThis());
+    MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
+
+    AsyncState &state = stateFor(fd);
+    {
+        std::lock_guard<std::mutex> lock(state.m_mutex);
+        MORDOR_ASSERT(!(state.m_events & event));
+        AsyncState::EventContext &context = state.contextForEvent(event);
+        MORDOR_ASSERT(!context.scheduler);
+        MORDOR_ASSERT(!context.fiber);
+        MORDOR_ASSERT(!context.dg);
+        MORDOR_ASSERT(!context.async);
+        // A poll left behind by an earlier registration does just as well
+        // (if it was asked to go away, complete() re-arms it)
+        if (!context.pollArmed)
+            submitPoll(state, event);
+        atomicIncrement(m_pendingEventCount);
+        state.m_events = (Event)(state.m_events | event);
+        context.scheduler = Scheduler::getThis();
+        if (dg) {
+            context.dg.swap(dg);
+        } else {
+            context.fiber = Fiber::getThis();
+        }
+    }
+    // Nobody on this thread is going to go idle on our ring any time soon
+    if (Scheduler::getThis() != this)
+        flush();
+}
+
+void
+IOManager::registerEvent(int fd, Event event, AsyncEvent *e)
+{
+    MORDOR_ASSERT(fd > 0);
+    MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(Fiber::getThis());
+    MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
+    MORDOR_ASSERT(e);
+
+    AsyncState &state = stateFor(fd);
+    {
+        std::lock_guard<std::mutex> lock(state.m_mutex);
+        MORDOR_ASSERT(!(state.m_events & event));
+        AsyncState::EventContext &context = state.contextForEvent(event);
+        MORDOR_ASSERT(!context.scheduler);
+        MORDOR_ASSERT(!context.fiber);
+        MORDOR_ASSERT(!context.dg);
+        MORDOR_ASSERT(!context.async);
+        e->sqe.fd = fd;
+        e->sqe.user_data = tagFor(&state, event, true);
+        queue(e->sqe);
+        atomicIncrement(m_pendingEventCount);
+        state.m_events = (Event)(state.m_events | event);
+        context.scheduler = Scheduler::getThis();
+        context.fiber = Fiber::getThis();
+        context.async = e;
+    }
+    if (Scheduler::getThis() != this)
+        flush();
+}
+
+bool
+IOManager::unregisterEvent(int fd, Event event)
+{
+    MORDOR_ASSERT(fd > 0);
+    MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
+
+    AsyncState *state = existingStateFor(fd);
+    if (!state)
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(state->m_mutex);
+        if (!(state->m_events & event))
+            return false;
+        AsyncState::EventContext &context = state->contextForEvent(event);
+        // The kernel may already be writing into the operation's buffers;
+        // it can only be cancelled
+        MORDOR_ASSERT(!context.async);
+        submitRemove(*state, event);
+        atomicDecrement(m_pendingEventCount);
+        state->m_events = (Event)(state->m_events & ~event);
+        // spawn a dedicated fiber to do the cleanup
+        state->resetContext(context);
+    }
+    if (Scheduler::getThis() != this)
+        flush();
+    return true;
+}
+
+bool
+IOManager::cancelEvent(int fd, Event event)
+{
+    MORDOR_ASSERT(fd > 0);
+    MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
+
+    AsyncState *state = existingStateFor(fd);
+    if (!state)
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(state->m_mutex);
+        if (!(state->m_events & event))
+            return false;
+        AsyncState::EventContext &context = state->contextForEvent(event);
+        if (context.async) {
+            // The waiting fiber is resumed once the operation completes
+            // (with -ECANCELED, unless it beat us to it)
+            io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(io_uring_sqe));
+            sqe.opcode = IORING_OP_ASYNC_CANCEL;
+            sqe.fd = -1;
+            sqe.addr = tagFor(state, event, true);
+            sqe.user_data = IGNORE_USER_DATA;
+            queue(sqe);
+        } else {
+            submitRemove(*state, event);
+            state->triggerEvent(event, m_pendingEventCount);
+        }
+    }
+    if (Scheduler::getThis() != this)
+        flush();
+    return true;
+}
+
+bool
+IOManager::stopping(unsigned long long &nextTimeout)
+{
+    nextTimeout = nextTimer();
+    return nextTimeout == ~0ull && Scheduler::stopping() &&
+        m_pendingEventCount == 0;
+}
+
+void
+IOManager::submitPoll(AsyncState &state, Event event)
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = state.m_fd;
+    // POLL_ADD is one shot, just like the EPOLL_CTL_DEL/MOD dance in
+    // iomanager_epoll.cpp; POLLERR and POLLHUP are always reported
+    switch (event) {
+        case READ:
+            sqe.poll32_events = POLLIN;
+            break;
+        case WRITE:
+            sqe.poll32_events = POLLOUT;
+            break;
+        case CLOSE:
+            sqe.poll32_events = POLLRDHUP;
+            break;
+        default:
+            MORDOR_NOTREACHED();
+    }
+    sqe.user_data = tagFor(&state, event);
+    queue(sqe);
+    state.contextForEvent(event).pollArmed = true;
+}
+
+void
+IOManager::submitRemove(AsyncState &state, Event event)
+{
+    if (!state.contextForEvent(event).pollArmed)
+        return;
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = IORING_OP_POLL_REMOVE;
+    sqe.fd = -1;
+    sqe.addr = tagFor(&state, event);
+    sqe.user_data = IGNORE_USER_DATA;
+    queue(sqe);
+}
+
+void
+IOManager::armTickle()
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = m_tickleFd;
+    sqe.addr = (uintptr_t)&m_tickleValue;
+    sqe.len = sizeof(m_tickleValue);
+    sqe.user_data = TICKLE_USER_DATA;
+    queue(sqe);
+}
+
+unsigned int
+IOManager::unsubmitted() const
+{
+    // The kernel advances the head as it consumes entries, so this is what's
+    // actually waiting, whoever it was queued or submitted by
+    return *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+}
+
+void
+IOManager::queue(const io_uring_sqe &sqe)
+{
+    std::lock_guard<std::mutex> lock(m_sqMutex);
+    // Full; hand everything to the kernel now rather than waiting for
+    // idle().  idle() may be submitting too, without the lock; the kernel
+    // only ever takes what's actually there, so either way it gets it all
+    while (unsubmitted() == m_sqEntries) {
+        int rc = io_uring_enter(m_ringfd, m_sqEntries, 0, 0, NULL, 0);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE)
+            << this << " io_uring_enter(" << m_ringfd << ", "
+            << m_sqEntries << ", 0): " << rc << " (" << lastError() << ")";
+        if (rc < 0)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_enter");
+    }
+    unsigned int tail = *m_sqTail;
+    unsigned int index = tail & m_sqMask;
+    m_sqes[index] = sqe;
+    m_sqArray[index] = index;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void
+IOManager::flush()
+{
+    std::lock_guard<std::mutex> lock(m_sqMutex);
+    while (unsigned int toSubmit = unsubmitted()) {
+        int rc = io_uring_enter(m_ringfd, toSubmit, 0, 0, NULL, 0);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
+            << " io_uring_enter(" << m_ringfd << ", " << toSubmit
+            << ", 0): " << rc << " (" << lastError() << ")";
+        if (rc < 0)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_enter");
+        if (rc == 0)
+            break;
+    }
+}
+
+size_t
+IOManager::reap(io_uring_cqe *cqes, size_t count)
+{
+    std::lock_guard<std::mutex> lock(m_cqMutex);
+    unsigned int head = *m_cqHead;
+    unsigned int tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    size_t result = 0;
+    while (head != tail && result < count)
+        cqes[result++] = m_cqes[head++ & m_cqMask];
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    return result;
+}
+
+void
+IOManager::complete(const io_uring_cqe &cqe)
+{
+    if (cqe.user_data == IGNORE_USER_DATA)
+        return;
+    if (cqe.user_data == TICKLE_USER_DATA) {
+        MORDOR_LOG_VERBOSE(g_log) << this << " received tickle";
+        armTickle();
+        return;
+    }
+
+    AsyncState &state =
+        *(AsyncState *)(uintptr_t)(cqe.user_data & ~(EVENT_MASK | ASYNC_FLAG));
+    Event event = eventFor(cqe.user_data);
+    std::lock_guard<std::mutex> lock(state.m_mutex);
+    MORDOR_LOG_TRACE(g_log) << " io_uring_cqe {" << state.m_fd << ", "
+        << event << ((cqe.user_data & ASYNC_FLAG) ? " (async)" : "") << ", "
+        << cqe.res << "}, registered for " << state.m_events;
+    AsyncState::EventContext &context = state.contextForEvent(event);
+
+    if (cqe.user_data & ASYNC_FLAG) {
+        MORDOR_ASSERT(context.async);
+        MORDOR_ASSERT(state.m_events & event);
+        context.async->result = cqe.res;
+        context.async = NULL;
+        state.triggerEvent(event, m_pendingEventCount);
+        return;
+    }
+
+    context.pollArmed = false;
+    // Unregistered or cancelled since, or an AsyncEvent has taken over
+    if (!(state.m_events & event) || context.async)
+        return;
+    // Removal of the poll for a previous registration caught up with it
+    // after it had been reused by this one
+    if (cqe.res == -ECANCELED) {
+        submitPoll(state, event);
+        return;
+    }
+    state.triggerEvent(event, m_pendingEventCount);
+}
+
+void
+IOManager::idle()
+{
+    io_uring_cqe cqes[64];
+    while (true) {
+        unsigned long long nextTimeout;
+        if (stopping(nextTimeout))
+            return;
+        size_t count = reap(cqes, 64);
+        // Only wait if nothing has already completed; this is also where
+        // whatever was queued since last time gets submitted, in one go
+        if (count == 0) {
+            // Anything that doesn't make it in (or that queue() submits
+            // first) is still counted by unsubmitted() next time
+            unsigned int toSubmit;
+            {
+                std::lock_guard<std::mutex> lock(m_sqMutex);
+                toSubmit = unsubmitted();
+            }
+            unsigned int flags = IORING_ENTER_GETEVENTS;
+            io_uring_getevents_arg arg;
+            __kernel_timespec ts;
+            memset(&arg, 0, sizeof(io_uring_getevents_arg));
+            if (nextTimeout != ~0ull) {
+                ts.tv_sec = nextTimeout / 1000000;
+                ts.tv_nsec = (nextTimeout % 1000000) * 1000;
+                arg.ts = (uintptr_t)&ts;
+            }
+            flags |= IORING_ENTER_EXT_ARG;
+            int rc = io_uring_enter(m_ringfd, toSubmit, 1, flags, &arg,
+                sizeof(io_uring_getevents_arg));
+            error_t error = lastError();
+            MORDOR_LOG_LEVEL(g_log, rc < 0 && error != ETIME && error != EINTR ?
+                Log::ERROR : Log::VERBOSE) << this << " io_uring_enter("
+                << m_ringfd << ", " << toSubmit << ", 1, " << nextTimeout
+                << "): " << rc << " (" << error << ")";
+            // ETIME is the timeout expiring; EBUSY means the completion
+            // queue has to be drained before anything more can be submitted
+            if (rc < 0 && error != ETIME && error != EINTR && error != EBUSY &&
+                error != EAGAIN)
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "io_uring_enter");
+            count = reap(cqes, 64);
+        }
+        std::vector<std::function<void ()> > expired = processTimers();
+        if (!expired.empty()) {
+            schedule(expired.begin(), expired.end());
+            expired.clear();
+        }
+
+        boost::exception_ptr exception;
+        for (size_t i = 0; i < count; ++i) {
+            try {
+                complete(cqes[i]);
+            } catch (boost::exception &) {
+                exception = boost::current_exception();
+            }
+        }
+        if (exception)
+            boost::rethrow_exception(exception);
+        try {
+            Fiber::yield();
+        } catch (OperationAbortedException &) {
+            return;
+        }
+    }
+}
+
+void
+IOManager::tickle()
+{
+    if (!hasIdleThreads()) {
+        MORDOR_LOG_VERBOSE(g_log) << this << " 0 idle thread, no tickle.";
+        return;
+    }
+    unsigned long long value = 1;
+    int rc = write(m_tickleFd, &value, sizeof(value));
+    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << m_tickleFd << ", "
+        << sizeof(value) << "): " << rc << " (" << lastError() << ")";
+    MORDOR_VERIFY(rc == sizeof(value));
+}
+
+}
+
+#endif
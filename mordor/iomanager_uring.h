@@ -0,0 +1,159 @@
+#ifndef __MORDOR_IOMANAGER_URING_H__
+#define __MORDOR_IOMANAGER_URING_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <mutex>
+
+#include <linux/io_uring.h>
+
+#include "util.h"
+
+#include "scheduler.h"
+#include "timer.h"
+#include "version.h"
+
+#ifndef LINUX
+#error IOManagerURing is Linux only
+#endif
+
+namespace Mordor {
+
+class Fiber;
+
+/// An operation to be performed by the kernel on the IOManager's io_uring
+
+/// Fill in sqe (the fd, user_data and flags fields are taken care of by
+/// IOManager::registerEvent), register it, and yield; once the fiber is
+/// resumed, result holds what the equivalent syscall would have returned, or
+/// -errno.
+struct AsyncEvent
+{
+    AsyncEvent();
+
+    /// Reset sqe for a new operation
+    void prepare(int opcode, const void *addr = NULL, unsigned int len = 0,
+        unsigned long long offset = 0);
+
+    io_uring_sqe sqe;
+    int result;
+};
+
+class IOManager : public Scheduler, public TimerManager
+{
+public:
+    enum Event {
+        NONE  = 0x0000,
+        READ  = 0x0001,
+        WRITE = 0x0004,
+        CLOSE = 0x2000
+    };
+
+private:
+    struct AsyncState : Mordor::noncopyable
+    {
+        AsyncState();
+        ~AsyncState();
+
+        struct EventContext
+        {
+            EventContext() : scheduler(NULL), async(NULL), pollArmed(false) {}
+            Scheduler *scheduler;
+            std::shared_ptr<Fiber> fiber;
+            std::function<void ()> dg;
+            // The operation in flight, if this is a completion rather than
+            // a readiness registration
+            AsyncEvent *async;
+            // Whether a POLL_ADD for this event is still owned by the kernel
+            // (possibly one that has been asked to go away, but hasn't yet)
+            bool pollArmed;
+        };
+
+        EventContext &contextForEvent(Event event);
+        bool triggerEvent(Event event, size_t &pendingEventCount);
+        void resetContext(EventContext &);
+
+        int m_fd;
+        EventContext m_in, m_out, m_close;
+        Event m_events;
+        std::mutex m_mutex;
+
+    private:
+        void asyncResetContext(EventContext&);
+    };
+
+public:
+    /// @param autoStart  whether call the start() automatically in constructor
+    /// @note @p autoStart provides a more friendly behavior for derived class
+    ///      that inherits from IOManager
+    /// @param workStealing  see Scheduler::Scheduler
+    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true,
+        bool workStealing = false);
+    ~IOManager();
+
+    bool stopping();
+
+    void registerEvent(int fd, Event events,
+        std::function<void ()> dg = NULL);
+    /// Submit e->sqe against fd; the current fiber will be rescheduled once
+    /// it completes.  At most one operation (or readiness registration) per
+    /// fd and event may be outstanding at a time.
+    /// @note Submission is deferred until this thread next goes idle, so that
+    /// it can be batched with others into a single io_uring_enter
+    void registerEvent(int fd, Event event, AsyncEvent *e);
+    /// Will not cause the event to fire
+    /// @return If the event was successfully unregistered before firing normally
+    /// @pre No AsyncEvent is outstanding for fd and event
+    bool unregisterEvent(int fd, Event events);
+    /// Will cause the event to fire; an outstanding AsyncEvent is cancelled,
+    /// and completes with -ECANCELED unless it already finished
+    bool cancelEvent(int fd, Event events);
+    /// Nothing is kept registered between events; see iomanager_epoll.h
+    void unregisterFd(int fd) {}
+
+protected:
+    bool stopping(unsigned long long &nextTimeout);
+    void idle();
+    void tickle();
+
+    void onTimerInsertedAtFront() { tickle(); }
+
+private:
+    void closeRing();
+    AsyncState &stateFor(int fd);
+    AsyncState *existingStateFor(int fd);
+    void submitPoll(AsyncState &state, Event event);
+    void submitRemove(AsyncState &state, Event event);
+    void armTickle();
+    /// Queued, but not yet consumed by the kernel; m_sqMutex must be held
+    unsigned int unsubmitted() const;
+    void queue(const io_uring_sqe &sqe);
+    void flush();
+    size_t reap(io_uring_cqe *cqes, size_t count);
+    void complete(const io_uring_cqe &cqe);
+
+private:
+    int m_ringfd;
+    int m_tickleFd;
+    unsigned long long m_tickleValue;
+
+    // Submission queue, protected by m_sqMutex
+    std::mutex m_sqMutex;
+    unsigned int *m_sqHead, *m_sqTail, *m_sqArray;
+    unsigned int m_sqMask, m_sqEntries;
+    io_uring_sqe *m_sqes;
+    // Completion queue, protected by m_cqMutex
+    std::mutex m_cqMutex;
+    unsigned int *m_cqHead, *m_cqTail;
+    unsigned int m_cqMask;
+    io_uring_cqe *m_cqes;
+    void *m_sqRing, *m_cqRing;
+    size_t m_sqRingSize, m_cqRingSize;
+
+    size_t m_pendingEventCount;
+    std::mutex m_mutex;
+    std::vector<AsyncState *> m_pendingEvents;
+};
+
+}
+
+#endif
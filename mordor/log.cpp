@@ -63,12 +63,16 @@ static struct LogInitializer
     {
         g_start = TimerManager::now();
 
-        g_logError->monitor(&enableLoggers);
-        g_logWarn->monitor(&enableLoggers);
-        g_logInfo->monitor(&enableLoggers);
-        g_logVerbose->monitor(&enableLoggers);
-        g_logDebug->monitor(&enableLoggers);
-        g_logTrace->monitor(&enableLoggers);
+        // Re-matching every logger once per batch of changes, rather than
+        // once for each of them
+        std::vector<ConfigVarBase::ptr> levels;
+        levels.push_back(g_logError);
+        levels.push_back(g_logWarn);
+        levels.push_back(g_logInfo);
+        levels.push_back(g_logVerbose);
+        levels.push_back(g_logDebug);
+        levels.push_back(g_logTrace);
+        Config::monitor(levels, &enableLoggers);
 
         g_logStdout->monitor(&enableStdoutLogging);
 #ifdef WINDOWS
@@ -2,10 +2,18 @@
 
 #include "log_file.h"
 
+#include <string.h>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 
+#include "mordor/atomic.h"
 #include "mordor/config.h"
+#include "mordor/per_thread.h"
+#include "mordor/statistics.h"
+#include "mordor/streams/buffer.h"
 #include "mordor/streams/file.h"
+#include "mordor/thread.h"
 
 namespace Mordor {
 
@@ -13,6 +21,30 @@ static void enableFileLogging();
 
 static ConfigVar<std::string>::ptr g_logFile =
     Config::lookup("log.file", std::string(), "Log to file");
+static ConfigVar<bool>::ptr g_logFileAsync =
+    Config::lookup("log.fileasync", false,
+    "Write to the log file from a background thread, instead of from "
+    "whichever thread logged the message");
+static ConfigVar<size_t>::ptr g_logFileBufferSize =
+    Config::lookup<size_t>("log.filebuffersize", 64 * 1024u,
+    "Bytes of not yet written messages each thread may have outstanding "
+    "when log.fileasync is set");
+static ConfigVar<std::string>::ptr g_logFileOverflow =
+    Config::lookup("log.fileoverflow", std::string("drop"),
+    "What to do with a message when log.fileasync is set and there is no "
+    "room for it (drop or block)");
+
+static CountStatistic<unsigned long long> &g_statDropped =
+    Statistics::registerStatistic("log.file.dropped",
+    CountStatistic<unsigned long long>(),
+    "Messages an asynchronous FileLogSink discarded for lack of room");
+static CountStatistic<unsigned long long> &g_statBlocked =
+    Statistics::registerStatistic("log.file.blocked",
+    CountStatistic<unsigned long long>(),
+    "Times a thread waited for an asynchronous FileLogSink to make room");
+
+// How long the writer thread lets messages accumulate before writing them
+static const std::chrono::milliseconds FLUSH_INTERVAL(100);
 
 
 namespace {
@@ -21,7 +53,14 @@ static struct LogInitializer
 {
     LogInitializer()
     {
-        g_logFile->monitor(&enableFileLogging);
+        // So that setting log.file and log.fileasync together doesn't open
+        // a synchronous sink only to replace it
+        std::vector<ConfigVarBase::ptr> vars;
+        vars.push_back(g_logFile);
+        vars.push_back(g_logFileAsync);
+        vars.push_back(g_logFileBufferSize);
+        vars.push_back(g_logFileOverflow);
+        Config::monitor(vars, &enableFileLogging);
     }
 } g_init;
 
@@ -30,22 +69,311 @@ static struct LogInitializer
 static void enableFileLogging()
 {
     static LogSink::ptr fileSink;
+    static size_t bufferSize;
+    static FileLogSink::OverflowPolicy policy;
     std::string file = g_logFile->val();
+    bool async = g_logFileAsync->val();
     if (fileSink.get() && file.empty()) {
         Log::root()->removeSink(fileSink);
         fileSink.reset();
     } else if (!file.empty()) {
         if (fileSink.get()) {
-            if (static_cast<FileLogSink*>(fileSink.get())->file() == file)
+            FileLogSink *sink = static_cast<FileLogSink*>(fileSink.get());
+            if (sink->file() == file && sink->async() == async &&
+                (!async || (bufferSize == g_logFileBufferSize->val() &&
+                policy == (g_logFileOverflow->val() == "block" ?
+                FileLogSink::BLOCK : FileLogSink::DROP))))
                 return;
             Log::root()->removeSink(fileSink);
             fileSink.reset();
         }
-        fileSink.reset(new FileLogSink(file));
+        if (async) {
+            bufferSize = g_logFileBufferSize->val();
+            policy = g_logFileOverflow->val() == "block" ?
+                FileLogSink::BLOCK : FileLogSink::DROP;
+            fileSink.reset(new FileLogSink(file, bufferSize, policy));
+        } else {
+            fileSink.reset(new FileLogSink(file));
+        }
         Log::root()->addSink(fileSink);
     }
 }
 
+/// The writer thread, and the per-thread rings it drains, for an
+/// asynchronous FileLogSink
+struct FileLogSink::Writer : Mordor::noncopyable
+{
+    /// Single producer (the logging thread), single consumer (the writer
+    /// thread) ring of formatted messages
+    struct Ring : Mordor::noncopyable
+    {
+        Ring(size_t capacity);
+
+        /// Called only by the owning thread
+        /// @return false if there isn't room for line
+        bool push(const std::string &line, bool &halfFull);
+
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        // Free running; only the owning thread advances head, and only the
+        // writer thread advances tail
+        volatile size_t head, tail;
+        // The Writer is gone; the owning thread should forget about it
+        volatile bool closed;
+    };
+
+    typedef std::vector<std::pair<unsigned long long,
+        std::shared_ptr<Ring> > > ThreadRings;
+
+    Writer(std::shared_ptr<Stream> stream, size_t bufferSize,
+        OverflowPolicy policy);
+    ~Writer();
+
+    void log(const std::string &line, Log::Level level);
+    void flush();
+
+    unsigned long long id;
+    std::shared_ptr<Stream> stream;
+    size_t bufferSize;
+    OverflowPolicy policy;
+    volatile unsigned long long dropped;
+
+private:
+    Ring *ring();
+    void wake();
+    void drop();
+    void run();
+    void drain(const std::vector<std::shared_ptr<Ring> > &rings);
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_drained;
+    bool m_wakeRequested, m_stopping;
+    unsigned long long m_passes;
+    std::vector<std::shared_ptr<Ring> > m_rings;
+    std::unique_ptr<Thread> m_thread;
+};
+
+FileLogSink::Writer::Ring::Ring(size_t capacity)
+    : data(new char[capacity]),
+      capacity(capacity),
+      head(0),
+      tail(0),
+      closed(false)
+{
+    MORDOR_ASSERT((capacity & (capacity - 1)) == 0);
+}
+
+bool
+FileLogSink::Writer::Ring::push(const std::string &line, bool &halfFull)
+{
+    size_t length = line.size();
+    size_t h = head;
+    // Full barrier, so we see everything the writer thread did before
+    // releasing this space
+    size_t t = atomicAdd(tail, (size_t)0);
+    if (capacity - (h - t) < length)
+        return false;
+    size_t offset = h & (capacity - 1);
+    size_t first = (std::min)(length, capacity - offset);
+    memcpy(data.get() + offset, line.c_str(), first);
+    memcpy(data.get(), line.c_str() + first, length - first);
+    // Publish the message only after it has been copied in
+    atomicSwap(head, h + length);
+    halfFull = h + length - t > capacity / 2;
+    return true;
+}
+
+static size_t
+ringCapacity(size_t bufferSize)
+{
+    size_t capacity = 256;
+    while (capacity < bufferSize)
+        capacity <<= 1;
+    return capacity;
+}
+
+FileLogSink::Writer::Writer(std::shared_ptr<Stream> stream,
+    size_t bufferSize, OverflowPolicy policy)
+    : stream(stream),
+      bufferSize(ringCapacity(bufferSize)),
+      policy(policy),
+      dropped(0),
+      m_wakeRequested(false),
+      m_stopping(false),
+      m_passes(0)
+{
+    static volatile unsigned long long s_nextId;
+    id = atomicIncrement(s_nextId);
+    m_thread.reset(new Thread(std::bind(&Writer::run, this), "logwriter"));
+}
+
+FileLogSink::Writer::~Writer()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_one();
+    m_thread->join();
+    for (size_t i = 0; i < m_rings.size(); ++i)
+        m_rings[i]->closed = true;
+}
+
+FileLogSink::Writer::Ring *
+FileLogSink::Writer::ring()
+{
+    // Messages logged late during thread exit find this thread's rings
+    // already gone, and get written synchronously
+    ThreadRings *threadRings = PerThread<ThreadRings, Writer>::get();
+    if (!threadRings)
+        return NULL;
+    ThreadRings &rings = *threadRings;
+    for (size_t i = 0; i < rings.size();) {
+        if (rings[i].first == id)
+            return rings[i].second.get();
+        // Forget rings belonging to Writers that have since been destroyed
+        if (rings[i].second->closed) {
+            rings[i] = rings.back();
+            rings.pop_back();
+        } else {
+            ++i;
+        }
+    }
+    std::shared_ptr<Ring> ring(new Ring(bufferSize));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_rings.push_back(ring);
+    }
+    rings.push_back(std::make_pair(id, ring));
+    return ring.get();
+}
+
+void
+FileLogSink::Writer::log(const std::string &line, Log::Level level)
+{
+    Ring *ring = this->ring();
+    if (!ring) {
+        stream->write(line.c_str(), line.size());
+        return;
+    }
+    bool halfFull;
+    while (!ring->push(line, halfFull)) {
+        // The writer thread itself (logging from inside its own writes) must
+        // never wait on itself
+        if (policy == DROP || line.size() > ring->capacity ||
+            gettid() == m_thread->tid()) {
+            drop();
+            return;
+        }
+        g_statBlocked.increment();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        unsigned long long passes = m_passes;
+        m_wakeRequested = true;
+        m_wake.notify_one();
+        while (m_passes == passes)
+            m_drained.wait(lock);
+    }
+    if (halfFull || level <= Log::ERROR)
+        wake();
+}
+
+void
+FileLogSink::Writer::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // The pass in progress (if any) may have missed messages logged just
+    // before now; the one after it won't have
+    unsigned long long target = m_passes + 2;
+    m_wakeRequested = true;
+    m_wake.notify_one();
+    while (m_passes < target)
+        m_drained.wait(lock);
+}
+
+void
+FileLogSink::Writer::wake()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_wakeRequested = true;
+    m_wake.notify_one();
+}
+
+void
+FileLogSink::Writer::drop()
+{
+    atomicIncrement(dropped);
+    g_statDropped.increment();
+}
+
+void
+FileLogSink::Writer::run()
+{
+    std::vector<std::shared_ptr<Ring> > rings;
+    while (true) {
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!m_wakeRequested && !m_stopping)
+                m_wake.wait_for(lock, FLUSH_INTERVAL);
+            m_wakeRequested = false;
+            stopping = m_stopping;
+            // Rings whose thread has exited can go once they're empty
+            for (size_t i = 0; i < m_rings.size();) {
+                if (m_rings[i].use_count() == 1 &&
+                    m_rings[i]->head == m_rings[i]->tail) {
+                    m_rings[i] = m_rings.back();
+                    m_rings.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+            rings = m_rings;
+        }
+        drain(rings);
+        rings.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_passes;
+        }
+        m_drained.notify_all();
+        if (stopping)
+            return;
+    }
+}
+
+void
+FileLogSink::Writer::drain(const std::vector<std::shared_ptr<Ring> > &rings)
+{
+    Buffer buffer;
+    std::vector<size_t> heads(rings.size());
+    for (size_t i = 0; i < rings.size(); ++i) {
+        Ring &ring = *rings[i];
+        // Full barrier, so we see the messages themselves
+        size_t h = heads[i] = atomicAdd(ring.head, (size_t)0);
+        size_t t = ring.tail;
+        if (h == t)
+            continue;
+        size_t offset = t & (ring.capacity - 1);
+        size_t first = (std::min)(h - t, ring.capacity - offset);
+        buffer.adopt(ring.data.get() + offset, first);
+        buffer.produce(first);
+        if (h - t > first) {
+            buffer.adopt(ring.data.get(), h - t - first);
+            buffer.produce(h - t - first);
+        }
+    }
+    try {
+        while (buffer.readAvailable() > 0)
+            buffer.consume(stream->write(buffer, buffer.readAvailable()));
+    } catch (...) {
+        // Nowhere to report it; the messages are lost, but the rings must
+        // still be emptied or their threads would stall
+    }
+    for (size_t i = 0; i < rings.size(); ++i)
+        atomicSwap(rings[i]->tail, heads[i]);
+}
+
 FileLogSink::FileLogSink(const std::string &file)
 {
     m_stream.reset(new FileStream(file, FileStream::APPEND,
@@ -53,6 +381,21 @@ FileLogSink::FileLogSink(const std::string &file)
     m_file = file;
 }
 
+FileLogSink::FileLogSink(const std::string &file, size_t bufferSize,
+    OverflowPolicy policy)
+{
+    m_stream.reset(new FileStream(file, FileStream::APPEND,
+        FileStream::OPEN_OR_CREATE));
+    m_file = file;
+    m_writer.reset(new Writer(m_stream, bufferSize, policy));
+}
+
+FileLogSink::~FileLogSink()
+{
+    // Stop (and drain) the writer thread before the stream goes away
+    m_writer.reset();
+}
+
 void
 FileLogSink::log(const std::string &logger,
         std::chrono::system_clock::time_point now, unsigned long long elapsed,
@@ -65,8 +408,27 @@ FileLogSink::log(const std::string &logger,
         << fiber << " " << logger << " " << file << ":" << line << " "
         << str << std::endl;
     std::string logline = os.str();
+    if (m_writer) {
+        m_writer->log(logline, level);
+        return;
+    }
     m_stream->write(logline.c_str(), logline.size());
     m_stream->flush();
 }
 
+void
+FileLogSink::flush()
+{
+    if (m_writer)
+        m_writer->flush();
+    else
+        m_stream->flush();
+}
+
+unsigned long long
+FileLogSink::dropped() const
+{
+    return m_writer ? m_writer->dropped : 0;
+}
+
 }
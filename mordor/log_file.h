@@ -11,12 +11,37 @@ namespace Mordor {
 /// log to the same file simultaneously, without fear of corrupting each
 /// others' messages.  The messages will still be intermingled, but each one
 /// will be atomic
+///
+/// By default each message is written (and flushed) by the thread that logged
+/// it.  An asynchronous FileLogSink instead has each logging thread append
+/// the formatted message to a lock-free ring buffer of its own, and a
+/// dedicated writer thread gathers whatever has accumulated in all of them
+/// into a single writev every so often (immediately for ERROR and FATAL
+/// messages).  Memory use is bounded by the ring size per logging thread;
+/// what happens when a ring is full is decided by the OverflowPolicy.
 class FileLogSink : public LogSink
 {
+public:
+    enum OverflowPolicy {
+        /// Discard the message (counted in dropped() and the
+        /// log.file.dropped statistic)
+        DROP,
+        /// Wait for the writer thread to make room
+        BLOCK
+    };
+
 public:
     /// @param file The file to open and log to.  If it does not exist, it is
     /// created.
     FileLogSink(const std::string &file);
+    /// Create an asynchronous FileLogSink
+    /// @param bufferSize The size of each logging thread's ring buffer
+    /// (rounded up to a power of two); messages longer than this are always
+    /// dropped
+    FileLogSink(const std::string &file, size_t bufferSize,
+        OverflowPolicy policy);
+    /// Writes out anything still buffered
+    ~FileLogSink();
 
     void log(const std::string &logger,
             std::chrono::system_clock::time_point now, unsigned long long elapsed,
@@ -24,11 +49,21 @@ public:
         Log::Level level, const std::string &str,
         const char *file, int line);
 
+    /// Block until every message logged (by any thread) before this call has
+    /// been written out
+    void flush();
+
     std::string file() const { return m_file; }
+    bool async() const { return !!m_writer; }
+    /// Number of messages discarded because there was no room for them
+    unsigned long long dropped() const;
 
 private:
+    struct Writer;
+
     std::string m_file;
     std::shared_ptr<Stream> m_stream;
+    std::shared_ptr<Writer> m_writer;
 };
 
 }
@@ -0,0 +1,59 @@
+#ifndef __MORDOR_PER_THREAD_H__
+#define __MORDOR_PER_THREAD_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "predef.h"
+
+#include "util.h"
+
+namespace Mordor {
+
+/// A lazily created, per-thread instance of T (typically a free list or
+/// similar cache), destroyed when the thread exits
+///
+/// The instance is reached through a plain pointer (rather than being a
+/// thread_local object itself), so that anything running late during thread
+/// exit, after it has been torn down, gets NULL from get() instead of
+/// resurrecting it or touching a destroyed object; callers then just fall
+/// back to doing without.  Use a distinct Tag if two users share a T.
+template <class T, class Tag = T>
+class PerThread : Mordor::noncopyable
+{
+public:
+    /// @return This thread's instance, or NULL once thread exit has started
+    static T *get()
+    {
+        if (!t_instance && !t_destroyed) {
+            // Make sure this thread's instance gets cleaned up when it exits
+            (void)&t_cleanup;
+            t_instance = new T();
+        }
+        return t_instance;
+    }
+
+private:
+    struct Cleanup
+    {
+        ~Cleanup()
+        {
+            delete t_instance;
+            t_instance = NULL;
+            t_destroyed = true;
+        }
+    };
+
+    static thread_local T *t_instance;
+    static thread_local bool t_destroyed;
+    static thread_local Cleanup t_cleanup;
+};
+
+template <class T, class Tag>
+thread_local T *PerThread<T, Tag>::t_instance = NULL;
+template <class T, class Tag>
+thread_local bool PerThread<T, Tag>::t_destroyed = false;
+template <class T, class Tag>
+thread_local typename PerThread<T, Tag>::Cleanup PerThread<T, Tag>::t_cleanup;
+
+}
+
+#endif
@@ -0,0 +1,357 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "binarycopy.h"
+
+#include <string.h>
+
+#include "mordor/assert.h"
+#include "mordor/endian.h"
+#include "mordor/exception.h"
+#include "mordor/streams/stream.h"
+
+#include "exception.h"
+
+namespace Mordor {
+namespace PQ {
+
+// "PGCOPY\n\377\r\n\0", then no flags, and no header extension
+static const char g_header[] =
+    "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
+static const size_t g_signatureLength = 11;
+static const size_t g_headerLength = 19;
+
+static const boost::posix_time::ptime
+    postgres_epoch(boost::gregorian::date(2000, 1, 1));
+
+template <class T>
+static void
+store(char *destination, T value)
+{
+    value = byteswapOnLittleEndian(value);
+    memcpy(destination, &value, sizeof(T));
+}
+
+template <class T>
+static T
+load(const char *source)
+{
+    T value;
+    memcpy(&value, source, sizeof(T));
+    return byteswapOnLittleEndian(value);
+}
+
+BinaryCopyWriter::BinaryCopyWriter(Stream::ptr stream, size_t bufferSize)
+    : m_stream(stream),
+      m_bufferSize(bufferSize),
+      m_start(NULL),
+      m_pos(NULL),
+      m_end(NULL),
+      m_rows(0)
+#ifndef NDEBUG
+      , m_fieldsLeft(0)
+#endif
+{
+    MORDOR_ASSERT(m_stream->supportsWrite());
+    MORDOR_ASSERT(bufferSize > 0);
+    memcpy(reserve(g_headerLength), g_header, g_headerLength);
+}
+
+void
+BinaryCopyWriter::grow(size_t length)
+{
+    flush();
+    iovec iov = m_buffer.writeBuffer((std::max)(length, m_bufferSize), true);
+    m_start = m_pos = (char *)iov.iov_base;
+    m_end = m_start + iov.iov_len;
+}
+
+void
+BinaryCopyWriter::flush()
+{
+    m_buffer.produce(m_pos - m_start);
+    m_start = m_pos;
+    while (m_buffer.readAvailable())
+        m_buffer.consume(m_stream->write(m_buffer,
+            m_buffer.readAvailable()));
+}
+
+void
+BinaryCopyWriter::row(size_t fields)
+{
+    MORDOR_ASSERT(m_fieldsLeft == 0);
+    MORDOR_ASSERT(fields < 0x8000);
+    store(reserve(2), (short)fields);
+    ++m_rows;
+#ifndef NDEBUG
+    m_fieldsLeft = fields;
+#endif
+}
+
+void
+BinaryCopyWriter::field(int length)
+{
+#ifndef NDEBUG
+    MORDOR_ASSERT(m_fieldsLeft > 0);
+    --m_fieldsLeft;
+#endif
+    store(reserve(4), length);
+}
+
+void
+BinaryCopyWriter::append(const Null &)
+{
+    field(-1);
+}
+
+void
+BinaryCopyWriter::append(bool value)
+{
+    field(1);
+    *reserve(1) = value ? 1 : 0;
+}
+
+void
+BinaryCopyWriter::append(char value)
+{
+    field(1);
+    *reserve(1) = value;
+}
+
+void
+BinaryCopyWriter::append(short value)
+{
+    field(2);
+    store(reserve(2), value);
+}
+
+void
+BinaryCopyWriter::append(int value)
+{
+    field(4);
+    store(reserve(4), value);
+}
+
+void
+BinaryCopyWriter::append(long long value)
+{
+    field(8);
+    store(reserve(8), value);
+}
+
+void
+BinaryCopyWriter::append(float value)
+{
+    int bits;
+    memcpy(&bits, &value, 4);
+    append(bits);
+}
+
+void
+BinaryCopyWriter::append(double value)
+{
+    long long bits;
+    memcpy(&bits, &value, 8);
+    append(bits);
+}
+
+void
+BinaryCopyWriter::append(const char *value)
+{
+    append(value, strlen(value));
+}
+
+void
+BinaryCopyWriter::append(const char *value, size_t length)
+{
+    MORDOR_ASSERT(length <= 0x7fffffff);
+    field((int)length);
+    memcpy(reserve(length), value, length);
+}
+
+void
+BinaryCopyWriter::append(const boost::posix_time::ptime &value)
+{
+    if (value.is_not_a_date_time())
+        append(Null());
+    else
+        append((long long)(value - postgres_epoch).total_microseconds());
+}
+
+void
+BinaryCopyWriter::finish()
+{
+    MORDOR_ASSERT(m_fieldsLeft == 0);
+    store(reserve(2), (short)-1);
+    flush();
+    m_stream->close();
+}
+
+BinaryCopyReader::BinaryCopyReader(Stream::ptr stream)
+    : m_stream(stream),
+      m_rows(0),
+      m_started(false),
+      m_done(false)
+{
+    MORDOR_ASSERT(m_stream->supportsRead());
+}
+
+void
+BinaryCopyReader::fill(size_t length)
+{
+    while (m_buffer.readAvailable() < length) {
+        if (m_stream->read(m_buffer, 65536) == 0)
+            MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    }
+}
+
+bool
+BinaryCopyReader::next()
+{
+    if (m_done)
+        return false;
+    if (!m_started) {
+        fill(g_headerLength);
+        char header[g_headerLength];
+        m_buffer.copyOut(header, g_headerLength);
+        if (memcmp(header, g_header, g_signatureLength) != 0)
+            MORDOR_THROW_EXCEPTION(Exception("Not binary COPY data"));
+        int extension = load<int>(header + 15);
+        if (extension < 0)
+            MORDOR_THROW_EXCEPTION(Exception("Malformed binary COPY data"));
+        fill(g_headerLength + extension);
+        m_buffer.consume(g_headerLength + extension);
+        m_started = true;
+    }
+    fill(2);
+    char count[2];
+    m_buffer.copyOut(count, 2);
+    short fields = load<short>(count);
+    if (fields == -1) {
+        m_buffer.consume(2);
+        m_done = true;
+        m_fields.clear();
+        return false;
+    }
+    if (fields < -1)
+        MORDOR_THROW_EXCEPTION(Exception("Malformed binary COPY data"));
+    // Find where the row ends, then take all of it at once
+    m_fields.resize(fields);
+    size_t length = 2;
+    for (short i = 0; i < fields; ++i) {
+        fill(length + 4);
+        char field[4];
+        m_buffer.copyOut(field, 4, length);
+        int fieldLength = load<int>(field);
+        // -1 is NULL
+        if (fieldLength < -1)
+            MORDOR_THROW_EXCEPTION(Exception("Malformed binary COPY data"));
+        length += 4;
+        m_fields[i] = std::make_pair(length, fieldLength);
+        if (fieldLength > 0)
+            length += fieldLength;
+    }
+    fill(length);
+    m_row.resize(length);
+    m_buffer.copyOut(&m_row[0], length);
+    m_buffer.consume(length);
+    ++m_rows;
+    return true;
+}
+
+const char *
+BinaryCopyReader::data(size_t column, size_t length) const
+{
+    MORDOR_ASSERT(column < m_fields.size());
+    MORDOR_ASSERT(m_fields[column].second == (int)length);
+    return &m_row[m_fields[column].first];
+}
+
+template <>
+std::string
+BinaryCopyReader::get<std::string>(size_t column) const
+{
+    MORDOR_ASSERT(column < m_fields.size());
+    if (m_fields[column].second <= 0)
+        return std::string();
+    return std::string(&m_row[m_fields[column].first],
+        m_fields[column].second);
+}
+
+template <>
+bool
+BinaryCopyReader::get<bool>(size_t column) const
+{
+    return !!*data(column, 1);
+}
+
+template <>
+char
+BinaryCopyReader::get<char>(size_t column) const
+{
+    return *data(column, 1);
+}
+
+template <>
+short
+BinaryCopyReader::get<short>(size_t column) const
+{
+    return load<short>(data(column, 2));
+}
+
+template <>
+int
+BinaryCopyReader::get<int>(size_t column) const
+{
+    MORDOR_ASSERT(column < m_fields.size());
+    if (m_fields[column].second == 2)
+        return get<short>(column);
+    return load<int>(data(column, 4));
+}
+
+template <>
+long long
+BinaryCopyReader::get<long long>(size_t column) const
+{
+    MORDOR_ASSERT(column < m_fields.size());
+    switch (m_fields[column].second) {
+        case 2:
+            return get<short>(column);
+        case 4:
+            return get<int>(column);
+        default:
+            return load<long long>(data(column, 8));
+    }
+}
+
+template <>
+float
+BinaryCopyReader::get<float>(size_t column) const
+{
+    int bits = load<int>(data(column, 4));
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+template <>
+double
+BinaryCopyReader::get<double>(size_t column) const
+{
+    long long bits = load<long long>(data(column, 8));
+    double value;
+    memcpy(&value, &bits, 8);
+    return value;
+}
+
+template <>
+boost::posix_time::ptime
+BinaryCopyReader::get<boost::posix_time::ptime>(size_t column) const
+{
+    MORDOR_ASSERT(column < m_fields.size());
+    if (m_fields[column].second < 0)
+        return boost::posix_time::ptime();
+    return postgres_epoch + boost::posix_time::microseconds(
+        load<long long>(data(column, 8)));
+}
+
+}}
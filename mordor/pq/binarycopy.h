@@ -0,0 +1,141 @@
+#ifndef __MORDOR_PQ_BINARYCOPY_H__
+#define __MORDOR_PQ_BINARYCOPY_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "mordor/streams/buffer.h"
+#include "mordor/util.h"
+#include "preparedstatement.h"
+
+namespace Mordor {
+
+class Stream;
+
+namespace PQ {
+
+/// Writes rows to a binary COPY IN, from typed values
+///
+/// Each value is appended to a Buffer in the server's own binary
+/// representation, with no text formatting or intermediate strings, and the
+/// Buffer is written to the stream a chunk at a time:
+/// @code
+/// BinaryCopyWriter writer(conn.copyIn("stuff").binary()());
+/// writer.row(2);
+/// writer.append(1ll);
+/// writer.append("one");
+/// writer.finish();
+/// @endcode
+/// Binary COPY doesn't convert anything, so each value's type has to match
+/// its column's exactly:
+///  * Null (any)
+///  * bool (boolean)
+///  * char (char)
+///  * short (smallint)
+///  * int (integer)
+///  * long long (bigint)
+///  * float (real)
+///  * double (double precision)
+///  * const char *, std::string (text, varchar, bytea)
+///  * boost::posix_time::ptime (timestamp; not_a_date_time is NULL)
+class BinaryCopyWriter : Mordor::noncopyable
+{
+public:
+    /// @param stream As returned by Connection::copyIn(...).binary()()
+    /// @param bufferSize How much to collect before writing to stream
+    BinaryCopyWriter(std::shared_ptr<Stream> stream,
+        size_t bufferSize = 65536);
+
+    /// Start a row, of fields values
+    void row(size_t fields);
+
+    void append(const Null &);
+    void append(bool value);
+    void append(char value);
+    void append(short value);
+    void append(int value);
+    void append(long long value);
+    void append(float value);
+    void append(double value);
+    void append(const char *value);
+    void append(const char *value, size_t length);
+    void append(const std::string &value)
+    { append(value.c_str(), value.size()); }
+    void append(const boost::posix_time::ptime &value);
+
+    /// Write the end of the data and close the stream, finishing the COPY
+    void finish();
+
+    unsigned long long rows() const { return m_rows; }
+
+private:
+    // length contiguous bytes to write into
+    char *reserve(size_t length)
+    {
+        if ((size_t)(m_end - m_pos) < length)
+            grow(length);
+        char *result = m_pos;
+        m_pos += length;
+        return result;
+    }
+    void grow(size_t length);
+    void flush();
+    void field(int length);
+
+private:
+    std::shared_ptr<Stream> m_stream;
+    Buffer m_buffer;
+    size_t m_bufferSize;
+    char *m_start, *m_pos, *m_end;
+    unsigned long long m_rows;
+#ifndef NDEBUG
+    size_t m_fieldsLeft;
+#endif
+};
+
+/// Reads rows from a binary COPY OUT, as typed values
+///
+/// @code
+/// BinaryCopyReader reader(conn.copyOut("stuff").binary()());
+/// while (reader.next())
+///     std::cout << reader.get<long long>(0) << std::endl;
+/// @endcode
+/// get() takes the same types BinaryCopyWriter::append() does (except
+/// Null; check getIsNull() first).  The format doesn't say what type each
+/// column is, so get() checks only that the value is the right size;
+/// long long and int also accept the narrower integer types.
+class BinaryCopyReader : Mordor::noncopyable
+{
+public:
+    /// @param stream As returned by Connection::copyOut(...).binary()()
+    BinaryCopyReader(std::shared_ptr<Stream> stream);
+
+    /// Move to the next row
+    /// @return false if there are no more
+    bool next();
+    unsigned long long rows() const { return m_rows; }
+
+    size_t columns() const { return m_fields.size(); }
+    bool getIsNull(size_t column) const
+    { return m_fields[column].second < 0; }
+    template <class T> T get(size_t column) const;
+
+private:
+    void fill(size_t length);
+    const char *data(size_t column, size_t length) const;
+
+private:
+    std::shared_ptr<Stream> m_stream;
+    Buffer m_buffer;
+    std::vector<char> m_row;
+    // Offset into m_row and length (-1 for NULL) of each field
+    std::vector<std::pair<size_t, int> > m_fields;
+    unsigned long long m_rows;
+    bool m_started, m_done;
+};
+
+}}
+
+#endif
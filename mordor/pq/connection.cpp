@@ -2,9 +2,16 @@
 
 #include "connection.h"
 
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
 #include "mordor/assert.h"
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/fiber.h"
 #include "mordor/iomanager.h"
 #include "mordor/log.h"
+#include "mordor/statistics.h"
 
 #include "exception.h"
 
@@ -17,10 +24,25 @@ namespace PQ {
 
 static Logger::ptr g_log = Log::lookup("mordor:pq");
 
+static ConfigVar<size_t>::ptr g_statementCacheSize =
+    Config::lookup<size_t>("pq.statementcache.size", 64u,
+    "Prepared statements kept per connection by prepareCached(); 0 disables "
+    "the cache");
+
+static CountStatistic<unsigned long long> &g_statCacheHits =
+    Statistics::registerStatistic("pq.statementcache.hit",
+    CountStatistic<unsigned long long>(),
+    "prepareCached() calls that reused a statement already on the server");
+static CountStatistic<unsigned long long> &g_statCacheMisses =
+    Statistics::registerStatistic("pq.statementcache.miss",
+    CountStatistic<unsigned long long>(),
+    "prepareCached() calls that had to prepare the statement");
+
 Connection::Connection(const std::string &conninfo, IOManager *ioManager,
     Scheduler *scheduler, bool connectImmediately)
 : m_conninfo(conninfo)
 , m_exceptioned(false)
+, m_nextStatement(0)
 {
 #ifdef WINDOWS
     m_scheduler = scheduler;
@@ -39,10 +61,20 @@ Connection::status()
     return PQstatus(m_conn.get());
 }
 
+PGTransactionStatusType
+Connection::transactionStatus()
+{
+    if (!m_conn)
+        return PQTRANS_UNKNOWN;
+    return PQtransactionStatus(m_conn.get());
+}
+
 void
 Connection::connect()
 {
     m_exceptioned = false;
+    m_statements.clear();
+    m_statementsByCommand.clear();
 #ifdef WINDOWS
     SchedulerSwitcher switcher(m_scheduler);
 #else
@@ -95,6 +127,8 @@ void
 Connection::reset()
 {
     m_exceptioned = false;
+    m_statements.clear();
+    m_statementsByCommand.clear();
 #ifdef WINDOWS
     SchedulerSwitcher switcher(m_scheduler);
 #else
@@ -199,6 +233,57 @@ void flush(PGconn *conn, SchedulerType *scheduler)
     }
 }
 
+namespace {
+struct Waiter
+{
+    Scheduler *scheduler;
+    Fiber::ptr fiber;
+    volatile int fired;
+};
+}
+
+// Whichever of the events waited on fires first resumes the fiber
+static void wake(std::shared_ptr<Waiter> waiter)
+{
+    if (atomicCompareAndSwap(waiter->fired, 1, 0) == 0)
+        waiter->scheduler->schedule(waiter->fiber);
+}
+
+// Like flush(), but reads while waiting for room to write: in pipeline mode
+// the server can be busy sending Results for statements it already has,
+// and won't read any more until they've been read
+void flushPipeline(PGconn *conn, SchedulerType *scheduler)
+{
+    int fd = PQsocket(conn);
+    while (true) {
+        int result = PQflush(conn);
+        MORDOR_LOG_DEBUG(g_log) << conn << " PQflush(): " << result;
+        switch (result) {
+            case 0:
+                return;
+            case -1:
+                throwException(conn);
+            case 1:
+                break;
+            default:
+                MORDOR_NOTREACHED();
+        }
+        std::shared_ptr<Waiter> waiter(new Waiter());
+        waiter->scheduler = Scheduler::getThis();
+        waiter->fiber = Fiber::getThis();
+        waiter->fired = 0;
+        scheduler->registerEvent(fd, SchedulerType::READ,
+            boost::bind(&wake, waiter));
+        scheduler->registerEvent(fd, SchedulerType::WRITE,
+            boost::bind(&wake, waiter));
+        Scheduler::yieldTo();
+        scheduler->unregisterEvent(fd, SchedulerType::READ);
+        scheduler->unregisterEvent(fd, SchedulerType::WRITE);
+        if (!PQconsumeInput(conn))
+            throwException(conn);
+    }
+}
+
 PGresult *nextResult(PGconn *conn, SchedulerType *scheduler)
 {
     while (true) {
@@ -262,6 +347,49 @@ Connection::prepare(const std::string &command, const std::string &name, Prepare
     }
 }
 
+PreparedStatement
+Connection::prepareCached(const std::string &command,
+    PreparedStatement::ResultFormat resultFormat)
+{
+    size_t cacheSize = g_statementCacheSize->val();
+    std::map<std::string,
+        std::list<std::pair<std::string, std::string> >::iterator>::iterator
+        it = m_statementsByCommand.find(command);
+    if (it != m_statementsByCommand.end()) {
+        g_statCacheHits.increment();
+        m_statements.splice(m_statements.begin(), m_statements, it->second);
+        return PreparedStatement(m_conn, std::string(), it->second->second,
+            m_scheduler, resultFormat);
+    }
+    g_statCacheMisses.increment();
+    if (cacheSize == 0)
+        return prepare(command, std::string(), resultFormat);
+    while (m_statements.size() >= cacheSize) {
+        // Forget it first, so it isn't deallocated twice if this throws
+        std::string name = m_statements.back().second;
+        m_statementsByCommand.erase(m_statements.back().first);
+        m_statements.pop_back();
+        prepare("DEALLOCATE " + name).execute();
+    }
+    std::string name = "mordor_cached_" +
+        boost::lexical_cast<std::string>(m_nextStatement++);
+    PreparedStatement result = prepare(command, name, resultFormat);
+    m_statements.push_front(std::make_pair(command, name));
+    m_statementsByCommand[command] = m_statements.begin();
+    return result;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+Pipeline::ptr
+Connection::pipeline()
+{
+    if (!PQenterPipelineMode(m_conn.get()))
+        throwException(m_conn.get());
+    MORDOR_LOG_DEBUG(g_log) << m_conn.get() << " PQenterPipelineMode()";
+    return Pipeline::ptr(new Pipeline(m_conn, m_scheduler));
+}
+#endif
+
 Connection::CopyInParams
 Connection::copyIn(const std::string &table)
 {
@@ -2,10 +2,15 @@
 #define __MORDOR_PQ_CONNECTION_H__
 // Copyright (c) 2010 Mozy, Inc.
 
+#include <list>
+#include <map>
+
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include "mordor/util.h"
+#include "cursor.h"
 #include "exception.h"
+#include "pipeline.h"
 #include "preparedstatement.h"
 
 namespace Mordor {
@@ -22,6 +27,8 @@ public:
         bool connectImmediately = true);
 
     ConnStatusType status();
+    /// PQTRANS_UNKNOWN if not connected
+    PGTransactionStatusType transactionStatus();
 
     void connect();
     /// @brief Resets the communication channel to the server.
@@ -42,6 +49,25 @@ public:
     /// Create a PreparedStatement object representing a previously prepared
     /// statement on the server
     PreparedStatement find(const std::string &name);
+    /// Prepare command on the server the first time it's asked for, and
+    /// reuse that statement after
+    ///
+    /// Statements are kept per connection, keyed by their text, up to
+    /// pq.statementcache.size of the most recently used ones; the least
+    /// recently used is deallocated to make room.  The cache lives as long as
+    /// the server session does, so a pooled Connection keeps its statements
+    /// from one checkout to the next; connect() and reset() clear it.
+    /// @note The PreparedStatement returned is only good until the next
+    /// prepareCached() call on this Connection, which may deallocate it; call
+    /// prepareCached() again each time rather than holding on to it.
+    PreparedStatement prepareCached(const std::string &command,
+        PreparedStatement::ResultFormat = PreparedStatement::BINARY);
+
+#ifdef LIBPQ_HAS_PIPELINING
+    /// Put the connection in pipeline mode until the Pipeline is destroyed
+    /// @pre No other statement is in progress on the connection
+    Pipeline::ptr pipeline();
+#endif
 
 #define PQ_EXCEPTION_WRAPPER_EXECUTE(code) \
     try {                                  \
@@ -159,11 +185,18 @@ private:
     SchedulerType *m_scheduler;
     std::shared_ptr<PGconn> m_conn;
     bool m_exceptioned;
+    // Most recently used first; command text and statement name
+    std::list<std::pair<std::string, std::string> > m_statements;
+    std::map<std::string,
+        std::list<std::pair<std::string, std::string> >::iterator>
+        m_statementsByCommand;
+    unsigned long long m_nextStatement;
 };
 
 // Internal functions
 #ifndef WIN32
 void flush(PGconn *conn, SchedulerType *scheduler);
+void flushPipeline(PGconn *conn, SchedulerType *scheduler);
 PGresult *nextResult(PGconn *conn, SchedulerType *scheduler);
 #endif
 std::string escape(PGconn *conn, const std::string &string);
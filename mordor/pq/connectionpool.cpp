@@ -7,6 +7,7 @@
 #include "mordor/config.h"
 #include "mordor/iomanager.h"
 #include "mordor/log.h"
+#include "mordor/statistics.h"
 #include "mordor/timer.h"
 #include "mordor/util.h"
 
@@ -17,15 +18,40 @@ namespace PQ {
 
 static Logger::ptr g_logger = Log::lookup("mordor:pq:connectionpool");
 
+typedef ShardedStatistic<HistogramStatistic<unsigned long long> >
+    WaitStatistic;
+// Up to a minute; anything longer is counted as a minute
+static WaitStatistic &g_statWait =
+    Statistics::registerStatistic("pq.connectionpool.wait",
+    WaitStatistic(HistogramStatistic<unsigned long long>("us", "checkouts",
+    6, 60000000ull)),
+    "Time getConnection() waited for a connection to be released");
+static CountStatistic<unsigned long long> &g_statExhausted =
+    Statistics::registerStatistic("pq.connectionpool.exhausted",
+    CountStatistic<unsigned long long>(),
+    "Checkouts that found every connection in the pool busy");
+static AverageMinMaxStatistic<unsigned int> &g_statInUse =
+    Statistics::registerStatistic("pq.connectionpool.inuse",
+    AverageMinMaxStatistic<unsigned int>("connections"),
+    "Connections checked out of a pool, whenever one is checked out or "
+    "released");
+static CountStatistic<unsigned long long> &g_statConnects =
+    Statistics::registerStatistic("pq.connectionpool.connects",
+    CountStatistic<unsigned long long>(),
+    "Connections made at checkout, because they weren't connected yet, were "
+    "idle too long, broken, or left in a transaction that couldn't be rolled "
+    "back");
+
 ConnectionPool::ConnectionPool(
     const std::string &conninfo, IOManager *iomanager,
-    size_t num, unsigned long long idleTolerance)
+    size_t num, unsigned long long idleTolerance, size_t minimum)
     : m_conninfo(conninfo)
     , m_iomanager(iomanager)
     , m_mutex()
     , m_condition(m_mutex)
     , m_total(num)
-    , m_idleTolerance(idleTolerance) {
+    , m_idleTolerance(idleTolerance)
+    , m_warming(0) {
     FiberMutex::ScopedLock lock(m_mutex);
     try {
         for (size_t i = 0; i < m_total; i++) {
@@ -38,25 +64,58 @@ ConnectionPool::ConnectionPool(
             << boost::current_exception_diagnostic_information();
         throw;
     }
+    if (m_iomanager) {
+        for (; m_warming < std::min(minimum, m_total); ++m_warming)
+            m_iomanager->schedule(boost::bind(&ConnectionPool::warmUp, this));
+    }
 }
 
 ConnectionPool::~ConnectionPool() {
     FiberMutex::ScopedLock lock(m_mutex);
-    while(!m_busyConnections.empty()) {
+    while(!m_busyConnections.empty() || m_warming) {
         m_condition.wait();
     }
 }
 
+void ConnectionPool::warmUp() {
+    FiberMutex::ScopedLock lock(m_mutex);
+    // Only never connected ones are at the back; take one out of the free
+    // list so it isn't handed out half connected
+    std::shared_ptr<Connection> conn;
+    if (!m_freeConnections.empty() &&
+        m_freeConnections.back().first->status() == CONNECTION_BAD) {
+        conn = m_freeConnections.back().first;
+        m_freeConnections.pop_back();
+        lock.unlock();
+        try {
+            conn->connect();
+            MORDOR_LOG_DEBUG(g_logger) << "Warmed up connection " << conn.get();
+        } catch (...) {
+            // getConnection() will try again
+            MORDOR_LOG_WARNING(g_logger)
+                << boost::current_exception_diagnostic_information();
+        }
+        lock.lock();
+    }
+    if (conn && m_busyConnections.size() + m_freeConnections.size() +
+        m_warming <= m_total)
+        m_freeConnections.push_front(std::make_pair(conn, TimerManager::now()));
+    --m_warming;
+    m_condition.broadcast();
+}
+
 bool ConnectionPool::connectionExpired(unsigned long long freeTime) const
 {
     return (m_idleTolerance != 0) && (TimerManager::now() > (freeTime + m_idleTolerance));
 }
 
 std::shared_ptr<Connection> ConnectionPool::getConnection() {
+    unsigned long long start = TimerManager::now();
     FiberMutex::ScopedLock lock(m_mutex);
     MORDOR_LOG_DEBUG(g_logger) << "Trying to get connection, pool size is "
                                << m_freeConnections.size();
-    if (m_freeConnections.empty() && m_busyConnections.size() < m_total) {
+    if (m_freeConnections.empty() &&
+        m_busyConnections.size() + m_warming < m_total) {
         MORDOR_LOG_DEBUG(g_logger) << "Trying to creat new connection";
         try {
             m_freeConnections.push_back(
@@ -67,16 +126,48 @@ std::shared_ptr<Connection> ConnectionPool::getConnection() {
                 << boost::current_exception_diagnostic_information();
         }
     }
-    while (m_freeConnections.empty()) {
-        m_condition.wait();
+    if (m_freeConnections.empty()) {
+        g_statExhausted.increment();
+        while (m_freeConnections.empty()) {
+            m_condition.wait();
+        }
+        g_statWait.update(TimerManager::now() - start);
     }
     MORDOR_ASSERT(!m_freeConnections.empty());
     std::shared_ptr<Connection> conn = (*m_freeConnections.begin()).first;
 
     // For connection which was pre-allocated in constructor but not connected,
     // its status is CONNECTION_BAD, so we'd always connect it here.
-    if (connectionExpired((*m_freeConnections.begin()).second) || conn->status() == CONNECTION_BAD) {
+    bool reconnect = connectionExpired((*m_freeConnections.begin()).second) ||
+        conn->status() == CONNECTION_BAD;
+    if (!reconnect) {
+        switch (conn->transactionStatus()) {
+            case PQTRANS_IDLE:
+                break;
+            case PQTRANS_INTRANS:
+            case PQTRANS_INERROR:
+                // Released in the middle of a transaction; rolling it back
+                // keeps the session (and its prepared statements)
+                MORDOR_LOG_WARNING(g_logger) << "Connection was left in a "
+                    "transaction, rolling back";
+                try {
+                    conn->execute("ROLLBACK");
+                    reconnect = conn->transactionStatus() != PQTRANS_IDLE;
+                } catch (...) {
+                    MORDOR_LOG_WARNING(g_logger)
+                        << boost::current_exception_diagnostic_information();
+                    reconnect = true;
+                }
+                break;
+            default:
+                // Still busy with a command, or broken
+                reconnect = true;
+                break;
+        }
+    }
+    if (reconnect) {
         MORDOR_LOG_WARNING(g_logger) << "Connection is expired or bad, try to re-connect";
+        g_statConnects.increment();
         conn->connect();
     }
     if (conn->status() != CONNECTION_OK) {
@@ -96,13 +187,14 @@ std::shared_ptr<Connection> ConnectionPool::getConnection() {
         boost::bind(&ConnectionPool::releaseConnection, this, _1));
     m_busyConnections.push_back(conn);
     m_freeConnections.erase(m_freeConnections.begin());
+    g_statInUse.update((unsigned int)m_busyConnections.size());
     return ret;
 }
 
 void ConnectionPool::resize(size_t num) {
     FiberMutex::ScopedLock lock(m_mutex);
     m_total = num;
-    while (m_busyConnections.size() + m_freeConnections.size() > m_total &&
+    while (m_busyConnections.size() + m_freeConnections.size() + m_warming > m_total &&
            !m_freeConnections.empty()) {
         m_freeConnections.erase(m_freeConnections.begin());
     }
@@ -119,7 +211,8 @@ void ConnectionPool::releaseConnection(Connection* conn) {
     //or the pointer hold by it will be deleted after the second line
 
     m_busyConnections.erase(it);
-    if (m_busyConnections.size() + m_freeConnections.size() < m_total) {
+    g_statInUse.update((unsigned int)m_busyConnections.size());
+    if (m_busyConnections.size() + m_freeConnections.size() + m_warming < m_total) {
         m_freeConnections.push_front(std::make_pair(c, TimerManager::now()));
         m_condition.signal();
     }
@@ -24,8 +24,11 @@ public:
     /// @param size           pool size, 5 by default
     /// @param idleTolerance  re-connect interval(in us) for idle
     ///                           connection, disable re-connect by setting it to 0
+    /// @param minimum        connections to connect up front, in the background
+    ///                           on iomanager; the rest connect on first use
     ConnectionPool(const std::string &conninfo, IOManager *iomanager,
-        size_t size = 5, unsigned long long idleTolerance = 0);
+        size_t size = 5, unsigned long long idleTolerance = 0,
+        size_t minimum = 0);
     ~ConnectionPool();
     std::shared_ptr<Connection> getConnection();
     void resize(size_t num);
@@ -33,6 +36,7 @@ public:
 private:
     void releaseConnection(Mordor::PQ::Connection* conn);
     bool connectionExpired(unsigned long long freeTime) const;
+    void warmUp();
 
 private:
     std::list<std::shared_ptr<Mordor::PQ::Connection> > m_busyConnections;
@@ -50,6 +54,8 @@ private:
     FiberCondition m_condition;
     size_t m_total;
     unsigned long long m_idleTolerance;
+    /// connections taken out of the free list by warmUp() to connect
+    size_t m_warming;
 };
 
 }}
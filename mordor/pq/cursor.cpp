@@ -0,0 +1,98 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "cursor.h"
+
+#include "mordor/assert.h"
+#include "mordor/iomanager.h"
+#include "mordor/log.h"
+
+#include "connection.h"
+#include "exception.h"
+
+namespace Mordor {
+namespace PQ {
+
+static Logger::ptr g_log = Log::lookup("mordor:pq");
+
+Cursor::Cursor(std::shared_ptr<PGconn> conn, SchedulerType *scheduler)
+    : m_conn(conn),
+      m_scheduler(scheduler),
+      m_rows(0),
+      m_done(false)
+{}
+
+Cursor::~Cursor()
+{
+    if (m_done)
+        return;
+    MORDOR_LOG_DEBUG(g_log) << m_conn.get() << " cancelling after "
+        << m_rows << " rows";
+    // Rather than have the server send (and us read) every row left
+    PGcancel *cancel = PQgetCancel(m_conn.get());
+    if (cancel) {
+        char error[256];
+        if (!PQcancel(cancel, error, sizeof(error)))
+            MORDOR_LOG_WARNING(g_log) << m_conn.get() << " PQcancel(): "
+                << error;
+        PQfreeCancel(cancel);
+    }
+    try {
+        // Rows already on their way still have to be read, up to the error
+        // the cancel ends the query with (if it didn't finish first)
+        while (next());
+    } catch (QueryCanceledException &) {
+    } catch (...) {
+        MORDOR_LOG_ERROR(g_log) << m_conn.get() << " abandoning cursor: "
+            << boost::current_exception_diagnostic_information();
+    }
+}
+
+PGresult *
+Cursor::nextResult()
+{
+#ifndef WINDOWS
+    if (m_scheduler)
+        return PQ::nextResult(m_conn.get(), m_scheduler);
+#endif
+    return PQgetResult(m_conn.get());
+}
+
+bool
+Cursor::next()
+{
+    if (m_done)
+        return false;
+    PGconn *conn = m_conn.get();
+#ifndef WINDOWS
+    SchedulerSwitcher switcher(m_scheduler);
+#endif
+    std::shared_ptr<PGresult> result(nextResult(), &PQclear);
+    if (!result) {
+        m_done = true;
+        m_row = Result();
+        return false;
+    }
+    ExecStatusType status = PQresultStatus(result.get());
+    if (status == PGRES_SINGLE_TUPLE) {
+        m_row = Result(result);
+        ++m_rows;
+        return true;
+    }
+    // Anything else is the end; read the NULL after it
+    m_done = true;
+    m_row = Result();
+    std::shared_ptr<PGresult> end(nextResult(), &PQclear);
+    MORDOR_ASSERT(!end);
+    MORDOR_LOG_VERBOSE(g_log) << conn << " PQresultStatus(" << result.get()
+        << "): " << PQresStatus(status) << " after " << m_rows << " rows";
+    switch (status) {
+        case PGRES_COMMAND_OK:
+        case PGRES_TUPLES_OK:
+            return false;
+        default:
+            throwException(result.get());
+            MORDOR_NOTREACHED();
+    }
+}
+
+}}
@@ -0,0 +1,78 @@
+#ifndef __MORDOR_PQ_CURSOR_H__
+#define __MORDOR_PQ_CURSOR_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "mordor/util.h"
+#include "preparedstatement.h"
+
+namespace Mordor {
+namespace PQ {
+
+/// The rows of a statement, read one at a time as they arrive
+///
+/// A Result holds every row a query returned, so nothing can be looked at
+/// until the last one has arrived, and a query returning millions of rows
+/// needs memory for all of them.  PreparedStatement::stream() instead puts
+/// libpq in single row mode, and a Cursor hands the rows over as they're
+/// read, keeping only the current one.
+///
+/// An error part way through (a division by zero in the 5000th row, say) is
+/// thrown from next() once the rows before it have been returned.  Destroying
+/// a Cursor before next() has returned false cancels the query (PQcancel(),
+/// which blocks the thread while it connects to the server to ask), then
+/// reads and discards whatever rows were already sent, since nothing else
+/// can be done with the connection until then.
+class Cursor : Mordor::noncopyable
+{
+    friend class PreparedStatement;
+public:
+    typedef std::shared_ptr<Cursor> ptr;
+
+private:
+    Cursor(std::shared_ptr<PGconn> conn, SchedulerType *scheduler);
+
+public:
+    ~Cursor();
+
+    /// Move to the next row
+    /// @return false if there are no more
+    bool next();
+    /// How many rows next() has moved to
+    unsigned long long rows() const { return m_rows; }
+
+    /// The current row, as a Result with one row
+    const Result &row() const { return m_row; }
+
+    size_t columns() const { return m_row.columns(); }
+    size_t column(const char *name) const { return m_row.column(name); }
+    size_t column(const std::string &name) const
+    { return m_row.column(name); }
+
+    Oid getType(size_t column) const { return m_row.getType(column); }
+    bool getIsNull(size_t column) const { return m_row.getIsNull(0, column); }
+    bool getIsNull(const char *col) const { return m_row.getIsNull(0, col); }
+    bool getIsNull(const std::string &col) const
+    { return m_row.getIsNull(0, col); }
+
+    /// Get the value of a column of the current row; see Result::get()
+    template <class T> T get(size_t column) const
+        { return m_row.get<T>(0, column); }
+    template <class T> T get(const char *col) const
+        { return m_row.get<T>(0, col); }
+    template <class T> T get(const std::string &col) const
+        { return m_row.get<T>(0, col); }
+
+private:
+    PGresult *nextResult();
+
+private:
+    std::shared_ptr<PGconn> m_conn;
+    SchedulerType *m_scheduler;
+    Result m_row;
+    unsigned long long m_rows;
+    bool m_done;
+};
+
+}}
+
+#endif
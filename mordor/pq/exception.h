@@ -34,6 +34,8 @@ struct Exception : Base
 };
 
 DEFINE_MORDOR_PQ_EXCEPTION(ConnectionException, Exception);
+/// A statement in a Pipeline skipped because an earlier one failed
+DEFINE_MORDOR_PQ_EXCEPTION(PipelineAbortedException, Exception);
 
 DEFINE_MORDOR_PQ_EXCEPTION(DataException, Exception);
 DEFINE_MORDOR_PQ_EXCEPTION(ArraySubscriptError, DataException);
@@ -0,0 +1,163 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "pipeline.h"
+
+#include "mordor/assert.h"
+#include "mordor/iomanager.h"
+#include "mordor/log.h"
+
+#include "connection.h"
+#include "exception.h"
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+namespace Mordor {
+namespace PQ {
+
+static Logger::ptr g_log = Log::lookup("mordor:pq");
+
+Pipeline::Pipeline(std::shared_ptr<PGconn> conn, SchedulerType *scheduler)
+    : m_conn(conn),
+      m_scheduler(scheduler),
+      m_pending(0),
+      m_unsynced(0),
+      m_syncs(0)
+{}
+
+Pipeline::~Pipeline()
+{
+    PGconn *conn = m_conn.get();
+    try {
+        if (m_unsynced)
+            sync();
+        while (m_pending) {
+            try {
+                next();
+            } catch (ConnectionException &) {
+                throw;
+            } catch (Exception &) {
+                // Already logged; the caller didn't want it
+            }
+        }
+        // Then the sync points after them
+        bool nullResult = false;
+        while (m_syncs) {
+            std::shared_ptr<PGresult> result(nextResult(), &PQclear);
+            if (!result) {
+                if (nullResult)
+                    throwException(conn);
+                nullResult = true;
+                continue;
+            }
+            nullResult = false;
+            if (PQresultStatus(result.get()) == PGRES_PIPELINE_SYNC)
+                --m_syncs;
+        }
+        if (!PQexitPipelineMode(conn))
+            throwException(conn);
+        MORDOR_LOG_DEBUG(g_log) << conn << " PQexitPipelineMode()";
+    } catch (...) {
+        MORDOR_LOG_ERROR(g_log) << conn << " abandoning pipeline: "
+            << boost::current_exception_diagnostic_information();
+    }
+}
+
+void
+Pipeline::queue(PreparedStatement &stmt)
+{
+    PGconn *conn = m_conn.get();
+    MORDOR_ASSERT(stmt.m_conn.lock() == m_conn);
+    const char *api = stmt.send(conn);
+    ++m_pending;
+    ++m_unsynced;
+#ifndef WINDOWS
+    // Send what fits now, so the server can get started, but leave the rest
+    // buffered rather than wait for room
+    if (m_scheduler && PQflush(conn) == -1)
+        throwException(conn);
+#endif
+    MORDOR_LOG_VERBOSE(g_log) << conn << " " << api << "(\"" << stmt.m_command
+        << stmt.m_name << "\", " << stmt.m_params.size() << ") queued";
+}
+
+void
+Pipeline::sync()
+{
+    PGconn *conn = m_conn.get();
+#ifndef WINDOWS
+    SchedulerSwitcher switcher(m_scheduler);
+#endif
+    if (!PQpipelineSync(conn))
+        throwException(conn);
+    ++m_syncs;
+    MORDOR_LOG_DEBUG(g_log) << conn << " PQpipelineSync(): " << m_unsynced
+        << " statements";
+    m_unsynced = 0;
+#ifndef WINDOWS
+    if (m_scheduler)
+        flushPipeline(conn, m_scheduler);
+#endif
+}
+
+PGresult *
+Pipeline::nextResult()
+{
+#ifndef WINDOWS
+    if (m_scheduler)
+        return PQ::nextResult(m_conn.get(), m_scheduler);
+#endif
+    return PQgetResult(m_conn.get());
+}
+
+Result
+Pipeline::next()
+{
+    PGconn *conn = m_conn.get();
+    MORDOR_ASSERT(m_pending);
+    // The server doesn't send anything for a batch until it's been synced
+    if (m_pending <= m_unsynced)
+        sync();
+#ifndef WINDOWS
+    SchedulerSwitcher switcher(m_scheduler);
+#endif
+    std::shared_ptr<PGresult> result;
+    bool nullResult = false;
+    while (true) {
+        result.reset(nextResult(), &PQclear);
+        if (!result) {
+            // One NULL can come between one statement's Result and the next
+            // sync point; more means nothing is coming
+            if (nullResult)
+                throwException(conn);
+            nullResult = true;
+            continue;
+        }
+        nullResult = false;
+        if (PQresultStatus(result.get()) != PGRES_PIPELINE_SYNC)
+            break;
+        MORDOR_ASSERT(m_syncs);
+        --m_syncs;
+    }
+    --m_pending;
+    // Each statement's Results end with a NULL
+    std::shared_ptr<PGresult> end(nextResult(), &PQclear);
+    MORDOR_ASSERT(!end);
+    ExecStatusType status = PQresultStatus(result.get());
+    MORDOR_LOG_VERBOSE(g_log) << conn << " PQresultStatus(" << result.get()
+        << "): " << PQresStatus(status) << ", " << m_pending << " pending";
+    switch (status) {
+        case PGRES_COMMAND_OK:
+        case PGRES_TUPLES_OK:
+            return Result(result);
+        case PGRES_PIPELINE_ABORTED:
+            MORDOR_THROW_EXCEPTION(PipelineAbortedException(
+                "Skipped because an earlier statement in the batch failed"));
+        default:
+            throwException(result.get());
+            MORDOR_NOTREACHED();
+    }
+}
+
+}}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef __MORDOR_PQ_PIPELINE_H__
+#define __MORDOR_PQ_PIPELINE_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "mordor/util.h"
+#include "preparedstatement.h"
+
+// Pipeline mode needs libpq 14 or later
+#ifdef LIBPQ_HAS_PIPELINING
+
+namespace Mordor {
+namespace PQ {
+
+/// Statements sent to the server without waiting for each other's Results
+///
+/// Each statement queue()d is sent as soon as there's room, and the server
+/// runs them in order; sync() marks the end of a batch, and next() returns
+/// their Results in the order they were queued (syncing first if needed).
+/// A batch of N statements costs one round trip instead of N.
+/// The parameters are copied when a statement is queued, so the same
+/// PreparedStatement can be rebound and queued again straight away.
+///
+/// Outside of an explicit transaction, each batch (everything up to a
+/// sync()) runs as one implicit transaction, so it is all or nothing: when
+/// a statement fails, next() throws its exception as execute() would, the
+/// statements before it in the batch are rolled back even though their
+/// Results were already returned, and the server skips everything queued
+/// after it up to the next sync(); next() throws PipelineAbortedException
+/// for each of those.  Batches after the sync() aren't affected.
+///
+/// While a Pipeline exists its Connection is in pipeline mode, and must not
+/// be used for anything else.  Destroying it discards any Results not yet
+/// retrieved.  Without an IOManager the connection blocks, and a batch
+/// whose statements and Results don't fit in the socket buffers can
+/// deadlock; use an IOManager for big batches.
+class Pipeline : Mordor::noncopyable
+{
+    friend class Connection;
+public:
+    typedef std::shared_ptr<Pipeline> ptr;
+
+private:
+    Pipeline(std::shared_ptr<PGconn> conn, SchedulerType *scheduler);
+
+public:
+    ~Pipeline();
+
+    /// Send stmt, with the parameters bound to it
+    void queue(PreparedStatement &stmt);
+    /// Bind params to stmt (starting at $1), then send it
+    template <class... T>
+    void queue(PreparedStatement &stmt, const T &... params)
+    {
+        stmt.bindAll(1, params...);
+        queue(stmt);
+    }
+
+    /// Ends the current batch and sends everything still unsent
+    void sync();
+    /// The Result of the oldest statement whose Result hasn't been retrieved
+    Result next();
+    /// How many statements have been queued whose Results haven't been
+    /// retrieved
+    size_t pending() const { return m_pending; }
+
+private:
+    PGresult *nextResult();
+
+private:
+    std::shared_ptr<PGconn> m_conn;
+    SchedulerType *m_scheduler;
+    size_t m_pending, m_unsynced, m_syncs;
+};
+
+}}
+
+#endif
+
+#endif
@@ -8,6 +8,7 @@
 #include "mordor/iomanager.h"
 
 #include "connection.h"
+#include "cursor.h"
 #include "exception.h"
 
 #define BOOLOID 16
@@ -195,10 +196,7 @@ PreparedStatement::execute()
     if (m_name.empty()) {
 #ifndef WINDOWS
         if (m_scheduler) {
-            api = "PQsendQueryParams";
-            if (!PQsendQueryParams(conn, m_command.c_str(),
-                nParams, paramTypes, params, paramLengths, paramFormats, m_resultFormat))
-                throwException(conn);
+            api = send(conn);
             flush(conn, m_scheduler);
             next.reset(nextResult(conn, m_scheduler), &PQclear);
             while (next) {
@@ -229,10 +227,7 @@ PreparedStatement::execute()
     } else {
 #ifndef WINDOWS
         if (m_scheduler) {
-            api = "PQsendQueryPrepared";
-            if (!PQsendQueryPrepared(conn, m_name.c_str(),
-                nParams, params, paramLengths, paramFormats, 1))
-                throwException(conn);
+            api = send(conn);
             flush(conn, m_scheduler);
             next.reset(nextResult(conn, m_scheduler), &PQclear);
             while (next) {
@@ -278,6 +273,52 @@ PreparedStatement::execute()
     }
 }
 
+Cursor::ptr
+PreparedStatement::stream()
+{
+    std::shared_ptr<PGconn> conn = m_conn.lock();
+#ifndef WINDOWS
+    SchedulerSwitcher switcher(m_scheduler);
+#endif
+    const char *api = send(conn.get());
+    if (!PQsetSingleRowMode(conn.get()))
+        throwException(conn.get());
+#ifndef WINDOWS
+    if (m_scheduler)
+        flush(conn.get(), m_scheduler);
+#endif
+    MORDOR_LOG_VERBOSE(g_log) << conn.get() << " " << api << "(\"" << m_command
+        << m_name << "\", " << m_params.size() << "), PQsetSingleRowMode()";
+    return Cursor::ptr(new Cursor(conn, m_scheduler));
+}
+
+const char *
+PreparedStatement::send(PGconn *conn)
+{
+    int nParams = (int)m_params.size();
+    Oid *paramTypes = NULL;
+    int *paramLengths = NULL, *paramFormats = NULL;
+    const char **params = NULL;
+    if (nParams) {
+        if (m_name.empty())
+            paramTypes = &m_paramTypes[0];
+        params = &m_params[0];
+        paramLengths = &m_paramLengths[0];
+        paramFormats = &m_paramFormats[0];
+    }
+    if (m_name.empty()) {
+        if (!PQsendQueryParams(conn, m_command.c_str(),
+            nParams, paramTypes, params, paramLengths, paramFormats, m_resultFormat))
+            throwException(conn);
+        return "PQsendQueryParams";
+    } else {
+        if (!PQsendQueryPrepared(conn, m_name.c_str(),
+            nParams, params, paramLengths, paramFormats, 1))
+            throwException(conn);
+        return "PQsendQueryPrepared";
+    }
+}
+
 void
 PreparedStatement::setType(size_t param, Oid type)
 {
@@ -16,6 +16,8 @@ class Scheduler;
 
 namespace PQ {
 
+class Cursor;
+
 #ifdef WIN32
 typedef Scheduler SchedulerType;
 #else
@@ -28,6 +30,8 @@ struct Skip {};
 class PreparedStatement
 {
     friend class Connection;
+    friend class Cursor;
+    friend class Pipeline;
 public:
     enum ResultFormat {
         TEXT   = 0,
@@ -153,8 +157,29 @@ public:
         return execute();
     }
 
+    /// Run the statement, fetching its rows one at a time as they're read
+    /// rather than all of them up front; see Cursor
+    std::shared_ptr<Cursor> stream();
+    template <class... T>
+    std::shared_ptr<Cursor> stream(const T &... params)
+    {
+        bindAll(1, params...);
+        return stream();
+    }
+
 private:
     void bind(size_t param, const Skip &) {}
+    void bindAll(size_t param) {}
+    template <class T, class... Rest>
+    void bindAll(size_t param, const T &value, const Rest &... rest)
+    {
+        bind(param, value);
+        bindAll(param + 1, rest...);
+    }
+    /// Sends the statement with its current parameters, without waiting for
+    /// a result
+    /// @return The libpq function used, for logging
+    const char *send(PGconn *conn);
     void setType(size_t param, Oid type);
     void ensure(size_t count);
 
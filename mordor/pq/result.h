@@ -8,11 +8,15 @@ namespace Mordor {
 namespace PQ {
 
 class Connection;
+class Cursor;
+class Pipeline;
 class PreparedStatement;
 
 class Result
 {
     friend class Connection;
+    friend class Cursor;
+    friend class Pipeline;
     friend class PreparedStatement;
 private:
     Result(std::shared_ptr<PGresult> result)
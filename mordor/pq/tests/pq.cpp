@@ -5,11 +5,14 @@
 #include <iostream>
 
 #include <boost/date_time/posix_time/posix_time_io.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include "mordor/config.h"
 #include "mordor/iomanager.h"
 #include "mordor/main.h"
+#include "mordor/pq/binarycopy.h"
 #include "mordor/pq/connection.h"
+#include "mordor/pq/connectionpool.h"
 #include "mordor/pq/exception.h"
 #include "mordor/pq/transaction.h"
 #include "mordor/version.h"
@@ -331,3 +334,353 @@ static void copyOut(IOManager *ioManager = NULL)
 
 MORDOR_PQ_UNITTEST(copyOut)
 { copyOut(ioManager); }
+
+#ifdef LIBPQ_HAS_PIPELINING
+MORDOR_PQ_UNITTEST(pipeline)
+{
+    Connection conn(g_goodConnString, ioManager);
+    conn.execute("CREATE TEMP TABLE pipelined (id INTEGER, name TEXT)");
+    PreparedStatement insert = conn.prepare(
+        "INSERT INTO pipelined VALUES($1, $2)");
+    PreparedStatement select = conn.prepare(
+        "SELECT name FROM pipelined WHERE id=$1");
+    {
+        Pipeline::ptr pipeline = conn.pipeline();
+        for (int i = 0; i < 1000; ++i)
+            pipeline->queue(insert, i, boost::lexical_cast<std::string>(i));
+        pipeline->queue(select, 42);
+        MORDOR_TEST_ASSERT_EQUAL(pipeline->pending(), 1001u);
+        for (int i = 0; i < 1000; ++i)
+            pipeline->next();
+        Result result = pipeline->next();
+        MORDOR_TEST_ASSERT_EQUAL(pipeline->pending(), 0u);
+        MORDOR_TEST_ASSERT_EQUAL(result.rows(), 1u);
+        MORDOR_TEST_ASSERT_EQUAL(result.get<std::string>(0u, (size_t)0u), "42");
+    }
+    // Back out of pipeline mode
+    Result result = conn.execute("SELECT COUNT(*) FROM pipelined");
+    MORDOR_TEST_ASSERT_EQUAL(result.get<long long>(0u, (size_t)0u), 1000);
+}
+
+MORDOR_PQ_UNITTEST(pipelineError)
+{
+    Connection conn(g_goodConnString, ioManager);
+    conn.execute("CREATE TEMP TABLE pipelined (id INTEGER)");
+    PreparedStatement insert = conn.prepare("INSERT INTO pipelined VALUES($1)");
+    PreparedStatement divide = conn.prepare("SELECT 1 / $1");
+    {
+        Pipeline::ptr pipeline = conn.pipeline();
+        pipeline->queue(insert, 1);
+        pipeline->queue(divide, 0);
+        pipeline->queue(insert, 2);
+        pipeline->sync();
+        // A new batch isn't affected
+        pipeline->queue(insert, 3);
+        pipeline->next();
+        MORDOR_TEST_ASSERT_EXCEPTION(pipeline->next(), DivisionByZeroException);
+        MORDOR_TEST_ASSERT_EXCEPTION(pipeline->next(), PipelineAbortedException);
+        pipeline->next();
+        // Left for the destructor to collect
+        pipeline->queue(insert, 4);
+        pipeline->queue(divide, 0);
+    }
+    // Each batch was its own implicit transaction: the failed divides took
+    // 1 and 4 down with them, and 2 was never run
+    Result result = conn.execute("SELECT SUM(id) FROM pipelined");
+    MORDOR_TEST_ASSERT_EQUAL(result.get<long long>(0u, (size_t)0u), 3);
+}
+#endif
+
+MORDOR_PQ_UNITTEST(stream)
+{
+    Connection conn(g_goodConnString, ioManager);
+    PreparedStatement stmt = conn.prepare(
+        "SELECT x, 'row ' || x AS name FROM generate_series(1, $1) x");
+    Cursor::ptr cursor = stmt.stream(100000);
+    long long sum = 0;
+    while (cursor->next()) {
+        MORDOR_TEST_ASSERT_EQUAL(cursor->columns(), 2u);
+        long long x = cursor->get<int>((size_t)0u);
+        MORDOR_TEST_ASSERT_EQUAL(cursor->rows(), (unsigned long long)x);
+        MORDOR_TEST_ASSERT_EQUAL(cursor->get<std::string>("name"),
+            "row " + boost::lexical_cast<std::string>(x));
+        sum += x;
+    }
+    MORDOR_TEST_ASSERT_EQUAL(cursor->rows(), 100000u);
+    MORDOR_TEST_ASSERT_EQUAL(sum, 5000050000ll);
+    MORDOR_TEST_ASSERT(!cursor->next());
+}
+
+MORDOR_PQ_UNITTEST(streamError)
+{
+    Connection conn(g_goodConnString, ioManager);
+    PreparedStatement stmt = conn.prepare(
+        "SELECT 1 / (5000 - x) FROM generate_series(1, 10000) x");
+    Cursor::ptr cursor = stmt.stream();
+    MORDOR_TEST_ASSERT_EXCEPTION(while (cursor->next()), DivisionByZeroException);
+    MORDOR_TEST_ASSERT_LESS_THAN(cursor->rows(), 5000u);
+    MORDOR_TEST_ASSERT(!cursor->next());
+    // The connection is still usable
+    Result result = conn.execute("SELECT 1");
+    MORDOR_TEST_ASSERT_EQUAL(result.get<int>(0u, (size_t)0u), 1);
+}
+
+MORDOR_PQ_UNITTEST(streamAbandoned)
+{
+    Connection conn(g_goodConnString, ioManager);
+    PreparedStatement stmt = conn.prepare(
+        "SELECT x FROM generate_series(1, 10000000) x");
+    {
+        // Cancelled, rather than read to the end
+        Cursor::ptr cursor = stmt.stream();
+        MORDOR_TEST_ASSERT(cursor->next());
+        MORDOR_TEST_ASSERT_EQUAL(cursor->get<int>((size_t)0u), 1);
+    }
+    Result result = conn.execute("SELECT 2");
+    MORDOR_TEST_ASSERT_EQUAL(result.get<int>(0u, (size_t)0u), 2);
+}
+
+MORDOR_UNITTEST(PQ, binaryCopyFormat)
+{
+    MemoryStream::ptr stream(new MemoryStream());
+    BinaryCopyWriter writer(stream);
+    writer.row(2);
+    writer.append(1);
+    writer.append("ab");
+    writer.finish();
+    MORDOR_TEST_ASSERT(stream->buffer() == std::string(
+        "PGCOPY\n\377\r\n\0"            // signature
+        "\0\0\0\0\0\0\0\0"              // flags, header extension
+        "\0\2"                          // fields
+        "\0\0\0\4" "\0\0\0\1"           // 1
+        "\0\0\0\2" "ab"                 // "ab"
+        "\377\377", 37));               // trailer
+}
+
+MORDOR_UNITTEST(PQ, binaryCopyRoundTrip)
+{
+    const boost::posix_time::ptime sometime(boost::gregorian::date(2009, 5, 19),
+        boost::posix_time::hours(15) + boost::posix_time::minutes(53) +
+        boost::posix_time::microseconds(123456));
+    MemoryStream::ptr stream(new MemoryStream());
+    // A small buffer, so rows are split across writes
+    BinaryCopyWriter writer(stream, 7);
+    for (int i = 0; i < 1000; ++i) {
+        writer.row(10);
+        writer.append(i % 2 == 0);
+        writer.append('M');
+        writer.append((short)-i);
+        writer.append(i);
+        writer.append(i * 1000000000ll);
+        writer.append(i / 4.0f);
+        writer.append(i / 8.0);
+        writer.append(std::string(i % 50, 'x'));
+        writer.append(sometime + boost::posix_time::seconds(i));
+        if (i % 3)
+            writer.append(Null());
+        else
+            writer.append(boost::posix_time::ptime());
+    }
+    writer.finish();
+    MORDOR_TEST_ASSERT_EQUAL(writer.rows(), 1000u);
+
+    stream->seek(0);
+    BinaryCopyReader reader(stream);
+    for (int i = 0; i < 1000; ++i) {
+        MORDOR_TEST_ASSERT(reader.next());
+        MORDOR_TEST_ASSERT_EQUAL(reader.columns(), 10u);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<bool>(0), i % 2 == 0);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<char>(1), 'M');
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<short>(2), (short)-i);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<int>(3), i);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<long long>(3), i);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<long long>(4), i * 1000000000ll);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<float>(5), i / 4.0f);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<double>(6), i / 8.0);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<std::string>(7),
+            std::string(i % 50, 'x'));
+        MORDOR_TEST_ASSERT(!reader.getIsNull(7));
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<boost::posix_time::ptime>(8),
+            sometime + boost::posix_time::seconds(i));
+        MORDOR_TEST_ASSERT(reader.getIsNull(9));
+        MORDOR_TEST_ASSERT(reader.get<boost::posix_time::ptime>(9)
+            .is_not_a_date_time());
+    }
+    MORDOR_TEST_ASSERT(!reader.next());
+    MORDOR_TEST_ASSERT_EQUAL(reader.rows(), 1000u);
+}
+
+MORDOR_UNITTEST(PQ, binaryCopyTruncated)
+{
+    MemoryStream::ptr stream(new MemoryStream(Buffer("garbage garbage garbage")));
+    BinaryCopyReader garbage(stream);
+    MORDOR_TEST_ASSERT_EXCEPTION(garbage.next(), PQ::Exception);
+
+    // One field of four bytes, with only one of them there
+    static const char partial[] = "PGCOPY\n\377\r\n\0" "\0\0\0\0\0\0\0\0"
+        "\0\1" "\0\0\0\4" "\0";
+    stream.reset(new MemoryStream(Buffer(partial, sizeof(partial) - 1)));
+    BinaryCopyReader truncated(stream);
+    MORDOR_TEST_ASSERT_EXCEPTION(truncated.next(), UnexpectedEofException);
+
+    // A negative header extension length
+    static const char badExtension[] = "PGCOPY\n\377\r\n\0" "\0\0\0\0"
+        "\377\377\377\376";
+    stream.reset(new MemoryStream(Buffer(badExtension,
+        sizeof(badExtension) - 1)));
+    BinaryCopyReader extension(stream);
+    MORDOR_TEST_ASSERT_EXCEPTION(extension.next(), PQ::Exception);
+
+    // A field count below -1 (the trailer)
+    static const char badFields[] = "PGCOPY\n\377\r\n\0" "\0\0\0\0\0\0\0\0"
+        "\377\376";
+    stream.reset(new MemoryStream(Buffer(badFields, sizeof(badFields) - 1)));
+    BinaryCopyReader fields(stream);
+    MORDOR_TEST_ASSERT_EXCEPTION(fields.next(), PQ::Exception);
+
+    // A field length below -1 (NULL)
+    static const char badLength[] = "PGCOPY\n\377\r\n\0" "\0\0\0\0\0\0\0\0"
+        "\0\1" "\377\377\377\376";
+    stream.reset(new MemoryStream(Buffer(badLength, sizeof(badLength) - 1)));
+    BinaryCopyReader length(stream);
+    MORDOR_TEST_ASSERT_EXCEPTION(length.next(), PQ::Exception);
+}
+
+static void binaryCopy(IOManager *ioManager)
+{
+    Connection conn(g_goodConnString, ioManager);
+    conn.execute("CREATE TEMP TABLE typed (id BIGINT, name TEXT, "
+        "efficiency DOUBLE PRECISION, awesome BOOLEAN, sometime TIMESTAMP)");
+    const boost::posix_time::ptime sometime(boost::gregorian::date(2009, 5, 19),
+        boost::posix_time::hours(15));
+    BinaryCopyWriter writer(conn.copyIn("typed").binary()());
+    for (long long i = 1; i <= 10000; ++i) {
+        writer.row(5);
+        writer.append(i);
+        writer.append("row " + boost::lexical_cast<std::string>(i));
+        writer.append(i / 2.0);
+        writer.append(i % 2 == 0);
+        if (i % 10)
+            writer.append(sometime + boost::posix_time::seconds(i));
+        else
+            writer.append(Null());
+    }
+    writer.finish();
+    Result result = conn.execute("SELECT COUNT(*), SUM(id), "
+        "COUNT(sometime) FROM typed");
+    MORDOR_TEST_ASSERT_EQUAL(result.get<long long>(0u, (size_t)0u), 10000);
+    MORDOR_TEST_ASSERT_EQUAL(result.get<long long>(0u, 1u), 50005000);
+    MORDOR_TEST_ASSERT_EQUAL(result.get<long long>(0u, 2u), 9000);
+
+    BinaryCopyReader reader(conn.copyOut("typed").binary()());
+    long long expected = 0;
+    while (reader.next()) {
+        ++expected;
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<long long>(0), expected);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<std::string>(1),
+            "row " + boost::lexical_cast<std::string>(expected));
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<double>(2), expected / 2.0);
+        MORDOR_TEST_ASSERT_EQUAL(reader.get<bool>(3), expected % 2 == 0);
+        MORDOR_TEST_ASSERT_EQUAL(reader.getIsNull(4), expected % 10 == 0);
+    }
+    MORDOR_TEST_ASSERT_EQUAL(expected, 10000);
+}
+
+MORDOR_PQ_UNITTEST(binaryCopy)
+{ binaryCopy(ioManager); }
+
+static long long preparedOnServer(Connection &conn)
+{
+    return conn.execute("SELECT COUNT(*) FROM pg_prepared_statements")
+        .get<long long>(0u, (size_t)0u);
+}
+
+static void prepareCached(IOManager *ioManager)
+{
+    Connection conn(g_goodConnString, ioManager);
+    PreparedStatement plusOne = conn.prepareCached("SELECT $1::integer + 1");
+    MORDOR_TEST_ASSERT_EQUAL(plusOne.execute(1).get<int>(0u, (size_t)0u), 2);
+    plusOne = conn.prepareCached("SELECT $1::integer + 1");
+    MORDOR_TEST_ASSERT_EQUAL(plusOne.execute(2).get<int>(0u, (size_t)0u), 3);
+    MORDOR_TEST_ASSERT_EQUAL(preparedOnServer(conn), 1);
+
+    // The least recently used statement makes room for the new one
+    conn.prepareCached("SELECT $1::integer + 2");
+    conn.prepareCached("SELECT $1::integer + 1");
+    conn.prepareCached("SELECT $1::integer + 3");
+    MORDOR_TEST_ASSERT_EQUAL(preparedOnServer(conn), 2);
+    plusOne = conn.prepareCached("SELECT $1::integer + 1");
+    MORDOR_TEST_ASSERT_EQUAL(plusOne.execute(3).get<int>(0u, (size_t)0u), 4);
+    MORDOR_TEST_ASSERT_EQUAL(preparedOnServer(conn), 2);
+
+    // A new session has none of them
+    conn.reset();
+    MORDOR_TEST_ASSERT_EQUAL(preparedOnServer(conn), 0);
+    plusOne = conn.prepareCached("SELECT $1::integer + 1");
+    MORDOR_TEST_ASSERT_EQUAL(plusOne.execute(4).get<int>(0u, (size_t)0u), 5);
+}
+
+MORDOR_PQ_UNITTEST(prepareCached)
+{
+    ConfigVarBase::ptr cacheSize = Config::lookup("pq.statementcache.size");
+    MORDOR_TEST_ASSERT(cacheSize);
+    MORDOR_TEST_ASSERT(cacheSize->fromString("2"));
+    try {
+        prepareCached(ioManager);
+    } catch (...) {
+        cacheSize->fromString("64");
+        throw;
+    }
+    cacheSize->fromString("64");
+}
+
+MORDOR_UNITTEST(PQ, connectionPoolStatementCache)
+{
+    IOManager ioManager;
+    ConnectionPool pool(g_goodConnString, &ioManager, 1, 0, 1);
+    {
+        std::shared_ptr<Connection> conn = pool.getConnection();
+        conn->prepareCached("SELECT 1");
+        MORDOR_TEST_ASSERT_EQUAL(preparedOnServer(*conn), 1);
+    }
+    // Same connection, same session, same statements
+    std::shared_ptr<Connection> conn = pool.getConnection();
+    conn->prepareCached("SELECT 1");
+    MORDOR_TEST_ASSERT_EQUAL(preparedOnServer(*conn), 1);
+}
+
+MORDOR_UNITTEST(PQ, connectionPoolAbandonedTransaction)
+{
+    IOManager ioManager;
+    ConnectionPool pool(g_goodConnString, &ioManager, 1);
+    {
+        std::shared_ptr<Connection> conn = pool.getConnection();
+        conn->prepareCached("SELECT 1");
+        conn->execute("BEGIN");
+        MORDOR_TEST_ASSERT_EQUAL(conn->transactionStatus(), PQTRANS_INTRANS);
+    }
+    {
+        // Rolled back, rather than reconnected, so the statement survives
+        std::shared_ptr<Connection> conn = pool.getConnection();
+        MORDOR_TEST_ASSERT_EQUAL(conn->transactionStatus(), PQTRANS_IDLE);
+        MORDOR_TEST_ASSERT_EQUAL(preparedOnServer(*conn), 1);
+        conn->execute("BEGIN");
+        // (Through a PreparedStatement, because a failed execute() marks
+        // the whole connection bad)
+        MORDOR_TEST_ASSERT_EXCEPTION(conn->prepare("SELECT 1/0").execute(),
+            PQ::Exception);
+        MORDOR_TEST_ASSERT_EQUAL(conn->transactionStatus(), PQTRANS_INERROR);
+    }
+    std::shared_ptr<Connection> conn = pool.getConnection();
+    MORDOR_TEST_ASSERT_EQUAL(conn->transactionStatus(), PQTRANS_IDLE);
+    MORDOR_TEST_ASSERT_EQUAL(preparedOnServer(*conn), 1);
+}
+
+MORDOR_UNITTEST(PQ, connectionPoolWarmUpFails)
+{
+    IOManager ioManager;
+    // Warming up can't connect; checking out tries again, and throws
+    ConnectionPool pool("host=/nonexistent/mordor", &ioManager, 3, 0, 2);
+    MORDOR_TEST_ASSERT_EXCEPTION(pool.getConnection(), ConnectionException);
+    MORDOR_TEST_ASSERT_EXCEPTION(pool.getConnection(), ConnectionException);
+}
@@ -12,21 +12,30 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:scheduler");
 
-ThreadLocalStorage<Scheduler *> Scheduler::t_scheduler;
-ThreadLocalStorage<Fiber *> Scheduler::t_fiber;
+// In work stealing mode, how many batches a thread takes from its own queue
+// before it looks at the shared one regardless
+static const unsigned int g_sharedQueueInterval = 16;
 
-Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
+ThreadLocalStorage<Scheduler *, Scheduler> Scheduler::t_scheduler;
+ThreadLocalStorage<Fiber *, Scheduler::FiberTag> Scheduler::t_fiber;
+ThreadLocalStorage<Scheduler::WorkQueue *, Scheduler::QueueTag>
+    Scheduler::t_queue;
+
+Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize,
+    bool workStealing)
     : m_activeThreadCount(0),
       m_idleThreadCount(0),
       m_stopping(true),
       m_autoStop(false),
-      m_batchSize(batchSize)
+      m_batchSize(batchSize),
+      m_workStealing(workStealing)
 {
     MORDOR_ASSERT(threads >= 1);
     if (useCaller) {
         --threads;
         MORDOR_ASSERT(getThis() == NULL);
         t_scheduler = this;
+        t_queue = NULL;
         m_rootFiber.reset(new Fiber(boost::bind(&Scheduler::run, this)));
         t_scheduler = this;
         t_fiber = m_rootFiber.get();
@@ -42,6 +51,7 @@ Scheduler::~Scheduler()
     MORDOR_ASSERT(m_stopping);
     if (getThis() == this) {
         t_scheduler = NULL;
+        t_queue = NULL;
     }
 }
 
@@ -76,7 +86,7 @@ bool
 Scheduler::hasWorkToDo()
 {
     std::lock_guard<std::mutex> lock(m_mutex);
-    return !m_fibers.empty();
+    return !m_fibers.empty() || !queuesEmpty();
 }
 
 void
@@ -152,7 +162,8 @@ bool
 Scheduler::stopping()
 {
     std::lock_guard<std::mutex> lock(m_mutex);
-    return m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+    return m_stopping && m_fibers.empty() && queuesEmpty() &&
+        m_activeThreadCount == 0;
 }
 
 void
@@ -249,22 +260,43 @@ Scheduler::run()
     }
     Fiber::ptr idleFiber(new Fiber(boost::bind(&Scheduler::idle, this)));
     MORDOR_LOG_VERBOSE(g_log) << this << " starting thread with idle fiber " << idleFiber;
+    WorkQueue *queue = NULL;
+    if (m_workStealing) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        queue = &queueFor(gettid());
+        t_queue = queue;
+    }
     Fiber::ptr dgFiber;
     // use a vector for O(1) .size()
     std::vector<FiberAndThread> batch;
     batch.reserve(m_batchSize);
     bool isActive = false;
+    unsigned int localBatches = 0;
     while (true) {
         MORDOR_ASSERT(batch.empty());
         bool dontIdle = false;
         bool tickleMe = false;
-        {
+        tid_t pinnedThread = emptytid();
+        // Every so often look at the shared queue even though our own has
+        // work; a fiber that keeps rescheduling itself would otherwise keep
+        // work from outside waiting, and this thread from ever retiring
+        if (queue && ++localBatches < g_sharedQueueInterval) {
+            // Our own queue first; this is the only lock a busy thread takes
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            dequeue(queue->pinned, batch, isActive, dontIdle);
+            dequeue(queue->fibers, batch, isActive, dontIdle);
+            // There's more than we can handle; let an idle thread steal it
+            if (batch.size() == m_batchSize && !queue->fibers.empty())
+                tickleMe = true;
+        }
+        if (batch.empty()) {
+            localBatches = 0;
             std::lock_guard<std::mutex> lock(m_mutex);
             // Kill ourselves off if needed
             if (m_threads.size() > m_threadCount && gettid() != m_rootThread) {
                 // Accounting
                 if (isActive)
-                    --m_activeThreadCount;
+                    atomicDecrement(m_activeThreadCount);
                 // Kill off the idle fiber
                 try {
                     throw boost::enable_current_exception(
@@ -278,6 +310,7 @@ Scheduler::run()
                     it != m_threads.end();
                     ++it)
                     if ((*it)->tid() == gettid()) {
+                        retireQueue(queue);
                         m_threads.erase(it);
                         if (m_threads.size() > m_threadCount)
                             tickle();
@@ -298,8 +331,8 @@ Scheduler::run()
                         << " skipping item scheduled for thread "
                         << it->thread;
 
-                    // Wake up another thread to hopefully service this
-                    tickleMe = true;
+                    // Wake up that thread to service this
+                    pinnedThread = it->thread;
                     dontIdle = true;
                     ++it;
                     continue;
@@ -324,15 +357,27 @@ Scheduler::run()
                 batch.push_back(*it);
                 it = m_fibers.erase(it);
                 if (!isActive) {
-                    ++m_activeThreadCount;
+                    atomicIncrement(m_activeThreadCount);
                     isActive = true;
                 }
             }
+            if (queue && batch.empty()) {
+                // Our own queue, if it was skipped to get here
+                std::lock_guard<std::mutex> lock2(queue->mutex);
+                dequeue(queue->pinned, batch, isActive, dontIdle);
+                dequeue(queue->fibers, batch, isActive, dontIdle);
+                if (batch.size() == m_batchSize && !queue->fibers.empty())
+                    tickleMe = true;
+            }
+            if (queue && batch.empty())
+                steal(*queue, batch, isActive, tickleMe, dontIdle);
             if (batch.empty() && isActive) {
-                --m_activeThreadCount;
+                atomicDecrement(m_activeThreadCount);
                 isActive = false;
             }
         }
+        if (pinnedThread != emptytid())
+            tickleThread(pinnedThread);
         if (tickleMe)
             tickle();
         MORDOR_LOG_DEBUG(g_log) << this
@@ -346,6 +391,10 @@ Scheduler::run()
 
             if (idleFiber->state() == Fiber::TERM) {
                 MORDOR_LOG_DEBUG(g_log) << this << " idle fiber terminated";
+                if (queue) {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    retireQueue(queue);
+                }
                 if (gettid() == m_rootThread)
                     m_callingFiber.reset();
                 // Unblock the next thread
@@ -399,7 +448,8 @@ Scheduler::run()
                     batch.clear();
                     // decrease the activeCount as this thread is in exception
                     isActive = false;
-                    --m_activeThreadCount;
+                    atomicDecrement(m_activeThreadCount);
+                    retireQueue(queue);
                 }
                 throw;
             }
@@ -407,6 +457,175 @@ Scheduler::run()
     }
 }
 
+bool
+Scheduler::scheduleWorkStealing(FiberAndThread &ft)
+{
+    MORDOR_ASSERT(ft.fiber || ft.dg);
+    WorkQueue *queue = Scheduler::getThis() == this ? t_queue.get() : NULL;
+    if (queue && (ft.thread == emptytid() || ft.thread == queue->thread)) {
+        // Scheduling onto our own queue; nobody else needs to know unless
+        // there's already work waiting that an idle thread could steal
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        bool tickleMe = !queue->fibers.empty();
+        if (ft.thread == emptytid())
+            queue->fibers.push_back(std::move(ft));
+        else
+            queue->pinned.push_back(std::move(ft));
+        return tickleMe;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (ft.thread == emptytid()) {
+        m_fibers.push_back(std::move(ft));
+    } else {
+        WorkQueue &target = queueFor(ft.thread);
+        std::lock_guard<std::mutex> lock2(target.mutex);
+        target.pinned.push_back(std::move(ft));
+    }
+    return true;
+}
+
+Scheduler::WorkQueue &
+Scheduler::queueFor(tid_t thread)
+{
+    for (std::vector<std::shared_ptr<WorkQueue> >::const_iterator it
+        (m_queues.begin());
+        it != m_queues.end();
+        ++it) {
+        if ((*it)->thread == thread)
+            return **it;
+    }
+    // The thread may not have started running yet; create its queue now so
+    // work pinned to it has somewhere to go
+    m_queues.push_back(std::shared_ptr<WorkQueue>(new WorkQueue(thread)));
+    return *m_queues.back();
+}
+
+void
+Scheduler::retireQueue(WorkQueue *queue)
+{
+    if (!queue)
+        return;
+    MORDOR_ASSERT(t_queue.get() == queue);
+    t_queue = NULL;
+    for (std::vector<std::shared_ptr<WorkQueue> >::iterator it
+        (m_queues.begin());
+        it != m_queues.end();
+        ++it) {
+        if (it->get() != queue)
+            continue;
+        {
+            // Hand any leftovers to the shared queue so they aren't lost
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            std::copy(queue->pinned.begin(), queue->pinned.end(),
+                back_inserter(m_fibers));
+            std::copy(queue->fibers.begin(), queue->fibers.end(),
+                back_inserter(m_fibers));
+        }
+        m_queues.erase(it);
+        return;
+    }
+    MORDOR_NOTREACHED();
+}
+
+bool
+Scheduler::queuesEmpty()
+{
+    for (std::vector<std::shared_ptr<WorkQueue> >::const_iterator it
+        (m_queues.begin());
+        it != m_queues.end();
+        ++it) {
+        std::lock_guard<std::mutex> lock((*it)->mutex);
+        if (!(*it)->pinned.empty() || !(*it)->fibers.empty())
+            return false;
+    }
+    return true;
+}
+
+void
+Scheduler::dequeue(std::deque<FiberAndThread> &fibers,
+    std::vector<FiberAndThread> &batch, bool &isActive, bool &dontIdle)
+{
+    std::deque<FiberAndThread>::iterator it(fibers.begin());
+    while (it != fibers.end() && batch.size() < m_batchSize) {
+        MORDOR_ASSERT(it->fiber || it->dg);
+        // Same race as in run(); it has to yield on the other thread first
+        if (it->fiber && it->fiber->state() == Fiber::EXEC) {
+            MORDOR_LOG_DEBUG(g_log) << this
+                << " skipping executing fiber " << it->fiber;
+            ++it;
+            dontIdle = true;
+            continue;
+        }
+        // Become active while the queue is still locked, so that stopping()
+        // never sees the work as neither queued nor running
+        if (!isActive) {
+            atomicIncrement(m_activeThreadCount);
+            isActive = true;
+        }
+        batch.push_back(std::move(*it));
+        it = fibers.erase(it);
+    }
+}
+
+void
+Scheduler::steal(WorkQueue &thief, std::vector<FiberAndThread> &batch,
+    bool &isActive, bool &tickleMe, bool &dontIdle)
+{
+    size_t self = 0;
+    while (m_queues[self].get() != &thief)
+        ++self;
+    std::vector<FiberAndThread> stolen;
+    for (size_t i = 1; i < m_queues.size(); ++i) {
+        WorkQueue &victim = *m_queues[(self + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.pinned.empty()) {
+            MORDOR_LOG_DEBUG(g_log) << this
+                << " skipping items scheduled for thread " << victim.thread;
+            // Wake up another thread to hopefully service this
+            tickleMe = true;
+            dontIdle = true;
+        }
+        if (!batch.empty())
+            continue;
+        // Take half of the victim's work, oldest last, skipping fibers that
+        // are still executing
+        std::vector<FiberAndThread> skipped;
+        size_t toSteal = (victim.fibers.size() + 1) / 2;
+        while (toSteal > 0 && !victim.fibers.empty()) {
+            FiberAndThread ft(std::move(victim.fibers.back()));
+            victim.fibers.pop_back();
+            if (ft.fiber && ft.fiber->state() == Fiber::EXEC) {
+                skipped.push_back(std::move(ft));
+                dontIdle = true;
+                continue;
+            }
+            --toSteal;
+            if (!isActive) {
+                atomicIncrement(m_activeThreadCount);
+                isActive = true;
+            }
+            if (batch.size() < m_batchSize)
+                batch.push_back(std::move(ft));
+            else
+                stolen.push_back(std::move(ft));
+        }
+        while (!skipped.empty()) {
+            victim.fibers.push_back(std::move(skipped.back()));
+            skipped.pop_back();
+        }
+        if (!batch.empty())
+            MORDOR_LOG_DEBUG(g_log) << this << " stole "
+                << batch.size() + stolen.size() << " fiber/dgs from thread "
+                << victim.thread;
+    }
+    if (!stolen.empty()) {
+        std::lock_guard<std::mutex> lock(thief.mutex);
+        // stolen is newest-first; keep the victim's order on our queue
+        thief.fibers.insert(thief.fibers.begin(), stolen.rbegin(),
+            stolen.rend());
+    }
+}
+
 SchedulerSwitcher::SchedulerSwitcher(Scheduler *target)
 {
     m_caller = Scheduler::getThis();
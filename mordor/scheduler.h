@@ -2,6 +2,7 @@
 #define __MORDOR_SCHEDULER_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <deque>
 #include <list>
 #include <mutex>
 
@@ -41,8 +42,12 @@ public:
     /// executing thread
     /// @param batchSize Number of operations to pull off the scheduler queue
     /// on every iteration
+    /// @param workStealing Give each thread its own run queue (plus an inbox
+    /// for work targeted at that thread) instead of sharing a single queue;
+    /// threads that run out of work steal from their peers
     /// @pre if (useCaller == true) Scheduler::getThis() == NULL
-    Scheduler(size_t threads = 1, bool useCaller = true, size_t batchSize = 1);
+    Scheduler(size_t threads = 1, bool useCaller = true, size_t batchSize = 1,
+        bool workStealing = false);
     /// Destroys the scheduler, implicitly calling stop()
     virtual ~Scheduler();
 
@@ -80,12 +85,19 @@ public:
     void schedule(FiberOrDg fd, tid_t thread = emptytid())
     {
         bool tickleMe;
-        {
+        if (m_workStealing) {
+            FiberAndThread ft(fd, thread);
+            tickleMe = scheduleWorkStealing(ft);
+        } else {
             std::lock_guard<std::mutex> lock(m_mutex);
             tickleMe = scheduleNoLock(fd, thread);
         }
-        if (shouldTickle(tickleMe))
-            tickle();
+        if (shouldTickle(tickleMe)) {
+            if (thread == emptytid())
+                tickle();
+            else
+                tickleThread(thread);
+        }
     }
 
     /// Schedule multiple items to be executed at once
@@ -96,7 +108,13 @@ public:
     void schedule(InputIterator begin, InputIterator end)
     {
         bool tickleMe = false;
-        {
+        if (m_workStealing) {
+            while (begin != end) {
+                FiberAndThread ft(&*begin, emptytid());
+                tickleMe = scheduleWorkStealing(ft) || tickleMe;
+                ++begin;
+            }
+        } else {
             std::lock_guard<std::mutex> lock(m_mutex);
             while (begin != end) {
                 tickleMe = scheduleNoLock(&*begin) || tickleMe;
@@ -153,6 +171,7 @@ public:
     }
 
     tid_t rootThreadId() const { return m_rootThread; }
+    bool workStealing() const { return m_workStealing; }
 protected:
     /// Derived classes can query stopping() to see if the Scheduler is trying
     /// to stop, and should return from the idle Fiber as soon as possible.
@@ -172,22 +191,44 @@ protected:
     /// The Scheduler wants to force the idle fiber to Fiber::yield(), because
     /// new work has been scheduled.
     virtual void tickle() = 0;
+    /// Like tickle(), but the new work can only run on @p thread; derived
+    /// classes that are able to wake a particular thread should override this
+    virtual void tickleThread(tid_t thread) { tickle(); }
 
     bool hasWorkToDo();
     virtual bool hasIdleThreads() const { return m_idleThreadCount != 0; }
 
     /// determine whether tickle() is needed, to be invoked in schedule()
-    /// @param empty whether m_fibers is empty before the new task is scheduled
+    /// @param empty whether m_fibers is empty before the new task is scheduled;
+    /// in work stealing mode, whether the new task may need another thread
+    /// to pick it up
     virtual bool shouldTickle(bool empty) const
-    { return empty && Scheduler::getThis() != this; }
+    { return empty && (m_workStealing || Scheduler::getThis() != this); }
 
     /// set `this' to TLS so that getThis() can get correct Scheduler
     void setThis() { t_scheduler = this; }
 
 private:
+    struct FiberAndThread;
+    struct WorkQueue;
+
     void yieldTo(bool yieldToCallerOnTerminate);
     void run();
 
+    /// @return If another thread should be tickled to pick up the work
+    bool scheduleWorkStealing(FiberAndThread &ft);
+    /// @pre m_mutex is locked
+    WorkQueue &queueFor(tid_t thread);
+    /// @pre m_mutex is locked
+    void retireQueue(WorkQueue *queue);
+    /// @pre m_mutex is locked
+    bool queuesEmpty();
+    void dequeue(std::deque<FiberAndThread> &fibers,
+        std::vector<FiberAndThread> &batch, bool &isActive, bool &dontIdle);
+    /// @pre m_mutex is locked
+    void steal(WorkQueue &thief, std::vector<FiberAndThread> &batch,
+        bool &isActive, bool &tickleMe, bool &dontIdle);
+
     /// @pre @c fd should be valid
     /// @pre the task to be scheduled is not thread-targeted, or this scheduler
     ///      owns the targeted thread.
@@ -217,10 +258,28 @@ private:
             dg.swap(*d);
         }
     };
-    static ThreadLocalStorage<Scheduler *> t_scheduler;
-    static ThreadLocalStorage<Fiber *> t_fiber;
+    /// Per-thread run queue used in work stealing mode
+    struct WorkQueue : Mordor::noncopyable {
+        WorkQueue(tid_t th) : thread(th) {}
+        std::mutex mutex;
+        /// Work that any thread may run; the owner takes from the front,
+        /// thieves take from the back
+        std::deque<FiberAndThread> fibers;
+        /// Work that must run on this thread; never stolen
+        std::deque<FiberAndThread> pinned;
+        tid_t thread;
+    };
+    // Tags for the thread locals, so they can be native ones
+    struct FiberTag;
+    struct QueueTag;
+    static ThreadLocalStorage<Scheduler *, Scheduler> t_scheduler;
+    static ThreadLocalStorage<Fiber *, FiberTag> t_fiber;
+    static ThreadLocalStorage<WorkQueue *, QueueTag> t_queue;
     std::mutex m_mutex;
+    /// In work stealing mode, only holds work scheduled from outside this
+    /// Scheduler's threads
     std::list<FiberAndThread> m_fibers;
+    std::vector<std::shared_ptr<WorkQueue> > m_queues;
     tid_t m_rootThread;
     std::shared_ptr<Fiber> m_rootFiber;
     std::shared_ptr<Fiber> m_callingFiber;
@@ -229,6 +288,7 @@ private:
     bool m_stopping;
     bool m_autoStop;
     size_t m_batchSize;
+    bool m_workStealing;
 };
 
 /// Automatic Scheduler switcher
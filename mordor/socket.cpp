@@ -28,6 +28,10 @@
 #define closesocket close
 #endif
 
+#ifdef LINUX
+#include <sys/sendfile.h>
+#endif
+
 namespace Mordor {
 
 #ifdef WINDOWS
@@ -302,6 +306,8 @@ Socket::~Socket()
 #else
     if (m_isRegisteredForRemoteClose)
         m_ioManager->unregisterEvent(m_sock, IOManager::CLOSE);
+    if (m_ioManager && m_sock != -1)
+        m_ioManager->unregisterFd(m_sock);
 #endif
     if (m_sock != -1) {
         int rc = ::closesocket(m_sock);
@@ -741,6 +747,24 @@ suckylsp:
                     FILE_SKIP_COMPLETION_PORT_ON_SUCCESS |
                     FILE_SKIP_SET_EVENT_ON_HANDLE);
         }
+#elif defined(MORDOR_IO_URING)
+        if (m_cancelledReceive) {
+            MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): ("
+                << m_cancelledReceive << ")";
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "accept");
+        }
+        m_receiveEvent.prepare(IORING_OP_ACCEPT);
+        m_receiveEvent.sqe.accept_flags = SOCK_NONBLOCK;
+        int newsock = waitForCompletion(m_receiveEvent, IOManager::READ,
+            m_cancelledReceive, m_receiveTimeout);
+        if (newsock < 0) {
+            MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): ("
+                << -newsock << ")";
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(-newsock, "accept");
+        }
+        target.m_sock = newsock;
+        MORDOR_LOG_INFO(g_log) << this << " accept(" << m_sock << "): "
+            << newsock << " (" << *target.remoteAddress() << ", " << &target << ')';
 #else
         int newsock;
         error_t error;
@@ -837,7 +861,8 @@ Socket::shutdown(int how)
 
 template <bool isSend>
 size_t
-Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
+Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address,
+    void *control, size_t *controlLength)
 {
 #if !defined(WINDOWS) && !defined(OSX)
     flags |= MSG_NOSIGNAL;
@@ -853,6 +878,7 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
     unsigned long long &timeout = isSend ? m_sendTimeout : m_receiveTimeout;
 
 #ifdef WINDOWS
+    MORDOR_ASSERT(!control);
     DWORD bufferCount = (DWORD)std::min<size_t>(length, 0xffffffff);
     AsyncEvent &event = isSend ? m_sendEvent : m_receiveEvent;
     OVERLAPPED *overlapped = m_ioManager ? &event.overlapped : NULL;
@@ -949,6 +975,10 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
         msg.msg_name = (sockaddr *)address->name();
         msg.msg_namelen = address->nameLen();
     }
+    if (control) {
+        msg.msg_control = control;
+        msg.msg_controllen = *controlLength;
+    }
     IOManager::Event event = isSend ? IOManager::WRITE : IOManager::READ;
     if (m_ioManager) {
         if (cancelled) {
@@ -956,6 +986,29 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
             MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
         }
     }
+#ifdef MORDOR_IO_URING
+    if (m_ioManager) {
+        AsyncEvent &asyncEvent = isSend ? m_sendEvent : m_receiveEvent;
+        asyncEvent.prepare(isSend ? IORING_OP_SENDMSG : IORING_OP_RECVMSG,
+            &msg, 1);
+        asyncEvent.sqe.msg_flags = flags;
+        int rc = waitForCompletion(asyncEvent, event, cancelled, timeout);
+        error_t error = 0;
+        if (rc < 0) {
+            error = -rc;
+            rc = -1;
+        }
+        MORDOR_SOCKET_LOG(rc, error);
+        if (rc == -1)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+        if (!isSend) {
+            flags = msg.msg_flags;
+            if (control)
+                *controlLength = msg.msg_controllen;
+        }
+        return rc;
+    }
+#endif
     int rc;
     error_t error;
     do {
@@ -984,8 +1037,11 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
     MORDOR_SOCKET_LOG(rc, error);
     if (rc == -1)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API(api);
-    if (!isSend)
+    if (!isSend) {
         flags = msg.msg_flags;
+        if (control)
+            *controlLength = msg.msg_controllen;
+    }
     return rc;
 #endif
 }
@@ -1021,6 +1077,62 @@ Socket::sendTo(const iovec *buffers, size_t length, int flags,
     return doIO<true>((iovec *)buffers, length, flags, (Address *)&to);
 }
 
+#ifndef WINDOWS
+size_t
+Socket::sendMessage(const iovec *buffers, size_t length, const void *control,
+    size_t controlLength, int flags)
+{
+    return doIO<true>((iovec *)buffers, length, flags, NULL, (void *)control,
+        &controlLength);
+}
+#endif
+
+#ifdef LINUX
+size_t
+Socket::sendFile(int fd, size_t length)
+{
+    // For MORDOR_SOCKET_LOG
+    const bool isSend = true;
+    Address *address = NULL;
+    const char *api = "sendfile";
+    if (m_ioManager && m_cancelledSend) {
+        MORDOR_SOCKET_LOG(-1, m_cancelledSend);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, api);
+    }
+    length = std::min<size_t>(length, 0x7ffff000);
+    ssize_t rc;
+    error_t error;
+    do {
+        rc = ::sendfile(m_sock, fd, NULL, length);
+        error = errno;
+    } while (rc == -1 && error == EINTR);
+    while (m_ioManager && rc == -1 && error == EAGAIN) {
+        m_ioManager->registerEvent(m_sock, IOManager::WRITE);
+        Timer::ptr timer;
+        if (m_sendTimeout != ~0ull)
+            timer = m_ioManager->registerConditionTimer(m_sendTimeout,
+                boost::bind(&Socket::cancelIo, this, IOManager::WRITE,
+                    boost::ref(m_cancelledSend), ETIMEDOUT),
+                weak_ptr(shared_from_this()));
+        Scheduler::yieldTo();
+        if (timer)
+            timer->cancel();
+        if (m_cancelledSend) {
+            MORDOR_SOCKET_LOG(-1, m_cancelledSend);
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, api);
+        }
+        do {
+            rc = ::sendfile(m_sock, fd, NULL, length);
+            error = errno;
+        } while (rc == -1 && error == EINTR);
+    }
+    MORDOR_SOCKET_LOG(rc, error);
+    if (rc == -1)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+    return rc;
+}
+#endif
+
 size_t
 Socket::receive(void *buffer, size_t length, int *flags)
 {
@@ -1063,6 +1175,19 @@ Socket::receiveFrom(iovec *buffers, size_t length, Address &from, int *flags)
     return doIO<false>(buffers, length, *flags, &from);
 }
 
+#ifndef WINDOWS
+size_t
+Socket::receiveMessage(iovec *buffers, size_t length, void *control,
+    size_t &controlLength, int *flags)
+{
+    int flagStorage = 0;
+    if (!flags)
+        flags = &flagStorage;
+    return doIO<false>(buffers, length, *flags, NULL, control,
+        &controlLength);
+}
+#endif
+
 void
 Socket::getOption(int level, int option, void *result, size_t *len)
 {
@@ -1184,6 +1309,38 @@ Socket::cancelIo(int event, error_t &cancelled, error_t error)
 }
 #endif
 
+#ifdef MORDOR_IO_URING
+int
+Socket::waitForCompletion(AsyncEvent &event, int ioEvent, error_t &cancelled,
+    unsigned long long timeout)
+{
+    Timer::ptr timer;
+    if (timeout != ~0ull)
+        timer = m_ioManager->registerConditionTimer(timeout,
+            boost::bind(&Socket::cancelIo, this, ioEvent,
+                boost::ref(cancelled), ETIMEDOUT),
+            weak_ptr(shared_from_this()));
+    while (true) {
+        m_ioManager->registerEvent(m_sock, (IOManager::Event)ioEvent, &event);
+        Scheduler::yieldTo();
+        if (event.result != -EAGAIN || cancelled)
+            break;
+        // Older kernels fail operations on non-blocking sockets instead of
+        // waiting for them; wait for readiness ourselves and try again
+        m_ioManager->registerEvent(m_sock, (IOManager::Event)ioEvent);
+        Scheduler::yieldTo();
+        if (cancelled)
+            break;
+    }
+    if (timer)
+        timer->cancel();
+    // An operation that managed to complete anyway still counts
+    if (cancelled && (event.result == -ECANCELED || event.result == -EAGAIN))
+        return -cancelled;
+    return event.result;
+}
+#endif
+
 Address::ptr
 Socket::emptyAddress()
 {
@@ -24,6 +24,9 @@
 # include <netinet/ip.h>
 #endif
 #include <sys/un.h>
+#ifdef MORDOR_IO_URING
+#include "iomanager.h"
+#endif
 #endif
 
 namespace Mordor {
@@ -123,11 +126,30 @@ public:
     size_t sendTo(const iovec *buffers, size_t length, int flags, const Address &to);
     size_t sendTo(const iovec *buffers, size_t length, int flags, const std::shared_ptr<Address> to)
     { return sendTo(buffers, length, flags, *to.get()); }
+#ifdef LINUX
+    /// Send up to length bytes from the current file position of fd (a
+    /// regular file) with sendfile(2), honoring the send timeout and
+    /// cancelSend() like send() does
+    /// @return The amount sent; 0 only if fd is at EOF
+    size_t sendFile(int fd, size_t length);
+#endif
+#ifndef WINDOWS
+    /// send() with ancillary data (see sendmsg(2))
+    size_t sendMessage(const iovec *buffers, size_t length,
+        const void *control, size_t controlLength, int flags = 0);
+#endif
 
     size_t receive(void *buffer, size_t length, int *flags = NULL);
     size_t receive(iovec *buffers, size_t length, int *flags = NULL);
     size_t receiveFrom(void *buffer, size_t length, Address &from, int *flags = NULL);
     size_t receiveFrom(iovec *buffers, size_t length, Address &from, int *flags = NULL);
+#ifndef WINDOWS
+    /// receive() with ancillary data (see recvmsg(2))
+    /// @param controlLength The size of control on entry; how much of it was
+    /// filled in on return
+    size_t receiveMessage(iovec *buffers, size_t length, void *control,
+        size_t &controlLength, int *flags = NULL);
+#endif
 
     std::shared_ptr<Address> emptyAddress();
     std::shared_ptr<Address> remoteAddress();
@@ -148,7 +170,8 @@ public:
 
 private:
     template <bool isSend>
-    size_t doIO(iovec *buffers, size_t length, int &flags, Address *address = NULL);
+    size_t doIO(iovec *buffers, size_t length, int &flags, Address *address = NULL,
+        void *control = NULL, size_t *controlLength = NULL);
     static void callOnRemoteClose(weak_ptr self);
     void registerForRemoteClose();
     void accept(Socket &target);
@@ -159,6 +182,10 @@ private:
 #else
     void cancelIo(int event, error_t &cancelled, error_t error);
 #endif
+#ifdef MORDOR_IO_URING
+    int waitForCompletion(AsyncEvent &event, int ioEvent, error_t &cancelled,
+        unsigned long long timeout);
+#endif
 
 private:
     socket_t m_sock;
@@ -179,6 +206,8 @@ private:
     bool m_useAcceptEx;         //Cache the values in case they are changed in the registry at
     bool m_useConnectEx;        //runtime
 
+#elif defined(MORDOR_IO_URING)
+    AsyncEvent m_sendEvent, m_receiveEvent;
 #endif
     bool m_isConnected, m_isRegisteredForRemoteClose;
     boost::signals2::signal<void ()> m_onRemoteClose;
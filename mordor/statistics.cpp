@@ -2,12 +2,45 @@
 
 #include "statistics.h"
 
+#include <thread>
+
 #include "atomic.h"
 #include "timer.h"
 #include "type_name.h"
 
 namespace Mordor {
 
+namespace Detail {
+
+static size_t
+countShards()
+{
+    size_t processors = std::thread::hardware_concurrency();
+    size_t result = 1;
+    while (result < processors && result < 64)
+        result *= 2;
+    return result;
+}
+
+size_t
+statisticShards()
+{
+    static const size_t shards = countShards();
+    return shards;
+}
+
+size_t
+statisticShard()
+{
+    // Handed out round robin, so the first statisticShards() threads each
+    // get their own
+    static volatile size_t next = 0;
+    static thread_local size_t shard = atomicIncrement(next) - 1;
+    return shard;
+}
+
+}
+
 Statistic *Statistics::lookup(const std::string &name)
 {
     StatisticsCache::const_iterator it = stats().find(name);
@@ -26,10 +59,12 @@ dump(std::ostream &os, const Statistic &stat, int level = 0)
     if (stat.units)
         os << " " << stat.units;
     os << std::endl;
-    const Statistic *substat = stat.begin();
+    std::unique_ptr<Statistic> merged = stat.merged();
+    const Statistic &parent = merged ? *merged : stat;
+    const Statistic *substat = parent.begin();
     while (substat) {
         dump(os, *substat, level);
-        substat = stat.next(substat);
+        substat = parent.next(substat);
     }
     return os;
 }
@@ -4,13 +4,20 @@
 
 #include "predef.h"
 
+#include <cmath>
 #include <limits>
+#include <memory>
+#include <new>
 #include <ostream>
 
 #include "assert.h"
 #include "atomic.h"
 #include "timer.h"
 
+#ifdef MSVC
+#include <intrin.h>
+#endif
+
 namespace Mordor {
 
 struct Statistic
@@ -25,6 +32,10 @@ struct Statistic
 
     virtual const Statistic *begin() const { return NULL; }
     virtual const Statistic *next(const Statistic *) const { MORDOR_NOTREACHED(); return NULL;}
+    /// A copy of its own for the caller to iterate instead, for a statistic
+    /// whose sub-statistics only exist once merged; NULL to iterate this one
+    virtual std::unique_ptr<Statistic> merged() const
+    { return std::unique_ptr<Statistic>(); }
 };
 
 inline std::ostream &operator <<(std::ostream &os, const Statistic &stat)
@@ -290,6 +301,335 @@ private:
     std::string m_units;
 };
 
+namespace Detail {
+inline unsigned int
+highestBit(unsigned long long value)
+{
+#ifdef MSVC
+    unsigned long index;
+#ifdef _WIN64
+    _BitScanReverse64(&index, value);
+#else
+    if (_BitScanReverse(&index, (unsigned long)(value >> 32)))
+        index += 32;
+    else
+        _BitScanReverse(&index, (unsigned long)value);
+#endif
+    return index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+}
+
+/// Log-linear (HDR style) histogram, for percentiles
+///
+/// Values below 2^bits each get their own bucket; above that every power of
+/// two is split into 2^(bits - 1) equal buckets, so any value is known to
+/// within 1/2^(bits - 1) of itself (3% with the default of 6 bits), and the
+/// memory used depends only on bits and the highest value tracked
+/// (7 KB for the defaults and unsigned int), never on how many values are
+/// recorded.  Values above highest are counted as highest, though maximum
+/// keeps the real one.
+///
+/// An update is one atomic increment of a bucket, on top of what an
+/// AverageMinMaxStatistic does, so it's safe from any thread; histograms
+/// with the same bits and highest can be merged, so it also works as the S
+/// of a ShardedStatistic.  T must be unsigned.
+template <class T>
+struct HistogramStatistic : Statistic
+{
+    typedef T value_type;
+
+    HistogramStatistic(const char *units = NULL,
+        const char *countunits = NULL, unsigned int bits = 6,
+        unsigned long long highest = (std::numeric_limits<T>::max)())
+        : Statistic(units),
+          count(countunits),
+          sum(units),
+          minimum(units),
+          maximum(units),
+          m_bits(bits),
+          m_highest(highest)
+    {
+        MORDOR_ASSERT(bits >= 2 && bits <= 20);
+        MORDOR_ASSERT(highest > 0);
+        m_size = index(highest) + 1;
+        m_counts = new unsigned long long[m_size];
+        for (size_t i = 0; i < m_size; ++i)
+            m_counts[i] = 0;
+    }
+    HistogramStatistic(const HistogramStatistic &copy)
+        : Statistic(copy.units),
+          count(copy.count),
+          sum(copy.sum),
+          minimum(copy.minimum),
+          maximum(copy.maximum),
+          m_bits(copy.m_bits),
+          m_highest(copy.m_highest),
+          m_size(copy.m_size),
+          m_counts(new unsigned long long[copy.m_size])
+    {
+        for (size_t i = 0; i < m_size; ++i)
+            m_counts[i] = copy.m_counts[i];
+    }
+    ~HistogramStatistic() { delete [] m_counts; }
+
+    HistogramStatistic &operator =(const HistogramStatistic &copy)
+    {
+        if (this == &copy)
+            return *this;
+        if (m_size != copy.m_size) {
+            delete [] m_counts;
+            m_counts = new unsigned long long[copy.m_size];
+            m_size = copy.m_size;
+        }
+        for (size_t i = 0; i < m_size; ++i)
+            m_counts[i] = copy.m_counts[i];
+        units = copy.units;
+        count = copy.count;
+        sum = copy.sum;
+        minimum = copy.minimum;
+        maximum = copy.maximum;
+        m_bits = copy.m_bits;
+        m_highest = copy.m_highest;
+        return *this;
+    }
+
+    CountStatistic<unsigned long long> count;
+    SumStatistic<unsigned long long> sum;
+    MinStatistic<T> minimum;
+    MaxStatistic<T> maximum;
+
+    void reset()
+    {
+        for (size_t i = 0; i < m_size; ++i)
+            m_counts[i] = 0;
+        count.reset();
+        sum.reset();
+        minimum.reset();
+        maximum.reset();
+    }
+
+    void update(T value)
+    {
+        unsigned long long bucketed = (unsigned long long)value;
+        if (bucketed > m_highest)
+            bucketed = m_highest;
+        atomicIncrement(m_counts[index(bucketed)]);
+        count.increment();
+        sum.add((unsigned long long)value);
+        minimum.update(value);
+        maximum.update(value);
+    }
+
+    void merge(const HistogramStatistic &stat)
+    {
+        MORDOR_ASSERT(m_bits == stat.m_bits);
+        MORDOR_ASSERT(m_size == stat.m_size);
+        for (size_t i = 0; i < m_size; ++i)
+            if (stat.m_counts[i])
+                atomicAdd(m_counts[i], (unsigned long long)stat.m_counts[i]);
+        count.merge(stat.count);
+        sum.merge(stat.sum);
+        minimum.merge(stat.minimum);
+        maximum.merge(stat.maximum);
+    }
+
+    /// The value percent% of the recorded values are at or below
+    ///
+    /// This is the top of the bucket that value fell in (but never more than
+    /// maximum), so it overstates by at most the histogram's precision.
+    T percentile(double percent) const
+    {
+        unsigned long long total = 0;
+        for (size_t i = 0; i < m_size; ++i)
+            total += m_counts[i];
+        if (total == 0)
+            return T();
+        unsigned long long rank =
+            (unsigned long long)std::ceil(percent / 100.0 * total);
+        if (rank == 0)
+            rank = 1;
+        else if (rank > total)
+            rank = total;
+        T highest = maximum.maximum;
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < m_size; ++i) {
+            seen += m_counts[i];
+            if (seen >= rank) {
+                unsigned long long top = lowest(i + 1) - 1;
+                return top < (unsigned long long)highest ? (T)top : highest;
+            }
+        }
+        return highest;
+    }
+
+    /// Everything recorded so far, leaving this histogram empty
+    ///
+    /// For exporting a window at a time.  Each counter is swapped out
+    /// atomically, so nothing is lost or counted twice, but an update racing
+    /// with this can land partly in the snapshot (its bucket, say) and partly
+    /// in the next one (its sum).
+    HistogramStatistic snapshotAndReset()
+    {
+        HistogramStatistic result(*this);
+        for (size_t i = 0; i < m_size; ++i)
+            result.m_counts[i] = m_counts[i] ?
+                atomicSwap(m_counts[i], 0ull) : 0ull;
+        result.count.count = atomicSwap(count.count, 0ull);
+        result.sum.sum = atomicSwap(sum.sum, 0ull);
+        result.minimum.minimum = atomicSwap(minimum.minimum,
+            (std::numeric_limits<T>::max)());
+        result.maximum.maximum = atomicSwap(maximum.maximum,
+            (std::numeric_limits<T>::min)());
+        return result;
+    }
+
+    std::ostream &serialize(std::ostream &os) const
+    {
+        return os << "p50=" << percentile(50.0)
+            << " p90=" << percentile(90.0)
+            << " p99=" << percentile(99.0)
+            << " p99.9=" << percentile(99.9);
+    }
+
+    const Statistic *begin() const { return &count; }
+    const Statistic *next(const Statistic *previous) const
+    {
+        if (previous == &count)
+            return &sum;
+        else if (previous == &sum)
+            return &minimum;
+        else if (previous == &minimum)
+            return &maximum;
+        else if (previous == &maximum)
+            return NULL;
+        MORDOR_NOTREACHED();
+    }
+
+private:
+    size_t index(unsigned long long value) const
+    {
+        if (value < (1ull << m_bits))
+            return (size_t)value;
+        unsigned int shift = Detail::highestBit(value) - m_bits + 1;
+        return ((size_t)shift << (m_bits - 1)) + (size_t)(value >> shift);
+    }
+
+    // The smallest value counted in bucket i
+    unsigned long long lowest(size_t i) const
+    {
+        if (i < ((size_t)1 << m_bits))
+            return i;
+        unsigned int shift = (unsigned int)(i >> (m_bits - 1)) - 1;
+        return (unsigned long long)(i - ((size_t)shift << (m_bits - 1)))
+            << shift;
+    }
+
+private:
+    unsigned int m_bits;
+    unsigned long long m_highest;
+    size_t m_size;
+    volatile unsigned long long *m_counts;
+};
+
+namespace Detail {
+/// How many shards each ShardedStatistic has (a power of two)
+size_t statisticShards();
+/// Which of them the calling thread updates
+size_t statisticShard();
+}
+
+/// Spreads a statistic over per-thread shards, each on its own cache line
+///
+/// Every update to a plain statistic is an atomic operation on one shared
+/// word, so a statistic updated from every thread, as often as on every
+/// fiber or buffer allocation, ends up bouncing its cache line between
+/// cores.  A ShardedStatistic keeps one S per shard instead (about as many
+/// as there are processors; threads beyond that share), updates only the
+/// calling thread's, and merges them all when read.  That makes reading it
+/// slower, and each one a few KB; it's only worth it for statistics that
+/// are hot.
+///
+/// S is any of the statistics above that has merge().
+template <class S>
+struct ShardedStatistic : Statistic
+{
+    typedef typename S::value_type value_type;
+
+    ShardedStatistic(const S &prototype = S())
+        : Statistic(prototype.units)
+    {
+        allocate(prototype, NULL);
+    }
+    ShardedStatistic(const ShardedStatistic &copy)
+        : Statistic(copy.units)
+    {
+        allocate(copy.shard(0), &copy);
+    }
+    ~ShardedStatistic()
+    {
+        for (size_t i = 0; i < m_shards; ++i)
+            shard(i).~S();
+        delete [] m_memory;
+    }
+
+    /// The calling thread's shard, to update as if it were the statistic
+    S &local() { return shard(Detail::statisticShard() & (m_shards - 1)); }
+    void increment() { local().increment(); }
+    void decrement() { local().decrement(); }
+    void add(value_type value) { local().add(value); }
+    void update(value_type value) { local().update(value); }
+
+    /// All the shards merged
+    S total() const
+    {
+        S result(shard(0));
+        result.reset();
+        for (size_t i = 0; i < m_shards; ++i)
+            result.merge(shard(i));
+        return result;
+    }
+
+    void reset()
+    {
+        for (size_t i = 0; i < m_shards; ++i)
+            shard(i).reset();
+    }
+
+    void merge(const ShardedStatistic &stat) { local().merge(stat.total()); }
+
+    std::ostream &serialize(std::ostream &os) const
+    { return os << total(); }
+
+    // Sub-statistics come from a merged copy that whoever is iterating owns,
+    // so concurrent dumps don't share (and reallocate) one
+    std::unique_ptr<Statistic> merged() const
+    { return std::unique_ptr<Statistic>(new S(total())); }
+
+private:
+    enum { CACHE_LINE = 64 };
+
+    void allocate(const S &prototype, const ShardedStatistic *copy)
+    {
+        m_shards = Detail::statisticShards();
+        m_stride = (sizeof(S) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+        m_memory = new char[m_stride * m_shards + CACHE_LINE - 1];
+        m_first = (char *)(((size_t)m_memory + CACHE_LINE - 1) &
+            ~(size_t)(CACHE_LINE - 1));
+        for (size_t i = 0; i < m_shards; ++i)
+            new (m_first + i * m_stride) S(copy ? copy->shard(i) : prototype);
+    }
+
+    S &shard(size_t index) const
+    { return *(S *)(m_first + index * m_stride); }
+
+private:
+    char *m_memory, *m_first;
+    size_t m_shards, m_stride;
+};
+
 
 class Statistics
 {
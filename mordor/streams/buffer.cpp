@@ -4,10 +4,29 @@
 
 #include <string.h>
 #include <algorithm>
+#include <new>
 
 #include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/per_thread.h"
+#include "mordor/statistics.h"
 #include "mordor/util.h"
 
+#if defined(X86_64)
+#   include <emmintrin.h>
+#   ifdef MSVC
+#       include <immintrin.h>
+#       include <intrin.h>
+#       define MORDOR_BUFFER_AVX2
+#   elif defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#       include <immintrin.h>
+#       define MORDOR_BUFFER_AVX2
+#   endif
+#elif defined(AARCH64) || (defined(ARM) && defined(__ARM_NEON))
+#   include <arm_neon.h>
+#   define MORDOR_BUFFER_NEON
+#endif
+
 #ifdef WINDOWS
 static u_long iovLength(size_t length)
 {
@@ -22,6 +41,129 @@ static size_t iovLength(size_t length)
 
 namespace Mordor {
 
+static ConfigVar<size_t>::ptr g_poolSize = Config::lookup<size_t>(
+    "buffer.poolsize",
+    4 * 1024 * 1024u,
+    "Maximum number of bytes of freed Buffer memory each thread keeps for "
+    "reuse");
+
+static ConfigVar<bool>::ptr g_simd = Config::lookup(
+    "buffer.simd", true,
+    "Use SSE2/AVX2/NEON when searching Buffers for multi-byte delimiters");
+
+// Updated on every allocation and free, from every thread
+typedef ShardedStatistic<CountStatistic<unsigned long long> > AllocStatistic;
+
+static AllocStatistic &g_statAllocHit =
+    Statistics::registerStatistic("buffer.alloc.hit",
+    AllocStatistic(),
+    "Buffer memory taken from the per-thread pool");
+static AllocStatistic &g_statAllocMiss =
+    Statistics::registerStatistic("buffer.alloc.miss",
+    AllocStatistic(),
+    "Buffer memory allocated from the heap");
+static AllocStatistic &g_statFreeHit =
+    Statistics::registerStatistic("buffer.free.hit",
+    AllocStatistic(),
+    "Buffer memory returned to the per-thread pool");
+static AllocStatistic &g_statFreeMiss =
+    Statistics::registerStatistic("buffer.free.miss",
+    AllocStatistic(),
+    "Buffer memory released to the heap");
+
+// Size class 0 is for header-only (adopted) Blocks; the rest double from
+// 256 bytes up to 256 KiB.  Anything bigger comes straight from the heap.
+static const size_t SMALLEST_CLASS = 256;
+static const int SIZE_CLASSES = 12;
+
+static size_t
+classSize(int sizeClass)
+{
+    return sizeClass == 0 ? 0 : SMALLEST_CLASS << (sizeClass - 1);
+}
+
+static int
+sizeClassFor(size_t length)
+{
+    if (length == 0)
+        return 0;
+    for (int sizeClass = 1; sizeClass < SIZE_CLASSES; ++sizeClass)
+        if (length <= classSize(sizeClass))
+            return sizeClass;
+    return -1;
+}
+
+/// Freed Blocks, kept per thread in a list for each size class
+struct Buffer::BlockPool : Mordor::noncopyable
+{
+    BlockPool() : bytes(0) { memset(blocks, 0, sizeof(blocks)); }
+    ~BlockPool();
+
+    static BlockPool *get();
+
+    Block *blocks[SIZE_CLASSES];
+    size_t bytes;
+};
+
+Buffer::BlockPool *
+Buffer::BlockPool::get()
+{
+    // Buffers destroyed late during thread exit find the pool already gone,
+    // and just free their memory
+    return PerThread<BlockPool>::get();
+}
+
+Buffer::BlockPool::~BlockPool()
+{
+    for (int i = 0; i < SIZE_CLASSES; ++i) {
+        while (blocks[i]) {
+            Block *block = blocks[i];
+            blocks[i] = block->next;
+            ::operator delete(block);
+        }
+    }
+}
+
+Buffer::Block *
+Buffer::Block::allocate(size_t length)
+{
+    int sizeClass = sizeClassFor(length);
+    BlockPool *pool = sizeClass >= 0 ? BlockPool::get() : NULL;
+    Block *block;
+    if (pool && pool->blocks[sizeClass]) {
+        g_statAllocHit.increment();
+        block = pool->blocks[sizeClass];
+        pool->blocks[sizeClass] = block->next;
+        pool->bytes -= sizeof(Block) + classSize(sizeClass);
+    } else {
+        g_statAllocMiss.increment();
+        block = (Block *)::operator new(sizeof(Block) +
+            (sizeClass >= 0 ? classSize(sizeClass) : length));
+        block->sizeClass = sizeClass;
+    }
+    block->refs = 0;
+    block->data = (unsigned char *)(block + 1);
+    block->next = NULL;
+    return block;
+}
+
+void
+Buffer::Block::recycle(Block *block)
+{
+    int sizeClass = block->sizeClass;
+    BlockPool *pool = sizeClass >= 0 ? BlockPool::get() : NULL;
+    size_t size = sizeof(Block) + (sizeClass >= 0 ? classSize(sizeClass) : 0);
+    if (pool && pool->bytes + size <= g_poolSize->val()) {
+        g_statFreeHit.increment();
+        block->next = pool->blocks[sizeClass];
+        pool->blocks[sizeClass] = block;
+        pool->bytes += size;
+    } else {
+        g_statFreeMiss.increment();
+        ::operator delete(block);
+    }
+}
+
 Buffer::SegmentData::SegmentData()
 {
     start(NULL);
@@ -30,15 +172,16 @@ Buffer::SegmentData::SegmentData()
 
 Buffer::SegmentData::SegmentData(size_t length)
 {
-    m_array.reset(new unsigned char[length], std::default_delete<unsigned char[]>());
-    start(m_array.get());
+    m_array.reset(Block::allocate(length));
+    start(m_array->data);
     this->length(length);
 }
 
 Buffer::SegmentData::SegmentData(void *buffer, size_t length)
 {
-    m_array.reset((unsigned char *)buffer, &nop<unsigned char *>);
-    start(m_array.get());
+    m_array.reset(Block::allocate(0));
+    m_array->data = (unsigned char *)buffer;
+    start(m_array->data);
     this->length(length);
 }
 
@@ -177,39 +320,165 @@ Buffer::Segment::invariant() const
     MORDOR_ASSERT(m_writeIndex <= m_data.length());
 }
 
+Buffer::SegmentList::SegmentList()
+: m_array((Segment *)m_inline.bytes),
+  m_head(0),
+  m_size(0),
+  m_capacity(INLINE_SEGMENTS)
+{}
+
+Buffer::SegmentList::~SegmentList()
+{
+    clear();
+    if (m_array != (Segment *)m_inline.bytes)
+        ::operator delete(m_array);
+}
+
+void
+Buffer::SegmentList::push_back(const Segment &segment)
+{
+    if (m_head + m_size == m_capacity)
+        grow(false);
+    new (m_array + m_head + m_size) Segment(segment);
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::push_front(const Segment &segment)
+{
+    if (m_head == 0)
+        grow(true);
+    new (m_array + m_head - 1) Segment(segment);
+    --m_head;
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::pop_front()
+{
+    MORDOR_ASSERT(m_size > 0);
+    m_array[m_head].~Segment();
+    ++m_head;
+    if (--m_size == 0)
+        m_head = 0;
+}
+
+void
+Buffer::SegmentList::insert(size_t index, const Segment &segment)
+{
+    MORDOR_ASSERT(index <= m_size);
+    if (index == m_size) {
+        push_back(segment);
+        return;
+    }
+    // Copy first; segment may refer to something we're about to move
+    Segment copy(segment);
+    push_back((*this)[m_size - 1]);
+    for (size_t i = m_size - 2; i > index; --i)
+        (*this)[i] = std::move((*this)[i - 1]);
+    (*this)[index] = std::move(copy);
+}
+
+void
+Buffer::SegmentList::erase(size_t first, size_t last)
+{
+    MORDOR_ASSERT(first <= last && last <= m_size);
+    if (first == last)
+        return;
+    // Erasing from the front just moves the head
+    if (first == 0) {
+        for (size_t i = 0; i < last; ++i)
+            m_array[m_head + i].~Segment();
+        m_head += last;
+        m_size -= last;
+        if (m_size == 0)
+            m_head = 0;
+        return;
+    }
+    size_t count = last - first;
+    for (size_t i = first; i + count < m_size; ++i)
+        (*this)[i] = std::move((*this)[i + count]);
+    for (size_t i = m_size - count; i < m_size; ++i)
+        (*this)[i].~Segment();
+    m_size -= count;
+}
+
+void
+Buffer::SegmentList::clear()
+{
+    for (size_t i = 0; i < m_size; ++i)
+        m_array[m_head + i].~Segment();
+    m_head = m_size = 0;
+}
+
+void
+Buffer::SegmentList::grow(bool front)
+{
+    // Double when more than half full; otherwise there's enough slack to
+    // just recenter
+    size_t capacity = m_capacity;
+    if (m_size + 1 > capacity / 2)
+        capacity *= 2;
+    // Leave the slack where it's wanted, plus a little at the other end
+    size_t slack = capacity - m_size;
+    size_t head = front ? slack - slack / 4 : slack / 4;
+    Segment *array = m_array;
+    if (capacity != m_capacity)
+        array = (Segment *)::operator new(capacity * sizeof(Segment));
+    if (array == m_array && head == m_head) {
+        // Nothing to move
+    } else if (array != m_array || head < m_head) {
+        for (size_t i = 0; i < m_size; ++i) {
+            new (array + head + i) Segment(std::move(m_array[m_head + i]));
+            m_array[m_head + i].~Segment();
+        }
+    } else {
+        for (size_t i = m_size; i > 0; --i) {
+            new (array + head + i - 1) Segment(
+                std::move(m_array[m_head + i - 1]));
+            m_array[m_head + i - 1].~Segment();
+        }
+    }
+    if (array != m_array && m_array != (Segment *)m_inline.bytes)
+        ::operator delete(m_array);
+    m_array = array;
+    m_head = head;
+    m_capacity = capacity;
+}
+
 
 Buffer::Buffer()
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     invariant();
 }
 
 Buffer::Buffer(const Buffer &copy)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     copyIn(copy);
 }
 
 Buffer::Buffer(const char *string)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     copyIn(string, strlen(string));
 }
 
 Buffer::Buffer(const std::string &string)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     copyIn(string);
 }
 
 Buffer::Buffer(const void *data, size_t length)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     copyIn(data, length);
 }
 
@@ -248,13 +517,11 @@ Buffer::adopt(void *buffer, size_t length)
         // put the new buffer at the front if possible to avoid
         // fragmentation
         m_segments.push_front(newSegment);
-        m_writeIt = m_segments.begin();
+        m_writeSegment = 0;
     } else {
         m_segments.push_back(newSegment);
-        if (m_writeAvailable == 0) {
-            m_writeIt = m_segments.end();
-            --m_writeIt;
-        }
+        if (m_writeAvailable == 0)
+            m_writeSegment = m_segments.size() - 1;
     }
     m_writeAvailable += length;
     invariant();
@@ -270,13 +537,11 @@ Buffer::reserve(size_t length)
             // put the new buffer at the front if possible to avoid
             // fragmentation
             m_segments.push_front(newSegment);
-            m_writeIt = m_segments.begin();
+            m_writeSegment = 0;
         } else {
             m_segments.push_back(newSegment);
-            if (m_writeAvailable == 0) {
-                m_writeIt = m_segments.end();
-                --m_writeIt;
-            }
+            if (m_writeAvailable == 0)
+                m_writeSegment = m_segments.size() - 1;
         }
         m_writeAvailable += newSegment.length();
         invariant();
@@ -287,12 +552,13 @@ void
 Buffer::compact()
 {
     invariant();
-    if (m_writeIt != m_segments.end()) {
-        if (m_writeIt->readAvailable() > 0) {
-            Segment newSegment = Segment(m_writeIt->readBuffer());
-            m_segments.insert(m_writeIt, newSegment);
+    if (m_writeSegment != m_segments.size()) {
+        if (m_segments[m_writeSegment].readAvailable() > 0) {
+            Segment newSegment = Segment(
+                m_segments[m_writeSegment].readBuffer());
+            m_segments.insert(m_writeSegment++, newSegment);
         }
-        m_writeIt = m_segments.erase(m_writeIt, m_segments.end());
+        m_segments.erase(m_writeSegment, m_segments.size());
         m_writeAvailable = 0;
     }
     MORDOR_ASSERT(writeAvailable() == 0);
@@ -305,12 +571,15 @@ Buffer::clear(bool clearWriteAvailableAsWell)
     if (clearWriteAvailableAsWell) {
         m_readAvailable = m_writeAvailable = 0;
         m_segments.clear();
-        m_writeIt = m_segments.end();
+        m_writeSegment = 0;
     } else {
         m_readAvailable = 0;
-        if (m_writeIt != m_segments.end() && m_writeIt->readAvailable())
-            m_writeIt->consume(m_writeIt->readAvailable());
-        m_segments.erase(m_segments.begin(), m_writeIt);
+        if (m_writeSegment != m_segments.size() &&
+            m_segments[m_writeSegment].readAvailable())
+            m_segments[m_writeSegment].consume(
+                m_segments[m_writeSegment].readAvailable());
+        m_segments.erase(0, m_writeSegment);
+        m_writeSegment = 0;
     }
     invariant();
     MORDOR_ASSERT(m_readAvailable == 0);
@@ -323,12 +592,12 @@ Buffer::produce(size_t length)
     m_readAvailable += length;
     m_writeAvailable -= length;
     while (length > 0) {
-        Segment &segment = *m_writeIt;
+        Segment &segment = m_segments[m_writeSegment];
         size_t toProduce = (std::min)(segment.writeAvailable(), length);
         segment.produce(toProduce);
         length -= toProduce;
         if (segment.writeAvailable() == 0)
-            ++m_writeIt;
+            ++m_writeSegment;
     }
     MORDOR_ASSERT(length == 0);
     invariant();
@@ -340,12 +609,14 @@ Buffer::consume(size_t length)
     MORDOR_ASSERT(length <= readAvailable());
     m_readAvailable -= length;
     while (length > 0) {
-        Segment &segment = *m_segments.begin();
+        Segment &segment = m_segments.front();
         size_t toConsume = (std::min)(segment.readAvailable(), length);
         segment.consume(toConsume);
         length -= toConsume;
-        if (segment.length() == 0)
+        if (segment.length() == 0) {
             m_segments.pop_front();
+            --m_writeSegment;
+        }
     }
     MORDOR_ASSERT(length == 0);
     invariant();
@@ -358,28 +629,34 @@ Buffer::truncate(size_t length)
     if (length == m_readAvailable)
         return;
     // Split any mixed read/write bufs
-    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
-        m_writeIt->consume(m_writeIt->readAvailable());
+    if (m_writeSegment != m_segments.size() &&
+        m_segments[m_writeSegment].readAvailable() != 0) {
+        m_segments.insert(m_writeSegment,
+            Segment(m_segments[m_writeSegment].readBuffer()));
+        Segment &writeSegment = m_segments[++m_writeSegment];
+        writeSegment.consume(writeSegment.readAvailable());
     }
     m_readAvailable = length;
-    std::list<Segment>::iterator it;
-    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
-        Segment &segment = *it;
+    size_t i;
+    for (i = 0; i < m_segments.size() && length > 0; ++i) {
+        Segment &segment = m_segments[i];
         if (length <= segment.readAvailable()) {
             segment.truncate(length);
             length = 0;
-            ++it;
+            ++i;
             break;
         } else {
             length -= segment.readAvailable();
         }
     }
     MORDOR_ASSERT(length == 0);
-    while (it != m_segments.end() && it->readAvailable() > 0) {
-        MORDOR_ASSERT(it->writeAvailable() == 0);
-        it = m_segments.erase(it);
+    size_t end = i;
+    while (end < m_segments.size() && m_segments[end].readAvailable() > 0) {
+        MORDOR_ASSERT(m_segments[end].writeAvailable() == 0);
+        ++end;
     }
+    m_segments.erase(i, end);
+    m_writeSegment -= end - i;
     invariant();
 }
 
@@ -392,7 +669,7 @@ Buffer::readBuffers(size_t length) const
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
         size_t toConsume = (std::min)(it->readAvailable(), remaining);
         SegmentData data = it->readBuffer().slice(0, toConsume);
@@ -449,15 +726,16 @@ Buffer::readBuffer(size_t length, bool coalesce) const
     // Breaking constness!
     Buffer* _this = const_cast<Buffer*>(this);
     // try to avoid allocation
-    if (m_writeIt != m_segments.end() && m_writeIt->writeAvailable()
-        >= readAvailable()) {
-        copyOut(m_writeIt->writeBuffer().start(), readAvailable());
-        Segment newSegment = Segment(m_writeIt->writeBuffer().slice(0,
+    if (m_writeSegment != m_segments.size() &&
+        m_segments[m_writeSegment].writeAvailable() >= readAvailable()) {
+        Segment &writeSegment = _this->m_segments[m_writeSegment];
+        copyOut(writeSegment.writeBuffer().start(), readAvailable());
+        Segment newSegment = Segment(writeSegment.writeBuffer().slice(0,
             readAvailable()));
         _this->m_segments.clear();
         _this->m_segments.push_back(newSegment);
         _this->m_writeAvailable = 0;
-        _this->m_writeIt = _this->m_segments.end();
+        _this->m_writeSegment = _this->m_segments.size();
         invariant();
         SegmentData data = newSegment.readBuffer().slice(0, length);
         result.iov_base = data.start();
@@ -470,7 +748,7 @@ Buffer::readBuffer(size_t length, bool coalesce) const
     _this->m_segments.clear();
     _this->m_segments.push_back(newSegment);
     _this->m_writeAvailable = 0;
-    _this->m_writeIt = _this->m_segments.end();
+    _this->m_writeSegment = _this->m_segments.size();
     invariant();
     SegmentData data = newSegment.readBuffer().slice(0, length);
     result.iov_base = data.start();
@@ -487,9 +765,9 @@ Buffer::writeBuffers(size_t length)
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::iterator it = m_writeIt;
+    size_t i = m_writeSegment;
     while (remaining > 0) {
-        Segment& segment = *it;
+        Segment& segment = m_segments[i];
         size_t toProduce = (std::min)(segment.writeAvailable(), remaining);
         SegmentData data = segment.writeBuffer().slice(0, toProduce);
 #ifdef WINDOWS
@@ -507,7 +785,7 @@ Buffer::writeBuffers(size_t length)
         result.push_back(iov);
 #endif
         remaining -= toProduce;
-        ++it;
+        ++i;
     }
     MORDOR_ASSERT(remaining == 0);
     invariant();
@@ -525,16 +803,19 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // Must allocate just the write segment
     if (writeAvailable() == 0) {
         reserve(length);
-        MORDOR_ASSERT(m_writeIt != m_segments.end());
-        MORDOR_ASSERT(m_writeIt->writeAvailable() >= length);
-        SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+        MORDOR_ASSERT(m_writeSegment != m_segments.size());
+        MORDOR_ASSERT(m_segments[m_writeSegment].writeAvailable() >= length);
+        SegmentData data =
+            m_segments[m_writeSegment].writeBuffer().slice(0, length);
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
     }
     // Can use an existing write segment
-    if (writeAvailable() > 0 && m_writeIt->writeAvailable() >= length) {
-        SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+    if (writeAvailable() > 0 &&
+        m_segments[m_writeSegment].writeAvailable() >= length) {
+        SegmentData data =
+            m_segments[m_writeSegment].writeBuffer().slice(0, length);
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
@@ -542,7 +823,7 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // If they don't want us to coalesce, just return as much as we can from
     // the first segment
     if (!coalesce) {
-        SegmentData data = m_writeIt->writeBuffer();
+        SegmentData data = m_segments[m_writeSegment].writeBuffer();
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
@@ -550,9 +831,10 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // Existing bufs are insufficient... remove them and reserve anew
     compact();
     reserve(length);
-    MORDOR_ASSERT(m_writeIt != m_segments.end());
-    MORDOR_ASSERT(m_writeIt->writeAvailable() >= length);
-    SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+    MORDOR_ASSERT(m_writeSegment != m_segments.size());
+    MORDOR_ASSERT(m_segments[m_writeSegment].writeAvailable() >= length);
+    SegmentData data =
+        m_segments[m_writeSegment].writeBuffer().slice(0, length);
     result.iov_base = data.start();
     result.iov_len = iovLength(data.length());
     return result;
@@ -572,30 +854,35 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
         return;
 
     // Split any mixed read/write bufs
-    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
-        m_writeIt->consume(m_writeIt->readAvailable());
+    if (m_writeSegment != m_segments.size() &&
+        m_segments[m_writeSegment].readAvailable() != 0) {
+        m_segments.insert(m_writeSegment,
+            Segment(m_segments[m_writeSegment].readBuffer()));
+        Segment &writeSegment = m_segments[++m_writeSegment];
+        writeSegment.consume(writeSegment.readAvailable());
         invariant();
     }
 
-    std::list<Segment>::const_iterator it = buffer.m_segments.begin();
-    while (pos != 0 && it != buffer.m_segments.end()) {
-        if (pos < it->readAvailable())
+    // Walk the source by index; buffer may be *this, and inserting into
+    // m_segments can move it
+    size_t i = 0;
+    while (pos != 0 && i < buffer.m_segments.size()) {
+        if (pos < buffer.m_segments[i].readAvailable())
             break;
-        pos -= it->readAvailable();
-        ++it;
+        pos -= buffer.m_segments[i].readAvailable();
+        ++i;
     }
-    MORDOR_ASSERT(it != buffer.m_segments.end());
-    for (; it != buffer.m_segments.end(); ++it) {
-        size_t toConsume = (std::min)(it->readAvailable() - pos, length);
-        if (m_readAvailable != 0 && it == buffer.m_segments.begin()) {
-            std::list<Segment>::iterator previousIt = m_writeIt;
-            --previousIt;
-            if ((char *)previousIt->readBuffer().start() +
-                previousIt->readBuffer().length() == (char *)it->readBuffer().start() + pos &&
-                previousIt->m_data.m_array.get() == it->m_data.m_array.get()) {
-                MORDOR_ASSERT(previousIt->writeAvailable() == 0);
-                previousIt->extend(toConsume);
+    MORDOR_ASSERT(i < buffer.m_segments.size());
+    for (; i < buffer.m_segments.size(); ++i) {
+        const Segment &segment = buffer.m_segments[i];
+        size_t toConsume = (std::min)(segment.readAvailable() - pos, length);
+        if (m_readAvailable != 0 && i == 0) {
+            Segment &previous = m_segments[m_writeSegment - 1];
+            if ((char *)previous.readBuffer().start() +
+                previous.readBuffer().length() == (char *)segment.readBuffer().start() + pos &&
+                previous.m_data.m_array.get() == segment.m_data.m_array.get()) {
+                MORDOR_ASSERT(previous.writeAvailable() == 0);
+                previous.extend(toConsume);
                 m_readAvailable += toConsume;
                 length -= toConsume;
                 pos = 0;
@@ -604,8 +891,8 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
                 continue;
             }
         }
-        Segment newSegment = Segment(it->readBuffer().slice(pos, toConsume));
-        m_segments.insert(m_writeIt, newSegment);
+        Segment newSegment = Segment(segment.readBuffer().slice(pos, toConsume));
+        m_segments.insert(m_writeSegment++, newSegment);
         m_readAvailable += toConsume;
         length -= toConsume;
         pos = 0;
@@ -621,16 +908,17 @@ Buffer::copyIn(const void *data, size_t length)
 {
     invariant();
 
-    while (m_writeIt != m_segments.end() && length > 0) {
-        size_t todo = (std::min)(length, m_writeIt->writeAvailable());
-        memcpy(m_writeIt->writeBuffer().start(), data, todo);
-        m_writeIt->produce(todo);
+    while (m_writeSegment != m_segments.size() && length > 0) {
+        Segment &writeSegment = m_segments[m_writeSegment];
+        size_t todo = (std::min)(length, writeSegment.writeAvailable());
+        memcpy(writeSegment.writeBuffer().start(), data, todo);
+        writeSegment.produce(todo);
         m_writeAvailable -= todo;
         m_readAvailable += todo;
         data = (unsigned char*)data + todo;
         length -= todo;
-        if (m_writeIt->writeAvailable() == 0)
-            ++m_writeIt;
+        if (writeSegment.writeAvailable() == 0)
+            ++m_writeSegment;
         invariant();
     }
 
@@ -639,6 +927,7 @@ Buffer::copyIn(const void *data, size_t length)
         memcpy(newSegment.writeBuffer().start(), data, length);
         newSegment.produce(length);
         m_segments.push_back(newSegment);
+        m_writeSegment = m_segments.size();
         m_readAvailable += length;
     }
 
@@ -665,7 +954,7 @@ Buffer::copyOut(void *buffer, size_t length, size_t pos) const
 
     MORDOR_ASSERT(length + pos <= readAvailable());
     unsigned char *next = (unsigned char*)buffer;
-    std::list<Segment>::const_iterator it = m_segments.begin();
+    SegmentList::const_iterator it = m_segments.begin();
     while (pos != 0 && it != m_segments.end()) {
         if (pos < it->readAvailable())
             break;
@@ -695,7 +984,7 @@ Buffer::find(char delimiter, size_t length) const
     size_t totalLength = 0;
     bool success = false;
 
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
         const void *start = it->readBuffer().start();
         size_t toscan = (std::min)(length, it->readAvailable());
@@ -715,6 +1004,255 @@ Buffer::find(char delimiter, size_t length) const
     return -1;
 }
 
+// Searching a contiguous run of memory for a multi-byte delimiter.  The
+// vectorized versions compare a block of candidate positions against the
+// delimiter's first and last bytes at once, and only memcmp where both match
+// (which, for the CRLFs and MIME boundaries this is mostly used for, is
+// nearly always a real match).
+typedef const char *(*SearchFn)(const char *haystack, size_t length,
+    const char *needle, size_t needleLength);
+
+static const char *
+searchScalar(const char *haystack, size_t length, const char *needle,
+    size_t needleLength)
+{
+    MORDOR_ASSERT(needleLength >= 2);
+    if (length < needleLength)
+        return NULL;
+    const char *end = haystack + length - needleLength + 1;
+    while (haystack < end) {
+        const char *point = (const char *)memchr(haystack, needle[0],
+            end - haystack);
+        if (!point)
+            return NULL;
+        if (memcmp(point + 1, needle + 1, needleLength - 1) == 0)
+            return point;
+        haystack = point + 1;
+    }
+    return NULL;
+}
+
+#if defined(X86_64) || defined(MORDOR_BUFFER_NEON)
+static inline unsigned int
+lowestBit(unsigned long long mask)
+{
+#ifdef MSVC
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+// Checks the candidates flagged in mask (bitsPerByte bits for each position
+// from point on) against the rest of needle
+static const char *
+verify(const char *point, unsigned long long mask, unsigned int bitsPerByte,
+    const char *needle, size_t needleLength)
+{
+    const unsigned long long lane = (1ull << bitsPerByte) - 1;
+    while (mask) {
+        unsigned int bit = lowestBit(mask);
+        const char *candidate = point + bit / bitsPerByte;
+        if (memcmp(candidate + 1, needle + 1, needleLength - 2) == 0)
+            return candidate;
+        mask &= ~(lane << bit);
+    }
+    return NULL;
+}
+#endif
+
+#ifdef X86_64
+// SSE2 is part of x86-64, so this needs no check
+static const char *
+searchSSE2(const char *haystack, size_t length, const char *needle,
+    size_t needleLength)
+{
+    MORDOR_ASSERT(needleLength >= 2);
+    if (length < needleLength)
+        return NULL;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+    const char *back = haystack + needleLength - 1;
+    size_t candidates = length - needleLength + 1;
+    size_t i = 0;
+    for (; i + 32 <= candidates; i += 32) {
+        __m128i match0 = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(haystack + i)),
+                first),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(back + i)),
+                last));
+        __m128i match1 = _mm_and_si128(
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(haystack + i + 16)), first),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(back + i + 16)),
+                last));
+        if (_mm_movemask_epi8(_mm_or_si128(match0, match1))) {
+            unsigned long long mask =
+                (unsigned int)_mm_movemask_epi8(match0) |
+                ((unsigned int)_mm_movemask_epi8(match1) << 16);
+            const char *point = verify(haystack + i, mask, 1, needle,
+                needleLength);
+            if (point)
+                return point;
+        }
+    }
+    return searchScalar(haystack + i, length - i, needle, needleLength);
+}
+#endif
+
+#ifdef MORDOR_BUFFER_AVX2
+#ifndef MSVC
+__attribute__((target("avx2")))
+#endif
+static const char *
+searchAVX2(const char *haystack, size_t length, const char *needle,
+    size_t needleLength)
+{
+    MORDOR_ASSERT(needleLength >= 2);
+    if (length < needleLength)
+        return NULL;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+    const char *back = haystack + needleLength - 1;
+    size_t candidates = length - needleLength + 1;
+    size_t i = 0;
+    for (; i + 64 <= candidates; i += 64) {
+        __m256i match0 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(haystack + i)), first),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(back + i)), last));
+        __m256i match1 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(haystack + i + 32)),
+                first),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(back + i + 32)), last));
+        __m256i either = _mm256_or_si256(match0, match1);
+        if (!_mm256_testz_si256(either, either)) {
+            unsigned long long mask =
+                (unsigned int)_mm256_movemask_epi8(match0) |
+                ((unsigned long long)(unsigned int)_mm256_movemask_epi8(
+                    match1) << 32);
+            const char *point = verify(haystack + i, mask, 1, needle,
+                needleLength);
+            if (point)
+                return point;
+        }
+    }
+    // Leave the last few candidates to the 16 byte version
+    return searchSSE2(haystack + i, length - i, needle, needleLength);
+}
+
+static bool
+hasAVX2()
+{
+#ifdef MSVC
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    // OSXSAVE and AVX, and the OS saves the YMM registers
+    if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & 0x20) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+#ifdef MORDOR_BUFFER_NEON
+static const char *
+searchNEON(const char *haystack, size_t length, const char *needle,
+    size_t needleLength)
+{
+    MORDOR_ASSERT(needleLength >= 2);
+    if (length < needleLength)
+        return NULL;
+    const uint8x16_t first = vdupq_n_u8((uint8_t)needle[0]);
+    const uint8x16_t last = vdupq_n_u8((uint8_t)needle[needleLength - 1]);
+    const uint8_t *front = (const uint8_t *)haystack;
+    const uint8_t *back = front + needleLength - 1;
+    size_t candidates = length - needleLength + 1;
+    size_t i = 0;
+    for (; i + 16 <= candidates; i += 16) {
+        uint8x16_t matches = vandq_u8(vceqq_u8(vld1q_u8(front + i), first),
+            vceqq_u8(vld1q_u8(back + i), last));
+        // No movemask on NEON; narrowing each 16 bit lane by 4 leaves a
+        // nibble per byte instead
+        unsigned long long mask = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+        if (mask) {
+            const char *point = verify(haystack + i, mask, 4, needle,
+                needleLength);
+            if (point)
+                return point;
+        }
+    }
+    return searchScalar(haystack + i, length - i, needle, needleLength);
+}
+#endif
+
+static SearchFn
+chooseVectorized()
+{
+#ifdef MORDOR_BUFFER_AVX2
+    if (hasAVX2())
+        return &searchAVX2;
+#endif
+#ifdef X86_64
+    return &searchSSE2;
+#elif defined(MORDOR_BUFFER_NEON)
+    return &searchNEON;
+#else
+    return NULL;
+#endif
+}
+
+// The vectorized searches test a block of positions at once, which is several
+// times faster than memchr + memcmp when the delimiter's first byte is common
+// (a CRLF in a head full of CRLFs), but memchr alone is faster still when
+// it's rare.  So memchr skips to the first possible match, and the vectorized
+// search carries on from there for a while.
+static const char *
+searchHybrid(SearchFn vectorized, const char *haystack, size_t length,
+    const char *needle, size_t needleLength)
+{
+    static const size_t WINDOW = 4096;
+    if (length < needleLength)
+        return NULL;
+    const char *end = haystack + length - needleLength + 1;
+    while (haystack < end) {
+        const char *point = (const char *)memchr(haystack, needle[0],
+            end - haystack);
+        if (!point)
+            return NULL;
+        size_t candidates = (std::min)((size_t)(end - point), WINDOW);
+        const char *found = vectorized(point, candidates + needleLength - 1,
+            needle, needleLength);
+        if (found)
+            return found;
+        haystack = point + candidates;
+    }
+    return NULL;
+}
+
+static const char *
+search(SearchFn vectorized, const char *haystack, size_t length,
+    const char *needle, size_t needleLength)
+{
+    if (vectorized)
+        return searchHybrid(vectorized, haystack, length, needle,
+            needleLength);
+    return searchScalar(haystack, length, needle, needleLength);
+}
+
 ptrdiff_t
 Buffer::find(const std::string &string, size_t length) const
 {
@@ -722,52 +1260,57 @@ Buffer::find(const std::string &string, size_t length) const
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
     MORDOR_ASSERT(!string.empty());
-
+    if (string.size() == 1)
+        return find(string[0], length);
+
+    static const SearchFn available = chooseVectorized();
+    SearchFn vectorized = g_simd->val() ? available : NULL;
+    const char *needle = string.c_str();
+    size_t needleLength = string.size();
+    // A match can only span segments by starting in the last
+    // needleLength - 1 bytes scanned so far.  Those are kept at the front of
+    // stitch; each segment's first needleLength - 1 bytes are appended to
+    // search for such a match before searching the segment itself.
+    char local[128];
+    std::vector<char> heap;
+    char *stitch = local;
+    if (2 * (needleLength - 1) > sizeof(local)) {
+        heap.resize(2 * (needleLength - 1));
+        stitch = &heap[0];
+    }
+    size_t carried = 0;
     size_t totalLength = 0;
-    size_t foundSoFar = 0;
 
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
+    SegmentList::const_iterator it;
+    for (it = m_segments.begin(); it != m_segments.end() && length > 0;
+        ++it) {
+        const char *start = (const char *)it->readBuffer().start();
         size_t toscan = (std::min)(length, it->readAvailable());
-        while (toscan > 0) {
-            if (foundSoFar == 0) {
-                const void *point = memchr(start, string[0], toscan);
-                if (point != NULL) {
-                    foundSoFar = 1;
-                    size_t found = (unsigned char*)point -
-                        (unsigned char*)start;
-                    toscan -= found + 1;
-                    length -= found + 1;
-                    totalLength += found;
-                    start = (unsigned char*)point + 1;
-                } else {
-                    totalLength += toscan;
-                    length -= toscan;
-                    toscan = 0;
-                    continue;
-                }
-            }
-            MORDOR_ASSERT(foundSoFar != 0);
-            size_t tocompare = (std::min)(toscan, string.size() - foundSoFar);
-            if (memcmp(start, string.c_str() + foundSoFar, tocompare) == 0) {
-                foundSoFar += tocompare;
-                toscan -= tocompare;
-                length -= tocompare;
-                if (foundSoFar == string.size())
-                    break;
-            } else {
-                totalLength += foundSoFar;
-                foundSoFar = 0;
-            }
+        size_t head = (std::min)(toscan, needleLength - 1);
+        memcpy(stitch + carried, start, head);
+        if (carried) {
+            const char *point = search(vectorized, stitch, carried + head,
+                needle, needleLength);
+            if (point && (size_t)(point - stitch) < carried)
+                return totalLength - carried + (point - stitch);
         }
-        if (foundSoFar == string.size())
-            break;
-        if (length == 0)
-            break;
+        const char *point = search(vectorized, start, toscan, needle,
+            needleLength);
+        if (point)
+            return totalLength + (point - start);
+        if (toscan >= needleLength - 1) {
+            carried = needleLength - 1;
+            memcpy(stitch, start + toscan - carried, carried);
+        } else {
+            // The whole segment is already in stitch, behind what was
+            // carried; keep the tail of both
+            size_t keep = (std::min)(carried + toscan, needleLength - 1);
+            memmove(stitch, stitch + carried + toscan - keep, keep);
+            carried = keep;
+        }
+        totalLength += toscan;
+        length -= toscan;
     }
-    if (foundSoFar == string.size())
-        return totalLength;
     return -1;
 }
 
@@ -830,7 +1373,7 @@ Buffer::visit(boost::function<void (const void *, size_t)> dg, size_t length) co
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
 
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
         size_t todo = (std::min)(length, it->readAvailable());
         MORDOR_ASSERT(todo != 0);
@@ -893,7 +1436,7 @@ Buffer::operator!= (const char *string) const
 int
 Buffer::opCmp(const Buffer &rhs) const
 {
-    std::list<Segment>::const_iterator leftIt, rightIt;
+    SegmentList::const_iterator leftIt, rightIt;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)rhs.readAvailable());
     leftIt = m_segments.begin(); rightIt = rhs.m_segments.begin();
     size_t leftOffset = 0, rightOffset = 0;
@@ -929,7 +1472,7 @@ int
 Buffer::opCmp(const char *string, size_t length) const
 {
     size_t offset = 0;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)length);
     if (lengthResult > 0)
         length = readAvailable();
@@ -953,7 +1496,7 @@ Buffer::invariant() const
     size_t read = 0;
     size_t write = 0;
     bool seenWrite = false;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
         const Segment &segment = *it;
         // Strict ordering
@@ -962,10 +1505,10 @@ Buffer::invariant() const
         write += segment.writeAvailable();
         if (!seenWrite && segment.writeAvailable() != 0) {
             seenWrite = true;
-            MORDOR_ASSERT(m_writeIt == it);
+            MORDOR_ASSERT(m_writeSegment == (size_t)(it - m_segments.begin()));
         }
         // We should keep segments optimally merged together
-        std::list<Segment>::const_iterator nextIt = it;
+        SegmentList::const_iterator nextIt = it;
         ++nextIt;
         if (nextIt != m_segments.end()) {
             const Segment& next = *nextIt;
@@ -984,7 +1527,7 @@ Buffer::invariant() const
     }
     MORDOR_ASSERT(read == m_readAvailable);
     MORDOR_ASSERT(write == m_writeAvailable);
-    MORDOR_ASSERT(write != 0 || (write == 0 && m_writeIt == m_segments.end()));
+    MORDOR_ASSERT(write != 0 || (write == 0 && m_writeSegment == m_segments.size()));
 #endif
 }
 
@@ -1,11 +1,12 @@
 #ifndef __MORDOR_BUFFER_H__
 #define __MORDOR_BUFFER_H__
 
-#include <list>
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/intrusive_ptr.hpp>
 
+#include "mordor/atomic.h"
 #include "mordor/socket.h"
 
 namespace Mordor {
@@ -13,6 +14,37 @@ namespace Mordor {
 struct Buffer
 {
 private:
+    /// Reference counted memory shared by all of the SegmentDatas sliced from
+    /// it
+    ///
+    /// Blocks are carved from per-thread pools of a few fixed size classes
+    /// (the header and the memory in one allocation), and go back to the pool
+    /// of whichever thread drops the last reference.  Adopted memory gets a
+    /// header-only Block that points at it.
+    struct Block
+    {
+        /// @param length 0 for a header-only Block
+        static Block *allocate(size_t length);
+        static void recycle(Block *block);
+
+        volatile size_t refs;
+        unsigned char *data;
+        /// Index into the size classes, or -1 if too big to be pooled
+        int sizeClass;
+        /// Next free Block in the pool
+        Block *next;
+
+        friend void intrusive_ptr_add_ref(Block *block)
+        { atomicIncrement(block->refs); }
+        friend void intrusive_ptr_release(Block *block)
+        {
+            if (atomicDecrement(block->refs) == 0)
+                recycle(block);
+        }
+    };
+    /// Per-thread free lists of Blocks; defined in buffer.cpp
+    struct BlockPool;
+
     struct SegmentData
     {
         friend struct Buffer;
@@ -36,7 +68,7 @@ private:
         void *m_start;
         size_t m_length;
     private:
-        std::shared_ptr<unsigned char> m_array;
+        boost::intrusive_ptr<Block> m_array;
     };
 
     struct Segment
@@ -65,6 +97,59 @@ private:
         void invariant() const;
     };
 
+    /// Contiguous, deque-like storage for Segments, with room for a few of
+    /// them inside the Buffer itself (most Buffers never have more than one
+    /// or two), so that adding and removing segments doesn't allocate.
+    /// Iterators (and references) are invalidated by any modification.
+    class SegmentList : Mordor::noncopyable
+    {
+    public:
+        typedef Segment *iterator;
+        typedef const Segment *const_iterator;
+
+    public:
+        SegmentList();
+        ~SegmentList();
+
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+
+        iterator begin() { return m_array + m_head; }
+        const_iterator begin() const { return m_array + m_head; }
+        iterator end() { return m_array + m_head + m_size; }
+        const_iterator end() const { return m_array + m_head + m_size; }
+
+        Segment &operator[](size_t index) { return m_array[m_head + index]; }
+        const Segment &operator[](size_t index) const
+        { return m_array[m_head + index]; }
+        Segment &front() { return (*this)[0]; }
+        const Segment &front() const { return (*this)[0]; }
+
+        void push_back(const Segment &segment);
+        void push_front(const Segment &segment);
+        void pop_front();
+        /// Insert before index
+        void insert(size_t index, const Segment &segment);
+        /// Erase [first, last)
+        void erase(size_t first, size_t last);
+        void clear();
+
+    private:
+        /// Make room for at least one more Segment; front says which end of
+        /// the storage it's needed at
+        void grow(bool front);
+
+    private:
+        enum { INLINE_SEGMENTS = 4 };
+
+        Segment *m_array;
+        size_t m_head, m_size, m_capacity;
+        union {
+            unsigned char bytes[INLINE_SEGMENTS * sizeof(Segment)];
+            void *alignment;
+        } m_inline;
+    };
+
 public:
     Buffer();
     Buffer(const Buffer &copy);
@@ -119,10 +204,12 @@ public:
     bool operator!= (const char *str) const;
 
 private:
-    std::list<Segment> m_segments;
+    SegmentList m_segments;
     size_t m_readAvailable;
     size_t m_writeAvailable;
-    std::list<Segment>::iterator m_writeIt;
+    /// Index of the first Segment with writeAvailable(), or
+    /// m_segments.size() if there isn't one
+    size_t m_writeSegment;
 
     int opCmp(const Buffer &rhs) const;
     int opCmp(const char *string, size_t length) const;
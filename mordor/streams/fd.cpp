@@ -10,6 +10,9 @@
 #include <sys/fcntl.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#ifdef LINUX
+#include <sys/sendfile.h>
+#endif
 
 #include "buffer.h"
 #include "mordor/assert.h"
@@ -19,6 +22,35 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:fd");
 
+#ifdef MORDOR_IO_URING
+// Hand the operation to the IOManager's ring instead of trying it and
+// waiting for readiness on EAGAIN; regular files never say EAGAIN, so this
+// is also what keeps them from blocking the thread.  Returns like the
+// syscall would (-1 and errno on failure).
+static int
+performIO(IOManager *ioManager, int fd, IOManager::Event event, int opcode,
+    const void *addr, size_t len)
+{
+    AsyncEvent asyncEvent;
+    // Offset -1 means the current file position, like read/write
+    asyncEvent.prepare(opcode, addr, (unsigned int)len, ~0ull);
+    while (true) {
+        ioManager->registerEvent(fd, event, &asyncEvent);
+        Scheduler::yieldTo();
+        if (asyncEvent.result != -EAGAIN)
+            break;
+        // Older kernels fail non-blocking fds instead of polling them
+        ioManager->registerEvent(fd, event);
+        Scheduler::yieldTo();
+    }
+    if (asyncEvent.result < 0) {
+        errno = -asyncEvent.result;
+        return -1;
+    }
+    return asyncEvent.result;
+}
+#endif
+
 FDStream::FDStream()
 : m_ioManager(NULL),
   m_scheduler(NULL),
@@ -49,6 +81,8 @@ FDStream::init(int fd, IOManager *ioManager, Scheduler *scheduler, bool own)
 FDStream::~FDStream()
 {
     if (m_own && m_fd >= 0) {
+        if (m_ioManager)
+            m_ioManager->unregisterFd(m_fd);
         SchedulerSwitcher switcher(m_scheduler);
         int rc = ::close(m_fd);
         MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
@@ -61,6 +95,8 @@ FDStream::close(CloseType type)
 {
     MORDOR_ASSERT(type == BOTH);
     if (m_fd > 0 && m_own) {
+        if (m_ioManager)
+            m_ioManager->unregisterFd(m_fd);
         SchedulerSwitcher switcher(m_scheduler);
         int rc = ::close(m_fd);
         error_t error = lastError();
@@ -80,7 +116,13 @@ FDStream::read(Buffer &buffer, size_t length)
     if (length > 0xfffffffe)
         length = 0xfffffffe;
     std::vector<iovec> iovs = buffer.writeBuffers(length);
+#ifdef MORDOR_IO_URING
+    int rc = m_ioManager ? performIO(m_ioManager, m_fd, IOManager::READ,
+        IORING_OP_READV, &iovs[0], iovs.size()) :
+        readv(m_fd, &iovs[0], iovs.size());
+#else
     int rc = readv(m_fd, &iovs[0], iovs.size());
+#endif
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " readv(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -105,7 +147,12 @@ FDStream::read(void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
+#ifdef MORDOR_IO_URING
+    int rc = m_ioManager ? performIO(m_ioManager, m_fd, IOManager::READ,
+        IORING_OP_READ, buffer, length) : ::read(m_fd, buffer, length);
+#else
     int rc = ::read(m_fd, buffer, length);
+#endif
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " read(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -129,14 +176,19 @@ FDStream::write(const Buffer &buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     length = std::min(length, (size_t)std::numeric_limits<ssize_t>::max());
     const std::vector<iovec> iovs = buffer.readBuffers(length);
-    ssize_t rc = 0;
     const int count = std::min(iovs.size(), (size_t)IOV_MAX);
-    while ((rc = writev(m_fd, &iovs[0], count)) < 0 &&
-           errno == EAGAIN && m_ioManager) {
+#ifdef MORDOR_IO_URING
+    ssize_t rc = m_ioManager ? performIO(m_ioManager, m_fd, IOManager::WRITE,
+        IORING_OP_WRITEV, &iovs[0], count) : writev(m_fd, &iovs[0], count);
+#else
+    ssize_t rc = writev(m_fd, &iovs[0], count);
+#endif
+    while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " writev(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::WRITE);
         Scheduler::yieldTo();
+        rc = writev(m_fd, &iovs[0], count);
     }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -156,7 +208,12 @@ FDStream::write(const void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
+#ifdef MORDOR_IO_URING
+    int rc = m_ioManager ? performIO(m_ioManager, m_fd, IOManager::WRITE,
+        IORING_OP_WRITE, buffer, length) : ::write(m_fd, buffer, length);
+#else
     int rc = ::write(m_fd, buffer, length);
+#endif
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " write(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -219,6 +276,47 @@ FDStream::truncate(long long size)
         MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "ftruncate");
 }
 
+#ifdef LINUX
+bool
+FDStream::supportsSendFile()
+{
+    // sendfile(2) can only read from something it can mmap
+    struct stat statbuf;
+    return m_fd >= 0 && fstat(m_fd, &statbuf) == 0 &&
+        S_ISREG(statbuf.st_mode);
+}
+
+size_t
+FDStream::sendFile(Stream &dst, size_t length)
+{
+    MORDOR_ASSERT(m_fd >= 0);
+    return dst.receiveFile(m_fd, length);
+}
+
+size_t
+FDStream::receiveFile(int fd, size_t length)
+{
+    SchedulerSwitcher switcher(m_ioManager ? NULL : m_scheduler);
+    MORDOR_ASSERT(m_fd >= 0);
+    length = std::min<size_t>(length, 0x7ffff000);
+    ssize_t rc = ::sendfile(m_fd, fd, NULL, length);
+    while (rc < 0 && errno == EAGAIN && m_ioManager) {
+        MORDOR_LOG_TRACE(g_log) << this << " sendfile(" << m_fd << ", " << fd
+            << ", " << length << "): " << rc << " (EAGAIN)";
+        m_ioManager->registerEvent(m_fd, IOManager::WRITE);
+        Scheduler::yieldTo();
+        rc = ::sendfile(m_fd, fd, NULL, length);
+    }
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
+        << " sendfile(" << m_fd << ", " << fd << ", " << length << "): "
+        << rc << " (" << error << ")";
+    if (rc < 0)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "sendfile");
+    return rc;
+}
+#endif
+
 void
 FDStream::flush(bool flushParent)
 {
@@ -29,6 +29,10 @@ public:
     bool supportsSeek() { return true; }
     bool supportsSize() { return true; }
     bool supportsTruncate() { return true; }
+#ifdef LINUX
+    bool supportsSendFile();
+    bool supportsReceiveFile() { return true; }
+#endif
 
     void close(CloseType type = BOTH);
     size_t read(Buffer &buffer, size_t length);
@@ -39,6 +43,10 @@ public:
     long long size();
     void truncate(long long size);
     void flush(bool flushParent = true);
+#ifdef LINUX
+    size_t sendFile(Stream &dst, size_t length);
+    size_t receiveFile(int fd, size_t length);
+#endif
 
     int fd() { return m_fd; }
 
@@ -86,6 +86,10 @@ public:
     bool supportsRead() { return m_supportsRead && NativeStream::supportsRead(); }
     bool supportsWrite() { return m_supportsWrite && NativeStream::supportsWrite(); }
     bool supportsSeek() { return m_supportsSeek && NativeStream::supportsSeek(); }
+#ifdef LINUX
+    bool supportsSendFile() { return m_supportsRead && NativeStream::supportsSendFile(); }
+    bool supportsReceiveFile() { return m_supportsWrite && NativeStream::supportsReceiveFile(); }
+#endif
 
     std::string path() const { return m_path; }
 
@@ -87,4 +87,29 @@ LimitedStream::unread(const Buffer &b, size_t len)
     m_pos -= len;
 }
 
+size_t
+LimitedStream::sendFile(Stream &dst, size_t len)
+{
+    if (m_pos >= m_size)
+        return 0;
+
+    len = (size_t)std::min<long long>(len, m_size - m_pos);
+    size_t result = parent()->sendFile(dst, len);
+    if (result == 0 && m_strict)
+        MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    m_pos += result;
+    return result;
+}
+
+size_t
+LimitedStream::receiveFile(int fd, size_t len)
+{
+    if (m_pos >= m_size)
+        MORDOR_THROW_EXCEPTION(WriteBeyondEofException());
+    len = (size_t)std::min<long long>(len, m_size - m_pos);
+    size_t result = parent()->receiveFile(fd, len);
+    m_pos += result;
+    return result;
+}
+
 }
@@ -24,6 +24,8 @@ public:
     bool supportsTell() { return true; }
     bool supportsSize() { return true; }
     bool supportsTruncate() { return false; }
+    bool supportsSendFile() { return parent()->supportsSendFile(); }
+    bool supportsReceiveFile() { return parent()->supportsReceiveFile(); }
 
     using MutatingFilterStream::read;
     size_t read(Buffer &b, size_t len);
@@ -33,6 +35,8 @@ public:
     long long size();
     void truncate(long long size);
     void unread(const Buffer &b, size_t len);
+    size_t sendFile(Stream &dst, size_t len);
+    size_t receiveFile(int fd, size_t len);
 
 private:
     long long m_pos, m_size;
@@ -77,6 +77,14 @@ SocketStream::cancelWrite()
     m_socket->cancelSend();
 }
 
+#ifdef LINUX
+size_t
+SocketStream::receiveFile(int fd, size_t length)
+{
+    return m_socket->sendFile(fd, length);
+}
+#endif
+
 boost::signals2::connection
 SocketStream::onRemoteClose(
     const boost::signals2::slot<void ()> &slot)
@@ -20,6 +20,9 @@ public:
     bool supportsRead() { return true; }
     bool supportsWrite() { return true; }
     bool supportsCancel() { return true; }
+#ifdef LINUX
+    bool supportsReceiveFile() { return true; }
+#endif
 
     void close(CloseType type = BOTH);
 
@@ -29,6 +32,9 @@ public:
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
     void cancelWrite();
+#ifdef LINUX
+    size_t receiveFile(int fd, size_t length);
+#endif
 
     boost::signals2::connection onRemoteClose(
         const boost::signals2::slot<void ()> &slot);
@@ -7,9 +7,30 @@
 #include <openssl/err.h>
 #include <openssl/x509v3.h>
 
+#ifdef LINUX
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#endif
+#if defined(TLS_TX) && OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/kdf.h>
+#define KERNEL_TLS
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
 #include "mordor/assert.h"
+#include "mordor/config.h"
 #include "mordor/log.h"
+#include "mordor/socket.h"
+#include "mordor/statistics.h"
+#include "mordor/timer.h"
 #include "mordor/util.h"
+#include "socket.h"
 
 #ifdef MSVC
 #pragma comment(lib, "libeay32")
@@ -20,6 +41,31 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:ssl");
 
+static ConfigVar<bool>::ptr g_kernelTLS = Config::lookup("ssl.ktls", false,
+    "Hand TLS 1.2 AES-GCM connections over sockets to the kernel (Linux "
+    "kTLS) once the handshake completes");
+
+static CountStatistic<unsigned long long> &g_statKernelSend =
+    Statistics::registerStatistic("ssl.ktls.send",
+    CountStatistic<unsigned long long>(),
+    "SSLStreams whose writes were handed to the kernel");
+static CountStatistic<unsigned long long> &g_statKernelReceive =
+    Statistics::registerStatistic("ssl.ktls.receive",
+    CountStatistic<unsigned long long>(),
+    "SSLStreams whose reads were handed to the kernel");
+
+static CountStatistic<unsigned long long> &g_statFullHandshakes =
+    Statistics::registerStatistic("ssl.handshake.full",
+    CountStatistic<unsigned long long>(),
+    "TLS handshakes that negotiated a new session");
+static CountStatistic<unsigned long long> &g_statResumedHandshakes =
+    Statistics::registerStatistic("ssl.handshake.resumed",
+    CountStatistic<unsigned long long>(),
+    "TLS handshakes that resumed an earlier session");
+
+// The most plaintext a single TLS record can carry
+static const size_t RECORD_SIZE = SSL3_RT_MAX_PLAIN_LENGTH;
+
 namespace {
 
 static struct SSLInitializer {
@@ -161,8 +207,95 @@ void add_ext(X509 *cert, int nid, const char *value)
 }
 
 
+// Where an SSL keeps a pointer back to its SSLStream
+static int
+streamIndex()
+{
+    static const int index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    return index;
+}
+
+SSLSessionCache::SSLSessionCache(size_t maxSessions, unsigned long long ttl)
+    : m_maxSessions(maxSessions),
+      m_ttl(ttl)
+{
+    MORDOR_ASSERT(maxSessions > 0);
+}
+
+std::shared_ptr<SSL_SESSION>
+SSLSessionCache::get(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, Entry>::iterator it = m_sessions.find(key);
+    if (it == m_sessions.end())
+        return std::shared_ptr<SSL_SESSION>();
+    if (it->second.expires <= TimerManager::now() ||
+        !SSL_SESSION_is_resumable(it->second.session.get())) {
+        m_lru.erase(it->second.lru);
+        m_sessions.erase(it);
+        return std::shared_ptr<SSL_SESSION>();
+    }
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return it->second.session;
+}
+
+void
+SSLSessionCache::put(const std::string &key, SSL_SESSION *session)
+{
+    MORDOR_ASSERT(session);
+    SSL_SESSION_up_ref(session);
+    std::shared_ptr<SSL_SESSION> ptr(session, &SSL_SESSION_free);
+    unsigned long long expires = m_ttl == ~0ull ? ~0ull :
+        TimerManager::now() + m_ttl;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, Entry>::iterator it = m_sessions.find(key);
+    if (it != m_sessions.end()) {
+        it->second.session.swap(ptr);
+        it->second.expires = expires;
+        m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+        return;
+    }
+    if (m_sessions.size() >= m_maxSessions) {
+        m_sessions.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+    m_lru.push_front(key);
+    Entry &entry = m_sessions[key];
+    entry.session = ptr;
+    entry.expires = expires;
+    entry.lru = m_lru.begin();
+}
+
+void
+SSLSessionCache::remove(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, Entry>::iterator it = m_sessions.find(key);
+    if (it != m_sessions.end()) {
+        m_lru.erase(it->second.lru);
+        m_sessions.erase(it);
+    }
+}
+
+void
+SSLSessionCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sessions.clear();
+    m_lru.clear();
+}
+
+size_t
+SSLSessionCache::size()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sessions.size();
+}
+
 SSLStream::SSLStream(Stream::ptr parent, bool client, bool own, SSL_CTX *ctx)
-: MutatingFilterStream(parent, own)
+: MutatingFilterStream(parent, own),
+  m_kernelSend(false),
+  m_kernelReceive(false)
 {
     MORDOR_ASSERT(parent);
     clearSSLError();
@@ -176,6 +309,8 @@ SSLStream::SSLStream(Stream::ptr parent, bool client, bool own, SSL_CTX *ctx)
         MORDOR_THROW_EXCEPTION(OpenSSLException(getOpenSSLErrorMessage()))
             << boost::errinfo_api_function("SSL_CTX_new");
     }
+    if (!ctx && client)
+        enableClientSessionCache(m_ctx.get());
     // Auto-generate self-signed server cert
     if (!ctx && !client) {
         std::shared_ptr<X509> cert;
@@ -202,6 +337,139 @@ SSLStream::SSLStream(Stream::ptr parent, bool client, bool own, SSL_CTX *ctx)
     BIO_set_mem_eof_return(m_readBio, -1);
 
     SSL_set_bio(m_ssl.get(), m_readBio, m_writeBio);
+    SSL_set_ex_data(m_ssl.get(), streamIndex(), this);
+}
+
+std::shared_ptr<SSL_CTX>
+SSLStream::createServerContext(size_t maxSessions, long timeout)
+{
+    std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(SSLv23_server_method()),
+        &SSL_CTX_free);
+    if (!ctx) {
+        MORDOR_ASSERT(hasOpenSSLError());
+        MORDOR_THROW_EXCEPTION(OpenSSLException(getOpenSSLErrorMessage()))
+            << boost::errinfo_api_function("SSL_CTX_new");
+    }
+    std::shared_ptr<X509> cert;
+    std::shared_ptr<EVP_PKEY> pkey;
+    mkcert(cert, pkey, 1024, rand(), 365);
+    SSL_CTX_use_certificate(ctx.get(), cert.get());
+    SSL_CTX_use_PrivateKey(ctx.get(), pkey.get());
+    enableServerSessionCache(ctx.get(), maxSessions, timeout);
+    return ctx;
+}
+
+void
+SSLStream::enableServerSessionCache(SSL_CTX *ctx, size_t maxSessions,
+    long timeout)
+{
+    static const unsigned char sessionIdContext[] = "mordor";
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, (long)maxSessions);
+    SSL_CTX_set_timeout(ctx, timeout);
+    // Required for resumption if the server asks for client certificates
+    SSL_CTX_set_session_id_context(ctx, sessionIdContext,
+        sizeof(sessionIdContext) - 1);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+}
+
+void
+SSLStream::enableClientSessionCache(SSL_CTX *ctx)
+{
+    // OpenSSL only tells us about new sessions if client caching is on; we
+    // don't want its internal store, since sessions are per-server.  The
+    // callback finds which SSLSessionCache (if any) to use through the SSL's
+    // ex data, so this is the same for every stream sharing ctx.
+    SSL_CTX_set_session_cache_mode(ctx,
+        SSL_CTX_get_session_cache_mode(ctx) | SSL_SESS_CACHE_CLIENT |
+        SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &SSLStream::newSession);
+}
+
+void
+SSLStream::sessionCache(SSLSessionCache::ptr cache, const std::string &key)
+{
+    MORDOR_ASSERT(cache);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    MORDOR_ASSERT(!SSL_is_server(m_ssl.get()));
+    MORDOR_ASSERT(SSL_CTX_sess_get_new_cb(m_ctx.get()) ==
+        &SSLStream::newSession);
+    m_sessionCache = cache;
+    m_sessionKey = key;
+    std::shared_ptr<SSL_SESSION> session = cache->get(key);
+    if (session)
+        SSL_set_session(m_ssl.get(), session.get());
+}
+
+bool
+SSLStream::sessionReused()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !!SSL_session_reused(m_ssl.get());
+}
+
+int
+SSLStream::newSession(SSL *ssl, SSL_SESSION *session)
+{
+    // Called from within SSL_connect or SSL_read, so m_mutex is already held
+    SSLStream *self = (SSLStream *)SSL_get_ex_data(ssl, streamIndex());
+    if (self && self->m_sessionCache)
+        self->m_sessionCache->put(self->m_sessionKey, session);
+    // We took our own reference, if any
+    return 0;
+}
+
+void
+SSLStream::alpnProtocols(const std::vector<std::string> &protocols)
+{
+    std::string wire;
+    for (std::vector<std::string>::const_iterator it = protocols.begin();
+        it != protocols.end();
+        ++it) {
+        MORDOR_ASSERT(!it->empty() && it->size() < 256);
+        wire.append(1, (char)it->size());
+        wire.append(*it);
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_alpnProtocols = wire;
+    if (SSL_is_server(m_ssl.get())) {
+        SSL_CTX_set_alpn_select_cb(m_ctx.get(), &SSLStream::selectProtocol,
+            NULL);
+    } else if (SSL_set_alpn_protos(m_ssl.get(),
+        (const unsigned char *)wire.c_str(), (unsigned int)wire.size())) {
+        MORDOR_THROW_EXCEPTION(OpenSSLException(getOpenSSLErrorMessage()))
+            << boost::errinfo_api_function("SSL_set_alpn_protos");
+    }
+}
+
+std::string
+SSLStream::alpnProtocol()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const unsigned char *protocol = NULL;
+    unsigned int length = 0;
+    SSL_get0_alpn_selected(m_ssl.get(), &protocol, &length);
+    return std::string((const char *)protocol, length);
+}
+
+int
+SSLStream::selectProtocol(SSL *ssl, const unsigned char **out,
+    unsigned char *outlen, const unsigned char *in, unsigned int inlen,
+    void *arg)
+{
+    // Called from within SSL_accept, so m_mutex is already held
+    SSLStream *self = (SSLStream *)SSL_get_ex_data(ssl, streamIndex());
+    if (!self || self->m_alpnProtocols.empty())
+        return SSL_TLSEXT_ERR_NOACK;
+    unsigned char *selected;
+    // Our preference first, not the client's
+    if (SSL_select_next_proto(&selected, outlen,
+        (const unsigned char *)self->m_alpnProtocols.c_str(),
+        (unsigned int)self->m_alpnProtocols.size(), in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
 }
 
 void
@@ -240,7 +508,12 @@ void
 SSLStream::close(CloseType type)
 {
     MORDOR_ASSERT(type == BOTH);
+    if (m_kernelSend)
+        kernelClose();
     if (!(sslCallWithLock(boost::bind(SSL_get_shutdown, m_ssl.get()), NULL) & SSL_SENT_SHUTDOWN)) {
+        // Anything still waiting to fill a record has to go before the
+        // close_notify
+        writeRecords(true);
         unsigned long error = SSL_ERROR_NONE;
         const int result = sslCallWithLock(boost::bind(SSL_shutdown, m_ssl.get()), &error);
         if (result <= 0) {
@@ -288,7 +561,14 @@ SSLStream::close(CloseType type)
         flush(false);
     }
 
-    while (!(sslCallWithLock(boost::bind(SSL_get_shutdown, m_ssl.get()), NULL) & SSL_RECEIVED_SHUTDOWN)) {
+    while (m_kernelReceive && !(sslCallWithLock(boost::bind(SSL_get_shutdown,
+        m_ssl.get()), NULL) & SSL_RECEIVED_SHUTDOWN)) {
+        // Discard anything still in flight, like SSL_shutdown does
+        char buffer[4096];
+        if (kernelRead(buffer, sizeof(buffer)) == 0)
+            break;
+    }
+    while (!m_kernelReceive && !(sslCallWithLock(boost::bind(SSL_get_shutdown, m_ssl.get()), NULL) & SSL_RECEIVED_SHUTDOWN)) {
         unsigned long error = SSL_ERROR_NONE;
         const int result = sslCallWithLock(boost::bind(SSL_shutdown, m_ssl.get()), &error);
         MORDOR_LOG_DEBUG(g_log) << this << " SSL_shutdown(" << m_ssl.get()
@@ -345,10 +625,18 @@ SSLStream::close(CloseType type)
 size_t
 SSLStream::read(void *buffer, size_t length)
 {
+    if (m_kernelReceive)
+        return kernelRead(buffer, length);
     const int toRead = (int)std::min<size_t>(0x0fffffff, length);
     while (true) {
         unsigned long error = SSL_ERROR_NONE;
         const int result = sslCallWithLock(boost::bind(SSL_read, m_ssl.get(), buffer, toRead), &error);
+        // With the kernel encrypting our writes, OpenSSL can no longer
+        // send anything itself (i.e. respond to renegotiation)
+        if (m_kernelSend && BIO_ctrl_pending(m_writeBio) != 0)
+            MORDOR_THROW_EXCEPTION(OpenSSLException(
+                "OpenSSL needs to write while the kernel owns the connection"))
+                << boost::errinfo_api_function("SSL_read");
         if (result > 0) {
             return result;
         }
@@ -404,23 +692,57 @@ SSLStream::read(void *buffer, size_t length)
 size_t
 SSLStream::write(const Buffer &buffer, size_t length)
 {
-    // SSL_write will create at least two SSL records for each call -
-    // one for data, and one tiny one for the checksum or IV or something.
-    // Dealing with lots of extra records can take some serious CPU time
+    if (m_kernelSend)
+        return parent()->write(buffer, length);
+    // SSL_write will create at least one SSL record for each call, and
+    // dealing with lots of extra records can take some serious CPU time
     // server-side, so we want to provide it with as much data as possible,
-    // even if that means reallocating.  That's why we use pass the flag to
-    // coalesce small segments, instead of only doing the first available
-    // segment
-    return Stream::write(buffer, length, true);
+    // even if that means reallocating.  Small writes are gathered until
+    // they fill a record; for big ones we pass the flag to coalesce small
+    // segments, instead of only doing the first available segment
+    if (m_plainBuffer.readAvailable() == 0 && length >= RECORD_SIZE)
+        return Stream::write(buffer, length, true);
+    const size_t toCopy = (std::min)(length,
+        RECORD_SIZE - m_plainBuffer.readAvailable());
+    m_plainBuffer.copyIn(buffer, toCopy);
+    if (m_plainBuffer.readAvailable() == RECORD_SIZE)
+        flush(false);
+    return toCopy;
 }
 
 size_t
 SSLStream::write(const void *buffer, size_t length)
 {
-    flush(false);
+    if (m_kernelSend)
+        return parent()->write(buffer, length);
     if (length == 0)
         return 0;
+    if (m_plainBuffer.readAvailable() == 0 && length >= RECORD_SIZE) {
+        flush(false);
+        return sslWrite(buffer, length);
+    }
+    const size_t toCopy = (std::min)(length,
+        RECORD_SIZE - m_plainBuffer.readAvailable());
+    m_plainBuffer.copyIn(buffer, toCopy);
+    if (m_plainBuffer.readAvailable() == RECORD_SIZE)
+        flush(false);
+    return toCopy;
+}
+
+void
+SSLStream::writeRecords(bool all)
+{
+    while (m_plainBuffer.readAvailable() >= RECORD_SIZE ||
+        (all && m_plainBuffer.readAvailable() > 0)) {
+        const iovec iov = m_plainBuffer.readBuffer(
+            (std::min)(m_plainBuffer.readAvailable(), RECORD_SIZE), true);
+        m_plainBuffer.consume(sslWrite(iov.iov_base, iov.iov_len));
+    }
+}
 
+size_t
+SSLStream::sslWrite(const void *buffer, size_t length)
+{
     const int toWrite = (int)std::min<size_t>(0x7fffffff, length);
     while (true) {
         unsigned long error = SSL_ERROR_NONE;
@@ -481,6 +803,13 @@ SSLStream::write(const void *buffer, size_t length)
 void
 SSLStream::flush(bool flushParent)
 {
+    if (m_kernelSend) {
+        if (flushParent)
+            parent()->flush(flushParent);
+        return;
+    }
+    writeRecords(true);
+
     static const int WRITE_BUF_LENGTH = 4096;
     char writeBuf[WRITE_BUF_LENGTH];
     int toWrite = 0;
@@ -508,6 +837,17 @@ SSLStream::flush(bool flushParent)
         parent()->flush(flushParent);
 }
 
+void
+SSLStream::handshakeComplete()
+{
+    if (sessionReused())
+        g_statResumedHandshakes.increment();
+    else
+        g_statFullHandshakes.increment();
+    flush(false);
+    enableKernelTLS();
+}
+
 void
 SSLStream::accept()
 {
@@ -515,14 +855,14 @@ SSLStream::accept()
         unsigned long error = SSL_ERROR_NONE;
         const int result = sslCallWithLock(boost::bind(SSL_accept, m_ssl.get()), &error);
         if (result > 0) {
-            flush(false);
+            handshakeComplete();
             return;
         }
         MORDOR_LOG_DEBUG(g_log) << this << " SSL_accept(" << m_ssl.get()
             << "): " << result << " (" << error << ")";
         switch (error) {
             case SSL_ERROR_NONE:
-                flush(false);
+                handshakeComplete();
                 return;
             case SSL_ERROR_ZERO_RETURN:
                 // Received close_notify message
@@ -577,12 +917,12 @@ SSLStream::connect()
         MORDOR_LOG_DEBUG(g_log) << this << " SSL_connect(" << m_ssl.get()
             << "): " << result << " (" << error << ")";
         if (result > 0) {
-            flush(false);
+            handshakeComplete();
             return;
         }
         switch (error) {
             case SSL_ERROR_NONE:
-                flush(false);
+                handshakeComplete();
                 return;
             case SSL_ERROR_ZERO_RETURN:
                 // Received close_notify message
@@ -724,6 +1064,285 @@ SSLStream::verifyPeerCertificate(const std::string &hostname)
     }
 }
 
+size_t
+SSLStream::receiveFile(int fd, size_t length)
+{
+    MORDOR_ASSERT(m_kernelSend);
+    return parent()->receiveFile(fd, length);
+}
+
+#ifdef KERNEL_TLS
+// RFC 5246 6.3
+static bool
+deriveKeyBlock(SSL *ssl, unsigned char *keyBlock, size_t length)
+{
+    const EVP_MD *md = SSL_CIPHER_get_handshake_digest(
+        SSL_get_current_cipher(ssl));
+    unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+    size_t masterLength = SSL_SESSION_get_master_key(SSL_get_session(ssl),
+        master, sizeof(master));
+    unsigned char seed[2 * SSL3_RANDOM_SIZE];
+    SSL_get_server_random(ssl, seed, SSL3_RANDOM_SIZE);
+    SSL_get_client_random(ssl, seed + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+    static char label[] = "key expansion";
+
+    EVP_KDF *kdf = EVP_KDF_fetch(NULL, OSSL_KDF_NAME_TLS1_PRF, NULL);
+    EVP_KDF_CTX *ctx = kdf ? EVP_KDF_CTX_new(kdf) : NULL;
+    EVP_KDF_free(kdf);
+    bool result = false;
+    if (ctx && md) {
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+                (char *)EVP_MD_get0_name(md), 0),
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, master,
+                masterLength),
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, label,
+                sizeof(label) - 1),
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, seed,
+                sizeof(seed)),
+            OSSL_PARAM_construct_end()
+        };
+        result = EVP_KDF_derive(ctx, keyBlock, length, params) > 0;
+    }
+    EVP_KDF_CTX_free(ctx);
+    OPENSSL_cleanse(master, sizeof(master));
+    if (!result)
+        ERR_clear_error();
+    return result;
+}
+
+static bool
+setKernelKeys(Socket &socket, int direction, unsigned short cipherType,
+    const unsigned char *key, const unsigned char *salt)
+{
+    // Each side's Finished was record 0 under the new keys; the explicit
+    // nonce only has to be unique, so it starts from the sequence number too
+    static const unsigned char sequence[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    union {
+        tls12_crypto_info_aes_gcm_128 gcm128;
+        tls12_crypto_info_aes_gcm_256 gcm256;
+    } info;
+    memset(&info, 0, sizeof(info));
+    size_t length;
+    switch (cipherType) {
+        case TLS_CIPHER_AES_GCM_128:
+            info.gcm128.info.version = TLS_1_2_VERSION;
+            info.gcm128.info.cipher_type = cipherType;
+            memcpy(info.gcm128.key, key, sizeof(info.gcm128.key));
+            memcpy(info.gcm128.salt, salt, sizeof(info.gcm128.salt));
+            memcpy(info.gcm128.iv, sequence, sizeof(info.gcm128.iv));
+            memcpy(info.gcm128.rec_seq, sequence, sizeof(info.gcm128.rec_seq));
+            length = sizeof(info.gcm128);
+            break;
+        case TLS_CIPHER_AES_GCM_256:
+            info.gcm256.info.version = TLS_1_2_VERSION;
+            info.gcm256.info.cipher_type = cipherType;
+            memcpy(info.gcm256.key, key, sizeof(info.gcm256.key));
+            memcpy(info.gcm256.salt, salt, sizeof(info.gcm256.salt));
+            memcpy(info.gcm256.iv, sequence, sizeof(info.gcm256.iv));
+            memcpy(info.gcm256.rec_seq, sequence, sizeof(info.gcm256.rec_seq));
+            length = sizeof(info.gcm256);
+            break;
+        default:
+            MORDOR_NOTREACHED();
+    }
+    bool result = true;
+    try {
+        socket.setOption(SOL_TLS, direction, &info, length);
+    } catch (...) {
+        MORDOR_LOG_DEBUG(g_log) << "setsockopt(SOL_TLS, "
+            << (direction == TLS_TX ? "TLS_TX" : "TLS_RX") << "): "
+            << boost::current_exception_diagnostic_information();
+        result = false;
+    }
+    OPENSSL_cleanse(&info, sizeof(info));
+    return result;
+}
+#endif
+
+void
+SSLStream::enableKernelTLS()
+{
+#ifdef KERNEL_TLS
+    if (!g_kernelTLS->val())
+        return;
+    SocketStream *stream = dynamic_cast<SocketStream *>(parent().get());
+    if (!stream)
+        return;
+    SSL *ssl = m_ssl.get();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // The kernel only knows how to do the record layer, so we have to be able
+    // to hand it the keys and sequence numbers ourselves; that's only
+    // possible with TLS 1.2
+    if (SSL_version(ssl) != TLS1_2_VERSION)
+        return;
+    size_t keyLength;
+    unsigned short cipherType;
+    switch (SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(ssl))) {
+        case NID_aes_128_gcm:
+            keyLength = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+            cipherType = TLS_CIPHER_AES_GCM_128;
+            break;
+        case NID_aes_256_gcm:
+            keyLength = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+            cipherType = TLS_CIPHER_AES_GCM_256;
+            break;
+        default:
+            return;
+    }
+    // Everything OpenSSL wrote has to have gone out already
+    MORDOR_ASSERT(BIO_ctrl_pending(m_writeBio) == 0);
+    MORDOR_ASSERT(m_plainBuffer.readAvailable() == 0);
+
+    // AEAD ciphers have no MAC keys, so the key block is just the client and
+    // server write keys, followed by their implicit IVs (salts)
+    unsigned char keyBlock[2 * TLS_CIPHER_AES_GCM_256_KEY_SIZE +
+        2 * TLS_CIPHER_AES_GCM_128_SALT_SIZE];
+    if (!deriveKeyBlock(ssl, keyBlock,
+        2 * keyLength + 2 * TLS_CIPHER_AES_GCM_128_SALT_SIZE))
+        return;
+    const unsigned char *clientKey = keyBlock;
+    const unsigned char *serverKey = keyBlock + keyLength;
+    const unsigned char *clientSalt = keyBlock + 2 * keyLength;
+    const unsigned char *serverSalt = clientSalt +
+        TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+    const bool server = !!SSL_is_server(ssl);
+
+    Socket &socket = *stream->socket();
+    try {
+        socket.setOption(SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+    } catch (...) {
+        // Probably the tls module isn't loaded
+        MORDOR_LOG_DEBUG(g_log) << this << " setsockopt(TCP_ULP, tls): "
+            << boost::current_exception_diagnostic_information();
+        OPENSSL_cleanse(keyBlock, sizeof(keyBlock));
+        return;
+    }
+    if (setKernelKeys(socket, TLS_TX, cipherType,
+        server ? serverKey : clientKey, server ? serverSalt : clientSalt)) {
+        m_kernelSend = true;
+        g_statKernelSend.increment();
+        SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+        // Only if OpenSSL isn't holding on to anything the peer already sent
+        // (it would have to be decrypted by OpenSSL, and would throw off the
+        // sequence number)
+        if (m_readBuffer.readAvailable() == 0 &&
+            BIO_ctrl_pending(m_readBio) == 0 && !SSL_has_pending(ssl) &&
+            setKernelKeys(socket, TLS_RX, cipherType,
+            server ? clientKey : serverKey, server ? clientSalt : serverSalt)) {
+            m_kernelReceive = true;
+            g_statKernelReceive.increment();
+        }
+    }
+    OPENSSL_cleanse(keyBlock, sizeof(keyBlock));
+    MORDOR_LOG_DEBUG(g_log) << this << " kTLS send: " << m_kernelSend
+        << " receive: " << m_kernelReceive;
+#endif
+}
+
+size_t
+SSLStream::kernelRead(void *buffer, size_t length)
+{
+#ifdef KERNEL_TLS
+    Socket &socket = *static_cast<SocketStream *>(parent().get())->socket();
+    while (true) {
+        iovec iov;
+        iov.iov_base = buffer;
+        iov.iov_len = length;
+        union {
+            cmsghdr header;
+            char buffer[CMSG_SPACE(sizeof(unsigned char))];
+        } control;
+        size_t controlLength = sizeof(control);
+        const size_t result = socket.receiveMessage(&iov, 1, &control,
+            controlLength);
+        // Non-application records come with their type
+        unsigned char type = SSL3_RT_APPLICATION_DATA;
+        msghdr msg;
+        memset(&msg, 0, sizeof(msghdr));
+        msg.msg_control = &control;
+        msg.msg_controllen = controlLength;
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+            cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+            type = *CMSG_DATA(cmsg);
+        if (type == SSL3_RT_APPLICATION_DATA)
+            return result;
+        const unsigned char *record = (const unsigned char *)buffer;
+        MORDOR_LOG_DEBUG(g_log) << this << " kTLS record type " << (int)type
+            << ": " << result;
+        switch (type) {
+            case SSL3_RT_ALERT:
+                if (result >= 2 && record[1] == SSL_AD_CLOSE_NOTIFY) {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    SSL_set_shutdown(m_ssl.get(),
+                        SSL_get_shutdown(m_ssl.get()) | SSL_RECEIVED_SHUTDOWN);
+                    return 0;
+                }
+                MORDOR_LOG_ERROR(g_log) << this << " received alert "
+                    << (result >= 2 ? SSL_alert_desc_string_long(record[1]) :
+                    "(truncated)");
+                MORDOR_THROW_EXCEPTION(OpenSSLException(
+                    result >= 2 ? SSL_alert_desc_string_long(record[1]) :
+                    "truncated alert"))
+                    << boost::errinfo_api_function("recvmsg");
+            case SSL3_RT_HANDSHAKE:
+                {
+                    // Renegotiation; the kernel can't do that, so decline
+                    static const unsigned char noRenegotiation[] =
+                        { SSL3_AL_WARNING, SSL_AD_NO_RENEGOTIATION };
+                    kernelSendRecord(SSL3_RT_ALERT, noRenegotiation,
+                        sizeof(noRenegotiation));
+                    continue;
+                }
+            default:
+                continue;
+        }
+    }
+#else
+    MORDOR_NOTREACHED();
+#endif
+}
+
+void
+SSLStream::kernelSendRecord(unsigned char type, const void *buffer,
+    size_t length)
+{
+#ifdef KERNEL_TLS
+    Socket &socket = *static_cast<SocketStream *>(parent().get())->socket();
+    union {
+        cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(unsigned char))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    control.header.cmsg_level = SOL_TLS;
+    control.header.cmsg_type = TLS_SET_RECORD_TYPE;
+    control.header.cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(&control.header) = type;
+    iovec iov;
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = length;
+    socket.sendMessage(&iov, 1, &control, CMSG_SPACE(sizeof(unsigned char)));
+#else
+    MORDOR_NOTREACHED();
+#endif
+}
+
+void
+SSLStream::kernelClose()
+{
+    int shutdown = sslCallWithLock(boost::bind(SSL_get_shutdown,
+        m_ssl.get()), NULL);
+    if (shutdown & SSL_SENT_SHUTDOWN)
+        return;
+    static const unsigned char closeNotify[] =
+        { SSL3_AL_WARNING, SSL_AD_CLOSE_NOTIFY };
+    kernelSendRecord(SSL3_RT_ALERT, closeNotify, sizeof(closeNotify));
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SSL_set_shutdown(m_ssl.get(), SSL_get_shutdown(m_ssl.get()) |
+        SSL_SENT_SHUTDOWN);
+}
+
 void
 SSLStream::wantRead()
 {
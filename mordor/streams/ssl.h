@@ -4,6 +4,8 @@
 
 #include "filter.h"
 
+#include <list>
+#include <map>
 #include <mutex>
 #include <vector>
 
@@ -45,6 +47,61 @@ private:
     long m_verifyResult;
 };
 
+/// Client side cache of TLS sessions, so that new connections to a server can
+/// resume instead of doing a full handshake
+///
+/// Sessions are keyed by whatever identifies the server (ConnectionBroker uses
+/// host:port), and are kept for at most ttl microseconds.  Once there are
+/// maxSessions, the least recently used one is dropped.  TLS 1.3 sessions
+/// (tickets) arrive after the handshake, so they're stored whenever the
+/// server sends them.
+class SSLSessionCache
+{
+public:
+    typedef std::shared_ptr<SSLSessionCache> ptr;
+
+public:
+    SSLSessionCache(size_t maxSessions = 1024,
+        unsigned long long ttl = 3600000000ull);
+
+    /// @return NULL if there's no usable session for key
+    std::shared_ptr<SSL_SESSION> get(const std::string &key);
+    /// Takes its own reference to session
+    void put(const std::string &key, SSL_SESSION *session);
+    void remove(const std::string &key);
+    void clear();
+
+    size_t size();
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<SSL_SESSION> session;
+        unsigned long long expires;
+        std::list<std::string>::iterator lru;
+    };
+
+private:
+    std::mutex m_mutex;
+    size_t m_maxSessions;
+    unsigned long long m_ttl;
+    std::map<std::string, Entry> m_sessions;
+    // Most recently used at the front
+    std::list<std::string> m_lru;
+};
+
+/// A Stream that speaks TLS over its parent
+///
+/// Writes smaller than a TLS record are gathered until a full record (16 KiB)
+/// can be sent, or until flush().
+///
+/// If the ssl.ktls ConfigVar is set, the parent is a SocketStream, and the
+/// session negotiated TLS 1.2 with AES-GCM, the keys are handed to the
+/// kernel (Linux kTLS) once the handshake completes.  Writes then go straight
+/// to the socket (and receiveFile() is supported, so transferStream from a
+/// file uses sendfile); reads do too, unless the peer had already sent data
+/// that OpenSSL was holding on to.  If the kernel doesn't support it, the
+/// stream silently carries on in user space.
 class SSLStream : public MutatingFilterStream
 {
 public:
@@ -54,6 +111,8 @@ public:
     SSLStream(Stream::ptr parent, bool client = true, bool own = true, SSL_CTX *ctx = NULL);
 
     bool supportsHalfClose() { return false; }
+    bool supportsReceiveFile()
+    { return m_kernelSend && parent()->supportsReceiveFile(); }
 
     void close(CloseType type = BOTH);
     using MutatingFilterStream::read;
@@ -61,26 +120,83 @@ public:
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
     void flush(bool flushParent = true);
+    size_t receiveFile(int fd, size_t length);
 
     void accept();
     void connect();
 
+    /// Resume a session from cache (if it has one under key) in connect(),
+    /// and save the session the server gives us back into it
+    /// @pre this is a client, and connect() hasn't been called yet
+    /// @pre The context passed to the constructor (if any) has been through
+    /// enableClientSessionCache()
+    void sessionCache(SSLSessionCache::ptr cache, const std::string &key);
+    /// Whether the handshake resumed an earlier session
+    bool sessionReused();
+
+    /// Creates a server context with a self-signed certificate (like the one
+    /// an SSLStream generates when it isn't given a context), with session
+    /// resumption enabled; share it among all of a server's SSLStreams
+    static std::shared_ptr<SSL_CTX> createServerContext(
+        size_t maxSessions = 20480, long timeout = 300);
+    /// Let clients of servers using ctx resume their sessions, either by
+    /// session ID (kept in ctx's own cache of at most maxSessions) or by
+    /// ticket (including TLS 1.3's), for timeout seconds
+    static void enableServerSessionCache(SSL_CTX *ctx,
+        size_t maxSessions = 20480, long timeout = 300);
+    /// Let clients using ctx save sessions with sessionCache(); call it once
+    /// when setting up a shared context, before any SSLStream uses it (one
+    /// an SSLStream creates for itself already has it)
+    static void enableClientSessionCache(SSL_CTX *ctx);
+
     void serverNameIndication(const std::string &hostname);
+    /// Application protocols (ALPN, e.g. "h2" and "http/1.1") a client
+    /// offers, or a server accepts (in order of its preference)
+    /// @pre connect() or accept() hasn't been called yet
+    void alpnProtocols(const std::vector<std::string> &protocols);
+    /// The protocol ALPN settled on; empty if the peer didn't do ALPN, or
+    /// there was nothing in common
+    std::string alpnProtocol();
 
     void verifyPeerCertificate();
     void verifyPeerCertificate(const std::string &hostname);
     void clearSSLError();
 
+    /// Whether the kernel is encrypting what this stream writes
+    bool kernelSend() const { return m_kernelSend; }
+    /// Whether the kernel is decrypting what this stream reads
+    bool kernelReceive() const { return m_kernelReceive; }
+
 private:
     void wantRead();
     int sslCallWithLock(boost::function<int ()> dg, unsigned long *error);
+    void handshakeComplete();
+    static int newSession(SSL *ssl, SSL_SESSION *session);
+    static int selectProtocol(SSL *ssl, const unsigned char **out,
+        unsigned char *outlen, const unsigned char *in, unsigned int inlen,
+        void *arg);
+    size_t sslWrite(const void *buffer, size_t length);
+    void writeRecords(bool all);
+
+    void enableKernelTLS();
+    size_t kernelRead(void *buffer, size_t length);
+    void kernelSendRecord(unsigned char type, const void *buffer,
+        size_t length);
+    void kernelClose();
 
 private:
     std::mutex m_mutex;
     std::shared_ptr<SSL_CTX> m_ctx;
     std::shared_ptr<SSL> m_ssl;
     Buffer m_readBuffer, m_writeBuffer;
+    // Plaintext waiting to fill a record
+    Buffer m_plainBuffer;
     BIO *m_readBio, *m_writeBio;
+    bool m_kernelSend, m_kernelReceive;
+    SSLSessionCache::ptr m_sessionCache;
+    std::string m_sessionKey;
+    // Length-prefixed, as it goes on the wire
+    std::string m_alpnProtocols;
 };
 
 }
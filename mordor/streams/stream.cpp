@@ -165,4 +165,16 @@ Stream::unread(const Buffer &buffer, size_t length)
     MORDOR_NOTREACHED();
 }
 
+size_t
+Stream::sendFile(Stream &dst, size_t length)
+{
+    MORDOR_NOTREACHED();
+}
+
+size_t
+Stream::receiveFile(int fd, size_t length)
+{
+    MORDOR_NOTREACHED();
+}
+
 }
@@ -80,6 +80,10 @@ public:
     virtual bool supportsFind() { return false; }
     /// @return If it is valid to call unread()
     virtual bool supportsUnread() { return false; }
+    /// @return If it is valid to call sendFile()
+    virtual bool supportsSendFile() { return false; }
+    /// @return If it is valid to call receiveFile()
+    virtual bool supportsReceiveFile() { return false; }
 
     /// @brief Gracefully close the Stream
     /// @details
@@ -232,6 +236,30 @@ public:
     /// @pre supportsUnread()
     virtual void unread(const Buffer &buffer, size_t length);
 
+    /// @brief Read data from the Stream straight into another Stream
+    /// @details
+    /// Hands the Stream's underlying file descriptor to
+    /// dst.receiveFile(), so that the data can be moved by the kernel
+    /// without being copied through user space.  Otherwise behaves like a
+    /// read() from this Stream followed by a write() of the same data to
+    /// @c dst; in particular 0 means EOF.  See transferStream().
+    /// @param dst The Stream to write to
+    /// @param length The maximum amount to transfer
+    /// @return The amount actually transferred
+    /// @pre supportsSendFile() && dst.supportsReceiveFile()
+    virtual size_t sendFile(Stream &dst, size_t length);
+
+    /// @brief Write data read directly from a file descriptor
+    /// @details
+    /// Called by sendFile(); reads from the current file position of
+    /// @c fd, which must be a regular file, and advances it by the amount
+    /// returned.  Returns 0 only if @c fd is at EOF.
+    /// @param fd The file descriptor to read from
+    /// @param length The maximum amount to transfer
+    /// @return The amount actually transferred
+    /// @pre supportsReceiveFile()
+    virtual size_t receiveFile(int fd, size_t length);
+
     /// Event triggered when the remote end of the connection closes the
     /// virtual circuit
     ///
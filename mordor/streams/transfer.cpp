@@ -2,6 +2,8 @@
 
 #include "transfer.h"
 
+#include <algorithm>
+
 #include <boost/bind.hpp>
 
 #include "mordor/assert.h"
@@ -18,6 +20,11 @@ static ConfigVar<size_t>::ptr g_chunkSize =
     Config::lookup("transferstream.chunksize",
                    (size_t)65536,
                    "transfer chunk size.");
+static ConfigVar<bool>::ptr g_sendFile =
+    Config::lookup("transferstream.sendfile", true,
+                   "Let the kernel move data between streams backed by "
+                   "file descriptors (sendfile), instead of copying it "
+                   "through user space, when both streams support it.");
 static Logger::ptr g_log = Log::lookup("mordor:stream:transfer");
 
 static void readOne(Stream &src, Buffer *&buffer, size_t len, size_t &result)
@@ -36,6 +43,31 @@ static void writeOne(Stream &dst, Buffer *&buffer)
     }
 }
 
+static unsigned long long sendFile(Stream &src, Stream &dst,
+                                   unsigned long long toTransfer,
+                                   ExactLength exactLength)
+{
+    unsigned long long totalRead = 0;
+    while (totalRead < toTransfer) {
+        size_t todo = (size_t)std::min<unsigned long long>(
+            toTransfer - totalRead, 0x7ffff000);
+        size_t result = src.sendFile(dst, todo);
+        MORDOR_LOG_TRACE(g_log) << "sent " << result << " bytes from " << &src
+            << " to " << &dst;
+        if (result == 0 && exactLength == EXACT) {
+            MORDOR_LOG_ERROR(g_log) << "only read " << totalRead << "/"
+                << toTransfer << " from " << &src;
+            MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+        }
+        if (result == 0)
+            break;
+        totalRead += result;
+    }
+    MORDOR_LOG_VERBOSE(g_log) << "sent " << totalRead << "/" << toTransfer
+        << " from " << &src << " to " << &dst;
+    return totalRead;
+}
+
 unsigned long long transferStream(Stream &src, Stream &dst,
                                   unsigned long long toTransfer,
                                   ExactLength exactLength)
@@ -56,6 +88,10 @@ unsigned long long transferStream(Stream &src, Stream &dst,
         exactLength = (toTransfer == ~0ull ? UNTILEOF : EXACT);
     MORDOR_ASSERT(exactLength == EXACT || exactLength == UNTILEOF);
 
+    if (g_sendFile->val() && src.supportsSendFile() &&
+        dst.supportsReceiveFile())
+        return sendFile(src, dst, toTransfer, exactLength);
+
     readBuffer = &buf1;
     todo = chunkSize;
     if (toTransfer - totalRead < (unsigned long long)todo)
@@ -2,8 +2,11 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/buffer.h"
 #include "mordor/test/test.h"
+#include "mordor/thread.h"
 
 using namespace Mordor;
 using namespace Mordor::Test;
@@ -789,6 +792,78 @@ MORDOR_UNITTEST(Buffer, findStringFalsePositiveAcrossMultipleSegments)
     MORDOR_TEST_ASSERT_EQUAL(b.find("000011"), 4);
 }
 
+MORDOR_UNITTEST(Buffer, findStringOverlappingAcrossSegments)
+{
+    // The partial match "aa" fails at the segment boundary, but a match
+    // starting one byte later doesn't
+    Buffer b("aa");
+    b.copyIn("ab");
+    MORDOR_TEST_ASSERT_EQUAL(b.find("aab"), 1);
+    b.clear();
+    b.copyIn("xa");
+    b.copyIn("b");
+    b.copyIn("a");
+    b.copyIn("bc");
+    MORDOR_TEST_ASSERT_EQUAL(b.find("ababc"), 1);
+    MORDOR_TEST_ASSERT_EQUAL(b.find("ababc", 5), -1);
+}
+
+static void
+checkFind(const std::string &data, const std::string &delimiter)
+{
+    std::string::size_type expected = data.find(delimiter);
+    // Every split into two segments, and a segment per byte
+    for (size_t split = 0; split <= data.size(); ++split) {
+        Buffer b(data.substr(0, split));
+        b.copyIn(data.substr(split));
+        MORDOR_TEST_ASSERT_EQUAL(b.find(delimiter),
+            expected == std::string::npos ? -1 : (ptrdiff_t)expected);
+    }
+    Buffer b;
+    for (size_t i = 0; i < data.size(); ++i)
+        b.copyIn(data.substr(i, 1));
+    MORDOR_TEST_ASSERT_EQUAL(b.find(delimiter),
+        expected == std::string::npos ? -1 : (ptrdiff_t)expected);
+}
+
+static void
+findStringLong()
+{
+    // Long enough for the vectorized paths, with near misses (first and last
+    // byte matching) all over
+    std::string data;
+    for (int i = 0; i < 200; ++i)
+        data.append(i % 7 == 0 ? "\r\r\n" : "\rx\n");
+    checkFind(data, "\r\n\r\n");
+    checkFind(data + "\r\n\r\n", "\r\n\r\n");
+    checkFind(data + "\r\n\r\n", "\r\n");
+    std::string boundary("\r\n--boundary0123456789abcdef0123456789");
+    checkFind(data, boundary);
+    checkFind(data + boundary.substr(0, boundary.size() - 1) + "X" + boundary,
+        boundary);
+    checkFind(std::string(200, 'a') + "b", std::string(40, 'a') + "b");
+    checkFind(std::string(200, 'a') + "b", std::string(80, 'a') + "b");
+    // Longer than the stretch handed to the vectorized search after each
+    // memchr
+    Buffer b(std::string(10000, '\r') + "\r\n");
+    MORDOR_TEST_ASSERT_EQUAL(b.find("\r\n"), 10000);
+}
+
+MORDOR_UNITTEST(Buffer, findStringLong)
+{
+    ConfigVarBase::ptr simd = Config::lookup("buffer.simd");
+    MORDOR_TEST_ASSERT(simd);
+    findStringLong();
+    MORDOR_TEST_ASSERT(simd->fromString("0"));
+    try {
+        findStringLong();
+    } catch (...) {
+        simd->fromString("1");
+        throw;
+    }
+    simd->fromString("1");
+}
+
 MORDOR_UNITTEST(Buffer, toString)
 {
     Buffer b;
@@ -838,3 +913,77 @@ MORDOR_UNITTEST(Buffer, clearReadPortionOnly)
     MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 0u);
     MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b.writeAvailable(), 5u);
 }
+
+static void reserveTwice(void *&first, void *&second,
+    unsigned long long &hitsDelta)
+{
+    typedef ShardedStatistic<CountStatistic<unsigned long long> > HitStat;
+    HitStat *hits = Statistics::lookup<HitStat>("buffer.alloc.hit");
+    {
+        Buffer b;
+        b.reserve(3000);
+        first = b.writeBuffer(1, false).iov_base;
+    }
+    unsigned long long before = hits->total().count;
+    {
+        Buffer b;
+        b.reserve(3000);
+        second = b.writeBuffer(1, false).iov_base;
+    }
+    hitsDelta = hits->total().count - before;
+}
+
+MORDOR_UNITTEST(Buffer, poolReuse)
+{
+    MORDOR_TEST_ASSERT(Statistics::lookup("buffer.alloc.hit"));
+    void *first = NULL, *second = NULL;
+    unsigned long long hitsDelta = 0;
+    // Run on a fresh thread, so the pool doesn't already hold blocks left
+    // behind by other tests
+    Thread thread(boost::bind(&reserveTwice, boost::ref(first),
+        boost::ref(second), boost::ref(hitsDelta)));
+    thread.join();
+    MORDOR_TEST_ASSERT_EQUAL(first, second);
+    MORDOR_TEST_ASSERT_EQUAL(hitsDelta, 1u);
+}
+
+MORDOR_UNITTEST(Buffer, manySegments)
+{
+    // Enough segments to outgrow the inline storage several times over,
+    // added at both ends
+    std::string expected;
+    Buffer b, piece;
+    for (int i = 0; i < 100; ++i) {
+        piece.clear();
+        piece.copyIn(std::string(1, (char)('a' + i % 26)));
+        b.copyIn(piece);
+        expected.append(1, (char)('a' + i % 26));
+    }
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 100u);
+    MORDOR_TEST_ASSERT(b == expected);
+    b.consume(50);
+    expected = expected.substr(50);
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 50u);
+    MORDOR_TEST_ASSERT(b == expected);
+    b.reserve(10);
+    b.copyIn(b, 25);
+    expected.append(expected.substr(0, 25));
+    MORDOR_TEST_ASSERT(b == expected);
+    b.truncate(60);
+    expected.resize(60);
+    MORDOR_TEST_ASSERT(b == expected);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b.writeAvailable(), 10u);
+    b.copyIn("hello");
+    expected.append("hello");
+    MORDOR_TEST_ASSERT(b == expected);
+    b.consume(b.readAvailable());
+    b.clear();
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 0u);
+    char data[4];
+    for (int i = 0; i < 20; ++i) {
+        b.adopt(data, 4);
+        b.clear(false);
+    }
+    MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(b.writeAvailable(), 80u);
+}
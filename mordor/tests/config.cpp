@@ -1,7 +1,10 @@
 // Copyright (c) 2011 - Mozy, Inc.
 
+#include <boost/bind.hpp>
+
 #include "mordor/config.h"
 #include "mordor/test/test.h"
+#include "mordor/thread.h"
 
 #ifdef HAVE_CONFIG_H
 #include "autoconfig.h"
@@ -270,3 +273,126 @@ MORDOR_UNITTEST(Config, lockConfigVar)
     MORDOR_TEST_ASSERT_EQUAL(var1->val(), 101);
     MORDOR_TEST_ASSERT_EQUAL(var2->val(), 222);
 }
+
+static void
+countChange(int &count)
+{
+    ++count;
+}
+
+static void
+checkBoth(ConfigVar<int>::ptr first, ConfigVar<std::string>::ptr second,
+    int &count)
+{
+    // Both are already set by the time either notifies
+    MORDOR_TEST_ASSERT_EQUAL(first->val(), 2);
+    MORDOR_TEST_ASSERT_EQUAL(second->val(), "two");
+    ++count;
+}
+
+MORDOR_UNITTEST(Config, batch)
+{
+    ConfigVar<int>::ptr first = Config::lookup("test.batch.first", 0, "");
+    ConfigVar<std::string>::ptr second = Config::lookup("test.batch.second",
+        std::string("zero"), "");
+    int firstChanges = 0, bothChanges = 0, monitorChanges = 0;
+    first->monitor(boost::bind(&countChange, boost::ref(firstChanges)));
+    boost::signals2::connection connection = first->onChange.connect(
+        boost::bind(&checkBoth, first, second, boost::ref(bothChanges)));
+    std::vector<ConfigVarBase::ptr> both;
+    both.push_back(first);
+    both.push_back(second);
+    Config::monitor(both, boost::bind(&countChange,
+        boost::ref(monitorChanges)));
+
+    {
+        Config::Batch batch;
+        first->val(1);
+        {
+            Config::Batch nested;
+            first->val(2);
+        }
+        second->val("two");
+        MORDOR_TEST_ASSERT_EQUAL(first->val(), 2);
+        MORDOR_TEST_ASSERT_EQUAL(firstChanges, 0);
+        MORDOR_TEST_ASSERT_EQUAL(monitorChanges, 0);
+    }
+    MORDOR_TEST_ASSERT_EQUAL(firstChanges, 1);
+    MORDOR_TEST_ASSERT_EQUAL(bothChanges, 1);
+    MORDOR_TEST_ASSERT_EQUAL(monitorChanges, 1);
+    connection.disconnect();
+
+    // Outside a batch, every change notifies straight away
+    first->val(3);
+    MORDOR_TEST_ASSERT_EQUAL(firstChanges, 2);
+    MORDOR_TEST_ASSERT_EQUAL(monitorChanges, 2);
+    second->val("three");
+    MORDOR_TEST_ASSERT_EQUAL(monitorChanges, 3);
+}
+
+MORDOR_UNITTEST(Config, loadFromCommandLineBatches)
+{
+    ConfigVar<int>::ptr first = Config::lookup("test.load.first", 0, "");
+    ConfigVar<int>::ptr second = Config::lookup("test.load.second", 0, "");
+    int changes = 0;
+    std::vector<ConfigVarBase::ptr> both;
+    both.push_back(first);
+    both.push_back(second);
+    Config::monitor(both, boost::bind(&countChange, boost::ref(changes)));
+    int argc = 3;
+    std::string args[] = { "program",
+                           "--test.load.first=1",
+                           "--test.load.second=2" };
+    char *argv[3];
+    for (int i = 0; i < argc; ++i)
+        argv[i] = const_cast<char *>(args[i].c_str());
+    Config::loadFromCommandLine(argc, argv);
+    MORDOR_TEST_ASSERT_EQUAL(first->val(), 1);
+    MORDOR_TEST_ASSERT_EQUAL(second->val(), 2);
+    MORDOR_TEST_ASSERT_EQUAL(changes, 1);
+}
+
+MORDOR_UNITTEST(Config, handle)
+{
+    ConfigVar<std::string>::ptr var = Config::lookup("test.handle",
+        std::string("one"), "");
+    ConfigVar<std::string>::Handle handle(var);
+    MORDOR_TEST_ASSERT_EQUAL(*handle, "one");
+    const std::string *first = &*handle;
+    // Unchanged, so no new snapshot
+    MORDOR_TEST_ASSERT_EQUAL(&*handle, first);
+    std::shared_ptr<const std::string> snapshot = var->snapshot();
+    var->val("two");
+    MORDOR_TEST_ASSERT_EQUAL(*handle, "two");
+    MORDOR_TEST_ASSERT_EQUAL(handle->size(), 3u);
+    // What was taken before the change stays as it was
+    MORDOR_TEST_ASSERT_EQUAL(*snapshot, "one");
+    MORDOR_TEST_ASSERT_EQUAL(var->toString(), "two");
+}
+
+static void
+readConcurrently(ConfigVar<std::string>::ptr var, volatile bool &done,
+    unsigned long long &reads)
+{
+    ConfigVar<std::string>::Handle handle(var);
+    while (!done) {
+        std::string value = var->val();
+        MORDOR_ASSERT(value == "short" || value == std::string(100, 'x'));
+        MORDOR_ASSERT(*handle == "short" || *handle == std::string(100, 'x'));
+        ++reads;
+    }
+}
+
+MORDOR_UNITTEST(Config, concurrentReads)
+{
+    ConfigVar<std::string>::ptr var = Config::lookup("test.concurrent",
+        std::string("short"), "");
+    volatile bool done = false;
+    unsigned long long reads = 0;
+    Thread reader(boost::bind(&readConcurrently, var, boost::ref(done),
+        boost::ref(reads)));
+    for (int i = 0; i < 10000; ++i)
+        var->val(i % 2 ? "short" : std::string(100, 'x'));
+    done = true;
+    reader.join();
+}
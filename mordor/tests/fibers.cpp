@@ -3,6 +3,7 @@
 #include <boost/bind.hpp>
 
 #include "mordor/fiber.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -604,3 +605,45 @@ MORDOR_UNITTEST(Fibers, exceptionDestructsBeforeFiberDestructs)
     }
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 7);
 }
+
+#ifdef POSIX
+static void touchStack(char *&stack)
+{
+    stack = (char *)__builtin_frame_address(0);
+}
+
+static void allocTwoStacks(char *&first, char *&second,
+    unsigned int &hitsDelta)
+{
+    typedef ShardedStatistic<AverageMinMaxStatistic<unsigned int> > TimeStat;
+    TimeStat *hits = Statistics::lookup<TimeStat>("fiber.allocstack.hit");
+    // Use an unusual stack size so nothing else is sharing the size class
+    {
+        Fiber::ptr f(new Fiber(boost::bind(&touchStack, boost::ref(first)),
+            200 * 1024));
+        f->call();
+    }
+    unsigned int before = hits->total().count.count;
+    {
+        Fiber::ptr f(new Fiber(boost::bind(&touchStack, boost::ref(second)),
+            200 * 1024));
+        f->call();
+    }
+    hitsDelta = hits->total().count.count - before;
+}
+
+MORDOR_UNITTEST(Fibers, stackPoolReuse)
+{
+    MORDOR_TEST_ASSERT(Statistics::lookup("fiber.allocstack.hit"));
+    char *first = NULL, *second = NULL;
+    unsigned int hitsDelta = 0;
+    // Run on a fresh thread, so the pool isn't already full of stacks left
+    // behind by other tests
+    Thread thread(boost::bind(&allocTwoStacks, boost::ref(first),
+        boost::ref(second), boost::ref(hitsDelta)));
+    thread.join();
+    MORDOR_TEST_ASSERT_EQUAL(hitsDelta, 1u);
+    // The same stack was handed out again
+    MORDOR_TEST_ASSERT_EQUAL(first, second);
+}
+#endif
@@ -0,0 +1,277 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/http/hpack.h"
+#include "mordor/string.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::HTTP;
+using namespace Mordor::Test;
+
+static HeaderList
+headerList(const char *const *headers)
+{
+    HeaderList result;
+    for (; *headers; headers += 2)
+        result.push_back(std::make_pair(std::string(headers[0]),
+            std::string(headers[1])));
+    return result;
+}
+
+static void
+assertHeaders(const HeaderList &actual, const char *const *expected)
+{
+    HeaderList expectedList = headerList(expected);
+    MORDOR_TEST_ASSERT_EQUAL(actual.size(), expectedList.size());
+    for (size_t i = 0; i < actual.size(); ++i) {
+        MORDOR_TEST_ASSERT_EQUAL(actual[i].first, expectedList[i].first);
+        MORDOR_TEST_ASSERT_EQUAL(actual[i].second, expectedList[i].second);
+    }
+}
+
+// RFC 7541 Appendix C.3 and C.4; the same requests with and without Huffman
+static const char *const g_request1[] = {
+    ":method", "GET", ":scheme", "http", ":path", "/",
+    ":authority", "www.example.com", NULL };
+static const char *const g_request2[] = {
+    ":method", "GET", ":scheme", "http", ":path", "/",
+    ":authority", "www.example.com", "cache-control", "no-cache", NULL };
+static const char *const g_request3[] = {
+    ":method", "GET", ":scheme", "https", ":path", "/index.html",
+    ":authority", "www.example.com", "custom-key", "custom-value", NULL };
+
+MORDOR_UNITTEST(HPACK, integers)
+{
+    // RFC 7541 Appendix C.1
+    std::string out;
+    HPACK::encodeInteger(10, 5, 0, out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out), "0a");
+    out.clear();
+    HPACK::encodeInteger(1337, 5, 0, out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out), "1f9a0a");
+    out.clear();
+    HPACK::encodeInteger(42, 8, 0, out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out), "2a");
+
+    out = dataFromHexstring("1f9a0a");
+    const unsigned char *p = (const unsigned char *)out.c_str();
+    unsigned long long value;
+    MORDOR_TEST_ASSERT(HPACK::decodeInteger(p, p + out.size(), 5, value));
+    MORDOR_TEST_ASSERT_EQUAL(value, 1337u);
+    p = (const unsigned char *)out.c_str();
+    MORDOR_TEST_ASSERT(!HPACK::decodeInteger(p, p + 2, 5, value));
+}
+
+MORDOR_UNITTEST(HPACK, huffman)
+{
+    std::string out;
+    HPACK::huffmanEncode("www.example.com", out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out),
+        "f1e3c2e5f23a6ba0ab90f4ff");
+    MORDOR_TEST_ASSERT_EQUAL(HPACK::huffmanLength("www.example.com"),
+        out.size());
+    std::string decoded;
+    HPACK::huffmanDecode((const unsigned char *)out.c_str(), out.size(),
+        decoded);
+    MORDOR_TEST_ASSERT_EQUAL(decoded, "www.example.com");
+
+    // Every byte value survives a round trip
+    std::string all;
+    for (int i = 0; i < 256; ++i)
+        all.append(1, (char)i);
+    out.clear();
+    decoded.clear();
+    HPACK::huffmanEncode(all, out);
+    HPACK::huffmanDecode((const unsigned char *)out.c_str(), out.size(),
+        decoded);
+    MORDOR_TEST_ASSERT(decoded == all);
+
+    // Padding that isn't all ones
+    out = dataFromHexstring("f1e3c2e5f23a6ba0ab90f4fe");
+    decoded.clear();
+    MORDOR_TEST_ASSERT_EXCEPTION(HPACK::huffmanDecode(
+        (const unsigned char *)out.c_str(), out.size(), decoded),
+        HPACKException);
+    // A whole byte of padding
+    out = dataFromHexstring("f1e3c2e5f23a6ba0ab90f4ffff");
+    decoded.clear();
+    MORDOR_TEST_ASSERT_EXCEPTION(HPACK::huffmanDecode(
+        (const unsigned char *)out.c_str(), out.size(), decoded),
+        HPACKException);
+}
+
+MORDOR_UNITTEST(HPACK, decodeLiteralWithIndexing)
+{
+    // RFC 7541 Appendix C.2.1
+    HPACKDecoder decoder;
+    HeaderList headers;
+    decoder.decode(dataFromHexstring(
+        "400a637573746f6d2d6b65790d637573746f6d2d686561646572"), headers);
+    static const char *const expected[] = {
+        "custom-key", "custom-header", NULL };
+    assertHeaders(headers, expected);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().size(), 55u);
+}
+
+MORDOR_UNITTEST(HPACK, decodeRequestsWithoutHuffman)
+{
+    HPACKDecoder decoder;
+    HeaderList headers;
+    decoder.decode(dataFromHexstring(
+        "828684410f7777772e6578616d706c652e636f6d"), headers);
+    assertHeaders(headers, g_request1);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().size(), 57u);
+
+    headers.clear();
+    decoder.decode(dataFromHexstring("828684be58086e6f2d6361636865"),
+        headers);
+    assertHeaders(headers, g_request2);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().size(), 110u);
+
+    headers.clear();
+    decoder.decode(dataFromHexstring(
+        "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565"),
+        headers);
+    assertHeaders(headers, g_request3);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().size(), 164u);
+}
+
+MORDOR_UNITTEST(HPACK, decodeRequestsWithHuffman)
+{
+    HPACKDecoder decoder;
+    HeaderList headers;
+    decoder.decode(dataFromHexstring("828684418cf1e3c2e5f23a6ba0ab90f4ff"),
+        headers);
+    assertHeaders(headers, g_request1);
+
+    headers.clear();
+    decoder.decode(dataFromHexstring("828684be5886a8eb10649cbf"), headers);
+    assertHeaders(headers, g_request2);
+
+    headers.clear();
+    decoder.decode(dataFromHexstring(
+        "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"), headers);
+    assertHeaders(headers, g_request3);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().size(), 164u);
+}
+
+MORDOR_UNITTEST(HPACK, encodeRequests)
+{
+    HPACKEncoder encoder;
+    std::string out;
+    encoder.encode(headerList(g_request1), out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out),
+        "828684418cf1e3c2e5f23a6ba0ab90f4ff");
+    out.clear();
+    encoder.encode(headerList(g_request2), out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out),
+        "828684be5886a8eb10649cbf");
+    out.clear();
+    encoder.encode(headerList(g_request3), out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out),
+        "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf");
+    MORDOR_TEST_ASSERT_EQUAL(encoder.table().size(), 164u);
+
+    encoder.huffman(false);
+    HPACKEncoder plainEncoder;
+    plainEncoder.huffman(false);
+    out.clear();
+    plainEncoder.encode(headerList(g_request1), out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out),
+        "828684410f7777772e6578616d706c652e636f6d");
+}
+
+MORDOR_UNITTEST(HPACK, eviction)
+{
+    // RFC 7541 Appendix C.5.1 and C.5.2, with a 256 byte table
+    HPACKDecoder decoder(256);
+    HeaderList headers;
+    decoder.decode(dataFromHexstring(
+        "4803333032580770726976617465611d"
+        "4d6f6e2c203231204f637420323031332032303a31333a323120474d54"
+        "6e1768747470733a2f2f7777772e6578616d706c652e636f6d"), headers);
+    static const char *const response1[] = {
+        ":status", "302", "cache-control", "private",
+        "date", "Mon, 21 Oct 2013 20:13:21 GMT",
+        "location", "https://www.example.com", NULL };
+    assertHeaders(headers, response1);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().size(), 222u);
+
+    headers.clear();
+    decoder.decode(dataFromHexstring("4803333037c1c0bf"), headers);
+    static const char *const response2[] = {
+        ":status", "307", "cache-control", "private",
+        "date", "Mon, 21 Oct 2013 20:13:21 GMT",
+        "location", "https://www.example.com", NULL };
+    assertHeaders(headers, response2);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().size(), 222u);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().entries(), 4u);
+}
+
+MORDOR_UNITTEST(HPACK, tableSizeUpdate)
+{
+    HPACKEncoder encoder;
+    HPACKDecoder decoder;
+    HeaderList headers;
+    std::string out;
+    encoder.encode(headerList(g_request3), out);
+    decoder.decode(out, headers);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().entries(), 2u);
+
+    // Shrinking to nothing, and back, flushes both tables
+    encoder.tableSize(0);
+    encoder.tableSize(4096);
+    out.clear();
+    encoder.encode(HeaderList(), out);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(out), "203fe11f");
+    decoder.decode(out, headers);
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().entries(), 0u);
+
+    // Bigger than advertised
+    HPACKDecoder smallDecoder(100);
+    MORDOR_TEST_ASSERT_EXCEPTION(smallDecoder.decode(
+        dataFromHexstring("3fe11f"), headers), HPACKException);
+    // Not at the start of the block
+    MORDOR_TEST_ASSERT_EXCEPTION(decoder.decode(dataFromHexstring("8220"),
+        headers), HPACKException);
+}
+
+MORDOR_UNITTEST(HPACK, sensitiveHeaders)
+{
+    HPACKEncoder encoder;
+    HeaderList headers;
+    headers.push_back(std::make_pair(std::string("authorization"),
+        std::string("Basic dXNlcjpwYXNz")));
+    std::string out;
+    encoder.encode(headers, out);
+    // Never indexed, with the name from the static table
+    MORDOR_TEST_ASSERT_EQUAL((unsigned char)out[0], 0x1f);
+    MORDOR_TEST_ASSERT_EQUAL(encoder.table().entries(), 0u);
+
+    HPACKDecoder decoder;
+    HeaderList decoded;
+    decoder.decode(out, decoded);
+    MORDOR_TEST_ASSERT_EQUAL(decoded.size(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(decoded[0].second, "Basic dXNlcjpwYXNz");
+    MORDOR_TEST_ASSERT_EQUAL(decoder.table().entries(), 0u);
+}
+
+MORDOR_UNITTEST(HPACK, malformed)
+{
+    HPACKDecoder decoder;
+    HeaderList headers;
+    // Index 0
+    MORDOR_TEST_ASSERT_EXCEPTION(decoder.decode(dataFromHexstring("80"),
+        headers), HPACKException);
+    // Past the end of the tables
+    MORDOR_TEST_ASSERT_EXCEPTION(decoder.decode(dataFromHexstring("be"),
+        headers), HPACKException);
+    // Truncated string
+    MORDOR_TEST_ASSERT_EXCEPTION(decoder.decode(dataFromHexstring("400a6375"),
+        headers), HPACKException);
+    // Too big for the header list limit
+    HPACKDecoder smallDecoder(4096, 40);
+    MORDOR_TEST_ASSERT_EXCEPTION(smallDecoder.decode(dataFromHexstring(
+        "400a637573746f6d2d6b65790d637573746f6d2d686561646572"), headers),
+        HPACKException);
+}
@@ -0,0 +1,436 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "mordor/http/client.h"
+#include "mordor/http/http2.h"
+#include "mordor/http/server.h"
+#include "mordor/parallel.h"
+#include "mordor/streams/filter.h"
+#include "mordor/streams/memory.h"
+#include "mordor/streams/pipe.h"
+#include "mordor/streams/transfer.h"
+#include "mordor/test/test.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+using namespace Mordor::HTTP;
+using namespace Mordor::HTTP::HTTP2;
+using namespace Mordor::Test;
+
+namespace {
+struct Frame
+{
+    FrameHeader header;
+    std::string payload;
+};
+
+// The client end of a pipe to a fake server that runs in the same Fiber;
+// like a socket, flush() doesn't wait for the other end to read
+class UnflushedStream : public FilterStream
+{
+public:
+    UnflushedStream(Stream::ptr parent)
+        : FilterStream(parent)
+    {}
+
+    using FilterStream::read;
+    size_t read(Buffer &buffer, size_t length)
+    { return parent()->read(buffer, length); }
+    using FilterStream::write;
+    size_t write(const Buffer &buffer, size_t length)
+    { return parent()->write(buffer, length); }
+    void flush(bool flushParent = true) {}
+};
+}
+
+static Session::ptr
+fakeServer(Stream::ptr &server)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    server = pipes.second;
+    Session::ptr client(new Session(Stream::ptr(
+        new UnflushedStream(pipes.first))));
+    client->start();
+    return client;
+}
+
+static void
+readExactly(Stream &stream, void *buffer, size_t length)
+{
+    char *p = (char *)buffer;
+    while (length > 0) {
+        size_t result = stream.read(p, length);
+        MORDOR_TEST_ASSERT(result > 0);
+        p += result;
+        length -= result;
+    }
+}
+
+static Frame
+readFrame(Stream &stream)
+{
+    Frame frame;
+    unsigned char raw[g_frameHeaderLength];
+    readExactly(stream, raw, g_frameHeaderLength);
+    frame.header = parseFrameHeader(raw);
+    frame.payload.resize(frame.header.length);
+    if (frame.header.length > 0)
+        readExactly(stream, &frame.payload[0], frame.header.length);
+    return frame;
+}
+
+static void
+writeFrame(Stream &stream, const FrameHeader &header,
+    const std::string &payload = std::string())
+{
+    MORDOR_ASSERT(header.length == payload.size());
+    unsigned char raw[g_frameHeaderLength];
+    serializeFrameHeader(header, raw);
+    Buffer buffer;
+    buffer.copyIn(raw, g_frameHeaderLength);
+    buffer.copyIn(payload);
+    while (buffer.readAvailable() > 0)
+        buffer.consume(stream.write(buffer, buffer.readAvailable()));
+}
+
+static std::string
+uint32(unsigned int value)
+{
+    std::string result(4, '\0');
+    result[0] = (char)(value >> 24);
+    result[1] = (char)(value >> 16);
+    result[2] = (char)(value >> 8);
+    result[3] = (char)value;
+    return result;
+}
+
+static std::string
+setting(Setting id, unsigned int value)
+{
+    return std::string(1, '\0') + (char)id + uint32(value);
+}
+
+MORDOR_UNITTEST(HTTP2, frameHeader)
+{
+    unsigned char raw[g_frameHeaderLength];
+    serializeFrameHeader(FrameHeader(0x123456, HEADERS,
+        END_HEADERS | END_STREAM, 0x7654321), raw);
+    MORDOR_TEST_ASSERT_EQUAL(std::string((const char *)raw,
+        g_frameHeaderLength), std::string("\x12\x34\x56\x01\x05\x07\x65\x43\x21",
+        g_frameHeaderLength));
+    FrameHeader header = parseFrameHeader(raw);
+    MORDOR_TEST_ASSERT_EQUAL(header.length, 0x123456u);
+    MORDOR_TEST_ASSERT_EQUAL(header.type, HEADERS);
+    MORDOR_TEST_ASSERT_EQUAL(header.flags, END_HEADERS | END_STREAM);
+    MORDOR_TEST_ASSERT_EQUAL(header.streamId, 0x7654321u);
+    // The reserved bit is ignored
+    raw[5] |= 0x80;
+    MORDOR_TEST_ASSERT_EQUAL(parseFrameHeader(raw).streamId, 0x7654321u);
+}
+
+static void
+writeBody(SessionStream::ptr stream, const std::string &body, bool &done)
+{
+    stream->write(body.c_str(), body.size());
+    stream->close();
+    done = true;
+}
+
+MORDOR_UNITTEST(HTTP2, clientFraming)
+{
+    WorkerPool pool;
+    Stream::ptr serverStream;
+    Session::ptr client = fakeServer(serverStream);
+    Stream &server = *serverStream;
+
+    std::string preface(g_prefaceLength, '\0');
+    readExactly(server, &preface[0], g_prefaceLength);
+    MORDOR_TEST_ASSERT_EQUAL(preface, std::string(g_preface));
+    Frame frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.type, SETTINGS);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.flags, 0);
+    // The session's receive window gets raised from the default
+    frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.type, WINDOW_UPDATE);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.streamId, 0u);
+
+    // Tiny stream windows, to exercise flow control
+    writeFrame(server, FrameHeader(6, SETTINGS), setting(INITIAL_WINDOW_SIZE,
+        10));
+    frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.type, SETTINGS);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.flags, ACK);
+
+    HeaderList headers;
+    headers.push_back(std::make_pair(std::string(":method"),
+        std::string("POST")));
+    headers.push_back(std::make_pair(std::string(":scheme"),
+        std::string("http")));
+    headers.push_back(std::make_pair(std::string(":path"),
+        std::string("/upload")));
+    headers.push_back(std::make_pair(std::string(":authority"),
+        std::string("www.example.com")));
+    SessionStream::ptr stream = client->openStream(headers, false);
+    MORDOR_TEST_ASSERT_EQUAL(stream->id(), 1u);
+    frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.type, HEADERS);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.flags, END_HEADERS);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.streamId, 1u);
+    HPACKDecoder decoder;
+    HeaderList decoded;
+    decoder.decode(frame.payload, decoded);
+    MORDOR_TEST_ASSERT(decoded == headers);
+
+    bool done = false;
+    pool.schedule(boost::bind(&writeBody, stream,
+        "0123456789abcdefghijklmno", boost::ref(done)));
+    frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.type, DATA);
+    MORDOR_TEST_ASSERT_EQUAL(frame.payload, "0123456789");
+    MORDOR_TEST_ASSERT(!done);
+    writeFrame(server, FrameHeader(4, WINDOW_UPDATE, 0, 1), uint32(10));
+    frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.payload, "abcdefghij");
+    MORDOR_TEST_ASSERT(!done);
+    writeFrame(server, FrameHeader(4, WINDOW_UPDATE, 0, 1), uint32(10));
+    frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.payload, "klmno");
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.flags, 0);
+    frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.type, DATA);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.flags, END_STREAM);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.length, 0u);
+    MORDOR_TEST_ASSERT(done);
+
+    writeFrame(server, FrameHeader(8, PING), "pingpong");
+    frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.type, PING);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.flags, ACK);
+    MORDOR_TEST_ASSERT_EQUAL(frame.payload, "pingpong");
+
+    // An interim response, then the real one
+    HPACKEncoder encoder;
+    std::string block;
+    HeaderList response;
+    response.push_back(std::make_pair(std::string(":status"),
+        std::string("100")));
+    encoder.encode(response, block);
+    writeFrame(server, FrameHeader(block.size(), HEADERS, END_HEADERS, 1),
+        block);
+    response[0].second = "200";
+    block.clear();
+    encoder.encode(response, block);
+    writeFrame(server, FrameHeader(block.size(), HEADERS, END_HEADERS, 1),
+        block);
+    writeFrame(server, FrameHeader(5, DATA, END_STREAM, 1), "hello");
+
+    MORDOR_TEST_ASSERT(stream->receiveHeaders(decoded));
+    MORDOR_TEST_ASSERT(decoded == response);
+    MemoryStream body;
+    transferStream(*stream, body);
+    MORDOR_TEST_ASSERT(body.buffer() == "hello");
+    MORDOR_TEST_ASSERT_EQUAL(client->activeStreams(), 0u);
+}
+
+MORDOR_UNITTEST(HTTP2, resetAndGoAway)
+{
+    WorkerPool pool;
+    Stream::ptr serverStream;
+    Session::ptr client = fakeServer(serverStream);
+    Stream &server = *serverStream;
+    std::string preface(g_prefaceLength, '\0');
+    readExactly(server, &preface[0], g_prefaceLength);
+    readFrame(server);
+    readFrame(server);
+    writeFrame(server, FrameHeader(0, SETTINGS));
+    readFrame(server);
+
+    HeaderList headers;
+    headers.push_back(std::make_pair(std::string(":method"),
+        std::string("GET")));
+    SessionStream::ptr stream1 = client->openStream(headers, true);
+    SessionStream::ptr stream3 = client->openStream(headers, true);
+    readFrame(server);
+    readFrame(server);
+    writeFrame(server, FrameHeader(4, RST_STREAM, 0, 1),
+        uint32(INTERNAL_ERROR));
+    // Stream 3 never got looked at, so the client may retry it
+    writeFrame(server, FrameHeader(8, GOAWAY), uint32(1) +
+        uint32(NO_HTTP2_ERROR));
+
+    HeaderList response;
+    MORDOR_TEST_ASSERT_EXCEPTION(stream1->receiveHeaders(response),
+        StreamResetException);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream3->receiveHeaders(response),
+        StreamRefusedException);
+    MORDOR_TEST_ASSERT(!client->newStreamsAllowed());
+    MORDOR_TEST_ASSERT_EXCEPTION(client->openStream(headers, true),
+        StreamRefusedException);
+}
+
+MORDOR_UNITTEST(HTTP2, protocolError)
+{
+    WorkerPool pool;
+    Stream::ptr serverStream;
+    Session::ptr client = fakeServer(serverStream);
+    Stream &server = *serverStream;
+    std::string preface(g_prefaceLength, '\0');
+    readExactly(server, &preface[0], g_prefaceLength);
+    readFrame(server);
+    readFrame(server);
+    // Servers must start with SETTINGS
+    writeFrame(server, FrameHeader(8, PING), "pingpong");
+    Frame frame = readFrame(server);
+    MORDOR_TEST_ASSERT_EQUAL(frame.header.type, GOAWAY);
+    MORDOR_TEST_ASSERT_EQUAL(frame.payload.substr(4), uint32(PROTOCOL_ERROR));
+    MORDOR_TEST_ASSERT(client->closed());
+    HeaderList headers;
+    MORDOR_TEST_ASSERT_EXCEPTION(client->openStream(headers, true),
+        ConnectionErrorException);
+}
+
+MORDOR_UNITTEST(HTTP2, headerTranslation)
+{
+    Request request;
+    request.requestLine.method = POST;
+    request.requestLine.uri = "/upload?name=a";
+    request.request.host = "www.example.com";
+    request.general.connection.insert("close");
+    request.general.transferEncoding.push_back("chunked");
+    request.entity.contentType.type = "text";
+    request.entity.contentType.subtype = "plain";
+    request.entity.extension["X-Custom"] = "value";
+
+    HeaderList headers;
+    toHeaderList(request, "https", headers);
+    MORDOR_TEST_ASSERT_EQUAL(headers.size(), 6u);
+    MORDOR_TEST_ASSERT_EQUAL(headers[0].second, "POST");
+    MORDOR_TEST_ASSERT_EQUAL(headers[1].second, "https");
+    MORDOR_TEST_ASSERT_EQUAL(headers[2].first, ":authority");
+    MORDOR_TEST_ASSERT_EQUAL(headers[2].second, "www.example.com");
+    MORDOR_TEST_ASSERT_EQUAL(headers[3].second, "/upload?name=a");
+    MORDOR_TEST_ASSERT_EQUAL(headers[4].first, "content-type");
+    MORDOR_TEST_ASSERT_EQUAL(headers[5].first, "x-custom");
+
+    Request translated;
+    MORDOR_TEST_ASSERT(fromHeaderList(headers, translated));
+    MORDOR_TEST_ASSERT_EQUAL(translated.requestLine.method, POST);
+    MORDOR_TEST_ASSERT_EQUAL(translated.requestLine.uri,
+        URI("/upload?name=a"));
+    MORDOR_TEST_ASSERT_EQUAL(translated.request.host, "www.example.com");
+    MORDOR_TEST_ASSERT(translated.general.connection.empty());
+    MORDOR_TEST_ASSERT(translated.general.transferEncoding.empty());
+    MORDOR_TEST_ASSERT_EQUAL(translated.entity.extension["x-custom"],
+        "value");
+
+    // Malformed
+    HeaderList bad = headers;
+    bad.push_back(std::make_pair(std::string(":path"), std::string("/")));
+    MORDOR_TEST_ASSERT(!fromHeaderList(bad, translated));
+    bad = headers;
+    bad[5].first = "X-Custom";
+    MORDOR_TEST_ASSERT(!fromHeaderList(bad, translated));
+    bad = headers;
+    bad[5].second = "value\r\nX-Injected: yes";
+    MORDOR_TEST_ASSERT(!fromHeaderList(bad, translated));
+    bad = headers;
+    bad.push_back(std::make_pair(std::string("connection"),
+        std::string("close")));
+    MORDOR_TEST_ASSERT(!fromHeaderList(bad, translated));
+
+    Response response;
+    response.status.status = NOT_FOUND;
+    response.entity.contentLength = 0;
+    headers.clear();
+    toHeaderList(response, headers);
+    MORDOR_TEST_ASSERT_EQUAL(headers.size(), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(headers[0].second, "404");
+    Response translatedResponse;
+    MORDOR_TEST_ASSERT(fromHeaderList(headers, translatedResponse));
+    MORDOR_TEST_ASSERT_EQUAL(translatedResponse.status.status, NOT_FOUND);
+    MORDOR_TEST_ASSERT_EQUAL(translatedResponse.entity.contentLength, 0u);
+}
+
+static void
+echoServer(ServerRequest::ptr request)
+{
+    const std::string &path = request->request().requestLine.uri.path
+        .toString();
+    if (path == "/echo") {
+        transferStream(request->requestStream(), request->responseStream());
+        request->responseStream()->close();
+    } else {
+        request->response().entity.contentLength = path.size();
+        request->responseStream()->write(path.c_str(), path.size());
+        request->responseStream()->close();
+    }
+}
+
+static void
+startServer(Session::ptr server)
+{
+    server->start();
+}
+
+static void
+doRequest(Session::ptr client, const std::string &path)
+{
+    ClientConnection::ptr conn = client->connection();
+    Request request;
+    request.requestLine.uri = path;
+    request.request.host = "www.example.com";
+    ClientRequest::ptr clientRequest = conn->request(request);
+    MORDOR_TEST_ASSERT_EQUAL(clientRequest->response().status.status, OK);
+    MemoryStream response;
+    transferStream(clientRequest->responseStream(), response);
+    MORDOR_TEST_ASSERT(response.buffer() == path);
+}
+
+static void
+writeRequestBody(ClientRequest::ptr request, const Buffer &body)
+{
+    MemoryStream stream(body);
+    transferStream(stream, request->requestStream());
+    request->requestStream()->close();
+}
+
+MORDOR_UNITTEST(HTTP2, servlets)
+{
+    WorkerPool pool;
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    Session::ptr server(new Session(pipes.first, &echoServer));
+    Session::ptr client(new Session(pipes.second));
+    pool.schedule(boost::bind(&startServer, server));
+    client->start();
+
+    // Many requests at once, all over the one connection
+    std::vector<boost::function<void ()> > dgs;
+    for (int i = 0; i < 10; ++i)
+        dgs.push_back(boost::bind(&doRequest, client,
+            "/path" + boost::lexical_cast<std::string>(i)));
+    parallel_do(dgs);
+
+    // Bigger than any of the flow control windows
+    ClientConnection::ptr conn = client->connection();
+    Request request;
+    request.requestLine.method = POST;
+    request.requestLine.uri = "/echo";
+    request.request.host = "www.example.com";
+    request.entity.contentLength = 3 * 1024 * 1024;
+    ClientRequest::ptr clientRequest = conn->request(request);
+    std::string body(3 * 1024 * 1024, 'a');
+    for (size_t i = 0; i < body.size(); i += 4096)
+        body[i] = (char)(i / 4096);
+    Buffer requestBody(body);
+    std::vector<boost::function<void ()> > transfer;
+    transfer.push_back(boost::bind(&writeRequestBody, clientRequest,
+        boost::cref(requestBody)));
+    transfer.push_back(boost::bind(&ClientRequest::ensureResponse,
+        clientRequest));
+    parallel_do(transfer);
+    MemoryStream responseBody;
+    transferStream(clientRequest->responseStream(), responseBody);
+    MORDOR_TEST_ASSERT(responseBody.buffer() == body);
+}
@@ -1570,6 +1570,52 @@ MORDOR_UNITTEST(HTTPClient, serverHangsUpOnRequest)
 MORDOR_UNITTEST(HTTPClient, serverHangsUpOnRequestFlush)
 { serverHangsUpOnRequest(64 * 1024, true); }
 
+static void
+serverDropsFirstRequestServer(const URI &uri, ServerRequest::ptr request,
+    int &requests)
+{
+    if (++requests == 1) {
+        request->connection()->stream()->close();
+        request->cancel();
+        return;
+    }
+    respondError(request, OK);
+}
+
+MORDOR_UNITTEST(HTTPClient, retryIdempotentRequest)
+{
+    WorkerPool pool;
+    int requests = 0;
+    MockConnectionBroker server(boost::bind(&serverDropsFirstRequestServer,
+        _1, _2, boost::ref(requests)));
+    BaseRequestBroker requestBroker(ConnectionBroker::ptr(&server, &nop<ConnectionBroker *>));
+    requestBroker.idempotentRetries(1);
+
+    Request requestHeaders;
+    requestHeaders.requestLine.uri = "http://localhost/";
+
+    ClientRequest::ptr request = requestBroker.request(requestHeaders);
+    MORDOR_TEST_ASSERT_EQUAL(request->response().status.status, OK);
+    MORDOR_TEST_ASSERT_EQUAL(requests, 2);
+}
+
+MORDOR_UNITTEST(HTTPClient, dontRetryNonIdempotentRequest)
+{
+    WorkerPool pool;
+    int requests = 0;
+    MockConnectionBroker server(boost::bind(&serverDropsFirstRequestServer,
+        _1, _2, boost::ref(requests)));
+    BaseRequestBroker requestBroker(ConnectionBroker::ptr(&server, &nop<ConnectionBroker *>));
+    requestBroker.idempotentRetries(1);
+
+    Request requestHeaders;
+    requestHeaders.requestLine.method = POST;
+    requestHeaders.requestLine.uri = "http://localhost/";
+
+    MORDOR_TEST_ASSERT_ANY_EXCEPTION(requestBroker.request(requestHeaders));
+    MORDOR_TEST_ASSERT_EQUAL(requests, 1);
+}
+
 static void throwExceptionForRequest(ClientRequest::ptr request)
 {
     MORDOR_THROW_EXCEPTION(DummyException());
@@ -2757,6 +2803,43 @@ MORDOR_UNITTEST(HTTPConnectionNoCache, regardlessForceNewConnectionParam)
     ioManager.stop();
 }
 
+static void getConnection(ConnectionCache::ptr cache,
+    ClientConnection::ptr &conn)
+{
+    conn = cache->getConnection("http://localhost/").first;
+}
+
+MORDOR_UNITTEST(HTTPConnectionCache, pipelineDepth)
+{
+    WorkerPool pool;
+    StreamBroker::ptr broker(new DummyStreamBroker());
+    ConnectionCache::ptr cache = ConnectionCache::create(broker);
+    cache->pipelineDepth(2);
+
+    Request requestHeaders;
+    requestHeaders.requestLine.uri = "/";
+    requestHeaders.request.host = "localhost";
+    ClientConnection::ptr conn = cache->getConnection("http://localhost/").first;
+    ClientRequest::ptr request1 = conn->request(requestHeaders);
+    request1->doRequest();
+    ClientConnection::ptr conn2 = cache->getConnection("http://localhost/").first;
+    MORDOR_TEST_ASSERT_EQUAL(conn, conn2);
+    ClientRequest::ptr request2 = conn->request(requestHeaders);
+    request2->doRequest();
+    MORDOR_TEST_ASSERT_EQUAL(conn->outstandingRequests(), 2u);
+
+    // The pipeline is full; have to wait for a response
+    ClientConnection::ptr conn3;
+    pool.schedule(boost::bind(&getConnection, cache, boost::ref(conn3)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT(!conn3);
+    request1->response();
+    request1->finish();
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(conn3, conn);
+    request2->finish();
+}
+
 namespace {
 class FailStreamBroker : public StreamBroker
 {
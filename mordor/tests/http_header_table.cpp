@@ -0,0 +1,230 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <boost/lexical_cast.hpp>
+
+#include "mordor/http/header_table.h"
+#include "mordor/streams/buffered.h"
+#include "mordor/streams/pipe.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::HTTP;
+
+MORDOR_UNITTEST(HTTPHeaderTable, request)
+{
+    HeaderTable table;
+    Buffer buffer("GET /path?query HTTP/1.1\r\n"
+        "Host: example.com\r\n"
+        "Connection:   keep-alive, Upgrade  \r\n"
+        "X-Empty:\r\n"
+        "\r\n"
+        "body");
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(buffer), buffer.readAvailable() - 4);
+    MORDOR_TEST_ASSERT(table.method() == "GET");
+    MORDOR_TEST_ASSERT(table.target() == "/path?query");
+    MORDOR_TEST_ASSERT_EQUAL(table.version(), Version(1, 1));
+    MORDOR_TEST_ASSERT_EQUAL(table.size(), 3u);
+    MORDOR_TEST_ASSERT(table[0].name == "Host");
+    MORDOR_TEST_ASSERT(table[1].value == "keep-alive, Upgrade");
+    MORDOR_TEST_ASSERT(table[2].value.empty());
+    MORDOR_TEST_ASSERT(table.host() == "example.com");
+    MORDOR_TEST_ASSERT(table.find("CONNECTION"));
+    MORDOR_TEST_ASSERT(!table.find("Content-Type"));
+    MORDOR_TEST_ASSERT(table.hasToken("connection", "upgrade"));
+    MORDOR_TEST_ASSERT(!table.hasToken("Connection", "close"));
+    unsigned long long length;
+    MORDOR_TEST_ASSERT(!table.contentLength(length));
+    MORDOR_TEST_ASSERT(!table.chunked());
+    // The slices point into the buffer rather than at copies
+    const char *start = (const char *)buffer.readBuffer(~0, false).iov_base;
+    MORDOR_TEST_ASSERT(table.head().data == start);
+    MORDOR_TEST_ASSERT(table.host().data > start);
+}
+
+MORDOR_UNITTEST(HTTPHeaderTable, response)
+{
+    HeaderTable table(false);
+    std::string head("HTTP/1.0 404 Not Found\n"
+        "Content-Length: 12\n"
+        "Transfer-Encoding: gzip\n"
+        "Transfer-Encoding: gzip, Chunked ; foo=bar\n"
+        "\n");
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(Buffer(head)), head.size());
+    MORDOR_TEST_ASSERT_EQUAL(table.status(), NOT_FOUND);
+    MORDOR_TEST_ASSERT(table.reason() == "Not Found");
+    MORDOR_TEST_ASSERT_EQUAL(table.version(), Version(1, 0));
+    unsigned long long length;
+    MORDOR_TEST_ASSERT(table.contentLength(length));
+    MORDOR_TEST_ASSERT_EQUAL(length, 12u);
+    MORDOR_TEST_ASSERT(table.chunked());
+    MORDOR_TEST_ASSERT_EQUAL(table.get("transfer-encoding"),
+        "gzip,gzip, Chunked ; foo=bar");
+
+    // No reason phrase
+    MORDOR_TEST_ASSERT(table.parse(Buffer("HTTP/1.1 204\r\n\r\n")));
+    MORDOR_TEST_ASSERT_EQUAL(table.status(), NO_CONTENT);
+    MORDOR_TEST_ASSERT(table.reason().empty());
+    MORDOR_TEST_ASSERT_EQUAL(table.size(), 0u);
+}
+
+MORDOR_UNITTEST(HTTPHeaderTable, incomplete)
+{
+    HeaderTable table;
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(Buffer()), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(Buffer("\r\n\r\n")), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(Buffer("GET / HTTP/1.1\r\n")), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(Buffer("GET / HTTP/1.1\r\nA: b\r\n\r")),
+        0u);
+    // Leading empty lines are skipped
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(Buffer("\r\n\nGET / HTTP/1.1\r\n\r\n")),
+        21u);
+    MORDOR_TEST_ASSERT(table.head() == "GET / HTTP/1.1\r\n\r\n");
+}
+
+MORDOR_UNITTEST(HTTPHeaderTable, segmented)
+{
+    Buffer buffer;
+    buffer.copyIn("GET / HTTP/1.1\r\nHo");
+    Buffer second("st: example.com\r\n\r");
+    buffer.copyIn(second);
+    buffer.copyIn("\n");
+    HeaderTable table;
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(buffer), buffer.readAvailable());
+    MORDOR_TEST_ASSERT(table.host() == "example.com");
+    MORDOR_TEST_ASSERT(table.head() == "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n");
+}
+
+MORDOR_UNITTEST(HTTPHeaderTable, folding)
+{
+    HeaderTable table;
+    MORDOR_TEST_ASSERT(table.parse(Buffer("GET / HTTP/1.1\r\n"
+        "X-Folded: one\r\n"
+        "  two\r\n"
+        "\tthree \r\n"
+        "Host: example.com\r\n"
+        "\r\n")));
+    MORDOR_TEST_ASSERT_EQUAL(table.size(), 2u);
+    MORDOR_TEST_ASSERT(table[0].value == "one two three");
+    MORDOR_TEST_ASSERT(table.host() == "example.com");
+}
+
+MORDOR_UNITTEST(HTTPHeaderTable, manyFields)
+{
+    std::string head("GET / HTTP/1.1\r\n");
+    for (int i = 0; i < 100; ++i)
+        head += "X-Field" + boost::lexical_cast<std::string>(i) + ": " +
+            boost::lexical_cast<std::string>(i) + "\r\n";
+    head += "Content-Length: 5\r\n\r\n";
+    HeaderTable table;
+    MORDOR_TEST_ASSERT_EQUAL(table.parse(Buffer(head)), head.size());
+    MORDOR_TEST_ASSERT_EQUAL(table.size(), 101u);
+    MORDOR_TEST_ASSERT(table[99].name == "X-Field99");
+    MORDOR_TEST_ASSERT(*table.find("x-field50") == "50");
+    unsigned long long length;
+    MORDOR_TEST_ASSERT(table.contentLength(length));
+    MORDOR_TEST_ASSERT_EQUAL(length, 5u);
+}
+
+MORDOR_UNITTEST(HTTPHeaderTable, malformed)
+{
+    HeaderTable table;
+    const char *bad[] = {
+        "GET\r\n\r\n",
+        "GET /\r\n\r\n",
+        "GET / HTTP/1\r\n\r\n",
+        "GET / HTTP/1.1x\r\n\r\n",
+        "GET / HTTP/1.1000\r\n\r\n",
+        "G(T / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\n folded first\r\n\r\n",
+        "GET / HTTP/1.1\r\nNo colon\r\n\r\n",
+        "GET / HTTP/1.1\r\nSpace : before colon\r\n\r\n",
+        "GET / HTTP/1.1\r\n: no name\r\n\r\n",
+        "GET / HTTP/1.1\r\nX-Nul: a\001b\r\n\r\n",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        MORDOR_TEST_ASSERT_EXCEPTION(table.parse(Buffer(bad[i])),
+            BadMessageHeaderException);
+
+    HeaderTable response(false);
+    MORDOR_TEST_ASSERT_EXCEPTION(response.parse(Buffer("HTTP/1.1 20\r\n\r\n")),
+        BadMessageHeaderException);
+    MORDOR_TEST_ASSERT_EXCEPTION(response.parse(Buffer("HTTP/1.1 2000 OK\r\n\r\n")),
+        BadMessageHeaderException);
+
+    unsigned long long length;
+    MORDOR_TEST_ASSERT(table.parse(Buffer("GET / HTTP/1.1\r\n"
+        "Content-Length: 5\r\nContent-Length: 6\r\n\r\n")));
+    MORDOR_TEST_ASSERT_EXCEPTION(table.contentLength(length),
+        BadMessageHeaderException);
+    MORDOR_TEST_ASSERT(table.parse(Buffer("GET / HTTP/1.1\r\n"
+        "Content-Length: 5\r\nContent-Length: 5\r\n\r\n")));
+    MORDOR_TEST_ASSERT(table.contentLength(length));
+    MORDOR_TEST_ASSERT(table.parse(Buffer("GET / HTTP/1.1\r\n"
+        "Content-Length: -5\r\n\r\n")));
+    MORDOR_TEST_ASSERT_EXCEPTION(table.contentLength(length),
+        BadMessageHeaderException);
+    MORDOR_TEST_ASSERT(table.parse(Buffer("GET / HTTP/1.1\r\n"
+        "Content-Length: 99999999999999999999\r\n\r\n")));
+    MORDOR_TEST_ASSERT_EXCEPTION(table.contentLength(length),
+        BadMessageHeaderException);
+}
+
+MORDOR_UNITTEST(HTTPHeaderTable, read)
+{
+    // Not seekable, so BufferedStream keeps what's unread
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    pipes.first->write("POST /upload HTTP/1.1\r\nContent-Length: 4\r\n\r\n"
+        "bodyGET", 51);
+    pipes.first->close();
+    BufferedStream stream(pipes.second);
+    stream.bufferSize(8);
+    HeaderTable table;
+    MORDOR_TEST_ASSERT(table.read(stream));
+    MORDOR_TEST_ASSERT(table.method() == "POST");
+    unsigned long long length;
+    MORDOR_TEST_ASSERT(table.contentLength(length));
+    MORDOR_TEST_ASSERT_EQUAL(length, 4u);
+    // What was read past the head was put back
+    Buffer rest;
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(rest, 4), 4u);
+    MORDOR_TEST_ASSERT(rest == "body");
+    MORDOR_TEST_ASSERT_EXCEPTION(table.read(stream),
+        IncompleteMessageHeaderException);
+    // Nothing at all left is a clean end, not an error
+    MORDOR_TEST_ASSERT(!table.read(stream));
+
+    pipes = pipeStream();
+    pipes.first->write(std::string(1000, 'a').c_str(), 1000);
+    pipes.first->close();
+    BufferedStream tooLong(pipes.second);
+    MORDOR_TEST_ASSERT_EXCEPTION(table.read(tooLong, 100),
+        BadMessageHeaderException);
+}
+
+MORDOR_UNITTEST(HTTPHeaderTable, materialize)
+{
+    HeaderTable table;
+    MORDOR_TEST_ASSERT(table.parse(Buffer("PUT /a%20b HTTP/1.1\r\n"
+        "Host: example.com\r\n"
+        "Content-Type: text/plain; charset=utf-8\r\n"
+        "If-Match: \"abc\", W/\"def\"\r\n"
+        "X-Custom: value\r\n"
+        "\r\n")));
+    Request request;
+    table.request(request);
+    MORDOR_TEST_ASSERT_EQUAL(request.requestLine.method, PUT);
+    MORDOR_TEST_ASSERT_EQUAL(request.requestLine.uri.path.toString(),
+        "/a%20b");
+    MORDOR_TEST_ASSERT_EQUAL(request.request.host, "example.com");
+    MORDOR_TEST_ASSERT_EQUAL(request.entity.contentType.type, "text");
+    MORDOR_TEST_ASSERT_EQUAL(request.request.ifMatch.size(), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(request.entity.extension["X-Custom"], "value");
+
+    HeaderTable responseTable(false);
+    MORDOR_TEST_ASSERT(responseTable.parse(Buffer("HTTP/1.1 200 OK\r\n"
+        "Content-Length: 10\r\n\r\n")));
+    Response response;
+    responseTable.response(response);
+    MORDOR_TEST_ASSERT_EQUAL(response.status.status, OK);
+    MORDOR_TEST_ASSERT_EQUAL(response.entity.contentLength, 10u);
+}
@@ -116,3 +116,56 @@ MORDOR_UNITTEST(ServletDispatcher, wildcardMatchSeqOrder)
     // both match, the one who has the wildcard in the most right win
     MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/c/b/d"), acx);
 }
+
+MORDOR_UNITTEST(ServletDispatcher, wildcardBacktrack)
+{
+    ServletDispatcher dispatcher(true);
+    Servlet::ptr abc(new DummyServlet), xbd(new DummyServlet);
+
+    dispatcher.registerServlet("/a/b/c", abc);
+    dispatcher.registerServlet("/*/b/d", xbd);
+    // the literal "a" leads nowhere, so the wildcard has to be tried
+    MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/b/d"), xbd);
+    MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/b/c/d"), abc);
+    MORDOR_TEST_ASSERT(!dispatcher.getServlet("/a/c/d"));
+}
+
+MORDOR_UNITTEST(ServletDispatcher, unregister)
+{
+    ServletDispatcher dispatcher(true);
+    Servlet::ptr root(new DummyServlet), ab(new DummyServlet),
+        axb(new DummyServlet);
+
+    dispatcher.registerServlet("/", root);
+    dispatcher.registerServlet("/a/b", ab);
+    dispatcher.registerServlet("/a/*/b", axb);
+    MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/b/c"), ab);
+    MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/c/b"), axb);
+
+    MORDOR_TEST_ASSERT(!dispatcher.unregisterServlet("/a"));
+    MORDOR_TEST_ASSERT(!dispatcher.unregisterServlet("/a/b/c"));
+    MORDOR_TEST_ASSERT(!dispatcher.unregisterServlet("//trogdor/a/b"));
+    MORDOR_TEST_ASSERT(dispatcher.unregisterServlet("/a/b"));
+    MORDOR_TEST_ASSERT(!dispatcher.unregisterServlet("/a/b"));
+    MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/b/c"), root);
+    MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/c/b"), axb);
+    MORDOR_TEST_ASSERT(dispatcher.unregisterServlet("/a/*/b"));
+    MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/c/b"), root);
+
+    // and it can be registered again
+    dispatcher.registerServlet("/a/b", axb);
+    MORDOR_TEST_ASSERT_EQUAL(dispatcher.getServlet("/a/b/c"), axb);
+}
+
+MORDOR_UNITTEST(ServletDispatcher, creator)
+{
+    ServletDispatcher dispatcher;
+
+    dispatcher.registerServlet<DummyServlet>("/a");
+    Servlet::ptr first = dispatcher.getServlet("/a/b");
+    MORDOR_TEST_ASSERT(first);
+    MORDOR_TEST_ASSERT(dynamic_cast<DummyServlet *>(first.get()));
+    // a new one for every request
+    MORDOR_TEST_ASSERT(dispatcher.getServlet("/a/b") != first);
+    MORDOR_TEST_ASSERT(!dispatcher.getServlet("/b"));
+}
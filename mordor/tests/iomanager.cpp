@@ -2,6 +2,8 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/atomic.h"
+#include "mordor/config.h"
 #include "mordor/future.h"
 #include "mordor/iomanager.h"
 #include "mordor/test/test.h"
@@ -93,6 +95,27 @@ MORDOR_UNITTEST(IOManager, laterTimer)
     MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
 }
 
+MORDOR_UNITTEST(IOManager, timerWheel)
+{
+    ConfigVarBase::ptr granularity =
+        Config::lookup("iomanager.timer.granularity");
+    MORDOR_TEST_ASSERT(granularity);
+    granularity->fromString("1000");
+    int sequence = 0;
+    try {
+        IOManager manager;
+        granularity->fromString("0");
+        manager.registerTimer(100000,
+            boost::bind(&singleTimer, boost::ref(sequence), 1));
+        manager.dispatch();
+    } catch (...) {
+        granularity->fromString("0");
+        throw;
+    }
+    ++sequence;
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+}
+
 MORDOR_UNITTEST(IOManager, timerRefCountNoExpired)
 {
     IOManager manager;
@@ -170,3 +193,170 @@ MORDOR_UNITTEST(IOManager, tickleDeadlock)
                      tidB);
     manager.stop();
 }
+
+static void
+recordThread(tid_t &ranOn, Future<> &future)
+{
+    ranOn = gettid();
+    future.signal();
+}
+
+MORDOR_UNITTEST(IOManager, pinnedWorkWakesItsThread)
+{
+    IOManager manager(4, true);
+    const std::vector<std::shared_ptr<Thread> > threads = manager.threads();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        Future<> future;
+        tid_t ranOn = emptytid();
+        manager.schedule(boost::bind(recordThread, boost::ref(ranOn),
+            boost::ref(future)), threads[i]->tid());
+        future.wait();
+        MORDOR_TEST_ASSERT_EQUAL(ranOn, threads[i]->tid());
+    }
+    manager.stop();
+}
+
+#if defined(LINUX) && !defined(MORDOR_IO_URING)
+static void
+edgeTriggeredRead(IOManager &manager, int fd, std::string &result,
+    size_t expected)
+{
+    char c;
+    while (result.size() < expected) {
+        int rc = read(fd, &c, 1);
+        if (rc < 0 && errno == EAGAIN) {
+            manager.registerEvent(fd, IOManager::READ);
+            Scheduler::yieldTo();
+            continue;
+        }
+        MORDOR_TEST_ASSERT_EQUAL(rc, 1);
+        result.append(1, c);
+    }
+}
+
+static void
+writeByte(int fd, char c)
+{
+    MORDOR_TEST_ASSERT_EQUAL(write(fd, &c, 1), 1);
+}
+
+MORDOR_UNITTEST(IOManager, edgeTriggered)
+{
+    IOManager manager(1, true, true, false, true);
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    MORDOR_TEST_ASSERT_EQUAL(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+    std::string result;
+    manager.schedule(boost::bind(edgeTriggeredRead, boost::ref(manager),
+        fds[0], boost::ref(result), 3));
+    manager.schedule(boost::bind(writeByte, fds[1], 'a'));
+    manager.schedule(boost::bind(writeByte, fds[1], 'b'));
+    manager.schedule(boost::bind(writeByte, fds[1], 'c'));
+    manager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(result, "abc");
+
+    // The same fd number must work again once it's been forgotten
+    int fd = fds[0];
+    manager.unregisterFd(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    MORDOR_TEST_ASSERT_EQUAL(fds[0], fd);
+    MORDOR_TEST_ASSERT_EQUAL(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+    result.clear();
+    manager.schedule(boost::bind(edgeTriggeredRead, boost::ref(manager),
+        fds[0], boost::ref(result), 1));
+    manager.schedule(boost::bind(writeByte, fds[1], 'd'));
+    manager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(result, "d");
+    manager.unregisterFd(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
+
+#ifdef MORDOR_IO_URING
+static void
+asyncRead(IOManager &manager, int fd, char *buffer, AsyncEvent &event)
+{
+    event.prepare(IORING_OP_READ, buffer, 4, ~0ull);
+    manager.registerEvent(fd, IOManager::READ, &event);
+    Scheduler::yieldTo();
+}
+
+MORDOR_UNITTEST(IOManager, asyncEventCompletes)
+{
+    IOManager manager;
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    char buffer[4];
+    AsyncEvent event;
+    manager.schedule(boost::bind(asyncRead, boost::ref(manager), fds[0],
+        buffer, boost::ref(event)));
+    // Runs once the read has been registered
+    manager.schedule(boost::bind(&write, fds[1], "abcd", 4));
+    manager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(event.result, 4);
+    MORDOR_TEST_ASSERT_EQUAL(std::string(buffer, 4), "abcd");
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void
+incrementCount(volatile int &count)
+{
+    atomicIncrement(count);
+}
+
+static void
+registerReads(IOManager &manager, std::vector<int> &fds, volatile int &count)
+{
+    // All without yielding, so most of these find the ring full
+    for (size_t i = 0; i < fds.size(); i += 2)
+        manager.registerEvent(fds[i], IOManager::READ,
+            boost::bind(&incrementCount, boost::ref(count)));
+    for (size_t i = 1; i < fds.size(); i += 2)
+        MORDOR_TEST_ASSERT_EQUAL(write(fds[i], "a", 1), 1);
+}
+
+MORDOR_UNITTEST(IOManager, ringFull)
+{
+    ConfigVarBase::ptr entries = Config::lookup("iomanager.uring.entries");
+    MORDOR_TEST_ASSERT(entries);
+    std::vector<int> fds(128);
+    for (size_t i = 0; i < fds.size(); i += 2)
+        MORDOR_TEST_ASSERT_EQUAL(pipe(&fds[i]), 0);
+    volatile int count = 0;
+    entries->fromString("4");
+    try {
+        IOManager manager(2);
+        entries->fromString("256");
+        manager.schedule(boost::bind(&registerReads, boost::ref(manager),
+            boost::ref(fds), boost::ref(count)));
+        manager.stop();
+    } catch (...) {
+        entries->fromString("256");
+        throw;
+    }
+    MORDOR_TEST_ASSERT_EQUAL(count, 64);
+    for (size_t i = 0; i < fds.size(); ++i)
+        close(fds[i]);
+}
+
+MORDOR_UNITTEST(IOManager, asyncEventCancel)
+{
+    IOManager manager;
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    char buffer[4];
+    AsyncEvent event;
+    manager.schedule(boost::bind(asyncRead, boost::ref(manager), fds[0],
+        buffer, boost::ref(event)));
+    manager.schedule(boost::bind(&IOManager::cancelEvent, &manager, fds[0],
+        IOManager::READ));
+    manager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(event.result, -ECANCELED);
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
@@ -1,7 +1,13 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <fstream>
+
+#include <boost/bind.hpp>
+
 #include "mordor/log.h"
+#include "mordor/log_file.h"
 #include "mordor/test/test.h"
+#include "mordor/thread.h"
 
 using namespace Mordor;
 
@@ -132,3 +138,89 @@ MORDOR_UNITTEST(Log, levelNoPropagate)
     l2->level(Log::DEBUG, false);
     MORDOR_TEST_ASSERT_NOT_EQUAL(l->level(), Log::DEBUG);
 }
+
+#ifndef WINDOWS
+static std::string tempfilename()
+{
+    std::string result("/tmp/mordorXXXXXX");
+    int fd = mkstemp(&result[0]);
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mkstemp");
+    close(fd);
+    return result;
+}
+
+static size_t countLines(const std::string &file)
+{
+    std::ifstream stream(file.c_str());
+    std::string line;
+    size_t lines = 0;
+    while (std::getline(stream, line)) {
+        MORDOR_TEST_ASSERT(line.find("message number") != std::string::npos);
+        ++lines;
+    }
+    return lines;
+}
+
+static void logLines(Logger::ptr logger, int count)
+{
+    for (int i = 0; i < count; ++i)
+        MORDOR_LOG_INFO(logger) << "message number " << i;
+}
+
+static void testAsyncFileSink(FileLogSink::OverflowPolicy policy,
+    size_t bufferSize, size_t &written, unsigned long long &dropped)
+{
+    std::string file = tempfilename();
+    Logger::ptr logger = Log::lookup("asyncfilesink");
+    logger->inheritSinks(false);
+    logger->level(Log::INFO);
+    std::shared_ptr<FileLogSink> sink(new FileLogSink(file, bufferSize,
+        policy));
+    MORDOR_TEST_ASSERT(sink->async());
+    logger->addSink(sink);
+    try {
+        std::vector<std::shared_ptr<Thread> > threads;
+        for (int i = 0; i < 4; ++i)
+            threads.push_back(std::shared_ptr<Thread>(new Thread(
+                boost::bind(&logLines, logger, 1000))));
+        for (size_t i = 0; i < threads.size(); ++i)
+            threads[i]->join();
+        sink->flush();
+        written = countLines(file);
+        dropped = sink->dropped();
+    } catch (...) {
+        logger->clearSinks();
+        unlink(file.c_str());
+        throw;
+    }
+    logger->clearSinks();
+    unlink(file.c_str());
+}
+
+MORDOR_UNITTEST(Log, asyncFileSink)
+{
+    size_t written;
+    unsigned long long dropped;
+    testAsyncFileSink(FileLogSink::DROP, 1024 * 1024, written, dropped);
+    MORDOR_TEST_ASSERT_EQUAL(written, 4000u);
+    MORDOR_TEST_ASSERT_EQUAL(dropped, 0u);
+}
+
+MORDOR_UNITTEST(Log, asyncFileSinkDrop)
+{
+    size_t written;
+    unsigned long long dropped;
+    testAsyncFileSink(FileLogSink::DROP, 256, written, dropped);
+    MORDOR_TEST_ASSERT_EQUAL(written + dropped, 4000u);
+}
+
+MORDOR_UNITTEST(Log, asyncFileSinkBlock)
+{
+    size_t written;
+    unsigned long long dropped;
+    testAsyncFileSink(FileLogSink::BLOCK, 256, written, dropped);
+    MORDOR_TEST_ASSERT_EQUAL(written, 4000u);
+    MORDOR_TEST_ASSERT_EQUAL(dropped, 0u);
+}
+#endif
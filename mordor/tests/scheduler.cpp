@@ -436,6 +436,85 @@ MORDOR_UNITTEST(Scheduler, spreadTheLoadWhileStopping)
     MORDOR_TEST_ASSERT_ABOUT_EQUAL(threads.size(), 8u, 2u);
 }
 
+MORDOR_UNITTEST(Scheduler, workStealingHijackBasic)
+{
+    Fiber::ptr doNothingFiber(new Fiber(&doNothing));
+    WorkerPool pool(1, true, 1, true);
+    MORDOR_TEST_ASSERT(pool.workStealing());
+    pool.schedule(doNothingFiber);
+    MORDOR_TEST_ASSERT_EQUAL(doNothingFiber->state(), Fiber::INIT);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(doNothingFiber->state(), Fiber::TERM);
+}
+
+static void checkThread(tid_t expected, int &count)
+{
+    MORDOR_TEST_ASSERT_EQUAL(gettid(), expected);
+    ++count;
+}
+
+MORDOR_UNITTEST(Scheduler, workStealingScheduleForThread)
+{
+    WorkerPool pool(4, true, 1, true);
+    int count = 0;
+    for (int i = 0; i < 100; ++i) {
+        // Pinned work must never be stolen by another thread
+        pool.schedule(boost::bind(&checkThread, gettid(), boost::ref(count)),
+            gettid());
+        for (size_t j = 0; j < pool.threads().size(); ++j)
+            pool.schedule(boost::bind(&checkThread,
+                pool.threads()[j]->tid(), boost::ref(count)),
+                pool.threads()[j]->tid());
+    }
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(count, 400);
+}
+
+MORDOR_UNITTEST(Scheduler, workStealingSpreadTheLoad)
+{
+    std::set<tid_t> threads;
+    {
+        std::mutex mutex;
+        WorkerPool pool(8, true, 1, true);
+        // Wait for the other threads to get to idle first
+        Mordor::sleep(100000);
+        // All of the work lands on the queue of whichever thread runs
+        // startTheFibers; the rest of the threads have to steal it
+        pool.schedule(boost::bind(&startTheFibers, boost::ref(threads),
+            boost::ref(mutex)));
+        pool.stop();
+    }
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(threads.size(), 8u, 2u);
+}
+
+static void yieldUntil(volatile bool &done, bool &sawDone)
+{
+    // Give up eventually, rather than hang the test if it's starved
+    for (int i = 0; i < 1000000 && !done; ++i)
+        Scheduler::yield();
+    sawDone = done;
+}
+
+static void setTrue(volatile bool &flag)
+{
+    flag = true;
+}
+
+MORDOR_UNITTEST(Scheduler, workStealingYieldingDoesntStarveShared)
+{
+    volatile bool done = false;
+    bool sawDone = false;
+    WorkerPool pool(1, false, 1, true);
+    pool.schedule(boost::bind(&yieldUntil, boost::ref(done),
+        boost::ref(sawDone)));
+    // Let it settle into rescheduling itself on its own thread's queue
+    Mordor::sleep(10000);
+    // Goes on the shared queue, because we're not one of the pool's threads
+    pool.schedule(boost::bind(&setTrue, boost::ref(done)));
+    pool.stop();
+    MORDOR_TEST_ASSERT(sawDone);
+}
+
 MORDOR_UNITTEST(Scheduler, tolerantException)
 {
     WorkerPool pool;
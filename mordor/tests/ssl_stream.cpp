@@ -1,13 +1,19 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include "mordor/config.h"
 #include "mordor/iomanager.h"
 #include "mordor/parallel.h"
+#include "mordor/socket.h"
 #include "mordor/streams/hash.h"
+#include "mordor/streams/memory.h"
 #include "mordor/streams/null.h"
 #include "mordor/streams/pipe.h"
 #include "mordor/streams/random.h"
+#include "mordor/streams/socket.h"
 #include "mordor/streams/ssl.h"
+#include "mordor/streams/temp.h"
 #include "mordor/streams/transfer.h"
+#include "mordor/string.h"
 #include "mordor/test/test.h"
 #include "mordor/workerpool.h"
 
@@ -137,3 +143,267 @@ MORDOR_UNITTEST(SSLStream, forceDuplex)
     pool.dispatch();
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
 }
+
+namespace {
+class WriteCountingStream : public FilterStream
+{
+public:
+    WriteCountingStream(Stream::ptr parent)
+        : FilterStream(parent),
+          writes(0)
+    {}
+
+    using FilterStream::read;
+    size_t read(Buffer &buffer, size_t length)
+    { return parent()->read(buffer, length); }
+    using FilterStream::write;
+    size_t write(const Buffer &buffer, size_t length)
+    {
+        ++writes;
+        return parent()->write(buffer, length);
+    }
+
+    size_t writes;
+};
+}
+
+MORDOR_UNITTEST(SSLStream, coalesceSmallWrites)
+{
+    WorkerPool pool;
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    std::shared_ptr<WriteCountingStream> counter(
+        new WriteCountingStream(pipes.second));
+
+    SSLStream::ptr sslserver(new SSLStream(pipes.first, false));
+    SSLStream::ptr sslclient(new SSLStream(counter, true));
+
+    pool.schedule(boost::bind(&accept, sslserver));
+    sslclient->connect();
+    pool.dispatch();
+
+    counter->writes = 0;
+    for (int i = 0; i < 1000; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(sslclient->write("0123456789", 10), 10u);
+    // Nothing goes out until there's a full record
+    MORDOR_TEST_ASSERT_EQUAL(counter->writes, 0u);
+    sslclient->flush(false);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(counter->writes, 2u);
+
+    char buffer[10000];
+    size_t read = 0;
+    while (read < sizeof(buffer))
+        read += sslserver->read(buffer + read, sizeof(buffer) - read);
+    for (size_t i = 0; i < sizeof(buffer); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(buffer[i], (char)('0' + i % 10));
+}
+
+static void acceptWriteAndClose(SSLStream::ptr server)
+{
+    server->accept();
+    server->write("x", 1);
+    server->close();
+}
+
+// Returns whether the client resumed its session
+static bool resumedConnection(SSL_CTX *serverCtx, SSL_CTX *clientCtx,
+    SSLSessionCache::ptr cache)
+{
+    WorkerPool pool;
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+
+    SSLStream::ptr sslserver(new SSLStream(pipes.first, false, true,
+        serverCtx));
+    SSLStream::ptr sslclient(new SSLStream(pipes.second, true, true,
+        clientCtx));
+    sslclient->sessionCache(cache, "localhost:443");
+
+    pool.schedule(boost::bind(&acceptWriteAndClose, sslserver));
+    sslclient->connect();
+    // TLS 1.3 tickets come after the handshake
+    char buffer;
+    MORDOR_TEST_ASSERT_EQUAL(sslclient->read(&buffer, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(sslclient->read(&buffer, 1), 0u);
+    sslclient->close();
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sslserver->sessionReused(),
+        sslclient->sessionReused());
+    return sslclient->sessionReused();
+}
+
+static void sessionResumption(int version)
+{
+    std::shared_ptr<SSL_CTX> serverCtx = SSLStream::createServerContext();
+    std::shared_ptr<SSL_CTX> clientCtx(SSL_CTX_new(SSLv23_client_method()),
+        &SSL_CTX_free);
+    SSL_CTX_set_min_proto_version(clientCtx.get(), version);
+    SSL_CTX_set_max_proto_version(clientCtx.get(), version);
+    SSLStream::enableClientSessionCache(clientCtx.get());
+    SSLSessionCache::ptr cache(new SSLSessionCache());
+
+    MORDOR_TEST_ASSERT(!resumedConnection(serverCtx.get(), clientCtx.get(),
+        cache));
+    MORDOR_TEST_ASSERT_EQUAL(cache->size(), 1u);
+    MORDOR_TEST_ASSERT(resumedConnection(serverCtx.get(), clientCtx.get(),
+        cache));
+    MORDOR_TEST_ASSERT(resumedConnection(serverCtx.get(), clientCtx.get(),
+        cache));
+
+    // A different server doesn't know the session
+    std::shared_ptr<SSL_CTX> otherServerCtx =
+        SSLStream::createServerContext();
+    MORDOR_TEST_ASSERT(!resumedConnection(otherServerCtx.get(),
+        clientCtx.get(), cache));
+    MORDOR_TEST_ASSERT(resumedConnection(otherServerCtx.get(),
+        clientCtx.get(), cache));
+}
+
+MORDOR_UNITTEST(SSLStream, sessionResumptionTLS12)
+{
+    sessionResumption(TLS1_2_VERSION);
+}
+
+MORDOR_UNITTEST(SSLStream, sessionResumptionTLS13)
+{
+    sessionResumption(TLS1_3_VERSION);
+}
+
+MORDOR_UNITTEST(SSLStream, sessionCacheBounds)
+{
+    std::shared_ptr<SSL_SESSION> session(SSL_SESSION_new(),
+        &SSL_SESSION_free);
+    SSLSessionCache cache(2);
+    cache.put("a", session.get());
+    cache.put("b", session.get());
+    cache.put("a", session.get());
+    MORDOR_TEST_ASSERT_EQUAL(cache.size(), 2u);
+    // b is the least recently used
+    cache.put("c", session.get());
+    MORDOR_TEST_ASSERT_EQUAL(cache.size(), 2u);
+    cache.remove("a");
+    MORDOR_TEST_ASSERT_EQUAL(cache.size(), 1u);
+    cache.remove("b");
+    MORDOR_TEST_ASSERT_EQUAL(cache.size(), 1u);
+    // An empty session can't be resumed, so it's thrown away
+    MORDOR_TEST_ASSERT(!cache.get("c"));
+    MORDOR_TEST_ASSERT_EQUAL(cache.size(), 0u);
+}
+
+static std::string alpn(const char *clientProtocols,
+    const char *serverProtocols)
+{
+    WorkerPool pool;
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    SSLStream::ptr sslserver(new SSLStream(pipes.first, false));
+    SSLStream::ptr sslclient(new SSLStream(pipes.second, true));
+    std::vector<std::string> protocols;
+    if (*clientProtocols) {
+        protocols = split(clientProtocols, ',');
+        sslclient->alpnProtocols(protocols);
+    }
+    if (*serverProtocols) {
+        protocols = split(serverProtocols, ',');
+        sslserver->alpnProtocols(protocols);
+    }
+    pool.schedule(boost::bind(&accept, sslserver));
+    sslclient->connect();
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sslclient->alpnProtocol(),
+        sslserver->alpnProtocol());
+    return sslclient->alpnProtocol();
+}
+
+MORDOR_UNITTEST(SSLStream, alpn)
+{
+    // The server's preference wins
+    MORDOR_TEST_ASSERT_EQUAL(alpn("http/1.1,h2", "h2,http/1.1"), "h2");
+    MORDOR_TEST_ASSERT_EQUAL(alpn("h2,http/1.1", "http/1.1"), "http/1.1");
+    MORDOR_TEST_ASSERT_EQUAL(alpn("h2", "http/1.1"), "");
+    MORDOR_TEST_ASSERT_EQUAL(alpn("h2,http/1.1", ""), "");
+    MORDOR_TEST_ASSERT_EQUAL(alpn("", "h2"), "");
+}
+
+static void acceptAndEcho(Socket::ptr listen)
+{
+    Stream::ptr socketStream(new SocketStream(listen->accept()));
+    SSLStream::ptr server(new SSLStream(socketStream, false));
+    server->accept();
+    Buffer buffer;
+    while (server->read(buffer, 65536) != 0) {
+        while (buffer.readAvailable() > 0)
+            buffer.consume(server->write(buffer, buffer.readAvailable()));
+        server->flush();
+    }
+    server->close();
+}
+
+static void writeAll(Stream &file, Stream::ptr stream,
+    unsigned long long length)
+{
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(file, stream), length);
+    stream->flush();
+}
+
+static void readAll(Stream::ptr stream, MemoryStream &received,
+    unsigned long long length)
+{
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(stream, received, length),
+        length);
+}
+
+MORDOR_UNITTEST(SSLStream, kernelTLS)
+{
+    ConfigVarBase::ptr kernelTLS = Config::lookup("ssl.ktls");
+    MORDOR_TEST_ASSERT(kernelTLS);
+    kernelTLS->fromString("1");
+    // Only TLS 1.2 AES-GCM can be handed to the kernel
+    std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(SSLv23_client_method()),
+        &SSL_CTX_free);
+    SSL_CTX_set_max_proto_version(ctx.get(), TLS1_2_VERSION);
+    SSL_CTX_set_cipher_list(ctx.get(), "ECDHE-RSA-AES128-GCM-SHA256");
+    try {
+        IOManager ioManager;
+        std::vector<Address::ptr> addresses = Address::lookup("localhost");
+        MORDOR_TEST_ASSERT(!addresses.empty());
+        IPAddress::ptr address =
+            std::dynamic_pointer_cast<IPAddress>(addresses.front());
+        address->port(0);
+        Socket::ptr listen = address->createSocket(ioManager, SOCK_STREAM);
+        listen->bind(address);
+        listen->listen();
+        ioManager.schedule(boost::bind(&acceptAndEcho, listen));
+
+        Socket::ptr connect = address->createSocket(ioManager, SOCK_STREAM);
+        connect->connect(listen->localAddress());
+        Stream::ptr socketStream(new SocketStream(connect));
+        SSLStream::ptr client(new SSLStream(socketStream, true, true,
+            ctx.get()));
+        client->connect();
+        // Either way (the kernel may not have TLS support), it has to work
+        MORDOR_TEST_ASSERT_EQUAL(client->supportsReceiveFile(),
+            client->kernelSend());
+
+        // Goes through sendfile when the kernel is doing the encryption
+        std::string string;
+        for (int i = 0; i < 20000; ++i)
+            string += boost::lexical_cast<std::string>(i) + "\n";
+        Buffer data(string);
+        TempStream file;
+        MemoryStream dataStream(data);
+        transferStream(dataStream, file);
+        file.seek(0);
+
+        MemoryStream received;
+        std::vector<boost::function<void ()> > dgs;
+        dgs.push_back(boost::bind(&writeAll, boost::ref(file), client,
+            (unsigned long long)data.readAvailable()));
+        dgs.push_back(boost::bind(&readAll, client, boost::ref(received),
+            (unsigned long long)data.readAvailable()));
+        parallel_do(dgs);
+        MORDOR_TEST_ASSERT(received.buffer() == data);
+        client->close();
+    } catch (...) {
+        kernelTLS->fromString("0");
+        throw;
+    }
+    kernelTLS->fromString("0");
+}
@@ -1,5 +1,9 @@
+#include <boost/bind.hpp>
+
 #include "mordor/statistics.h"
 #include "mordor/test/test.h"
+#include "mordor/thread.h"
+#include "mordor/type_name.h"
 
 using namespace Mordor;
 
@@ -14,3 +18,186 @@ MORDOR_UNITTEST(Statistics, dumpStat)
         << sumStat << " s" << std::endl;
     MORDOR_TEST_ASSERT_EQUAL(os.str(), expectedOS.str());
 }
+
+static void
+countMany(ShardedStatistic<CountStatistic<unsigned long long> > &count,
+    ShardedStatistic<MaxStatistic<int> > &maximum, int base)
+{
+    for (int i = 0; i < 10000; ++i) {
+        count.increment();
+        maximum.update(base + i % 100);
+    }
+}
+
+MORDOR_UNITTEST(Statistics, sharded)
+{
+    ShardedStatistic<CountStatistic<unsigned long long> > count(
+        CountStatistic<unsigned long long>("ops"));
+    ShardedStatistic<MaxStatistic<int> > maximum;
+    MORDOR_TEST_ASSERT_EQUAL(std::string(count.units), "ops");
+    std::vector<std::shared_ptr<Thread> > threads;
+    for (int i = 0; i < 8; ++i)
+        threads.push_back(std::shared_ptr<Thread>(new Thread(boost::bind(
+            &countMany, boost::ref(count), boost::ref(maximum), i * 1000))));
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i]->join();
+    MORDOR_TEST_ASSERT_EQUAL(count.total().count, 80000u);
+    MORDOR_TEST_ASSERT_EQUAL(maximum.total().maximum, 7099);
+    std::ostringstream os;
+    os << count;
+    MORDOR_TEST_ASSERT_EQUAL(os.str(), "80000");
+    count.reset();
+    MORDOR_TEST_ASSERT_EQUAL(count.total().count, 0u);
+}
+
+MORDOR_UNITTEST(Statistics, shardedDump)
+{
+    // Sub-statistics are dumped from the merged shards
+    ShardedStatistic<AverageStatistic<int> > average(
+        AverageStatistic<int>("us", "calls"));
+    average.update(10);
+    average.update(20);
+    std::ostringstream os;
+    average.dump(os);
+    std::ostringstream expected;
+    expected << type_name(average) << ": 15 us" << std::endl
+        << "    " << type_name(CountStatistic<int>()) << ": 2 calls"
+        << std::endl
+        << "    " << type_name(SumStatistic<int>()) << ": 30 us"
+        << std::endl;
+    MORDOR_TEST_ASSERT_EQUAL(os.str(), expected.str());
+}
+
+MORDOR_UNITTEST(Statistics, histogramExact)
+{
+    // Below 2^bits every value has its own bucket
+    HistogramStatistic<unsigned int> histogram("us", "calls", 7);
+    for (unsigned int i = 1; i <= 100; ++i)
+        histogram.update(i);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.count.count, 100u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.sum.sum, 5050u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.minimum.minimum, 1u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.maximum.maximum, 100u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(0.0), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(50.0), 50u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(99.0), 99u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(100.0), 100u);
+    std::ostringstream os;
+    os << histogram;
+    MORDOR_TEST_ASSERT_EQUAL(os.str(), "p50=50 p90=90 p99=99 p99.9=100");
+    MORDOR_TEST_ASSERT_EQUAL(HistogramStatistic<unsigned int>().percentile(50.0),
+        0u);
+}
+
+MORDOR_UNITTEST(Statistics, histogramPrecision)
+{
+    HistogramStatistic<unsigned long long> histogram;
+    for (unsigned long long i = 1; i <= 1000000; ++i)
+        histogram.update(i * 10);
+    const double percents[] = { 10.0, 50.0, 90.0, 99.0, 99.9, 99.99 };
+    for (size_t i = 0; i < sizeof(percents) / sizeof(percents[0]); ++i) {
+        double exact = percents[i] * 100000.0;
+        double reported = (double)histogram.percentile(percents[i]);
+        // Never under, and over by no more than the 1/32 precision
+        MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(reported, exact);
+        MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(reported, exact * (1 + 1 / 32.0));
+    }
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(100.0), 10000000u);
+
+    // Values above highest land in the last bucket
+    HistogramStatistic<unsigned int> clamped(NULL, NULL, 4, 1000);
+    clamped.update(5);
+    clamped.update(100000);
+    MORDOR_TEST_ASSERT_EQUAL(clamped.maximum.maximum, 100000u);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(clamped.percentile(100.0), 1000u);
+    MORDOR_TEST_ASSERT_EQUAL(clamped.percentile(50.0), 5u);
+}
+
+static void
+recordMany(ShardedStatistic<HistogramStatistic<unsigned int> > &histogram,
+    unsigned int base)
+{
+    for (unsigned int i = 0; i < 10000; ++i)
+        histogram.update(base + i);
+}
+
+MORDOR_UNITTEST(Statistics, histogramMerge)
+{
+    ShardedStatistic<HistogramStatistic<unsigned int> > histogram(
+        HistogramStatistic<unsigned int>("us"));
+    std::vector<std::shared_ptr<Thread> > threads;
+    for (unsigned int i = 0; i < 4; ++i)
+        threads.push_back(std::shared_ptr<Thread>(new Thread(boost::bind(
+            &recordMany, boost::ref(histogram), i * 10000))));
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i]->join();
+    HistogramStatistic<unsigned int> total = histogram.total();
+    MORDOR_TEST_ASSERT_EQUAL(total.count.count, 40000u);
+    MORDOR_TEST_ASSERT_EQUAL(total.minimum.minimum, 0u);
+    MORDOR_TEST_ASSERT_EQUAL(total.maximum.maximum, 39999u);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(total.percentile(50.0), 19999u);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(total.percentile(50.0), 20624u);
+}
+
+static void
+dumpMany(ShardedStatistic<HistogramStatistic<unsigned int> > &histogram)
+{
+    for (int i = 0; i < 1000; ++i) {
+        std::ostringstream os;
+        histogram.dump(os);
+        histogram.update(i);
+    }
+}
+
+MORDOR_UNITTEST(Statistics, shardedConcurrentDump)
+{
+    ShardedStatistic<HistogramStatistic<unsigned int> > histogram(
+        HistogramStatistic<unsigned int>("us"));
+    std::vector<std::shared_ptr<Thread> > threads;
+    for (int i = 0; i < 4; ++i)
+        threads.push_back(std::shared_ptr<Thread>(new Thread(boost::bind(
+            &dumpMany, boost::ref(histogram)))));
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i]->join();
+    MORDOR_TEST_ASSERT_EQUAL(histogram.total().count.count, 4000u);
+}
+
+MORDOR_UNITTEST(Statistics, histogramSnapshotAndReset)
+{
+    HistogramStatistic<unsigned int> histogram("us");
+    {
+        TimeStatistic<HistogramStatistic<unsigned int> > time(histogram);
+    }
+    histogram.update(1000);
+    HistogramStatistic<unsigned int> snapshot = histogram.snapshotAndReset();
+    MORDOR_TEST_ASSERT_EQUAL(snapshot.count.count, 2u);
+    MORDOR_TEST_ASSERT_EQUAL(snapshot.maximum.maximum, 1000u);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(snapshot.percentile(100.0), 1000u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.count.count, 0u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(100.0), 0u);
+
+    histogram.update(7);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.minimum.minimum, 7u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.maximum.maximum, 7u);
+    unsigned int timed = snapshot.minimum.minimum;
+    snapshot.merge(histogram);
+    MORDOR_TEST_ASSERT_EQUAL(snapshot.count.count, 3u);
+    MORDOR_TEST_ASSERT_EQUAL(snapshot.minimum.minimum, (std::min)(timed, 7u));
+}
+
+MORDOR_UNITTEST(Statistics, histogramDump)
+{
+    HistogramStatistic<unsigned int> histogram("us", "calls");
+    histogram.update(10);
+    histogram.update(20);
+    std::ostringstream os;
+    histogram.dump(os);
+    std::ostringstream expected;
+    expected << type_name(histogram) << ": p50=10 p90=20 p99=20 p99.9=20 us"
+        << std::endl
+        << "    " << type_name(histogram.count) << ": 2 calls" << std::endl
+        << "    " << type_name(histogram.sum) << ": 30 us" << std::endl
+        << "    " << type_name(histogram.minimum) << ": 10 us" << std::endl
+        << "    " << type_name(histogram.maximum) << ": 20 us" << std::endl;
+    MORDOR_TEST_ASSERT_EQUAL(os.str(), expected.str());
+}
@@ -174,6 +174,87 @@ MORDOR_UNITTEST(Timer, rollover)
     TimerManager::setClock();
 }
 
+MORDOR_UNITTEST(Timer, wheel)
+{
+    static unsigned long long clock = 1000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+
+    int sequence = 0;
+    TimerManager manager(1000);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    // One timer for each of the first three levels of the wheel
+    Timer::ptr timer1 = manager.registerTimer(5000,
+        boost::bind(&singleTimer, boost::ref(sequence), 1));
+    Timer::ptr timer2 = manager.registerTimer(300000,
+        boost::bind(&singleTimer, boost::ref(sequence), 2));
+    Timer::ptr timer3 = manager.registerTimer(70000000,
+        boost::bind(&singleTimer, boost::ref(sequence), 3));
+    Timer::ptr cancelled = manager.registerTimer(200000,
+        boost::bind(&singleTimer, boost::ref(sequence), 0));
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 5000ULL);
+    MORDOR_TEST_ASSERT(cancelled->cancel());
+
+    clock += 4999;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 0);
+    clock += 1;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
+    // Nothing else on the lowest level; wake up again within a lap of it
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(manager.nextTimer(), 257000ULL);
+
+    clock = 1000000ULL + 299999;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
+    clock += 1;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+
+    clock = 1000000ULL + 69999999;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+    clock += 1;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 3);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    MORDOR_TEST_ASSERT(!timer1->cancel());
+
+    TimerManager::setClock();
+}
+
+MORDOR_UNITTEST(Timer, wheelRecurringAndReset)
+{
+    static unsigned long long clock = 1000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+
+    int sequence = 0;
+    int expected = 1;
+    TimerManager manager(1000);
+    Timer::ptr recurring = manager.registerTimer(10000,
+        boost::bind(&singleTimer, boost::ref(sequence), boost::ref(expected)),
+        true);
+    Timer::ptr timer = manager.registerTimer(1000000,
+        boost::bind(&singleTimer, boost::ref(sequence), boost::ref(expected)));
+    clock += 10000;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
+    expected = 2;
+    clock += 10000;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+    MORDOR_TEST_ASSERT(recurring->cancel());
+    // Pull the far timer in
+    MORDOR_TEST_ASSERT(timer->reset(25000, false));
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 5000ULL);
+    expected = 3;
+    clock += 5000;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 3);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+
+    TimerManager::setClock();
+}
+
 namespace {
 // anonymous namespace so that the class is only visible in this compiling unit
 class TestTimerClass
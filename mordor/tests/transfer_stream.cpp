@@ -1,6 +1,13 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <boost/lexical_cast.hpp>
+
+#include "mordor/iomanager.h"
+#include "mordor/socket.h"
+#include "mordor/streams/limited.h"
 #include "mordor/streams/memory.h"
+#include "mordor/streams/socket.h"
+#include "mordor/streams/temp.h"
 #include "mordor/streams/test.h"
 #include "mordor/streams/transfer.h"
 #include "mordor/test/test.h"
@@ -41,3 +48,74 @@ MORDOR_UNITTEST(TransferStream, inferEof)
     MemoryStream outStream;
     MORDOR_TEST_ASSERT_EQUAL(transferStream(inStream, outStream), 5ull);
 }
+
+#ifdef LINUX
+MORDOR_UNITTEST(TransferStream, sendFileThroughLimitedStream)
+{
+    TempStream::ptr inFile(new TempStream());
+    TempStream outFile;
+    inFile->write("helloworld", 10);
+    inFile->seek(2);
+    LimitedStream inStream(inFile, 5);
+    MORDOR_TEST_ASSERT(inStream.supportsSendFile());
+    MORDOR_TEST_ASSERT(outFile.supportsReceiveFile());
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(inStream, outFile), 5ull);
+    MORDOR_TEST_ASSERT_EQUAL(inFile->tell(), 7);
+    MORDOR_TEST_ASSERT_EQUAL(outFile.tell(), 5);
+    outFile.seek(0);
+    MemoryStream copy;
+    transferStream(outFile, copy);
+    MORDOR_TEST_ASSERT(copy.buffer() == "llowo");
+
+    // Only three bytes left in the file
+    inStream.reset(5);
+    outFile.truncate(0);
+    outFile.seek(0);
+    MORDOR_TEST_ASSERT_EXCEPTION(transferStream(inStream, outFile, 5),
+        UnexpectedEofException);
+    MORDOR_TEST_ASSERT_EQUAL(outFile.size(), 3);
+}
+
+static void
+receiveAll(Socket::ptr listen, MemoryStream &received)
+{
+    SocketStream stream(listen->accept());
+    transferStream(stream, received);
+}
+
+MORDOR_UNITTEST(TransferStream, sendFileToSocket)
+{
+    IOManager ioManager;
+    std::vector<Address::ptr> addresses = Address::lookup("localhost");
+    MORDOR_TEST_ASSERT(!addresses.empty());
+    IPAddress::ptr address =
+        std::dynamic_pointer_cast<IPAddress>(addresses.front());
+    address->port(0);
+    Socket::ptr listen = address->createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    MemoryStream received;
+    ioManager.schedule(boost::bind(&receiveAll, listen,
+        boost::ref(received)));
+
+    // Big enough to fill the socket buffers a few times over
+    std::string string;
+    for (int i = 0; i < 100000; ++i)
+        string += boost::lexical_cast<std::string>(i) + "\n";
+    Buffer data(string);
+    TempStream file;
+    MemoryStream dataStream(data);
+    transferStream(dataStream, file);
+    file.seek(0);
+
+    Socket::ptr connect = address->createSocket(ioManager, SOCK_STREAM);
+    connect->connect(listen->localAddress());
+    SocketStream stream(connect);
+    MORDOR_TEST_ASSERT(stream.supportsReceiveFile());
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(file, stream),
+        (unsigned long long)data.readAvailable());
+    stream.close();
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(received.buffer() == data);
+}
+#endif
@@ -4,6 +4,8 @@
 
 #include "predef.h"
 
+#include <type_traits>
+
 #include "util.h"
 
 #ifdef WINDOWS
@@ -14,9 +16,27 @@
 
 #include "exception.h"
 
+// ThreadLocalStorage impl selection
+
+// A ThreadLocalStorage with a Tag is a distinct type from every other, so on
+// Linux it can be a native (initial-exec) thread_local: a single load off
+// the thread pointer, instead of a call into pthread_getspecific.  Without a
+// Tag, or elsewhere, it is a pthread (or Tls) key per object.  Define
+// MORDOR_PTHREAD_TLS to use keys for everything.
+
+#if defined(LINUX) && !defined(MORDOR_PTHREAD_TLS)
+#   define MORDOR_NATIVE_TLS
+#endif
+
 namespace Mordor {
 
-template <class T>
+template <class T, class Tag = void,
+#ifdef MORDOR_NATIVE_TLS
+    bool Native = !std::is_void<Tag>::value
+#else
+    bool Native = false
+#endif
+    >
 class ThreadLocalStorageBase : Mordor::noncopyable
 {
 public:
@@ -79,20 +99,42 @@ private:
 #endif
 };
 
-template <class T>
-class ThreadLocalStorage : public ThreadLocalStorageBase<T>
+#ifdef MORDOR_NATIVE_TLS
+/// Tag must be unique to the variable: every object of this type shares the
+/// same storage
+template <class T, class Tag>
+class ThreadLocalStorageBase<T, Tag, true> : Mordor::noncopyable
+{
+public:
+    typename std::enable_if<sizeof(T) <= sizeof(void *)>::type set(const T &t)
+    { s_value = t; }
+
+    T get() const { return s_value; }
+
+    operator T() const { return get(); }
+
+private:
+    static thread_local T s_value __attribute__((tls_model("initial-exec")));
+};
+
+template <class T, class Tag>
+thread_local T ThreadLocalStorageBase<T, Tag, true>::s_value;
+#endif
+
+template <class T, class Tag = void>
+class ThreadLocalStorage : public ThreadLocalStorageBase<T, Tag>
 {
 public:
-    T operator =(T t) { ThreadLocalStorageBase<T>::set(t); return t; }
+    T operator =(T t) { ThreadLocalStorageBase<T, Tag>::set(t); return t; }
 };
 
-template <class T>
-class ThreadLocalStorage<T *> : public ThreadLocalStorageBase<T *>
+template <class T, class Tag>
+class ThreadLocalStorage<T *, Tag> : public ThreadLocalStorageBase<T *, Tag>
 {
 public:
-    T * operator =(T *const t) { ThreadLocalStorageBase<T *>::set(t); return t; }
-    T & operator*() { return *ThreadLocalStorageBase<T *>::get(); }
-    T * operator->() { return ThreadLocalStorageBase<T *>::get(); }
+    T * operator =(T *const t) { ThreadLocalStorageBase<T *, Tag>::set(t); return t; }
+    T & operator*() { return *ThreadLocalStorageBase<T *, Tag>::get(); }
+    T * operator->() { return ThreadLocalStorageBase<T *, Tag>::get(); }
 };
 
 };
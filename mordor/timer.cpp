@@ -35,6 +35,18 @@ static ConfigVar<unsigned long long>::ptr g_clockRolloverThreshold =
     Config::lookup<unsigned long long>("timer.clockrolloverthreshold", 5000000ULL,
     "Expire all timers if the clock goes backward by >= this amount");
 
+static ConfigVar<unsigned long long>::ptr g_ioManagerGranularity =
+    Config::lookup<unsigned long long>("iomanager.timer.granularity", 0ULL,
+    "Tick length (us) of the timing wheel IOManagers keep their timers in; "
+    "0 keeps them in an ordered set instead.  Only read when an IOManager is "
+    "created");
+
+// The timing wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots; level n
+// holds timers expiring within WHEEL_SIZE^(n+1) ticks
+static const unsigned int WHEEL_BITS = 8;
+static const size_t WHEEL_SIZE = 1 << WHEEL_BITS;
+static const size_t WHEEL_LEVELS = 4;
+
 static void
 stubOnTimer(std::weak_ptr<void> weakCond, std::function<void ()> dg);
 
@@ -91,14 +103,20 @@ Timer::Timer(unsigned long long us, std::function<void ()> dg, bool recurring,
     : m_recurring(recurring),
       m_us(us),
       m_dg(dg),
-      m_manager(manager)
+      m_manager(manager),
+      m_wheelPrev(NULL),
+      m_wheelNext(NULL),
+      m_wheelSlot(NULL)
 {
     MORDOR_ASSERT(m_dg);
     m_next = TimerManager::now() + m_us;
 }
 
 Timer::Timer(unsigned long long next)
-    : m_next(next)
+    : m_next(next),
+      m_wheelPrev(NULL),
+      m_wheelNext(NULL),
+      m_wheelSlot(NULL)
 {}
 
 bool
@@ -108,10 +126,7 @@ Timer::cancel()
     std::lock_guard<std::mutex> lock(m_manager->m_mutex);
     if (m_dg) {
         m_dg = NULL;
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            m_manager->m_timers.find(shared_from_this());
-        MORDOR_ASSERT(it != m_manager->m_timers.end());
-        m_manager->m_timers.erase(it);
+        m_manager->eraseTimer(shared_from_this());
         return true;
     }
     return false;
@@ -120,16 +135,15 @@ Timer::cancel()
 bool
 Timer::refresh()
 {
-    std::lock_guard<std::mutex> lock(m_manager->m_mutex);
-    if (!m_dg)
-        return false;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
-    m_next = TimerManager::now() + m_us;
-    m_manager->m_timers.insert(shared_from_this());
-    m_manager->m_mutex.unlock();
+    {
+        std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+        if (!m_dg)
+            return false;
+        Timer::ptr self = shared_from_this();
+        m_manager->eraseTimer(self);
+        m_next = TimerManager::now() + m_us;
+        m_manager->insertTimer(self);
+    }
     MORDOR_LOG_DEBUG(g_log) << this << " refresh";
     return true;
 }
@@ -137,60 +151,75 @@ Timer::refresh()
 bool
 Timer::reset(unsigned long long us, bool fromNow)
 {
-    std::lock_guard<std::mutex> lock(m_manager->m_mutex);
-    if (!m_dg)
-        return false;
-    // No change
-    if (us == m_us && !fromNow)
-        return true;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
-    unsigned long long start;
-    if (fromNow)
-        start = TimerManager::now();
-    else
-        start = m_next - m_us;
-    m_us = us;
-    m_next = start + m_us;
-    it = m_manager->m_timers.insert(shared_from_this()).first;
-    bool atFront = (it == m_manager->m_timers.begin()) && !m_manager->m_tickled;
-    if (atFront)
-        m_manager->m_tickled = true;
-    m_manager->m_mutex.unlock();
+    bool atFront;
+    {
+        std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+        if (!m_dg)
+            return false;
+        // No change
+        if (us == m_us && !fromNow)
+            return true;
+        Timer::ptr self = shared_from_this();
+        m_manager->eraseTimer(self);
+        unsigned long long start;
+        if (fromNow)
+            start = TimerManager::now();
+        else
+            start = m_next - m_us;
+        m_us = us;
+        m_next = start + m_us;
+        atFront = m_manager->insertTimer(self) && !m_manager->m_tickled;
+        if (atFront)
+            m_manager->m_tickled = true;
+    }
     MORDOR_LOG_DEBUG(g_log) << this << " reset to " << m_us;
     if (atFront)
         m_manager->onTimerInsertedAtFront();
     return true;
 }
 
-TimerManager::TimerManager()
+TimerManager::TimerManager(unsigned long long granularity)
 : m_tickled(false),
-  m_previousTime(0ull)
-{}
+  m_previousTime(0ull),
+  m_granularity(granularity),
+  m_currentTick(0ull),
+  m_wakeTick(~0ull),
+  m_wheelCount(0)
+{
+    if (m_granularity) {
+        m_currentTick = now() / m_granularity;
+        m_wheel.resize(WHEEL_SIZE * WHEEL_LEVELS);
+    }
+}
 
 TimerManager::~TimerManager()
 {
 #ifndef NDEBUG
     std::lock_guard<std::mutex> lock(m_mutex);
     MORDOR_ASSERT(m_timers.empty());
+    MORDOR_ASSERT(m_wheelCount == 0);
 #endif
 }
 
+unsigned long long
+TimerManager::ioManagerGranularity()
+{
+    return g_ioManagerGranularity->val();
+}
+
 Timer::ptr
 TimerManager::registerTimer(unsigned long long us, std::function<void ()> dg,
         bool recurring)
 {
     MORDOR_ASSERT(dg);
     Timer::ptr result(new Timer(us, dg, recurring, this));
-    std::lock_guard<std::mutex> lock(m_mutex);
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_timers.insert(result).first;
-    bool atFront = (it == m_timers.begin()) && !m_tickled;
-    if (atFront)
-        m_tickled = true;
-    m_mutex.unlock();
+    bool atFront;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        atFront = insertTimer(result) && !m_tickled;
+        if (atFront)
+            m_tickled = true;
+    }
     MORDOR_LOG_DEBUG(g_log) << result.get() << " registerTimer(" << us
         << ", " << recurring << "): " << atFront;
     if (atFront)
@@ -226,17 +255,34 @@ TimerManager::nextTimer()
 {
     std::lock_guard<std::mutex> lock(m_mutex);
     m_tickled = false;
-    if (m_timers.empty()) {
+    if (m_timers.empty() && m_wheelCount == 0) {
+        m_wakeTick = ~0ull;
         MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
         return ~0ull;
     }
-    const Timer::ptr &next = *m_timers.begin();
+    unsigned long long next;
+    if (m_granularity) {
+        // The lowest level is exact, but anything above it only gets
+        // cascaded down at the end of the lowest level's current lap; don't
+        // look past that unless we know nothing will be
+        unsigned long long lap = (m_currentTick | (WHEEL_SIZE - 1)) + 1;
+        unsigned long long end = m_currentTick + WHEEL_SIZE;
+        size_t cascading = (lap >> WHEEL_BITS) & (WHEEL_SIZE - 1);
+        if (cascading == 0 || m_wheel[WHEEL_SIZE + cascading])
+            end = lap;
+        for (m_wakeTick = m_currentTick; m_wakeTick < end; ++m_wakeTick)
+            if (m_wheel[m_wakeTick & (WHEEL_SIZE - 1)])
+                break;
+        next = m_wakeTick * m_granularity;
+    } else {
+        next = (*m_timers.begin())->m_next;
+    }
     unsigned long long nowUs = now();
     unsigned long long result;
-    if (nowUs >= next->m_next)
+    if (nowUs >= next)
         result = 0;
     else
-        result = next->m_next - nowUs;
+        result = next - nowUs;
     MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): " << result;
     return result;
 }
@@ -269,20 +315,46 @@ TimerManager::processTimers()
     unsigned long long nowUs = now();
     {
         std::lock_guard<std::mutex> lock(m_mutex);
-        if (m_timers.empty())
-            return result;
-        bool rollover = detectClockRollover(nowUs);
-        if (!rollover && (*m_timers.begin())->m_next > nowUs)
-            return result;
-        Timer nowTimer(nowUs);
-        Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
-        // Find all timers that are expired
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            rollover ? m_timers.end() : m_timers.lower_bound(nowTimerPtr);
-        while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
-        // Copy to expired, remove from m_timers;
-        expired.insert(expired.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
+        if (m_granularity) {
+            bool rollover = detectClockRollover(nowUs);
+            unsigned long long nowTick = nowUs / m_granularity;
+            if (rollover) {
+                for (size_t i = 0; i < m_wheel.size(); ++i)
+                    wheelExpire(&m_wheel[i], expired);
+                m_currentTick = nowTick;
+            }
+            while (m_wheelCount != 0 && m_currentTick <= nowTick) {
+                size_t slot = m_currentTick & (WHEEL_SIZE - 1);
+                if (slot == 0) {
+                    for (size_t level = 1; level < WHEEL_LEVELS; ++level) {
+                        wheelCascade(level);
+                        if ((m_currentTick >> (WHEEL_BITS * level)) &
+                            (WHEEL_SIZE - 1))
+                            break;
+                    }
+                }
+                wheelExpire(&m_wheel[slot], expired);
+                ++m_currentTick;
+            }
+            // Nothing left to look at between here and now
+            if (m_wheelCount == 0 && m_currentTick <= nowTick)
+                m_currentTick = nowTick + 1;
+        } else {
+            if (m_timers.empty())
+                return result;
+            bool rollover = detectClockRollover(nowUs);
+            if (!rollover && (*m_timers.begin())->m_next > nowUs)
+                return result;
+            Timer nowTimer(nowUs);
+            Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
+            // Find all timers that are expired
+            std::set<Timer::ptr, Timer::Comparator>::iterator it =
+                rollover ? m_timers.end() : m_timers.lower_bound(nowTimerPtr);
+            while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
+            // Copy to expired, remove from m_timers;
+            expired.insert(expired.begin(), m_timers.begin(), it);
+            m_timers.erase(m_timers.begin(), it);
+        }
         result.reserve(expired.size());
         // Look at expired timers and re-register recurring timers
         // (while under the same lock)
@@ -295,7 +367,7 @@ TimerManager::processTimers()
             if (timer->m_recurring) {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired and refreshed";
                 timer->m_next = nowUs + timer->m_us;
-                m_timers.insert(timer);
+                insertTimer(timer);
             } else {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired";
                 timer->m_dg = NULL;
@@ -305,6 +377,100 @@ TimerManager::processTimers()
     return result;
 }
 
+bool
+TimerManager::insertTimer(const Timer::ptr &timer)
+{
+    if (m_granularity) {
+        timer->m_self = timer;
+        wheelLink(timer.get());
+        ++m_wheelCount;
+        return (timer->m_next + m_granularity - 1) / m_granularity <
+            m_wakeTick;
+    } else {
+        std::set<Timer::ptr, Timer::Comparator>::iterator it =
+            m_timers.insert(timer).first;
+        return it == m_timers.begin();
+    }
+}
+
+void
+TimerManager::eraseTimer(const Timer::ptr &timer)
+{
+    if (m_granularity) {
+        MORDOR_ASSERT(timer->m_self);
+        wheelUnlink(timer.get());
+        --m_wheelCount;
+        timer->m_self.reset();
+    } else {
+        std::set<Timer::ptr, Timer::Comparator>::iterator it =
+            m_timers.find(timer);
+        MORDOR_ASSERT(it != m_timers.end());
+        m_timers.erase(it);
+    }
+}
+
+void
+TimerManager::wheelLink(Timer *timer)
+{
+    unsigned long long tick = std::max(
+        (timer->m_next + m_granularity - 1) / m_granularity, m_currentTick);
+    unsigned long long delta = tick - m_currentTick;
+    size_t level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+        delta >= (1ull << (WHEEL_BITS * (level + 1))))
+        ++level;
+    // Too far out for the wheel; park it in the last slot that is, and it'll
+    // be placed again when that one is cascaded
+    if (delta >= (1ull << (WHEEL_BITS * WHEEL_LEVELS)))
+        tick = m_currentTick + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    size_t slot = (tick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    Timer **head = &m_wheel[level * WHEEL_SIZE + slot];
+    timer->m_wheelSlot = head;
+    timer->m_wheelPrev = NULL;
+    timer->m_wheelNext = *head;
+    if (*head)
+        (*head)->m_wheelPrev = timer;
+    *head = timer;
+}
+
+void
+TimerManager::wheelUnlink(Timer *timer)
+{
+    if (timer->m_wheelPrev)
+        timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+    else
+        *timer->m_wheelSlot = timer->m_wheelNext;
+    if (timer->m_wheelNext)
+        timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+    timer->m_wheelPrev = timer->m_wheelNext = NULL;
+    timer->m_wheelSlot = NULL;
+}
+
+void
+TimerManager::wheelCascade(size_t level)
+{
+    size_t slot = (m_currentTick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    Timer *timer = m_wheel[level * WHEEL_SIZE + slot];
+    m_wheel[level * WHEEL_SIZE + slot] = NULL;
+    while (timer) {
+        Timer *next = timer->m_wheelNext;
+        wheelLink(timer);
+        timer = next;
+    }
+}
+
+void
+TimerManager::wheelExpire(Timer **slot, std::vector<Timer::ptr> &expired)
+{
+    while (*slot) {
+        Timer *timer = *slot;
+        wheelUnlink(timer);
+        --m_wheelCount;
+        expired.push_back(Timer::ptr());
+        expired.back().swap(timer->m_self);
+    }
+}
+
 void
 TimerManager::executeTimers()
 {
@@ -45,6 +45,11 @@ private:
     unsigned long long m_us;
     std::function<void ()> m_dg;
     TimerManager *m_manager;
+    // Timing wheel bookkeeping; the wheel's slots are intrusive lists, and
+    // m_self keeps the timer alive while it's linked into one
+    Timer::ptr m_self;
+    Timer *m_wheelPrev, *m_wheelNext;
+    Timer **m_wheelSlot;
 
 private:
     struct Comparator
@@ -58,7 +63,11 @@ class TimerManager : public Mordor::noncopyable
 {
     friend class Timer;
 public:
-    TimerManager();
+    /// @param granularity If 0, timers are kept ordered by expiry, and fire
+    /// exactly on time.  Otherwise they are hashed into a hierarchical timing
+    /// wheel with ticks of this many microseconds, which makes registering
+    /// and cancelling them O(1), but lets them fire up to a tick late
+    TimerManager(unsigned long long granularity = 0);
     virtual ~TimerManager();
 
     virtual Timer::ptr registerTimer(unsigned long long us,
@@ -95,13 +104,36 @@ protected:
     virtual void onTimerInsertedAtFront() {}
     std::vector<std::function<void ()> > processTimers();
 
+    /// The granularity IOManagers should pass to the constructor; set by the
+    /// iomanager.timer.granularity ConfigVar (0, no wheel, by default)
+    static unsigned long long ioManagerGranularity();
+
 private:
     static std::function<unsigned long long ()> ms_clockDg;
     bool detectClockRollover(unsigned long long nowUs);
+    /// @pre m_mutex is locked
+    /// @return If the timer needs to wake up someone waiting on nextTimer()
+    bool insertTimer(const Timer::ptr &timer);
+    /// @pre m_mutex is locked
+    void eraseTimer(const Timer::ptr &timer);
+    void wheelLink(Timer *timer);
+    void wheelUnlink(Timer *timer);
+    /// Move the timers in one slot of the given level to lower levels
+    void wheelCascade(size_t level);
+    void wheelExpire(Timer **slot, std::vector<Timer::ptr> &expired);
+
     std::set<Timer::ptr, Timer::Comparator> m_timers;
     std::mutex m_mutex;
     bool m_tickled;
     unsigned long long m_previousTime;
+
+    unsigned long long m_granularity;
+    /// Every tick before this one has been processed
+    unsigned long long m_currentTick;
+    /// The tick nextTimer() last told the caller to wait for
+    unsigned long long m_wakeTick;
+    std::vector<Timer *> m_wheel;
+    size_t m_wheelCount;
 };
 
 }
@@ -52,6 +52,8 @@
 #       define X86
 #   elif defined(__ppc__)
 #       define PPC
+#   elif defined(__aarch64__)
+#       define AARCH64
 #   elif defined(__arm__)
 #       define ARM
 #   endif
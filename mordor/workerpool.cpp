@@ -9,8 +9,9 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:workerpool");
 
-WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize)
-    : Scheduler(threads, useCaller, batchSize)
+WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize,
+    bool workStealing)
+    : Scheduler(threads, useCaller, batchSize, workStealing)
 {
     start();
 }
@@ -14,7 +14,8 @@ namespace Mordor {
 class WorkerPool : public Scheduler
 {
 public:
-    WorkerPool(size_t threads = 1, bool useCaller = true, size_t batchSize = 1);
+    WorkerPool(size_t threads = 1, bool useCaller = true, size_t batchSize = 1,
+        bool workStealing = false);
     ~WorkerPool() { stop(); }
 
 protected: